@@ -0,0 +1,97 @@
+#include "AllocationCounter.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+	std::atomic<std::uint64_t> g_Allocations{ 0 };
+	std::atomic<std::int64_t> g_LiveBytes{ 0 };
+
+	/// Every block is preceded by header which keeps its size and header size, so delete without size knows both
+	constexpr std::size_t MinHeaderSize = alignof(std::max_align_t);
+	static_assert(MinHeaderSize >= 2 * sizeof(std::size_t));
+
+	void* AllocateCounted(std::size_t size, std::size_t alignment)
+	{
+		const std::size_t headerSize = std::max(MinHeaderSize, alignment);
+		const std::size_t blockSize = (headerSize + size + alignment - 1) / alignment * alignment;
+#if defined(_WIN32) || defined(_WIN64)
+		void* block = _aligned_malloc(blockSize, alignment);
+#else
+		void* block = alignment <= MinHeaderSize ? std::malloc(blockSize) : std::aligned_alloc(alignment, blockSize);
+#endif
+		if (!block)
+		{
+			throw std::bad_alloc();
+		}
+
+		std::size_t* data = reinterpret_cast<std::size_t*>(static_cast<char*>(block) + headerSize);
+		data[-1] = size;
+		data[-2] = headerSize;
+		g_Allocations.fetch_add(1, std::memory_order_relaxed);
+		g_LiveBytes.fetch_add(static_cast<std::int64_t>(size), std::memory_order_relaxed);
+		return data;
+	}
+
+	void FreeCounted(void* pointer)
+	{
+		if (!pointer)
+		{
+			return;
+		}
+
+		const std::size_t* data = static_cast<const std::size_t*>(pointer);
+		g_LiveBytes.fetch_sub(static_cast<std::int64_t>(data[-1]), std::memory_order_relaxed);
+		void* block = static_cast<char*>(pointer) - data[-2];
+#if defined(_WIN32) || defined(_WIN64)
+		_aligned_free(block);
+#else
+		std::free(block);
+#endif
+	}
+}
+
+std::uint64_t pst::AllocationCounter::GetAllocations()
+{
+	return g_Allocations.load(std::memory_order_relaxed);
+}
+
+std::int64_t pst::AllocationCounter::GetLiveBytes()
+{
+	return g_LiveBytes.load(std::memory_order_relaxed);
+}
+
+// Array, nothrow and sized forms of the standard library call these ones
+void* operator new(std::size_t size)
+{
+	return AllocateCounted(size, MinHeaderSize);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+	return AllocateCounted(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* pointer) noexcept
+{
+	FreeCounted(pointer);
+}
+
+void operator delete(void* pointer, std::align_val_t) noexcept
+{
+	FreeCounted(pointer);
+}
+
+void operator delete(void* pointer, std::size_t) noexcept
+{
+	FreeCounted(pointer);
+}
+
+void operator delete(void* pointer, std::size_t, std::align_val_t) noexcept
+{
+	FreeCounted(pointer);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstdint>
+
+namespace pst
+{
+	/// Counts blocks of global operator new, which is replaced by AllocationCounter.cpp. Should be linked only into the benchmark executable
+	class AllocationCounter
+	{
+	public:
+		/// Number of allocations since start of the process
+		static std::uint64_t GetAllocations();
+
+		/// Bytes of blocks which are allocated and not deleted yet
+		static std::int64_t GetLiveBytes();
+	};
+}
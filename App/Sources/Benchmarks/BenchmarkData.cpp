@@ -0,0 +1,31 @@
+#include "BenchmarkData.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <utility>
+
+std::vector<std::string> pst::BenchmarkData::GenerateNicknames(int count, std::mt19937& generator)
+{
+	static constexpr char Alphabet[] = "abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
+	std::discrete_distribution<int> lengthDistribution({ 0, 0, 0, 2, 4, 6, 9, 11, 12, 12, 11, 9, 7, 5, 4, 3, 2, 1, 1, 0.5, 0.5 });
+	std::uniform_int_distribution<std::size_t> letterDistribution(0, sizeof(Alphabet) - 2);
+	std::vector<std::string> nicknames;
+	while (static_cast<int>(nicknames.size()) < count)
+	{
+		// Short names repeat sometimes, so a few more are made and repeats are removed
+		for (int i = static_cast<int>(nicknames.size()); i < count + count / 50 + 16; i++)
+		{
+			std::string nickname(lengthDistribution(generator), ' ');
+			std::generate(std::begin(nickname), std::end(nickname), [&]() { return Alphabet[letterDistribution(generator)]; });
+			nicknames.push_back(std::move(nickname));
+		}
+
+		std::sort(std::begin(nicknames), std::end(nicknames));
+		nicknames.erase(std::unique(std::begin(nicknames), std::end(nicknames)), std::end(nicknames));
+	}
+
+	std::shuffle(std::begin(nicknames), std::end(nicknames), generator);
+	nicknames.resize(count);
+	return nicknames;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <random>
+#include <string>
+#include <vector>
+
+namespace pst
+{
+	/// Keys and settings shared by BenchmarkSuite and PersistentMapBenchmark, so their results are measured on the same data
+	class BenchmarkData
+	{
+	public:
+		/// Versions kept by benchmarked maps and storages, like history limit of a server. Phases which measure history memory keep every version instead
+		static constexpr int HistoryLimit = 1000;
+
+		/// Unique nicknames in random order. Lengths follow typical player names: mostly 6 to 12 characters, some longer than
+		/// small string buffer. Letters are mostly lowercase, with some capitals, digits and underscores
+		static std::vector<std::string> GenerateNicknames(int count, std::mt19937& generator);
+	};
+}
@@ -0,0 +1,50 @@
+#include "BenchmarkSuite.h"
+#include "PersistentMapBenchmark.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+int main(int argc, char* argv[])
+{
+	pst::BenchmarkSuite::Options options;
+	bool isBackendComparison = false;
+	int maxSize = 0;
+	for (int i = 1; i < argc; i++)
+	{
+		if (std::strcmp(argv[i], "--max-size") == 0 && i + 1 < argc)
+		{
+			maxSize = std::atoi(argv[++i]);
+			options.m_MaxSize = maxSize;
+		}
+		else if (std::strcmp(argv[i], "--backends") == 0)
+		{
+			isBackendComparison = true;
+		}
+		else if (std::strcmp(argv[i], "--operations") == 0 && i + 1 < argc)
+		{
+			options.m_MaxOperations = std::atoi(argv[++i]);
+		}
+		else
+		{
+			std::fprintf(stderr, "Usage: %s [--backends] [--max-size N] [--operations N]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (options.m_MaxSize < 1000 || options.m_MaxOperations < 1)
+	{
+		std::fprintf(stderr, "Size should be at least 1000 and number of operations at least 1\n");
+		return 1;
+	}
+
+	// Comparison of map backends prints text lines, so it is run instead of the suite and doesn't mix into its JSON output
+	if (isBackendComparison)
+	{
+		pst::PersistentMapBenchmark::Run(maxSize > 0 ? maxSize : pst::PersistentMapBenchmark::DefaultMaxKeys);
+		return 0;
+	}
+
+	pst::BenchmarkSuite::Run(options);
+	return 0;
+}
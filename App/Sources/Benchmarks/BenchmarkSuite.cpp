@@ -0,0 +1,496 @@
+#include "BenchmarkSuite.h"
+
+#include "AllocationCounter.h"
+#include "BenchmarkData.h"
+#include "../CoreLib/PersistentMap.h"
+#include "../DataModel/PlayersStorage.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <utility>
+
+namespace
+{
+	/// Every kept version takes memory, so history phases are shorter than others
+	constexpr int MaxHistoryVersions = 10000;
+
+	/// Rollback-heavy mix undoes most of its changes: every cycle makes this many updates and rolls back all but one of them
+	constexpr int MixUpdates = 3;
+
+	constexpr int LeaderboardPageSize = 20;
+	constexpr int MatchSize = 10;
+
+	/// Ratings of imported players are spread as on a real server, so rating index has both unique and repeated ratings
+	constexpr int MaxRating = 3000;
+
+	/// Zipfian distribution over [0; n) by Gray et al. "Quickly generating billion-record synthetic databases", as used by YCSB.
+	/// Setup takes O(n) once, every draw takes O(1). Rank 0 is the most popular
+	class ZipfianDistribution
+	{
+	public:
+		ZipfianDistribution(int n, double theta)
+			: m_N(n)
+			, m_Theta(theta)
+			, m_Alpha(1.0 / (1.0 - theta))
+		{
+			double zetaN = 0;
+			for (int i = 1; i <= n; i++)
+			{
+				zetaN += 1.0 / std::pow(static_cast<double>(i), theta);
+			}
+
+			m_ZetaN = zetaN;
+			m_Eta = (1.0 - std::pow(2.0 / n, 1.0 - theta)) / (1.0 - (1.0 + std::pow(0.5, theta)) / zetaN);
+		}
+
+		template <typename TGenerator>
+		int operator()(TGenerator& generator) const
+		{
+			const double u = std::uniform_real_distribution<double>(0.0, 1.0)(generator);
+			const double uz = u * m_ZetaN;
+			if (uz < 1.0)
+			{
+				return 0;
+			}
+
+			if (uz < 1.0 + std::pow(0.5, m_Theta))
+			{
+				return 1;
+			}
+
+			return std::min(m_N - 1, static_cast<int>(m_N * std::pow(m_Eta * u - m_Eta + 1.0, m_Alpha)));
+		}
+
+	private:
+		int m_N;
+		double m_Theta;
+		double m_Alpha;
+		double m_ZetaN;
+		double m_Eta;
+	};
+
+	/// Results are summed here, so measured loops are not optimized away
+	volatile std::int64_t g_Checksum = 0;
+}
+
+void pst::BenchmarkSuite::Run(const Options& options)
+{
+	for (int size = 1000; size <= options.m_MaxSize; size *= 10)
+	{
+		std::mt19937 generator(static_cast<std::mt19937::result_type>(size));
+		Workload workload;
+		workload.m_Size = size;
+		workload.m_Nicknames = BenchmarkData::GenerateNicknames(size, generator);
+		for (KeyDistribution distribution : { KeyDistribution::Uniform, KeyDistribution::Zipfian })
+		{
+			DrawKeys(workload, distribution, options.m_MaxOperations);
+			BenchmarkMap(workload);
+			BenchmarkPlayersStorage(workload);
+		}
+
+		if (size > options.m_MaxSize / 10)
+		{
+			break;
+		}
+	}
+}
+
+void pst::BenchmarkSuite::DrawKeys(Workload& workload, KeyDistribution distribution, int numberOfOperations)
+{
+	std::mt19937 generator(static_cast<std::mt19937::result_type>(workload.m_Size) + static_cast<std::mt19937::result_type>(distribution));
+	workload.m_Distribution = distribution;
+	workload.m_Draws.resize(numberOfOperations);
+	if (distribution == KeyDistribution::Uniform)
+	{
+		std::uniform_int_distribution<int> keyDistribution(0, workload.m_Size - 1);
+		std::generate(std::begin(workload.m_Draws), std::end(workload.m_Draws), [&]() { return keyDistribution(generator); });
+	}
+	else
+	{
+		// Nicknames are in random order, so popular keys are spread over the whole tree
+		const ZipfianDistribution keyDistribution(workload.m_Size, 0.99);
+		std::generate(std::begin(workload.m_Draws), std::end(workload.m_Draws), [&]() { return keyDistribution(generator); });
+	}
+
+	// At most half of keys are removed by delete phases, so the tree keeps its size class
+	std::vector<bool> isDrawn(workload.m_Size);
+	workload.m_DistinctDraws.clear();
+	for (int index : workload.m_Draws)
+	{
+		if (static_cast<int>(workload.m_DistinctDraws.size()) == workload.m_Size / 2)
+		{
+			break;
+		}
+
+		if (!isDrawn[index])
+		{
+			isDrawn[index] = true;
+			workload.m_DistinctDraws.push_back(index);
+		}
+	}
+}
+
+template <typename TFunction>
+void pst::BenchmarkSuite::Measure(Measurement& measurement, int numberOfOperations, TFunction&& function)
+{
+	const std::uint64_t allocationsBefore = AllocationCounter::GetAllocations();
+	const auto start = std::chrono::steady_clock::now();
+	function();
+	const auto finish = std::chrono::steady_clock::now();
+	measurement.m_Nanoseconds += std::chrono::duration<double, std::nano>(finish - start).count();
+	measurement.m_Allocations += AllocationCounter::GetAllocations() - allocationsBefore;
+	measurement.m_Operations += numberOfOperations;
+}
+
+void pst::BenchmarkSuite::PrintResult(const char* suite, const char* operation, const Workload& workload, const Measurement& measurement, double bytesPerVersion)
+{
+	const double operations = std::max(measurement.m_Operations, 1);
+	std::printf("{\"suite\":\"%s\",\"operation\":\"%s\",\"size\":%d,\"keys\":\"%s\",\"operations\":%d,\"ns_per_op\":%.1f,\"allocations_per_op\":%.3f",
+		suite, operation, workload.m_Size, workload.m_Distribution == KeyDistribution::Uniform ? "uniform" : "zipfian", measurement.m_Operations,
+		measurement.m_Nanoseconds / operations, static_cast<double>(measurement.m_Allocations) / operations);
+	if (bytesPerVersion >= 0)
+	{
+		std::printf(",\"bytes_per_version\":%.1f", bytesPerVersion);
+	}
+
+	std::printf("}\n");
+	std::fflush(stdout);
+}
+
+void pst::BenchmarkSuite::PrintStats(const char* operation, const Workload& workload, const pst::PersistentMapStats& stats, int numberOfOperations)
+{
+	if (!pst::PersistentMap<int, int>::IsStatsEnabled)
+	{
+		return;
+	}
+
+	const double operations = std::max(numberOfOperations, 1);
+	std::printf("{\"suite\":\"PersistentMapStats\",\"operation\":\"%s\",\"size\":%d,\"keys\":\"%s\",\"operations\":%d,\"path_copy_clones_per_op\":%.3f,"
+		"\"insert_fixup_clones_per_op\":%.3f,\"delete_fixup_clones_per_op\":%.3f,\"rotations_per_op\":%.3f,\"comparisons_per_op\":%.3f}\n",
+		operation, workload.m_Size, workload.m_Distribution == KeyDistribution::Uniform ? "uniform" : "zipfian", numberOfOperations,
+		stats.m_PathCopyClones / operations, stats.m_InsertFixupClones / operations, stats.m_DeleteFixupClones / operations, stats.m_Rotations / operations,
+		stats.m_Comparisons / operations);
+	std::fflush(stdout);
+}
+
+void pst::BenchmarkSuite::BenchmarkMap(const Workload& workload)
+{
+	using PrefixMap = pst::PersistentMap<std::string, int, pst::NodePool, pst::StringPrefixKeyTraits<>>;
+	const std::vector<std::string>& nicknames = workload.m_Nicknames;
+	const std::vector<int>& draws = workload.m_Draws;
+	const std::vector<int>& distinctDraws = workload.m_DistinctDraws;
+	const int numberOfDraws = static_cast<int>(draws.size());
+	const int numberOfDistinctDraws = static_cast<int>(distinctDraws.size());
+	std::vector<std::pair<std::string, int>> entries;
+	for (int i = 0; i < workload.m_Size; i++)
+	{
+		entries.emplace_back(nicknames[i], i);
+	}
+
+	{
+		PrefixMap tree;
+		tree.BulkLoadUnsorted(entries);
+		Measurement search;
+		Measure(search, numberOfDraws, [&]()
+		{
+			std::int64_t checksum = 0;
+			for (int index : draws)
+			{
+				checksum += tree.Search(nicknames[index])->m_Value;
+			}
+
+			g_Checksum += checksum;
+		});
+
+		PrintResult("PersistentMap", "Search", workload, search);
+		tree.ResetStats();
+		Measurement update;
+		Measure(update, numberOfDraws, [&]()
+		{
+			for (int i = 0; i < numberOfDraws; i++)
+			{
+				tree.Insert(nicknames[draws[i]])->m_Value = i;
+				tree.DropVersionsBefore(tree.GetVersion() - BenchmarkData::HistoryLimit);
+			}
+		});
+
+		PrintResult("PersistentMap", "Update", workload, update);
+		PrintStats("Update", workload, tree.GetStats(), update.m_Operations);
+		tree.ResetStats();
+		Measurement deletion;
+		Measure(deletion, numberOfDistinctDraws, [&]()
+		{
+			for (int index : distinctDraws)
+			{
+				tree.Delete(nicknames[index]);
+				tree.DropVersionsBefore(tree.GetVersion() - BenchmarkData::HistoryLimit);
+			}
+		});
+
+		PrintResult("PersistentMap", "Delete", workload, deletion);
+		PrintStats("Delete", workload, tree.GetStats(), deletion.m_Operations);
+		tree.ResetStats();
+
+		// Deleted keys come back, so the next phases see the full map again
+		Measurement insertion;
+		Measure(insertion, numberOfDistinctDraws, [&]()
+		{
+			for (int index : distinctDraws)
+			{
+				tree.Insert(nicknames[index])->m_Value = index;
+				tree.DropVersionsBefore(tree.GetVersion() - BenchmarkData::HistoryLimit);
+			}
+		});
+
+		PrintResult("PersistentMap", "Insert", workload, insertion);
+		PrintStats("Insert", workload, tree.GetStats(), insertion.m_Operations);
+
+		// Versions to roll back are made by untimed updates, up to history limit at a time
+		Measurement rollback;
+		for (int first = 0; first < numberOfDraws; first += BenchmarkData::HistoryLimit)
+		{
+			const int count = std::min(BenchmarkData::HistoryLimit, numberOfDraws - first);
+			for (int i = first; i < first + count; i++)
+			{
+				tree.Insert(nicknames[draws[i]])->m_Value = -i;
+				tree.DropVersionsBefore(tree.GetVersion() - BenchmarkData::HistoryLimit);
+			}
+
+			Measure(rollback, count, [&]()
+			{
+				for (int i = 0; i < count; i++)
+				{
+					tree.Rollback(1);
+				}
+			});
+		}
+
+		PrintResult("PersistentMap", "Rollback", workload, rollback);
+		Measurement rollbackMix;
+		const int numberOfCycles = numberOfDraws / MixUpdates;
+		Measure(rollbackMix, numberOfCycles * (MixUpdates + 1), [&]()
+		{
+			for (int cycle = 0; cycle < numberOfCycles; cycle++)
+			{
+				for (int i = cycle * MixUpdates; i < (cycle + 1) * MixUpdates; i++)
+				{
+					tree.Insert(nicknames[draws[i]])->m_Value = i;
+					tree.DropVersionsBefore(tree.GetVersion() - BenchmarkData::HistoryLimit);
+				}
+
+				tree.Rollback(MixUpdates - 1);
+			}
+		});
+
+		PrintResult("PersistentMap", "RollbackMix", workload, rollbackMix);
+	}
+
+	// Fresh map has no free blocks in its pool, so every node of kept versions is new memory
+	PrefixMap tree;
+	tree.BulkLoadUnsorted(std::move(entries));
+	const int loadedVersion = tree.GetVersion();
+	const int numberOfVersions = std::min(numberOfDraws, MaxHistoryVersions);
+	const std::int64_t bytesBefore = AllocationCounter::GetLiveBytes();
+	Measurement history;
+	Measure(history, numberOfVersions, [&]()
+	{
+		for (int i = 0; i < numberOfVersions; i++)
+		{
+			tree.Insert(nicknames[draws[i]])->m_Value = -i;
+		}
+	});
+
+	PrintResult("PersistentMap", "History", workload, history, static_cast<double>(AllocationCounter::GetLiveBytes() - bytesBefore) / numberOfVersions);
+
+	// The same history measured by the map. The first query visits nodes created by every version and walks the loaded tree once for heap of its keys
+	pst::PersistentMapMemory retained;
+	Measurement accounting;
+	Measure(accounting, 1, [&]()
+	{
+		tree.GetRetainedMemory(loadedVersion, tree.GetVersion(), retained);
+	});
+
+	pst::PersistentMapVersionMemory loaded;
+	tree.GetVersionMemory(loadedVersion, loaded);
+	PrintResult("PersistentMap", "RetainedMemory", workload, accounting, static_cast<double>(retained.m_Bytes - loaded.m_Bytes) / numberOfVersions);
+}
+
+void pst::BenchmarkSuite::BenchmarkPlayersStorage(const Workload& workload)
+{
+	const std::vector<std::string>& nicknames = workload.m_Nicknames;
+	const std::vector<int>& draws = workload.m_Draws;
+	const std::vector<int>& distinctDraws = workload.m_DistinctDraws;
+	const int numberOfDraws = static_cast<int>(draws.size());
+	const int numberOfDistinctDraws = static_cast<int>(distinctDraws.size());
+	std::mt19937 generator(static_cast<std::mt19937::result_type>(workload.m_Size));
+	std::uniform_int_distribution<int> ratingDistribution(0, MaxRating);
+	std::vector<std::pair<std::string, int>> players;
+	for (int i = 0; i < workload.m_Size; i++)
+	{
+		players.emplace_back(nicknames[i], ratingDistribution(generator));
+	}
+
+	{
+		PlayersStorage storage;
+		storage.ImportPlayers(players);
+		storage.SetHistoryLimit(BenchmarkData::HistoryLimit);
+		Measurement rating;
+		Measure(rating, numberOfDraws, [&]()
+		{
+			std::int64_t checksum = 0;
+			for (int index : draws)
+			{
+				checksum += storage.GetPlayerRating(nicknames[index]);
+			}
+
+			g_Checksum += checksum;
+		});
+
+		PrintResult("PlayersStorage", "GetPlayerRating", workload, rating);
+		Measurement rank;
+		Measure(rank, numberOfDraws, [&]()
+		{
+			std::int64_t checksum = 0;
+			for (int index : draws)
+			{
+				checksum += storage.GetPlayerRank(nicknames[index]);
+			}
+
+			g_Checksum += checksum;
+		});
+
+		PrintResult("PlayersStorage", "GetPlayerRank", workload, rank);
+
+		// Popular pages are the top ones, so the drawn index is used as the first rank
+		Measurement leaderboard;
+		Measure(leaderboard, numberOfDraws, [&]()
+		{
+			std::int64_t checksum = 0;
+			for (int index : draws)
+			{
+				storage.VisitLeaderboard(index + 1, LeaderboardPageSize, [&checksum](const std::string&, int playerRating) { checksum += playerRating; });
+			}
+
+			g_Checksum += checksum;
+		});
+
+		PrintResult("PlayersStorage", "VisitLeaderboard", workload, leaderboard);
+		Measurement registration;
+		Measure(registration, numberOfDraws, [&]()
+		{
+			for (int i = 0; i < numberOfDraws; i++)
+			{
+				storage.RegisterPlayerResult(nicknames[draws[i]], i % MaxRating);
+			}
+		});
+
+		PrintResult("PlayersStorage", "RegisterPlayerResult", workload, registration);
+
+		// Participants are copied into matches before measuring, as a server would receive them
+		std::vector<std::vector<std::pair<std::string, int>>> matches(numberOfDraws / MatchSize);
+		for (int i = 0; i < static_cast<int>(matches.size()) * MatchSize; i++)
+		{
+			matches[i / MatchSize].emplace_back(nicknames[draws[i]], (i * 7) % MaxRating);
+		}
+
+		Measurement match;
+		Measure(match, static_cast<int>(matches.size()), [&]()
+		{
+			for (const auto& playerRatings : matches)
+			{
+				storage.RegisterMatchResult(playerRatings);
+			}
+		});
+
+		PrintResult("PlayersStorage", "RegisterMatchResult", workload, match);
+		Measurement unregistration;
+		Measure(unregistration, numberOfDistinctDraws, [&]()
+		{
+			for (int index : distinctDraws)
+			{
+				storage.UnregisterPlayer(nicknames[index]);
+			}
+		});
+
+		PrintResult("PlayersStorage", "UnregisterPlayer", workload, unregistration);
+
+		// Unregistered players come back, so the next phases see all players again
+		Measurement newRegistration;
+		Measure(newRegistration, numberOfDistinctDraws, [&]()
+		{
+			for (int index : distinctDraws)
+			{
+				storage.RegisterPlayerResult(nicknames[index], players[index].second);
+			}
+		});
+
+		PrintResult("PlayersStorage", "RegisterNewPlayer", workload, newRegistration);
+		Measurement rollback;
+		for (int first = 0; first < numberOfDraws; first += BenchmarkData::HistoryLimit)
+		{
+			const int count = std::min(BenchmarkData::HistoryLimit, numberOfDraws - first);
+			for (int i = first; i < first + count; i++)
+			{
+				storage.RegisterPlayerResult(nicknames[draws[i]], i % MaxRating);
+			}
+
+			Measure(rollback, count, [&]()
+			{
+				for (int i = 0; i < count; i++)
+				{
+					storage.Rollback(1);
+				}
+			});
+		}
+
+		PrintResult("PlayersStorage", "Rollback", workload, rollback);
+		Measurement rollbackMix;
+		const int numberOfCycles = numberOfDraws / MixUpdates;
+		Measure(rollbackMix, numberOfCycles * (MixUpdates + 1), [&]()
+		{
+			for (int cycle = 0; cycle < numberOfCycles; cycle++)
+			{
+				for (int i = cycle * MixUpdates; i < (cycle + 1) * MixUpdates; i++)
+				{
+					storage.RegisterPlayerResult(nicknames[draws[i]], i % MaxRating);
+				}
+
+				storage.Rollback(MixUpdates - 1);
+			}
+		});
+
+		PrintResult("PlayersStorage", "RollbackMix", workload, rollbackMix);
+	}
+
+	// Fresh storage keeps every version, so all memory made by changes is retained
+	PlayersStorage storage;
+	storage.ImportPlayers(players);
+	const int importedStep = storage.GetStep();
+	const int numberOfVersions = std::min(numberOfDraws, MaxHistoryVersions);
+	const std::int64_t bytesBefore = AllocationCounter::GetLiveBytes();
+	Measurement history;
+	Measure(history, numberOfVersions, [&]()
+	{
+		for (int i = 0; i < numberOfVersions; i++)
+		{
+			storage.RegisterPlayerResult(nicknames[draws[i]], i % MaxRating);
+		}
+	});
+
+	PrintResult("PlayersStorage", "History", workload, history, static_cast<double>(AllocationCounter::GetLiveBytes() - bytesBefore) / numberOfVersions);
+
+	// Keys of the storage don't own heap memory, so the query visits only nodes created by the steps
+	pst::PersistentMapMemory retained;
+	Measurement accounting;
+	Measure(accounting, 1, [&]()
+	{
+		storage.GetRetainedMemory(importedStep, storage.GetStep(), retained);
+	});
+
+	pst::PersistentMapVersionMemory imported;
+	storage.GetStepMemory(importedStep, imported);
+	PrintResult("PlayersStorage", "RetainedMemory", workload, accounting, static_cast<double>(retained.m_Bytes - imported.m_Bytes) / numberOfVersions);
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace pst
+{
+	struct PersistentMapStats;
+
+	/// Benchmarks of PersistentMap and PlayersStorage operations over map sizes and key distributions. Every result is printed as one JSON object per line
+	/// with ns/op, allocations/op and, for history phases, bytes retained per version, so outputs of two commits can be diffed line by line
+	class BenchmarkSuite
+	{
+	public:
+		struct Options
+		{
+			/// Sizes are powers of 10 from 1e3 up to this one
+			int m_MaxSize = 10000000;
+
+			/// Every phase runs at most this many operations, so large maps are measured in reasonable time
+			int m_MaxOperations = 100000;
+		};
+
+		static void Run(const Options& options);
+
+	private:
+		enum class KeyDistribution
+		{
+			Uniform,
+			Zipfian
+		};
+
+		/// Keys of the map and operations drawn from them. Draws are made in advance, so measured loops don't spend time in the generator
+		struct Workload
+		{
+			int m_Size;
+			KeyDistribution m_Distribution;
+
+			/// m_Size nicknames in random order, so index is unrelated to order of keys
+			std::vector<std::string> m_Nicknames;
+
+			/// Indices of nicknames picked by the distribution, one per operation
+			std::vector<int> m_Draws;
+
+			/// The same draws without repeats, for operations which can't be repeated on the same key
+			std::vector<int> m_DistinctDraws;
+		};
+
+		struct Measurement
+		{
+			double m_Nanoseconds = 0;
+			std::uint64_t m_Allocations = 0;
+			int m_Operations = 0;
+		};
+
+		/// Replaces draws of workload with numberOfOperations new ones from the distribution
+		static void DrawKeys(Workload& workload, KeyDistribution distribution, int numberOfOperations);
+
+		/// Adds time and allocations of function which runs numberOfOperations operations
+		template <typename TFunction>
+		static void Measure(Measurement& measurement, int numberOfOperations, TFunction&& function);
+
+		/// Bytes per version are printed only for phases which keep every version
+		static void PrintResult(const char* suite, const char* operation, const Workload& workload, const Measurement& measurement, double bytesPerVersion = -1);
+
+		/// Prints counters of map changes per operation when map is built with PST_PERSISTENT_MAP_STATS
+		static void PrintStats(const char* operation, const Workload& workload, const PersistentMapStats& stats, int numberOfOperations);
+
+		/// Search, update, delete and insert of string keys, rollback alone and mixed with updates, and memory of kept history
+		static void BenchmarkMap(const Workload& workload);
+
+		/// The same phases for queries and changes of players storage, plus match results and leaderboard pages
+		static void BenchmarkPlayersStorage(const Workload& workload);
+	};
+}
@@ -0,0 +1,352 @@
+#include "PersistentMapBenchmark.h"
+
+#include "BenchmarkData.h"
+#include "../CoreLib/MappedFile.h"
+#include "../CoreLib/PersistentBTree.h"
+#include "../CoreLib/PersistentFatNodeMap.h"
+#include "../CoreLib/PersistentMap.h"
+#include "../CoreLib/PersistentMapImage.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace
+{
+	/// Node pool which counts bytes of live nodes of all its instances
+	class CountingNodePool : public pst::NodePool
+	{
+	public:
+		void* Allocate(std::size_t size)
+		{
+			s_AllocatedBytes += size;
+			return pst::NodePool::Allocate(size);
+		}
+
+		static void Free(void* block, std::size_t size)
+		{
+			s_AllocatedBytes -= size;
+			pst::NodePool::Free(block, size);
+		}
+
+		static inline std::size_t s_AllocatedBytes = 0;
+	};
+
+	/// Maps return node, entry or value itself from Insert and Search
+	template <typename TItem>
+	decltype(auto) ValueOf(TItem& item)
+	{
+		if constexpr (std::is_same_v<std::remove_const_t<TItem>, int>)
+		{
+			return (item);
+		}
+		else
+		{
+			return (item.m_Value);
+		}
+	}
+
+	/// History memory which is not in nodes
+	template <typename TMap>
+	std::size_t GetHistoryBytesOutsideNodes(const TMap&)
+	{
+		return 0;
+	}
+
+	template <typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+	std::size_t GetHistoryBytesOutsideNodes(const pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>& map)
+	{
+		return map.GetUndoLogBytes();
+	}
+
+	template <typename TFunction>
+	double MeasureNsPerOperation(int numberOfOperations, TFunction&& function)
+	{
+		const auto start = std::chrono::steady_clock::now();
+		function();
+		const auto finish = std::chrono::steady_clock::now();
+		return std::chrono::duration<double, std::nano>(finish - start).count() / numberOfOperations;
+	}
+}
+
+void pst::PersistentMapBenchmark::Run(int maxKeys)
+{
+	using StringMap = pst::PersistentMap<std::string, int, pst::NodePool, pst::KeyTraits<std::string>>;
+	using PrefixMap = pst::PersistentMap<std::string, int, pst::NodePool, pst::StringPrefixKeyTraits<>>;
+	using PrefixBTree = pst::PersistentBTree<std::string, int, pst::NodePool, pst::StringPrefixKeyTraits<>>;
+	using PrefixFatNodeMap = pst::PersistentFatNodeMap<std::string, int, pst::NodePool, pst::StringPrefixKeyTraits<>>;
+	for (int numberOfKeys : { maxKeys / 100, maxKeys })
+	{
+		BenchmarkWrites<StringMap>(numberOfKeys, "rbtree/string");
+		BenchmarkWrites<PrefixMap>(numberOfKeys, "rbtree/prefix");
+		BenchmarkWrites<PrefixBTree>(numberOfKeys, "btree/prefix");
+		BenchmarkWrites<PrefixFatNodeMap>(numberOfKeys, "fatnode/prefix");
+	}
+
+	BenchmarkHistoryMemory<pst::PersistentMap<std::string, int, CountingNodePool, pst::StringPrefixKeyTraits<>>>(maxKeys / 10, maxKeys / 5, "rbtree/prefix");
+	BenchmarkHistoryMemory<pst::PersistentBTree<std::string, int, CountingNodePool, pst::StringPrefixKeyTraits<>>>(maxKeys / 10, maxKeys / 5, "btree/prefix");
+	BenchmarkHistoryMemory<pst::PersistentFatNodeMap<std::string, int, CountingNodePool, pst::StringPrefixKeyTraits<>>>(maxKeys / 10, maxKeys / 5, "fatnode/prefix");
+	BenchmarkBulkLoad(maxKeys);
+	BenchmarkUnion(maxKeys);
+	BenchmarkColdStart(maxKeys, maxKeys / 10);
+}
+
+template <typename TMap>
+void pst::PersistentMapBenchmark::BenchmarkWrites(int numberOfKeys, const char* mapName)
+{
+	std::mt19937 generator;
+	std::vector<std::string> nicknames = BenchmarkData::GenerateNicknames(numberOfKeys, generator);
+	TMap tree;
+	const double insertNs = MeasureNsPerOperation(numberOfKeys, [&]()
+	{
+		for (int i = 0; i < numberOfKeys; i++)
+		{
+			ValueOf(*tree.Insert(nicknames[i])) = i;
+			tree.DropVersionsBefore(tree.GetVersion() - BenchmarkData::HistoryLimit);
+		}
+	});
+
+	std::shuffle(std::begin(nicknames), std::end(nicknames), generator);
+	const double updateNs = MeasureNsPerOperation(numberOfKeys, [&]()
+	{
+		for (int i = 0; i < numberOfKeys; i++)
+		{
+			ValueOf(*tree.Insert(nicknames[i])) = -i;
+			tree.DropVersionsBefore(tree.GetVersion() - BenchmarkData::HistoryLimit);
+		}
+	});
+
+	std::shuffle(std::begin(nicknames), std::end(nicknames), generator);
+	long long checksum = 0;
+	const double searchNs = MeasureNsPerOperation(numberOfKeys, [&]()
+	{
+		for (int i = 0; i < numberOfKeys; i++)
+		{
+			checksum += ValueOf(*tree.Search(nicknames[i]));
+		}
+	});
+
+	std::shuffle(std::begin(nicknames), std::end(nicknames), generator);
+	const double deleteNs = MeasureNsPerOperation(numberOfKeys / 2, [&]()
+	{
+		for (int i = 0; i < numberOfKeys / 2; i++)
+		{
+			tree.Delete(nicknames[i]);
+			tree.DropVersionsBefore(tree.GetVersion() - BenchmarkData::HistoryLimit);
+		}
+	});
+
+	std::printf("%s keys=%d insert=%.0fns update=%.0fns search=%.0fns delete=%.0fns (checksum %lld)\n",
+		mapName, numberOfKeys, insertNs, updateNs, searchNs, deleteNs, checksum);
+}
+
+template <typename TMap>
+void pst::PersistentMapBenchmark::BenchmarkHistoryMemory(int numberOfKeys, int numberOfUpdates, const char* mapName)
+{
+	std::mt19937 generator;
+	std::vector<std::string> nicknames = BenchmarkData::GenerateNicknames(numberOfKeys, generator);
+	const std::size_t bytesBefore = CountingNodePool::s_AllocatedBytes;
+	{
+		TMap tree;
+
+		// Initial data is one version, so only updates build history
+		tree.BeginBatch();
+		for (int i = 0; i < numberOfKeys; i++)
+		{
+			ValueOf(*tree.Insert(nicknames[i])) = i;
+		}
+
+		tree.Commit();
+		const std::size_t treeBytes = CountingNodePool::s_AllocatedBytes - bytesBefore;
+		std::uniform_int_distribution<int> keyDistribution(0, numberOfKeys - 1);
+		for (int i = 0; i < numberOfUpdates; i++)
+		{
+			ValueOf(*tree.Insert(nicknames[keyDistribution(generator)])) = -i;
+		}
+
+		const std::size_t historyBytes = CountingNodePool::s_AllocatedBytes - bytesBefore - treeBytes + GetHistoryBytesOutsideNodes(tree);
+		std::printf("%s keys=%d versions=%d tree=%zuB history=%.0fB/version\n",
+			mapName, numberOfKeys, numberOfUpdates, treeBytes, static_cast<double>(historyBytes) / numberOfUpdates);
+	}
+}
+
+void pst::PersistentMapBenchmark::BenchmarkBulkLoad(int numberOfKeys)
+{
+	using PrefixMap = pst::PersistentMap<std::string, int, pst::NodePool, pst::StringPrefixKeyTraits<>>;
+	std::mt19937 generator;
+	std::vector<std::pair<std::string, int>> entries;
+	for (std::string& nickname : BenchmarkData::GenerateNicknames(numberOfKeys, generator))
+	{
+		entries.emplace_back(std::move(nickname), static_cast<int>(entries.size()));
+	}
+
+	std::vector<std::pair<std::string, int>> sortedEntries = entries;
+	std::sort(std::begin(sortedEntries), std::end(sortedEntries));
+	const double insertNs = MeasureNsPerOperation(numberOfKeys, [&]()
+	{
+		PrefixMap tree;
+		for (const auto& [nickname, value] : entries)
+		{
+			tree.Insert(nickname)->m_Value = value;
+			tree.DropVersionsBefore(tree.GetVersion() - BenchmarkData::HistoryLimit);
+		}
+	});
+
+	const double batchNs = MeasureNsPerOperation(numberOfKeys, [&]()
+	{
+		PrefixMap tree;
+		tree.BeginBatch();
+		for (const auto& [nickname, value] : entries)
+		{
+			tree.Insert(nickname)->m_Value = value;
+		}
+
+		tree.Commit();
+	});
+
+	const double sortedNs = MeasureNsPerOperation(numberOfKeys, [&]()
+	{
+		PrefixMap tree;
+		tree.BulkLoad(sortedEntries.begin(), sortedEntries.end());
+	});
+
+	// Includes copying of the input, which BulkLoadUnsorted takes by value
+	const double unsortedNs = MeasureNsPerOperation(numberOfKeys, [&]()
+	{
+		PrefixMap tree;
+		tree.BulkLoadUnsorted(entries);
+	});
+
+	std::printf("bulk load keys=%d insert=%.0fns batch=%.0fns sorted=%.0fns unsorted(%u threads)=%.0fns\n",
+		numberOfKeys, insertNs, batchNs, sortedNs, std::thread::hardware_concurrency(), unsortedNs);
+}
+
+void pst::PersistentMapBenchmark::BenchmarkUnion(int numberOfKeys)
+{
+	using PrefixMap = pst::PersistentMap<std::string, int, pst::NodePool, pst::StringPrefixKeyTraits<>>;
+	std::mt19937 generator;
+	std::vector<std::pair<std::string, int>> entries;
+	for (std::string& nickname : BenchmarkData::GenerateNicknames(numberOfKeys, generator))
+	{
+		entries.emplace_back(std::move(nickname), 0);
+	}
+
+	// Each way gets its own map, so both pay for reclamation of their own rolled back updates only
+	PrefixMap insertTree;
+	PrefixMap unionTree;
+	insertTree.BulkLoadUnsorted(entries);
+	unionTree.BulkLoadUnsorted(entries);
+	for (int numberOfUpdates : { numberOfKeys / 1000, numberOfKeys / 10, numberOfKeys })
+	{
+		// Half of updates change existing keys, half add new ones
+		std::vector<std::pair<std::string, int>> updates;
+		std::uniform_int_distribution<int> keyDistribution(0, numberOfKeys - 1);
+		for (int i = 0; i < numberOfUpdates; i++)
+		{
+			updates.emplace_back(i % 2 ? entries[keyDistribution(generator)].first : "new" + std::to_string(i), i);
+		}
+
+		std::sort(std::begin(updates), std::end(updates));
+		updates.erase(std::unique(std::begin(updates), std::end(updates), [](const auto& left, const auto& right) { return left.first == right.first; }), std::end(updates));
+		const double insertNs = MeasureNsPerOperation(static_cast<int>(updates.size()), [&]()
+		{
+			insertTree.BeginBatch();
+			for (const auto& [nickname, value] : updates)
+			{
+				insertTree.Insert(nickname)->m_Value = value;
+			}
+
+			insertTree.Commit();
+		});
+
+		const double unionNs = MeasureNsPerOperation(static_cast<int>(updates.size()), [&]()
+		{
+			unionTree.Union(updates.begin(), updates.end());
+		});
+
+		insertTree.Rollback(1);
+		unionTree.Rollback(1);
+		std::printf("union keys=%d updates=%zu batch insert=%.0fns/update union=%.0fns/update\n", numberOfKeys, updates.size(), insertNs, unionNs);
+	}
+}
+
+void pst::PersistentMapBenchmark::BenchmarkColdStart(int numberOfKeys, int numberOfUpdates)
+{
+	using PrefixMap = pst::PersistentMap<std::string, int, pst::NodePool, pst::StringPrefixKeyTraits<>>;
+	using PrefixMapImage = pst::PersistentMapImage<std::string, int, pst::StringPrefixKeyTraits<>>;
+	constexpr int NumberOfQueries = 1000;
+	std::mt19937 generator;
+	std::vector<std::string> nicknames = BenchmarkData::GenerateNicknames(numberOfKeys, generator);
+	const std::filesystem::path directory = std::filesystem::temp_directory_path();
+	const std::string snapshotPath = (directory / "PersistentMapBenchmark.snapshot").string();
+	const std::string imagePath = (directory / "PersistentMapBenchmark.image").string();
+	{
+		PrefixMap tree;
+		tree.BeginBatch();
+		for (int i = 0; i < numberOfKeys; i++)
+		{
+			tree.Insert(nicknames[i])->m_Value = i;
+		}
+
+		tree.Commit();
+		std::uniform_int_distribution<int> keyDistribution(0, numberOfKeys - 1);
+		for (int i = 0; i < numberOfUpdates; i++)
+		{
+			tree.Insert(nicknames[keyDistribution(generator)])->m_Value = -i;
+		}
+
+		std::ofstream snapshotFile(snapshotPath, std::ios::binary | std::ios::trunc);
+		pst::BinaryWriter writer(snapshotFile);
+		std::ofstream imageFile(imagePath, std::ios::binary | std::ios::trunc);
+		if (!tree.Save(writer, 0) || !PrefixMapImage::Write(imageFile, tree, 0))
+		{
+			std::printf("cold start: can't write files to %s\n", directory.string().c_str());
+			return;
+		}
+	}
+
+	// Files have just been written, so both runs read them from page cache. Checksums make sure that queries are not optimized away
+	std::int64_t loadChecksum = 0;
+	const auto loadStart = std::chrono::steady_clock::now();
+	{
+		std::ifstream snapshotFile(snapshotPath, std::ios::binary);
+		pst::BinaryReader reader(snapshotFile);
+		PrefixMap tree;
+		tree.Load(reader);
+		for (int i = 0; i < NumberOfQueries; i++)
+		{
+			loadChecksum += tree.Search(nicknames[i * 7919 % numberOfKeys])->m_Value;
+		}
+	}
+
+	const auto loadEnd = std::chrono::steady_clock::now();
+	std::int64_t imageChecksum = 0;
+	{
+		pst::MappedFile imageFile;
+		PrefixMapImage image;
+		imageFile.Open(imagePath);
+		image.Open(imageFile.GetData(), imageFile.GetSize());
+		const auto snapshot = image.GetSnapshot(image.GetVersion());
+		for (int i = 0; i < NumberOfQueries; i++)
+		{
+			imageChecksum += *snapshot.Search(nicknames[i * 7919 % numberOfKeys]);
+		}
+	}
+
+	const auto imageEnd = std::chrono::steady_clock::now();
+	std::printf("cold start keys=%d versions=%d snapshot=%juB load+%dqueries=%.1fms image=%juB map+%dqueries=%.1fms (checksums %lld %lld)\n",
+		numberOfKeys, numberOfUpdates + 1,
+		static_cast<std::uintmax_t>(std::filesystem::file_size(snapshotPath)), NumberOfQueries, std::chrono::duration<double, std::milli>(loadEnd - loadStart).count(),
+		static_cast<std::uintmax_t>(std::filesystem::file_size(imagePath)), NumberOfQueries, std::chrono::duration<double, std::milli>(imageEnd - loadEnd).count(),
+		static_cast<long long>(loadChecksum), static_cast<long long>(imageChecksum));
+	std::filesystem::remove(snapshotPath);
+	std::filesystem::remove(imagePath);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+namespace pst
+{
+	/// Micro benchmarks of PersistentMap, PersistentBTree and PersistentFatNodeMap write and read paths and history memory. Should be run in Release configuration
+	class PersistentMapBenchmark
+	{
+	public:
+		static constexpr int DefaultMaxKeys = 1000000;
+
+		/// Largest maps have maxKeys keys, smaller phases are scaled from it
+		static void Run(int maxKeys = DefaultMaxKeys);
+
+	private:
+		/// Runs the same workload with different maps and key traits, so tree layouts and the cost of key comparison can be compared
+		template <typename TMap>
+		static void BenchmarkWrites(int numberOfKeys, const char* mapName);
+
+		/// Updates random keys keeping every version and reports node bytes retained per version
+		template <typename TMap>
+		static void BenchmarkHistoryMemory(int numberOfKeys, int numberOfUpdates, const char* mapName);
+
+		/// Compares seeding empty map by inserts with O(n) bulk load of sorted and unsorted input
+		static void BenchmarkBulkLoad(int numberOfKeys);
+
+		/// Compares applying sorted batch of updates to large map by join-based union with batch of inserts
+		static void BenchmarkUnion(int numberOfKeys);
+
+		/// Compares time to first queries after restart: Load of saved map against mapping its image
+		static void BenchmarkColdStart(int numberOfKeys, int numberOfUpdates);
+	};
+}
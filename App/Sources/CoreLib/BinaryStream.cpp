@@ -0,0 +1,134 @@
+#include "BinaryStream.h"
+
+#include <algorithm>
+
+pst::BinaryWriter::BinaryWriter(std::ostream& stream)
+	: m_Stream(stream)
+{
+}
+
+void pst::BinaryWriter::WriteVarUInt(std::uint64_t value)
+{
+	unsigned char bytes[10];
+	std::size_t size = 0;
+	while (value >= 0x80)
+	{
+		bytes[size++] = static_cast<unsigned char>(value | 0x80);
+		value >>= 7;
+	}
+
+	bytes[size++] = static_cast<unsigned char>(value);
+	WriteBytes(bytes, size);
+}
+
+void pst::BinaryWriter::WriteVarInt(std::int64_t value)
+{
+	// Zigzag keeps small negative numbers short: 0, -1, 1, -2, ... become 0, 1, 2, 3, ...
+	WriteVarUInt((static_cast<std::uint64_t>(value) << 1) ^ static_cast<std::uint64_t>(value >> 63));
+}
+
+void pst::BinaryWriter::WriteUInt32(std::uint32_t value)
+{
+	const unsigned char bytes[4] = {
+		static_cast<unsigned char>(value),
+		static_cast<unsigned char>(value >> 8),
+		static_cast<unsigned char>(value >> 16),
+		static_cast<unsigned char>(value >> 24) };
+	WriteBytes(bytes, sizeof(bytes));
+}
+
+void pst::BinaryWriter::WriteBytes(const void* data, std::size_t size)
+{
+	m_Stream.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+}
+
+void pst::BinaryWriter::WriteString(std::string_view string)
+{
+	WriteVarUInt(string.size());
+	WriteBytes(string.data(), string.size());
+}
+
+bool pst::BinaryWriter::IsGood() const
+{
+	return m_Stream.good();
+}
+
+pst::BinaryReader::BinaryReader(std::istream& stream)
+	: m_Stream(stream)
+	, m_IsGood(true)
+{
+}
+
+std::uint64_t pst::BinaryReader::ReadVarUInt()
+{
+	std::uint64_t value = 0;
+	for (int shift = 0; shift < 64; shift += 7)
+	{
+		unsigned char byte;
+		if (!ReadBytes(&byte, 1))
+		{
+			return 0;
+		}
+
+		value |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+		if (!(byte & 0x80))
+		{
+			return value;
+		}
+	}
+
+	// More than 10 bytes can't be written by BinaryWriter
+	Fail();
+	return 0;
+}
+
+std::int64_t pst::BinaryReader::ReadVarInt()
+{
+	const std::uint64_t value = ReadVarUInt();
+	return static_cast<std::int64_t>(value >> 1) ^ -static_cast<std::int64_t>(value & 1);
+}
+
+std::uint32_t pst::BinaryReader::ReadUInt32()
+{
+	unsigned char bytes[4];
+	if (!ReadBytes(bytes, sizeof(bytes)))
+	{
+		return 0;
+	}
+
+	return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (static_cast<std::uint32_t>(bytes[3]) << 24);
+}
+
+bool pst::BinaryReader::ReadBytes(void* data, std::size_t size)
+{
+	if (m_IsGood && !m_Stream.read(static_cast<char*>(data), static_cast<std::streamsize>(size)))
+	{
+		Fail();
+	}
+
+	return m_IsGood;
+}
+
+std::string pst::BinaryReader::ReadString()
+{
+	std::size_t size = static_cast<std::size_t>(ReadVarUInt());
+	std::string string;
+	while (m_IsGood && string.size() < size)
+	{
+		const std::size_t offset = string.size();
+		string.resize(offset + std::min(size - offset, StringChunkSize));
+		ReadBytes(&string[offset], string.size() - offset);
+	}
+
+	return m_IsGood ? string : std::string();
+}
+
+void pst::BinaryReader::Fail()
+{
+	m_IsGood = false;
+}
+
+bool pst::BinaryReader::IsGood() const
+{
+	return m_IsGood;
+}
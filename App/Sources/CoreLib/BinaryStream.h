@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <limits>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+namespace pst
+{
+	/// Writes little-endian binary data to a stream. Integers are written as LEB128 varints, signed ones zigzag-encoded,
+	/// so small numbers such as node references and versions take one or two bytes
+	class BinaryWriter
+	{
+	public:
+		explicit BinaryWriter(std::ostream& stream);
+
+		void WriteVarUInt(std::uint64_t value);
+		void WriteVarInt(std::int64_t value);
+		void WriteUInt32(std::uint32_t value);
+		void WriteBytes(const void* data, std::size_t size);
+
+		/// Length-prefixed bytes of the string
+		void WriteString(std::string_view string);
+
+		/// False if any write has failed
+		bool IsGood() const;
+
+	private:
+		std::ostream& m_Stream;
+	};
+
+	/// Reads data written by BinaryWriter. Malformed or truncated input sets failure flag and makes all following reads return zeros,
+	/// so caller can read a whole record and check IsGood once
+	class BinaryReader
+	{
+	public:
+		explicit BinaryReader(std::istream& stream);
+
+		std::uint64_t ReadVarUInt();
+		std::int64_t ReadVarInt();
+		std::uint32_t ReadUInt32();
+		bool ReadBytes(void* data, std::size_t size);
+		std::string ReadString();
+
+		/// Marks input as malformed. Used by callers which validate what they have read
+		void Fail();
+
+		bool IsGood() const;
+
+	private:
+		/// Strings are read in chunks, so corrupted length fails on end of input instead of huge allocation
+		static constexpr std::size_t StringChunkSize = 64 * 1024;
+
+		std::istream& m_Stream;
+		bool m_IsGood;
+	};
+
+	/// Default encoding of map keys and values: varints for integers and enums, length-prefixed bytes for strings.
+	/// Types which refer to external memory (string views, pointers) need codec which knows the owner of that memory
+	template <typename T, typename = void>
+	struct BinaryCodec;
+
+	template <typename T>
+	struct BinaryCodec<T, std::enable_if_t<std::is_integral_v<T> || std::is_enum_v<T>>>
+	{
+		static void Write(BinaryWriter& writer, T value)
+		{
+			if constexpr (std::is_enum_v<T>)
+			{
+				BinaryCodec<std::underlying_type_t<T>>::Write(writer, static_cast<std::underlying_type_t<T>>(value));
+			}
+			else if constexpr (std::is_signed_v<T>)
+			{
+				writer.WriteVarInt(value);
+			}
+			else
+			{
+				writer.WriteVarUInt(value);
+			}
+		}
+
+		static T Read(BinaryReader& reader)
+		{
+			if constexpr (std::is_enum_v<T>)
+			{
+				return static_cast<T>(BinaryCodec<std::underlying_type_t<T>>::Read(reader));
+			}
+			else
+			{
+				bool fits;
+				T result;
+				if constexpr (std::is_signed_v<T>)
+				{
+					const std::int64_t value = reader.ReadVarInt();
+					fits = value >= std::numeric_limits<T>::min() && value <= std::numeric_limits<T>::max();
+					result = static_cast<T>(value);
+				}
+				else
+				{
+					const std::uint64_t value = reader.ReadVarUInt();
+					fits = value <= std::numeric_limits<T>::max();
+					result = static_cast<T>(value);
+				}
+
+				if (!fits)
+				{
+					// Value hasn't been written by this codec
+					reader.Fail();
+					return T();
+				}
+
+				return result;
+			}
+		}
+	};
+
+	template <>
+	struct BinaryCodec<std::string>
+	{
+		static void Write(BinaryWriter& writer, const std::string& value) { writer.WriteString(value); }
+		static std::string Read(BinaryReader& reader) { return reader.ReadString(); }
+	};
+
+	/// Codec of PersistentMap entries built from codecs of key and value. Codec can be stateful, e.g. to map interned keys to ids
+	template <typename TKey, typename TValue>
+	struct BinaryMapCodec
+	{
+		void WriteKey(BinaryWriter& writer, const TKey& key) const { BinaryCodec<TKey>::Write(writer, key); }
+		TKey ReadKey(BinaryReader& reader) const { return BinaryCodec<TKey>::Read(reader); }
+		void WriteValue(BinaryWriter& writer, const TValue& value) const { BinaryCodec<TValue>::Write(writer, value); }
+		TValue ReadValue(BinaryReader& reader) const { return BinaryCodec<TValue>::Read(reader); }
+	};
+}
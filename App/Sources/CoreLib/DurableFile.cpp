@@ -0,0 +1,200 @@
+#include "DurableFile.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+	#define WIN32_LEAN_AND_MEAN
+	#define NOMINMAX
+	#include <windows.h>
+#else
+	#include <cerrno>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+pst::DurableFile::DurableFile()
+	: m_Buffer(BufferSize)
+	, m_HasFailed(false)
+#if defined(_WIN32) || defined(_WIN64)
+	, m_File(INVALID_HANDLE_VALUE)
+#else
+	, m_File(-1)
+#endif
+{
+	setp(m_Buffer.data(), m_Buffer.data() + m_Buffer.size());
+}
+
+pst::DurableFile::~DurableFile()
+{
+	Close();
+}
+
+#if defined(_WIN32) || defined(_WIN64)
+
+bool pst::DurableFile::Open(const std::string& path)
+{
+	Close();
+	// Metadata of NTFS is journaled, so new directory entry doesn't need a sync of its own
+	m_File = CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	m_HasFailed = false;
+	return m_File != INVALID_HANDLE_VALUE;
+}
+
+bool pst::DurableFile::Close()
+{
+	if (m_File == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	const bool isSynced = Sync();
+	CloseHandle(m_File);
+	m_File = INVALID_HANDLE_VALUE;
+	return isSynced;
+}
+
+bool pst::DurableFile::IsOpen() const
+{
+	return m_File != INVALID_HANDLE_VALUE;
+}
+
+bool pst::DurableFile::Sync()
+{
+	if (!WriteBuffer() || !FlushFileBuffers(m_File))
+	{
+		m_HasFailed = true;
+	}
+
+	return !m_HasFailed;
+}
+
+bool pst::DurableFile::WriteBuffer()
+{
+	const char* data = pbase();
+	std::size_t size = static_cast<std::size_t>(pptr() - pbase());
+	setp(m_Buffer.data(), m_Buffer.data() + m_Buffer.size());
+	while (size > 0 && !m_HasFailed)
+	{
+		DWORD writtenSize = 0;
+		if (!WriteFile(m_File, data, static_cast<DWORD>(size), &writtenSize, nullptr))
+		{
+			m_HasFailed = true;
+			break;
+		}
+
+		data += writtenSize;
+		size -= writtenSize;
+	}
+
+	return !m_HasFailed;
+}
+
+#else
+
+bool pst::DurableFile::Open(const std::string& path)
+{
+	Close();
+	m_File = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	m_HasFailed = false;
+	if (m_File < 0)
+	{
+		return false;
+	}
+
+	// New file is lost with its directory entry on power loss, unless the directory is synced too
+	const std::string::size_type separator = path.rfind('/');
+	const std::string directory = separator == std::string::npos ? "." : (separator == 0 ? "/" : path.substr(0, separator));
+	const int directoryFile = open(directory.c_str(), O_RDONLY | O_CLOEXEC);
+	if (directoryFile < 0 || fsync(directoryFile) != 0)
+	{
+		m_HasFailed = true;
+	}
+
+	if (directoryFile >= 0)
+	{
+		close(directoryFile);
+	}
+
+	return true;
+}
+
+bool pst::DurableFile::Close()
+{
+	if (m_File < 0)
+	{
+		return false;
+	}
+
+	const bool isSynced = Sync();
+	close(m_File);
+	m_File = -1;
+	return isSynced;
+}
+
+bool pst::DurableFile::IsOpen() const
+{
+	return m_File >= 0;
+}
+
+bool pst::DurableFile::Sync()
+{
+#if defined(__APPLE__)
+	// fsync of macOS doesn't flush the drive cache
+	const bool isSynced = WriteBuffer() && fcntl(m_File, F_FULLFSYNC) == 0;
+#else
+	const bool isSynced = WriteBuffer() && fdatasync(m_File) == 0;
+#endif
+	if (!isSynced)
+	{
+		m_HasFailed = true;
+	}
+
+	return !m_HasFailed;
+}
+
+bool pst::DurableFile::WriteBuffer()
+{
+	const char* data = pbase();
+	std::size_t size = static_cast<std::size_t>(pptr() - pbase());
+	setp(m_Buffer.data(), m_Buffer.data() + m_Buffer.size());
+	while (size > 0 && !m_HasFailed)
+	{
+		const ssize_t writtenSize = write(m_File, data, size);
+		if (writtenSize < 0)
+		{
+			if (errno != EINTR)
+			{
+				m_HasFailed = true;
+			}
+
+			continue;
+		}
+
+		data += writtenSize;
+		size -= static_cast<std::size_t>(writtenSize);
+	}
+
+	return !m_HasFailed;
+}
+
+#endif
+
+pst::DurableFile::int_type pst::DurableFile::overflow(int_type character)
+{
+	if (!IsOpen() || !WriteBuffer())
+	{
+		return traits_type::eof();
+	}
+
+	if (!traits_type::eq_int_type(character, traits_type::eof()))
+	{
+		*pptr() = traits_type::to_char_type(character);
+		pbump(1);
+	}
+
+	return traits_type::not_eof(character);
+}
+
+int pst::DurableFile::sync()
+{
+	// Stream flush only hands data to the OS, durable sync is done by Sync
+	return IsOpen() && WriteBuffer() ? 0 : -1;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+namespace pst
+{
+	/// Write-only file for logs and checkpoints. It is a stream buffer, so std::ostream over it writes to the file.
+	/// Sync returns once the OS has stored written data on disk, so it survives OS crash and power loss.
+	/// Flush of std::ofstream only hands data to the OS page cache
+	class DurableFile : public std::streambuf
+	{
+	public:
+		DurableFile();
+		~DurableFile() override;
+
+		DurableFile(const DurableFile&) = delete;
+		DurableFile& operator=(const DurableFile&) = delete;
+
+		/// Creates empty file, replacing existing one, and makes its directory entry durable. Closes previously opened file.
+		/// Returns false if file can't be created
+		bool Open(const std::string& path);
+
+		/// Syncs and closes file. Returns false if nothing is open or the sync fails
+		bool Close();
+
+		bool IsOpen() const;
+
+		/// Writes buffered data and waits until the file is on disk. Returns false if a write has failed since the file was opened
+		bool Sync();
+
+	protected:
+		int_type overflow(int_type character) override;
+		int sync() override;
+
+	private:
+		static constexpr std::size_t BufferSize = 64 * 1024;
+
+		/// Hands buffered data to the OS. Error is kept, so Sync reports it even if it happened on an earlier write
+		bool WriteBuffer();
+
+		std::vector<char> m_Buffer;
+		bool m_HasFailed;
+
+#if defined(_WIN32) || defined(_WIN64)
+		void* m_File;
+#else
+		int m_File;
+#endif
+	};
+}
@@ -0,0 +1,74 @@
+#include "EpochDomain.h"
+
+#include <functional>
+#include <limits>
+#include <thread>
+
+pst::EpochDomain::ReadGuard::ReadGuard(EpochDomain& domain)
+	: m_Domain(&domain)
+	, m_Slot(domain.Pin())
+{
+}
+
+pst::EpochDomain::ReadGuard::~ReadGuard()
+{
+	if (m_Slot)
+	{
+		m_Slot->store(0, std::memory_order_release);
+	}
+}
+
+pst::EpochDomain::ReadGuard::ReadGuard(ReadGuard&& other)
+	: m_Domain(other.m_Domain)
+	, m_Slot(other.m_Slot)
+{
+	other.m_Slot = nullptr;
+}
+
+pst::EpochDomain::EpochDomain()
+	: m_Epoch(1)
+{
+}
+
+std::uint64_t pst::EpochDomain::Advance()
+{
+	return m_Epoch.fetch_add(1);
+}
+
+std::uint64_t pst::EpochDomain::GetOldestPinnedEpoch() const
+{
+	std::uint64_t oldestEpoch = std::numeric_limits<std::uint64_t>::max();
+	for (const Slot& slot : m_Slots)
+	{
+		const std::uint64_t epoch = slot.m_Epoch.load();
+		if (epoch != 0 && epoch < oldestEpoch)
+		{
+			oldestEpoch = epoch;
+		}
+	}
+
+	return oldestEpoch;
+}
+
+std::atomic<std::uint64_t>* pst::EpochDomain::Pin()
+{
+	// Start from slot chosen by thread id, so threads rarely compete for the same slot
+	const std::size_t firstSlot = std::hash<std::thread::id>()(std::this_thread::get_id()) % MaxReaders;
+	while (true)
+	{
+		for (std::size_t i = 0; i < MaxReaders; i++)
+		{
+			Slot& slot = m_Slots[(firstSlot + i) % MaxReaders];
+			std::uint64_t freeSlot = 0;
+
+			// Epoch read before pinning is fine: data is read after the slot is visible to writer, so it is either
+			// protected by pinned epoch or published after the writer has checked slots
+			if (slot.m_Epoch.load(std::memory_order_relaxed) == 0 && slot.m_Epoch.compare_exchange_strong(freeSlot, m_Epoch.load()))
+			{
+				return &slot.m_Epoch;
+			}
+		}
+
+		std::this_thread::yield();
+	}
+}
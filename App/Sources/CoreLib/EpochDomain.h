@@ -0,0 +1,62 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace pst
+{
+	/// Epoch based protection of memory which is read by lock-free readers and released by single writer.
+	/// Reader pins current epoch for the lifetime of ReadGuard. Writer tags released memory with epoch returned by Advance
+	/// and frees it only when IsReclaimable says that no pinned reader could have seen it.
+	class EpochDomain
+	{
+	public:
+		/// Number of readers which can be pinned at the same time. Reader waits for free slot if all of them are taken
+		static constexpr std::size_t MaxReaders = 128;
+
+		/// Pins epoch of the domain. Memory reachable from data published before guard is created stays valid until guard is destroyed
+		class ReadGuard
+		{
+		public:
+			explicit ReadGuard(EpochDomain& domain);
+			~ReadGuard();
+
+			ReadGuard(ReadGuard&& other);
+			ReadGuard(const ReadGuard&) = delete;
+			ReadGuard& operator=(const ReadGuard&) = delete;
+			ReadGuard& operator=(ReadGuard&&) = delete;
+
+			const EpochDomain& GetDomain() const { return *m_Domain; }
+
+		private:
+			const EpochDomain* m_Domain;
+			std::atomic<std::uint64_t>* m_Slot;
+		};
+
+		EpochDomain();
+
+		EpochDomain(const EpochDomain&) = delete;
+		EpochDomain& operator=(const EpochDomain&) = delete;
+
+		/// Starts new epoch. Returns epoch which memory unpublished right before this call should be tagged with
+		std::uint64_t Advance();
+
+		/// Returns oldest epoch pinned by readers. Memory tagged with smaller epoch can be freed
+		std::uint64_t GetOldestPinnedEpoch() const;
+
+	private:
+		// Every slot lives in its own cache line, so readers don't contend with each other
+		struct alignas(64) Slot
+		{
+			/// Pinned epoch or 0 if slot is free
+			std::atomic<std::uint64_t> m_Epoch{ 0 };
+		};
+
+		std::atomic<std::uint64_t>* Pin();
+
+		alignas(64) std::atomic<std::uint64_t> m_Epoch;
+		std::array<Slot, MaxReaders> m_Slots;
+	};
+}
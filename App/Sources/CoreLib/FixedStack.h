@@ -0,0 +1,62 @@
+#pragma once
+
+#include <array>
+#include <cassert>
+#include <cstddef>
+
+namespace pst
+{
+	/// Stack with capacity fixed at compile time. Lives on the call stack, so it never allocates
+	template <typename T, std::size_t Capacity>
+	class FixedStack
+	{
+	public:
+		FixedStack()
+			: m_Size(0)
+		{
+		}
+
+		void Push(const T& value)
+		{
+			assert(m_Size < Capacity);
+			m_Items[m_Size++] = value;
+		}
+
+		void Pop()
+		{
+			assert(m_Size > 0);
+			m_Size--;
+		}
+
+		T& Back()
+		{
+			assert(m_Size > 0);
+			return m_Items[m_Size - 1];
+		}
+
+		const T& Back() const
+		{
+			assert(m_Size > 0);
+			return m_Items[m_Size - 1];
+		}
+
+		T& operator[](std::size_t index)
+		{
+			assert(index < m_Size);
+			return m_Items[index];
+		}
+
+		const T& operator[](std::size_t index) const
+		{
+			assert(index < m_Size);
+			return m_Items[index];
+		}
+
+		std::size_t GetSize() const { return m_Size; }
+		bool IsEmpty() const { return m_Size == 0; }
+
+	private:
+		std::array<T, Capacity> m_Items;
+		std::size_t m_Size;
+	};
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+namespace pst
+{
+	/// Prefix type of key traits which don't cache key prefix in nodes. Takes no space in node
+	struct NoKeyPrefix
+	{
+		bool operator<(NoKeyPrefix) const { return false; }
+		bool operator!=(NoKeyPrefix) const { return false; }
+	};
+
+	/// Key traits define how PersistentMap compares keys:
+	///  - LookupKey is the type accepted by lookups. It should be constructible from TKey, so stored keys can be compared with each other
+	///  - MakeKey(lookupKey) builds stored key, it is called only when new node is created
+	///  - Compare(lookupKey, key) is a single three-way comparison: negative, zero or positive
+	///  - Prefix and GetPrefix(lookupKey) define fixed-width prefix cached in node. Different prefixes should order keys the same way as Compare,
+	///    equal prefixes tell nothing. Comparison of prefixes doesn't touch key memory, so it saves a cache miss per level for keys stored on heap
+	///  - GetHeapSize(key) returns bytes of heap memory owned by stored key for memory accounting. It is used only for keys which are not trivially copyable
+	/// Default traits use operator< of the key and cache nothing.
+	template <typename TKey>
+	struct KeyTraits
+	{
+		using LookupKey = TKey;
+		using Prefix = NoKeyPrefix;
+
+		static const TKey& MakeKey(const LookupKey& key) { return key; }
+
+		static int Compare(const LookupKey& left, const TKey& right)
+		{
+			return left < right ? -1 : (right < left ? 1 : 0);
+		}
+
+		static Prefix GetPrefix(const LookupKey&) { return Prefix(); }
+
+		/// Memory owned by arbitrary key is unknown
+		static std::size_t GetHeapSize(const TKey&) { return 0; }
+	};
+
+	/// Strings are looked up by std::string_view, so callers don't need to build std::string
+	template <>
+	struct KeyTraits<std::string>
+	{
+		using LookupKey = std::string_view;
+		using Prefix = NoKeyPrefix;
+
+		static std::string MakeKey(LookupKey key) { return std::string(key); }
+		static int Compare(LookupKey left, const std::string& right) { return left.compare(right); }
+		static Prefix GetPrefix(LookupKey) { return Prefix(); }
+
+		/// Short strings live inside the object. Buffer of long one has room for terminating zero
+		static std::size_t GetHeapSize(const std::string& key) { return key.capacity() > std::string().capacity() ? key.capacity() + 1 : 0; }
+	};
+
+	/// Views are stored as is, so the map doesn't own key memory. Buffers must outlive every version which has the key, e.g. interned strings
+	template <>
+	struct KeyTraits<std::string_view>
+	{
+		using LookupKey = std::string_view;
+		using Prefix = NoKeyPrefix;
+
+		static std::string_view MakeKey(LookupKey key) { return key; }
+		static int Compare(LookupKey left, std::string_view right) { return left.compare(right); }
+		static Prefix GetPrefix(LookupKey) { return Prefix(); }
+	};
+
+	/// String traits which cache first 8 bytes of the key in node as big-endian integer. Most comparisons of distinct strings
+	/// are decided by single integer compare without dereferencing string buffer. TKey is std::string or std::string_view
+	template <typename TKey = std::string>
+	struct StringPrefixKeyTraits : KeyTraits<TKey>
+	{
+		using Prefix = std::uint64_t;
+
+		static Prefix GetPrefix(std::string_view key)
+		{
+			// Missing bytes of short strings are zeros, so shorter string never gets greater prefix than its extension
+			unsigned char bytes[sizeof(Prefix)] = {};
+			if (!key.empty())
+			{
+				std::memcpy(bytes, key.data(), key.size() < sizeof(Prefix) ? key.size() : sizeof(Prefix));
+			}
+
+			Prefix prefix = 0;
+			for (unsigned char byte : bytes)
+			{
+				prefix = (prefix << 8) | byte;
+			}
+
+			return prefix;
+		}
+	};
+}
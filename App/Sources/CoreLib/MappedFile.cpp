@@ -0,0 +1,128 @@
+#include "MappedFile.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+	#define WIN32_LEAN_AND_MEAN
+	#define NOMINMAX
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+pst::MappedFile::MappedFile()
+	: m_Data(nullptr)
+	, m_Size(0)
+#if defined(_WIN32) || defined(_WIN64)
+	, m_File(INVALID_HANDLE_VALUE)
+	, m_Mapping(nullptr)
+#endif
+{
+}
+
+pst::MappedFile::~MappedFile()
+{
+	Close();
+}
+
+#if defined(_WIN32) || defined(_WIN64)
+
+bool pst::MappedFile::Open(const std::string& path)
+{
+	Close();
+	m_File = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	LARGE_INTEGER size;
+	if (m_File == INVALID_HANDLE_VALUE || !GetFileSizeEx(m_File, &size) || size.QuadPart == 0)
+	{
+		Close();
+		return false;
+	}
+
+	m_Mapping = CreateFileMappingA(m_File, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	m_Data = m_Mapping ? MapViewOfFile(m_Mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+	if (!m_Data)
+	{
+		Close();
+		return false;
+	}
+
+	m_Size = static_cast<std::size_t>(size.QuadPart);
+	return true;
+}
+
+void pst::MappedFile::Close()
+{
+	if (m_Data)
+	{
+		UnmapViewOfFile(m_Data);
+	}
+
+	if (m_Mapping)
+	{
+		CloseHandle(m_Mapping);
+	}
+
+	if (m_File != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(m_File);
+	}
+
+	m_Data = nullptr;
+	m_Size = 0;
+	m_Mapping = nullptr;
+	m_File = INVALID_HANDLE_VALUE;
+}
+
+#else
+
+bool pst::MappedFile::Open(const std::string& path)
+{
+	Close();
+	const int file = open(path.c_str(), O_RDONLY);
+	if (file < 0)
+	{
+		return false;
+	}
+
+	// Mapping keeps the file referenced, so descriptor is not needed after mmap
+	struct stat status;
+	void* data = MAP_FAILED;
+	if (fstat(file, &status) == 0 && status.st_size > 0)
+	{
+		data = mmap(nullptr, static_cast<std::size_t>(status.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+	}
+
+	close(file);
+	if (data == MAP_FAILED)
+	{
+		return false;
+	}
+
+	m_Data = data;
+	m_Size = static_cast<std::size_t>(status.st_size);
+	return true;
+}
+
+void pst::MappedFile::Close()
+{
+	if (m_Data)
+	{
+		munmap(const_cast<void*>(m_Data), m_Size);
+	}
+
+	m_Data = nullptr;
+	m_Size = 0;
+}
+
+#endif
+
+const void* pst::MappedFile::GetData() const
+{
+	return m_Data;
+}
+
+std::size_t pst::MappedFile::GetSize() const
+{
+	return m_Size;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace pst
+{
+	/// Read-only memory mapping of a whole file. Pages are loaded by the OS on first access, so opening costs the same for any file size
+	class MappedFile
+	{
+	public:
+		MappedFile();
+		~MappedFile();
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		/// Maps file, closing previously mapped one. Returns false if file can't be opened or mapped. Empty file can't be mapped
+		bool Open(const std::string& path);
+		void Close();
+
+		/// Start of the mapping, aligned to page size. nullptr if nothing is mapped
+		const void* GetData() const;
+		std::size_t GetSize() const;
+
+	private:
+		const void* m_Data;
+		std::size_t m_Size;
+
+#if defined(_WIN32) || defined(_WIN64)
+		void* m_File;
+		void* m_Mapping;
+#endif
+	};
+}
@@ -0,0 +1,131 @@
+#include "NodePool.h"
+
+#include <cassert>
+#include <cstdint>
+#include <new>
+
+pst::NodePool::NodePool()
+	: m_AllocatedBlocks(0)
+{
+}
+
+pst::NodePool::~NodePool()
+{
+	// Every node should be released before its pool
+	assert(m_AllocatedBlocks == 0);
+	for (void* chunk : m_Chunks)
+	{
+		::operator delete(chunk, std::align_val_t(ChunkSize));
+	}
+}
+
+void* pst::NodePool::Allocate(std::size_t size)
+{
+	m_AllocatedBlocks++;
+	if (size > MaxBlockSize)
+	{
+		// Block out of chunks is prefixed with its owner, so static Free finds the pool and its blocks are counted too
+		char* block = static_cast<char*>(::operator new(LargeBlockHeaderSize + size));
+		new (block) ChunkHeader{ this };
+		return block + LargeBlockHeaderSize;
+	}
+
+	const std::size_t index = GetSizeClassIndex(size);
+	SizeClass& sizeClass = m_SizeClasses[index];
+	if (sizeClass.m_FreeList)
+	{
+		FreeBlock* block = sizeClass.m_FreeList;
+		sizeClass.m_FreeList = block->m_Next;
+		return block;
+	}
+
+	const std::size_t blockSize = (index + 1) * Granularity;
+	if (sizeClass.m_Cursor == sizeClass.m_End)
+	{
+		// Chunk is cut into blocks of the same size class, so no remainder is wasted except the tail
+		char* chunk = static_cast<char*>(::operator new(ChunkSize, std::align_val_t(ChunkSize)));
+		m_Chunks.push_back(chunk);
+		new (chunk) ChunkHeader{ this };
+		sizeClass.m_Cursor = chunk + ChunkHeaderSize;
+		sizeClass.m_End = sizeClass.m_Cursor + ((ChunkSize - ChunkHeaderSize) / blockSize) * blockSize;
+	}
+
+	void* block = sizeClass.m_Cursor;
+	sizeClass.m_Cursor += blockSize;
+	return block;
+}
+
+void pst::NodePool::Deallocate(void* block, std::size_t size)
+{
+	assert(m_AllocatedBlocks > 0);
+	m_AllocatedBlocks--;
+	if (size > MaxBlockSize)
+	{
+		::operator delete(static_cast<char*>(block) - LargeBlockHeaderSize);
+		return;
+	}
+
+	SizeClass& sizeClass = m_SizeClasses[GetSizeClassIndex(size)];
+	FreeBlock* freeBlock = static_cast<FreeBlock*>(block);
+	freeBlock->m_Next = sizeClass.m_FreeList;
+	sizeClass.m_FreeList = freeBlock;
+}
+
+void pst::NodePool::Free(void* block, std::size_t size)
+{
+	if (size > MaxBlockSize)
+	{
+		reinterpret_cast<const ChunkHeader*>(static_cast<char*>(block) - LargeBlockHeaderSize)->m_Owner->Deallocate(block, size);
+		return;
+	}
+
+	const std::uintptr_t chunk = reinterpret_cast<std::uintptr_t>(block) & ~static_cast<std::uintptr_t>(ChunkSize - 1);
+	reinterpret_cast<const ChunkHeader*>(chunk)->m_Owner->Deallocate(block, size);
+}
+
+std::size_t pst::NodePool::GetAllocatedBlocks() const
+{
+	return m_AllocatedBlocks;
+}
+
+std::size_t pst::NodePool::GetReservedBytes() const
+{
+	return m_Chunks.size() * ChunkSize;
+}
+
+std::size_t pst::NodePool::GetSizeClassIndex(std::size_t size)
+{
+	assert(size > 0 && size <= MaxBlockSize);
+	return (size - 1) / Granularity;
+}
+
+pst::HeapNodePool::HeapNodePool()
+	: m_AllocatedBlocks(0)
+{
+}
+
+void* pst::HeapNodePool::Allocate(std::size_t size)
+{
+	m_AllocatedBlocks++;
+	char* block = static_cast<char*>(::operator new(BlockHeaderSize + size));
+	new (block) BlockHeader{ this };
+	return block + BlockHeaderSize;
+}
+
+void pst::HeapNodePool::Deallocate(void* block, std::size_t)
+{
+	assert(m_AllocatedBlocks > 0);
+	m_AllocatedBlocks--;
+	::operator delete(static_cast<char*>(block) - BlockHeaderSize);
+}
+
+void pst::HeapNodePool::Free(void* block, std::size_t size)
+{
+	const BlockHeader* header = reinterpret_cast<const BlockHeader*>(static_cast<char*>(block) - BlockHeaderSize);
+	header->m_Owner->Deallocate(block, size);
+}
+
+std::size_t pst::HeapNodePool::GetAllocatedBlocks() const
+{
+	return m_AllocatedBlocks;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <vector>
+
+namespace pst
+{
+	/// Size-class pool for small fixed-size objects (tree nodes).
+	/// Blocks are carved from large chunks with a bump pointer and freed blocks are kept in per-size free lists,
+	/// so neighbouring path copies land in contiguous memory and freeing a block never touches the system heap.
+	/// Chunks are returned to the system only when the pool is destroyed.
+	/// Chunks are aligned to their size, so a block finds its owning pool through the chunk header and nodes don't need to store it.
+	/// Not thread-safe: the pool is owned by a single writer.
+	class NodePool
+	{
+	public:
+		static constexpr std::size_t ChunkSize = 64 * 1024;
+		/// Blocks are aligned to it. Nodes hold pointers and integers of at most 8 bytes, so finer size classes don't round 40-byte node up to 48
+		static constexpr std::size_t Granularity = 8;
+		/// Large enough for about 1 KB nodes of PersistentBTree. Bigger requests go to the global heap, but are still counted as allocated blocks
+		static constexpr std::size_t MaxBlockSize = 1024;
+
+		NodePool();
+		~NodePool();
+
+		NodePool(const NodePool&) = delete;
+		NodePool& operator=(const NodePool&) = delete;
+
+		void* Allocate(std::size_t size);
+		void Deallocate(void* block, std::size_t size);
+
+		/// Returns block to the pool it was allocated from
+		static void Free(void* block, std::size_t size);
+
+		/// Number of blocks handed out and not returned yet
+		std::size_t GetAllocatedBlocks() const;
+
+		/// Bytes reserved from the system for chunks
+		std::size_t GetReservedBytes() const;
+
+	private:
+		struct FreeBlock
+		{
+			FreeBlock* m_Next;
+		};
+
+		struct ChunkHeader
+		{
+			NodePool* m_Owner;
+		};
+
+		// Header is padded so blocks keep the alignment of the chunk
+		static constexpr std::size_t ChunkHeaderSize = (sizeof(ChunkHeader) + Granularity - 1) / Granularity * Granularity;
+
+		// Block from the global heap has the same header, padded so the block keeps alignment of the global heap
+		static constexpr std::size_t LargeBlockHeaderSize = alignof(std::max_align_t);
+
+		struct SizeClass
+		{
+			FreeBlock* m_FreeList = nullptr;
+			char* m_Cursor = nullptr;
+			char* m_End = nullptr;
+		};
+
+		static std::size_t GetSizeClassIndex(std::size_t size);
+
+		std::array<SizeClass, MaxBlockSize / Granularity> m_SizeClasses;
+		std::vector<void*> m_Chunks;
+		std::size_t m_AllocatedBlocks;
+	};
+
+	/// Node pool which forwards every request to the global heap. Useful as a baseline or for debugging with heap tools.
+	/// Every block is prefixed with its owner, so static Free can keep count of allocated blocks.
+	class HeapNodePool
+	{
+	public:
+		HeapNodePool();
+
+		HeapNodePool(const HeapNodePool&) = delete;
+		HeapNodePool& operator=(const HeapNodePool&) = delete;
+
+		void* Allocate(std::size_t size);
+		void Deallocate(void* block, std::size_t size);
+		static void Free(void* block, std::size_t size);
+
+		/// Number of blocks handed out and not returned yet
+		std::size_t GetAllocatedBlocks() const;
+
+	private:
+		struct BlockHeader
+		{
+			HeapNodePool* m_Owner;
+		};
+
+		// Header is padded so blocks keep alignment of the global heap
+		static constexpr std::size_t BlockHeaderSize = alignof(std::max_align_t);
+
+		std::size_t m_AllocatedBlocks;
+	};
+}
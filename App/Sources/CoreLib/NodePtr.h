@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+
+namespace pst
+{
+	/// Owning handle over intrusively reference counted node.
+	/// TNode should provide AddRef(), ReleaseRef() which returns true when last reference is gone, and static Destroy(TNode*).
+	/// Reference counter is not atomic: handles are copied and destroyed by single writer only.
+	template <typename TNode>
+	class NodePtr
+	{
+	public:
+		NodePtr()
+			: m_Node(nullptr)
+		{
+		}
+
+		NodePtr(std::nullptr_t)
+			: m_Node(nullptr)
+		{
+		}
+
+		explicit NodePtr(TNode* node)
+			: m_Node(node)
+		{
+			if (m_Node)
+			{
+				m_Node->AddRef();
+			}
+		}
+
+		NodePtr(const NodePtr& other)
+			: NodePtr(other.m_Node)
+		{
+		}
+
+		NodePtr(NodePtr&& other)
+			: m_Node(other.m_Node)
+		{
+			other.m_Node = nullptr;
+		}
+
+		~NodePtr()
+		{
+			Release();
+		}
+
+		NodePtr& operator=(const NodePtr& other)
+		{
+			// Source can be owned by node which is released by this assignment, so take reference first
+			NodePtr(other).Swap(*this);
+			return *this;
+		}
+
+		NodePtr& operator=(NodePtr&& other)
+		{
+			NodePtr(std::move(other)).Swap(*this);
+			return *this;
+		}
+
+		NodePtr& operator=(std::nullptr_t)
+		{
+			NodePtr().Swap(*this);
+			return *this;
+		}
+
+		void Swap(NodePtr& other)
+		{
+			std::swap(m_Node, other.m_Node);
+		}
+
+		TNode* Get() const { return m_Node; }
+		TNode* operator->() const { return m_Node; }
+		TNode& operator*() const { return *m_Node; }
+		explicit operator bool() const { return m_Node != nullptr; }
+
+		bool operator==(const NodePtr& other) const { return m_Node == other.m_Node; }
+		bool operator!=(const NodePtr& other) const { return m_Node != other.m_Node; }
+		bool operator==(std::nullptr_t) const { return m_Node == nullptr; }
+		bool operator!=(std::nullptr_t) const { return m_Node != nullptr; }
+
+	private:
+		void Release()
+		{
+			if (m_Node && m_Node->ReleaseRef())
+			{
+				TNode::Destroy(m_Node);
+			}
+
+			m_Node = nullptr;
+		}
+
+		TNode* m_Node;
+	};
+}
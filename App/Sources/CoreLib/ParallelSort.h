@@ -0,0 +1,74 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace pst
+{
+	/// Inputs shorter than this are sorted by the calling thread, starting threads would cost more than the sort
+	constexpr std::size_t MinParallelSortSize = 1 << 16;
+
+	/// Stable sort of random access range by up to threadCount threads. Range is split into equal chunks which are sorted in parallel,
+	/// then neighbour chunks are merged pairwise in parallel until one is left. Equal elements keep their order. 0 threads means 1
+	template <typename TRandomIterator, typename TCompare>
+	void ParallelSort(TRandomIterator first, TRandomIterator last, TCompare compare, unsigned threadCount)
+	{
+		const std::size_t size = static_cast<std::size_t>(std::distance(first, last));
+		const std::size_t chunkCount = std::min<std::size_t>(std::max(threadCount, 1u), size / MinParallelSortSize + 1);
+		if (chunkCount < 2)
+		{
+			std::stable_sort(first, last, compare);
+			return;
+		}
+
+		// Chunk i is [bounds[i]; bounds[i + 1])
+		std::vector<TRandomIterator> bounds;
+		for (std::size_t i = 0; i <= chunkCount; i++)
+		{
+			bounds.push_back(first + static_cast<std::ptrdiff_t>(size * i / chunkCount));
+		}
+
+		std::vector<std::thread> threads;
+		for (std::size_t i = 0; i < chunkCount; i++)
+		{
+			threads.emplace_back([&bounds, &compare, i]() { std::stable_sort(bounds[i], bounds[i + 1], compare); });
+		}
+
+		for (std::thread& thread : threads)
+		{
+			thread.join();
+		}
+
+		// Every round halves the number of sorted chunks. Chunks are merged with their right neighbour, so order of equal elements is kept
+		while (bounds.size() > 2)
+		{
+			threads.clear();
+			for (std::size_t i = 0; i + 2 < bounds.size(); i += 2)
+			{
+				threads.emplace_back([&bounds, &compare, i]() { std::inplace_merge(bounds[i], bounds[i + 1], bounds[i + 2], compare); });
+			}
+
+			for (std::thread& thread : threads)
+			{
+				thread.join();
+			}
+
+			std::vector<TRandomIterator> mergedBounds;
+			for (std::size_t i = 0; i < bounds.size(); i += 2)
+			{
+				mergedBounds.push_back(bounds[i]);
+			}
+
+			if (mergedBounds.back() != bounds.back())
+			{
+				mergedBounds.push_back(bounds.back());
+			}
+
+			bounds = std::move(mergedBounds);
+		}
+	}
+}
@@ -0,0 +1 @@
+#include "PersistentBTree.h"
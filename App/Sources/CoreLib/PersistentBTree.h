@@ -0,0 +1,259 @@
+#pragma once
+
+#include "FixedStack.h"
+#include "KeyTraits.h"
+#include "NodePool.h"
+#include "NodePtr.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace pst
+{
+	class PersistentBTreeTest;
+
+	/// Key and value stored in leaf of PersistentBTree. Key must not be changed through entry returned by Insert
+	template <typename TKey, typename TValue>
+	struct PersistentBTreeEntry
+	{
+		TKey m_Key;
+		TValue m_Value;
+	};
+
+	/// Common part of leaf and branch nodes. Node is reference counted intrusively and returns its memory to TNodePool when last NodePtr is gone
+	template <typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+	class PersistentBTreeNode
+	{
+	public:
+		/// Leaf keeps up to Capacity entries, branch keeps up to Capacity separator keys and one more child.
+		/// Capacity is chosen so node fits into about 1 KB block of NodePool, but stays within 16..64 keys
+		static constexpr int Capacity = static_cast<int>(std::clamp<std::size_t>(
+			900 / std::max(sizeof(PersistentBTreeEntry<TKey, TValue>), sizeof(TKey) + sizeof(void*)), 16, 64));
+
+		/// Every node except root keeps at least this many entries or keys
+		static constexpr int MinCount = Capacity / 2;
+
+		PersistentBTreeNode(bool isLeaf, int currentVersion);
+		PersistentBTreeNode(const PersistentBTreeNode& other, int currentVersion);
+
+		PersistentBTreeNode& operator=(const PersistentBTreeNode&) = delete;
+
+		void AddRef() const { m_RefCount++; }
+
+		/// Returns true if it was the last reference
+		bool ReleaseRef() const
+		{
+			assert(m_RefCount > 0);
+			return --m_RefCount == 0;
+		}
+
+		/// Destroys leaf or branch and returns its memory to the pool
+		static void Destroy(PersistentBTreeNode* node);
+
+		/// True if node is referenced by more than one NodePtr
+		bool IsShared() const { return m_RefCount > 1; }
+
+		/// Version of data which created this node
+		int GetCreateVersion() const { return m_CreateVersion; }
+
+		bool IsLeaf() const { return m_IsLeaf; }
+
+		/// Number of entries of leaf or separator keys of branch
+		int m_Count;
+
+		/// Number of entries in subtree
+		int m_Size;
+
+	private:
+		mutable std::uint32_t m_RefCount;
+		const int m_CreateVersion;
+		const bool m_IsLeaf;
+	};
+
+	/// Leaf keeps sorted entries. Only first m_Count entries are constructed.
+	/// There is room for one more entry than Capacity: insertion overflows leaf first and then splits it into two halves
+	template <typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+	class PersistentBTreeLeaf : public PersistentBTreeNode<TKey, TValue, TNodePool, TKeyTraits>
+	{
+	public:
+		explicit PersistentBTreeLeaf(int currentVersion);
+		PersistentBTreeLeaf(const PersistentBTreeLeaf& other, int currentVersion);
+		~PersistentBTreeLeaf();
+
+		PersistentBTreeEntry<TKey, TValue>* GetEntries() { return reinterpret_cast<PersistentBTreeEntry<TKey, TValue>*>(m_Entries); }
+		const PersistentBTreeEntry<TKey, TValue>* GetEntries() const { return reinterpret_cast<const PersistentBTreeEntry<TKey, TValue>*>(m_Entries); }
+
+	private:
+		alignas(PersistentBTreeEntry<TKey, TValue>) unsigned char m_Entries[sizeof(PersistentBTreeEntry<TKey, TValue>) * (PersistentBTreeNode<TKey, TValue, TNodePool, TKeyTraits>::Capacity + 1)];
+	};
+
+	/// Branch with m_Count separator keys has m_Count + 1 children. Keys of child i are not less than key i - 1 and less than key i.
+	/// Only first m_Count keys are constructed. Like leaf, branch has room for one key and child which overflow it before split
+	template <typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+	class PersistentBTreeBranch : public PersistentBTreeNode<TKey, TValue, TNodePool, TKeyTraits>
+	{
+	public:
+		explicit PersistentBTreeBranch(int currentVersion);
+		PersistentBTreeBranch(const PersistentBTreeBranch& other, int currentVersion);
+		~PersistentBTreeBranch();
+
+		TKey* GetKeys() { return reinterpret_cast<TKey*>(m_Keys); }
+		const TKey* GetKeys() const { return reinterpret_cast<const TKey*>(m_Keys); }
+
+		NodePtr<PersistentBTreeNode<TKey, TValue, TNodePool, TKeyTraits>> m_Children[PersistentBTreeNode<TKey, TValue, TNodePool, TKeyTraits>::Capacity + 2];
+
+	private:
+		alignas(TKey) unsigned char m_Keys[sizeof(TKey) * (PersistentBTreeNode<TKey, TValue, TNodePool, TKeyTraits>::Capacity + 1)];
+	};
+
+	/// Persistent B+-tree with the same versioning as PersistentMap: every change makes new version, Rollback returns to older one,
+	/// old versions are dropped with DropVersionsBefore and their nodes are reclaimed incrementally.
+	/// Changes copy path of wide nodes instead of path of binary nodes, so tree is ~4 times shallower and lookup takes few cache misses per level.
+	/// Entries live in leaves and move on splits, so pointer returned by Insert is valid only until next change.
+	/// Map is used by single thread, it has no snapshots for concurrent readers.
+	template <typename TKey, typename TValue, typename TNodePool = NodePool, typename TKeyTraits = KeyTraits<TKey>>
+	class PersistentBTree
+	{
+		friend class PersistentBTreeTest;
+
+		/// Height of tree with at least MinCount + 1 >= 9 children per branch for any int-sized number of entries
+		static constexpr int MaxHeight = 16;
+
+	public:
+		using LookupKey = typename TKeyTraits::LookupKey;
+		using Entry = PersistentBTreeEntry<TKey, TValue>;
+
+		PersistentBTree();
+		~PersistentBTree();
+
+		PersistentBTree(const PersistentBTree&) = delete;
+		PersistentBTree& operator=(const PersistentBTree&) = delete;
+
+		/// Moves current version delta steps back. Returns false and changes nothing if that version has been dropped already
+		bool Rollback(int delta);
+		int GetVersion() const;
+
+		/// Oldest version which can still be reached by Rollback
+		int GetOldestVersion() const;
+
+		/// Drops all versions older than specified one (current version is never dropped). Nodes which are not shared
+		/// with retained versions are reclaimed incrementally by following mutations or by Reclaim
+		void DropVersionsBefore(int version);
+
+		/// Destroys up to maxNodes nodes released by dropped or overwritten versions. Returns number of freed node bytes
+		std::size_t Reclaim(std::size_t maxNodes);
+
+		/// Destroys all released nodes. Returns number of freed node bytes
+		std::size_t ReclaimAll();
+
+		/// Number of released subtrees and nodes waiting for reclamation
+		std::size_t GetPendingReclaimCount() const;
+
+		/// Starts new version of data. All Insert and Delete calls until Commit change this version instead of creating new ones
+		void BeginBatch();
+		void Commit();
+		bool IsInBatch() const;
+
+		/// Creates entry with specified key and default value. If entry exists already - returns it. Creates new version of data unless batch is started.
+		Entry* Insert(const LookupKey& key);
+
+		/// Deletes entry with specified key. Creates new version of data if entry exists and batch is not started.
+		void Delete(const LookupKey& key);
+
+		const Entry* Search(const LookupKey& key) const;
+
+		/// Searches in specified version without changing current one. Returns nullptr if version has been dropped or is newer than current one
+		const Entry* Search(const LookupKey& key, int version) const;
+
+		/// Returns number of entries in current version
+		int GetSize() const;
+
+		/// Returns number of keys which are less than specified key. Key doesn't have to exist
+		int GetRank(const LookupKey& key) const;
+
+		/// Calls visitor for every entry of current version in ascending order of keys
+		template <typename TVisitor>
+		void ForEach(TVisitor&& visitor) const;
+
+	private:
+		using Node = PersistentBTreeNode<TKey, TValue, TNodePool, TKeyTraits>;
+		using Leaf = PersistentBTreeLeaf<TKey, TValue, TNodePool, TKeyTraits>;
+		using Branch = PersistentBTreeBranch<TKey, TValue, TNodePool, TKeyTraits>;
+
+		/// Mutation clones and splits at most few nodes per level, so reclamation keeps up with writes
+		static constexpr std::size_t ReclaimStepSize = 4 * MaxHeight;
+
+		/// Branches from root to leaf with index of the child which descent took
+		using Path = FixedStack<std::pair<Branch*, int>, MaxHeight>;
+
+		/// Index of the first entry whose key is not less than specified one
+		static int LowerBoundInLeaf(const Leaf* leaf, const LookupKey& key);
+
+		/// Index of the child which can contain specified key
+		static int FindChild(const Branch* branch, const LookupKey& key);
+
+		static const Entry* SearchInSubtree(const Node* node, const LookupKey& key);
+
+		template <typename TVisitor>
+		static void ForEachInSubtree(const Node* node, TVisitor& visitor);
+
+		/// Allocates empty node of current version from the node pool
+		NodePtr<Node> CreateLeaf();
+		NodePtr<Node> CreateBranch();
+
+		/// Allocates copy of node of current version from the node pool. Node which is of current version already is returned as is.
+		NodePtr<Node> CloneNode(Node* node);
+
+		/// Moves upper half of overflowed node to new right sibling. Returns the sibling and separator key between them
+		std::pair<NodePtr<Node>, TKey> SplitLeaf(Leaf* leaf);
+		std::pair<NodePtr<Node>, TKey> SplitBranch(Branch* branch);
+
+		/// Inserts entry with default value at specified index of leaf. Leaf can overflow by one entry
+		static void InsertIntoLeaf(Leaf* leaf, int index, const LookupKey& key);
+
+		/// Inserts separator key and its right child at specified key index of branch. Branch can overflow by one key
+		static void InsertIntoBranch(Branch* branch, int index, TKey key, NodePtr<Node> child);
+
+		/// Refills child of branch which has fewer than MinCount entries or keys by borrowing from sibling or merging with it.
+		/// Branch should be of current version, its child is cloned already
+		void Rebalance(Branch* branch, int childIndex);
+
+		/// Number of entries in subtree of children [from; to) of branch
+		static int SumSizes(const Branch* branch, int from, int to);
+
+		const Node* GetRoot() const;
+
+		/// Returns slot of m_RootHistory which keeps root of specified version
+		NodePtr<Node>& GetRootLink(int version);
+		const NodePtr<Node>& GetRootLink(int version) const;
+
+		/// Creates new version which shares whole tree with previous one
+		void StartVersion();
+
+		/// Resets root for current version
+		void ClearCurrentVersion();
+
+		/// Queues subtree for reclamation instead of destroying it inline
+		void Retire(NodePtr<Node>& node);
+
+		// Pool should be declared before any node owner so it is destroyed last. Kept by pointer so nodes never see it move
+		std::unique_ptr<TNodePool> m_NodePool;
+
+		/// Root of version m_HistoryBase + i is kept at index i. Dropped versions are compacted lazily, so history prefix before m_OldestVersion is empty
+		std::vector<NodePtr<Node>> m_RootHistory;
+		int m_HistoryBase;
+		int m_OldestVersion;
+		int m_CurrentVersion;
+		bool m_InBatch;
+
+		/// Released subtrees. Used as a stack, so it holds at most one node's children per tree level while subtree is walked
+		std::vector<NodePtr<Node>> m_RetiredNodes;
+	};
+}
+
+#include "PersistentBTree.inl"
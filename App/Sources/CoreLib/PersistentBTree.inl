@@ -0,0 +1,834 @@
+#pragma once
+
+#include "PersistentBTree.h"
+
+#include <algorithm>
+#include <cassert>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <new>
+#include <utility>
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::PersistentBTreeNode<TKey, TValue, TNodePool, TKeyTraits>::PersistentBTreeNode(bool isLeaf, int currentVersion)
+	: m_Count(0)
+	, m_Size(0)
+	, m_RefCount(0)
+	, m_CreateVersion(currentVersion)
+	, m_IsLeaf(isLeaf)
+{
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::PersistentBTreeNode<TKey, TValue, TNodePool, TKeyTraits>::PersistentBTreeNode(const PersistentBTreeNode& other, int currentVersion)
+	: m_Count(other.m_Count)
+	, m_Size(other.m_Size)
+	, m_RefCount(0)
+	, m_CreateVersion(currentVersion)
+	, m_IsLeaf(other.m_IsLeaf)
+{
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentBTreeNode<TKey, TValue, TNodePool, TKeyTraits>::Destroy(PersistentBTreeNode* node)
+{
+	if (node->IsLeaf())
+	{
+		auto* leaf = static_cast<pst::PersistentBTreeLeaf<TKey, TValue, TNodePool, TKeyTraits>*>(node);
+		leaf->~PersistentBTreeLeaf();
+		TNodePool::Free(leaf, sizeof(pst::PersistentBTreeLeaf<TKey, TValue, TNodePool, TKeyTraits>));
+	}
+	else
+	{
+		auto* branch = static_cast<pst::PersistentBTreeBranch<TKey, TValue, TNodePool, TKeyTraits>*>(node);
+		branch->~PersistentBTreeBranch();
+		TNodePool::Free(branch, sizeof(pst::PersistentBTreeBranch<TKey, TValue, TNodePool, TKeyTraits>));
+	}
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::PersistentBTreeLeaf<TKey, TValue, TNodePool, TKeyTraits>::PersistentBTreeLeaf(int currentVersion)
+	: PersistentBTreeNode<TKey, TValue, TNodePool, TKeyTraits>(true, currentVersion)
+{
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::PersistentBTreeLeaf<TKey, TValue, TNodePool, TKeyTraits>::PersistentBTreeLeaf(const PersistentBTreeLeaf& other, int currentVersion)
+	: PersistentBTreeNode<TKey, TValue, TNodePool, TKeyTraits>(other, currentVersion)
+{
+	std::uninitialized_copy(other.GetEntries(), other.GetEntries() + this->m_Count, GetEntries());
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::PersistentBTreeLeaf<TKey, TValue, TNodePool, TKeyTraits>::~PersistentBTreeLeaf()
+{
+	std::destroy(GetEntries(), GetEntries() + this->m_Count);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::PersistentBTreeBranch<TKey, TValue, TNodePool, TKeyTraits>::PersistentBTreeBranch(int currentVersion)
+	: PersistentBTreeNode<TKey, TValue, TNodePool, TKeyTraits>(false, currentVersion)
+{
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::PersistentBTreeBranch<TKey, TValue, TNodePool, TKeyTraits>::PersistentBTreeBranch(const PersistentBTreeBranch& other, int currentVersion)
+	: PersistentBTreeNode<TKey, TValue, TNodePool, TKeyTraits>(other, currentVersion)
+{
+	std::uninitialized_copy(other.GetKeys(), other.GetKeys() + this->m_Count, GetKeys());
+	std::copy(std::begin(other.m_Children), std::begin(other.m_Children) + this->m_Count + 1, std::begin(m_Children));
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::PersistentBTreeBranch<TKey, TValue, TNodePool, TKeyTraits>::~PersistentBTreeBranch()
+{
+	std::destroy(GetKeys(), GetKeys() + this->m_Count);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::PersistentBTree()
+	: m_NodePool(std::make_unique<TNodePool>())
+	, m_HistoryBase(0)
+	, m_OldestVersion(0)
+	, m_CurrentVersion(0)
+	, m_InBatch(false)
+{
+	ClearCurrentVersion();
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::~PersistentBTree()
+{
+	// Destroying roots directly would recurse through the whole tree
+	for (auto& root : m_RootHistory)
+	{
+		Retire(root);
+	}
+
+	ReclaimAll();
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+bool pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::Rollback(int delta)
+{
+	assert(!m_InBatch);
+	assert(delta > 0);
+	if (delta > m_CurrentVersion - m_OldestVersion)
+	{
+		// Version is beyond retention horizon
+		return false;
+	}
+
+	m_CurrentVersion -= delta;
+	return true;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+int pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::GetVersion() const
+{
+	return m_CurrentVersion;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+int pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::GetOldestVersion() const
+{
+	return m_OldestVersion;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::DropVersionsBefore(int version)
+{
+	version = std::min(version, m_CurrentVersion);
+	if (version <= m_OldestVersion)
+	{
+		return;
+	}
+
+	for (int droppedVersion = m_OldestVersion; droppedVersion < version; droppedVersion++)
+	{
+		Retire(GetRootLink(droppedVersion));
+	}
+
+	m_OldestVersion = version;
+
+	// Erasing the prefix moves every retained root, so do it only when empty prefix is the larger part. Keeps dropping amortized O(1) per version
+	const std::size_t droppedCount = m_OldestVersion - m_HistoryBase;
+	if (droppedCount * 2 >= m_RootHistory.size())
+	{
+		m_RootHistory.erase(std::begin(m_RootHistory), std::begin(m_RootHistory) + droppedCount);
+		m_HistoryBase = m_OldestVersion;
+	}
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+std::size_t pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::Reclaim(std::size_t maxNodes)
+{
+	std::size_t freedBytes = 0;
+	for (std::size_t freedNodes = 0; freedNodes < maxNodes && !m_RetiredNodes.empty(); )
+	{
+		pst::NodePtr<Node> node = std::move(m_RetiredNodes.back());
+		m_RetiredNodes.pop_back();
+		if (node->IsShared())
+		{
+			// Subtree is still used by retained version, just drop our reference
+			continue;
+		}
+
+		// Children are moved out first, so destroying the node never cascades
+		if (node->IsLeaf())
+		{
+			freedBytes += sizeof(Leaf);
+		}
+		else
+		{
+			Branch* branch = static_cast<Branch*>(node.Get());
+			for (int i = 0; i <= branch->m_Count; i++)
+			{
+				Retire(branch->m_Children[i]);
+			}
+
+			freedBytes += sizeof(Branch);
+		}
+
+		node = nullptr;
+		freedNodes++;
+	}
+
+	return freedBytes;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+std::size_t pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::ReclaimAll()
+{
+	return Reclaim(std::numeric_limits<std::size_t>::max());
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+std::size_t pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::GetPendingReclaimCount() const
+{
+	return m_RetiredNodes.size();
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::BeginBatch()
+{
+	assert(!m_InBatch);
+	StartVersion();
+	m_InBatch = true;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::Commit()
+{
+	assert(m_InBatch);
+	m_InBatch = false;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+bool pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::IsInBatch() const
+{
+	return m_InBatch;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+typename pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::Entry* pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::Insert(const LookupKey& key)
+{
+	if (!m_InBatch)
+	{
+		StartVersion();
+	}
+
+	Reclaim(ReclaimStepSize);
+	pst::NodePtr<Node>& rootLink = GetRootLink(m_CurrentVersion);
+	if (!rootLink)
+	{
+		rootLink = CreateLeaf();
+	}
+
+	// Single descent: clone every node on the way and remember it for splits
+	Path path;
+	pst::NodePtr<Node>* link = &rootLink;
+	while (true)
+	{
+		*link = CloneNode(link->Get());
+		if (link->Get()->IsLeaf())
+		{
+			break;
+		}
+
+		Branch* branch = static_cast<Branch*>(link->Get());
+		const int childIndex = FindChild(branch, key);
+		path.Push({ branch, childIndex });
+		link = &branch->m_Children[childIndex];
+	}
+
+	Leaf* leaf = static_cast<Leaf*>(link->Get());
+	const int index = LowerBoundInLeaf(leaf, key);
+	if (index < leaf->m_Count && TKeyTraits::Compare(key, leaf->GetEntries()[index].m_Key) == 0)
+	{
+		// Entry has been found. Its leaf is cloned already so we can return it
+		return &leaf->GetEntries()[index];
+	}
+
+	InsertIntoLeaf(leaf, index, key);
+	Entry* entry = leaf->GetEntries() + index;
+
+	// Overflowed node is split and separator of the halves is pushed up until some ancestor has room for it. Every ancestor gets one more entry
+	pst::NodePtr<Node> splitNode;
+	TKey splitKey{};
+	if (leaf->m_Count > Node::Capacity)
+	{
+		auto [rightLeaf, separator] = SplitLeaf(leaf);
+		if (index >= leaf->m_Count)
+		{
+			entry = static_cast<Leaf*>(rightLeaf.Get())->GetEntries() + index - leaf->m_Count;
+		}
+
+		splitNode = std::move(rightLeaf);
+		splitKey = std::move(separator);
+	}
+
+	while (!path.IsEmpty())
+	{
+		const auto [branch, childIndex] = path.Back();
+		path.Pop();
+		branch->m_Size++;
+		if (!splitNode)
+		{
+			continue;
+		}
+
+		InsertIntoBranch(branch, childIndex, std::move(splitKey), std::move(splitNode));
+		if (branch->m_Count > Node::Capacity)
+		{
+			auto [rightBranch, separator] = SplitBranch(branch);
+			branch->m_Size = SumSizes(branch, 0, branch->m_Count + 1);
+			rightBranch->m_Size = SumSizes(static_cast<Branch*>(rightBranch.Get()), 0, rightBranch->m_Count + 1);
+			splitNode = std::move(rightBranch);
+			splitKey = std::move(separator);
+		}
+	}
+
+	if (splitNode)
+	{
+		// Root has been split, tree grows by one level
+		pst::NodePtr<Node> newRoot = CreateBranch();
+		Branch* rootBranch = static_cast<Branch*>(newRoot.Get());
+		rootBranch->m_Children[0] = std::move(rootLink);
+		InsertIntoBranch(rootBranch, 0, std::move(splitKey), std::move(splitNode));
+		rootBranch->m_Size = SumSizes(rootBranch, 0, 2);
+		rootLink = std::move(newRoot);
+	}
+
+	return entry;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::Delete(const LookupKey& key)
+{
+	Reclaim(ReclaimStepSize);
+
+	// Find entry being deleted first without cloning anything. Nothing changes if there is no such entry
+	if (!SearchInSubtree(GetRoot(), key))
+	{
+		return;
+	}
+
+	if (!m_InBatch)
+	{
+		StartVersion();
+	}
+
+	Path path;
+	pst::NodePtr<Node>* link = &GetRootLink(m_CurrentVersion);
+	while (true)
+	{
+		*link = CloneNode(link->Get());
+		(*link)->m_Size--;
+		if (link->Get()->IsLeaf())
+		{
+			break;
+		}
+
+		Branch* branch = static_cast<Branch*>(link->Get());
+		const int childIndex = FindChild(branch, key);
+		path.Push({ branch, childIndex });
+		link = &branch->m_Children[childIndex];
+	}
+
+	Leaf* leaf = static_cast<Leaf*>(link->Get());
+	Entry* entries = leaf->GetEntries();
+	const int index = LowerBoundInLeaf(leaf, key);
+	assert(index < leaf->m_Count && TKeyTraits::Compare(key, entries[index].m_Key) == 0);
+	std::move(entries + index + 1, entries + leaf->m_Count, entries + index);
+	entries[leaf->m_Count - 1].~Entry();
+	leaf->m_Count--;
+
+	// Separators are kept even if their entry is gone: they still split key ranges of children correctly
+	while (!path.IsEmpty())
+	{
+		auto [branch, childIndex] = path.Back();
+		path.Pop();
+		if (branch->m_Children[childIndex]->m_Count < Node::MinCount)
+		{
+			Rebalance(branch, childIndex);
+		}
+	}
+
+	pst::NodePtr<Node>& rootLink = GetRootLink(m_CurrentVersion);
+	if (rootLink->m_Count == 0)
+	{
+		// Empty root leaf means empty tree, branch root with single child is replaced by the child
+		pst::NodePtr<Node> child = rootLink->IsLeaf() ? nullptr : static_cast<Branch*>(rootLink.Get())->m_Children[0];
+		Retire(rootLink);
+		rootLink = std::move(child);
+	}
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+const typename pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::Entry* pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::Search(const LookupKey& key) const
+{
+	return SearchInSubtree(GetRoot(), key);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+const typename pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::Entry* pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::Search(const LookupKey& key, int version) const
+{
+	if (version < m_OldestVersion || version > m_CurrentVersion)
+	{
+		return nullptr;
+	}
+
+	return SearchInSubtree(GetRootLink(version).Get(), key);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+int pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::GetSize() const
+{
+	const Node* root = GetRoot();
+	return root ? root->m_Size : 0;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+int pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::GetRank(const LookupKey& key) const
+{
+	const Node* node = GetRoot();
+	if (!node)
+	{
+		return 0;
+	}
+
+	int rank = 0;
+	while (!node->IsLeaf())
+	{
+		const Branch* branch = static_cast<const Branch*>(node);
+		const int childIndex = FindChild(branch, key);
+		rank += SumSizes(branch, 0, childIndex);
+		node = branch->m_Children[childIndex].Get();
+	}
+
+	return rank + LowerBoundInLeaf(static_cast<const Leaf*>(node), key);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+template<typename TVisitor>
+void pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::ForEach(TVisitor&& visitor) const
+{
+	if (const Node* root = GetRoot())
+	{
+		ForEachInSubtree(root, visitor);
+	}
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+int pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::LowerBoundInLeaf(const Leaf* leaf, const LookupKey& key)
+{
+	int first = 0;
+	int count = leaf->m_Count;
+	const Entry* entries = leaf->GetEntries();
+	while (count > 0)
+	{
+		const int step = count / 2;
+		if (TKeyTraits::Compare(key, entries[first + step].m_Key) > 0)
+		{
+			first += step + 1;
+			count -= step + 1;
+		}
+		else
+		{
+			count = step;
+		}
+	}
+
+	return first;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+int pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::FindChild(const Branch* branch, const LookupKey& key)
+{
+	// Child i holds keys in [key i - 1; key i), so it is the number of separators not greater than the key
+	int first = 0;
+	int count = branch->m_Count;
+	const TKey* keys = branch->GetKeys();
+	while (count > 0)
+	{
+		const int step = count / 2;
+		if (TKeyTraits::Compare(key, keys[first + step]) >= 0)
+		{
+			first += step + 1;
+			count -= step + 1;
+		}
+		else
+		{
+			count = step;
+		}
+	}
+
+	return first;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+const typename pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::Entry* pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::SearchInSubtree(const Node* node, const LookupKey& key)
+{
+	if (!node)
+	{
+		return nullptr;
+	}
+
+	while (!node->IsLeaf())
+	{
+		const Branch* branch = static_cast<const Branch*>(node);
+		node = branch->m_Children[FindChild(branch, key)].Get();
+	}
+
+	const Leaf* leaf = static_cast<const Leaf*>(node);
+	const int index = LowerBoundInLeaf(leaf, key);
+	if (index < leaf->m_Count && TKeyTraits::Compare(key, leaf->GetEntries()[index].m_Key) == 0)
+	{
+		return &leaf->GetEntries()[index];
+	}
+
+	return nullptr;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+template<typename TVisitor>
+void pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::ForEachInSubtree(const Node* node, TVisitor& visitor)
+{
+	// Recursion depth is the tree height, which is small
+	if (node->IsLeaf())
+	{
+		const Leaf* leaf = static_cast<const Leaf*>(node);
+		std::for_each(leaf->GetEntries(), leaf->GetEntries() + leaf->m_Count, [&visitor](const Entry& entry) { visitor(entry); });
+		return;
+	}
+
+	const Branch* branch = static_cast<const Branch*>(node);
+	for (int i = 0; i <= branch->m_Count; i++)
+	{
+		ForEachInSubtree(branch->m_Children[i].Get(), visitor);
+	}
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::NodePtr<typename pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::Node> pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::CreateLeaf()
+{
+	void* block = m_NodePool->Allocate(sizeof(Leaf));
+	return pst::NodePtr<Node>(new (block) Leaf(m_CurrentVersion));
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::NodePtr<typename pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::Node> pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::CreateBranch()
+{
+	void* block = m_NodePool->Allocate(sizeof(Branch));
+	return pst::NodePtr<Node>(new (block) Branch(m_CurrentVersion));
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::NodePtr<typename pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::Node> pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::CloneNode(Node* node)
+{
+	if (node->GetCreateVersion() == m_CurrentVersion)
+	{
+		// Node has been created by this version already, nobody else can see it
+		return pst::NodePtr<Node>(node);
+	}
+
+	if (node->IsLeaf())
+	{
+		void* block = m_NodePool->Allocate(sizeof(Leaf));
+		return pst::NodePtr<Node>(new (block) Leaf(*static_cast<Leaf*>(node), m_CurrentVersion));
+	}
+
+	void* block = m_NodePool->Allocate(sizeof(Branch));
+	return pst::NodePtr<Node>(new (block) Branch(*static_cast<Branch*>(node), m_CurrentVersion));
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+std::pair<pst::NodePtr<typename pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::Node>, TKey> pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::SplitLeaf(Leaf* leaf)
+{
+	assert(leaf->m_Count == Node::Capacity + 1);
+	pst::NodePtr<Node> right = CreateLeaf();
+	Leaf* rightLeaf = static_cast<Leaf*>(right.Get());
+
+	// Both halves get at least MinCount entries
+	const int leftCount = leaf->m_Count / 2;
+	Entry* entries = leaf->GetEntries();
+	std::uninitialized_move(entries + leftCount, entries + leaf->m_Count, rightLeaf->GetEntries());
+	std::destroy(entries + leftCount, entries + leaf->m_Count);
+	rightLeaf->m_Count = leaf->m_Count - leftCount;
+	rightLeaf->m_Size = rightLeaf->m_Count;
+	leaf->m_Count = leftCount;
+	leaf->m_Size = leftCount;
+	return { std::move(right), rightLeaf->GetEntries()[0].m_Key };
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+std::pair<pst::NodePtr<typename pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::Node>, TKey> pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::SplitBranch(Branch* branch)
+{
+	assert(branch->m_Count == Node::Capacity + 1);
+	pst::NodePtr<Node> right = CreateBranch();
+	Branch* rightBranch = static_cast<Branch*>(right.Get());
+
+	// Middle key goes up to the parent, keys after it and their children move to the right branch. Both halves get at least MinCount keys
+	const int middle = branch->m_Count / 2;
+	TKey* keys = branch->GetKeys();
+	TKey separator = std::move(keys[middle]);
+	std::uninitialized_move(keys + middle + 1, keys + branch->m_Count, rightBranch->GetKeys());
+	std::move(std::begin(branch->m_Children) + middle + 1, std::begin(branch->m_Children) + branch->m_Count + 1, std::begin(rightBranch->m_Children));
+	std::destroy(keys + middle, keys + branch->m_Count);
+	rightBranch->m_Count = branch->m_Count - middle - 1;
+	branch->m_Count = middle;
+	return { std::move(right), std::move(separator) };
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::InsertIntoLeaf(Leaf* leaf, int index, const LookupKey& key)
+{
+	assert(leaf->m_Count <= Node::Capacity && index <= leaf->m_Count);
+	Entry* entries = leaf->GetEntries();
+	if (index == leaf->m_Count)
+	{
+		new (entries + index) Entry{ TKeyTraits::MakeKey(key), TValue() };
+	}
+	else
+	{
+		new (entries + leaf->m_Count) Entry(std::move(entries[leaf->m_Count - 1]));
+		std::move_backward(entries + index, entries + leaf->m_Count - 1, entries + leaf->m_Count);
+		entries[index] = Entry{ TKeyTraits::MakeKey(key), TValue() };
+	}
+
+	leaf->m_Count++;
+	leaf->m_Size++;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::InsertIntoBranch(Branch* branch, int index, TKey key, pst::NodePtr<Node> child)
+{
+	assert(branch->m_Count <= Node::Capacity && index <= branch->m_Count);
+	TKey* keys = branch->GetKeys();
+	if (index == branch->m_Count)
+	{
+		new (keys + index) TKey(std::move(key));
+	}
+	else
+	{
+		new (keys + branch->m_Count) TKey(std::move(keys[branch->m_Count - 1]));
+		std::move_backward(keys + index, keys + branch->m_Count - 1, keys + branch->m_Count);
+		keys[index] = std::move(key);
+	}
+
+	std::move_backward(std::begin(branch->m_Children) + index + 1, std::begin(branch->m_Children) + branch->m_Count + 1, std::begin(branch->m_Children) + branch->m_Count + 2);
+	branch->m_Children[index + 1] = std::move(child);
+	branch->m_Count++;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::Rebalance(Branch* branch, int childIndex)
+{
+	// Sibling with spare item lends one through the parent. Otherwise the child is merged with its sibling: together they have fewer than Capacity items
+	const bool hasLeft = childIndex > 0;
+	const bool hasRight = childIndex < branch->m_Count;
+	const bool borrowLeft = hasLeft && branch->m_Children[childIndex - 1]->m_Count > Node::MinCount;
+	const bool borrowRight = !borrowLeft && hasRight && branch->m_Children[childIndex + 1]->m_Count > Node::MinCount;
+	if (borrowLeft || borrowRight)
+	{
+		const int siblingIndex = borrowLeft ? childIndex - 1 : childIndex + 1;
+		branch->m_Children[siblingIndex] = CloneNode(branch->m_Children[siblingIndex].Get());
+		Node* child = branch->m_Children[childIndex].Get();
+		Node* sibling = branch->m_Children[siblingIndex].Get();
+		TKey& separator = branch->GetKeys()[borrowLeft ? childIndex - 1 : childIndex];
+		if (child->IsLeaf())
+		{
+			Entry* childEntries = static_cast<Leaf*>(child)->GetEntries();
+			Entry* siblingEntries = static_cast<Leaf*>(sibling)->GetEntries();
+			if (borrowLeft)
+			{
+				// Last entry of the left sibling becomes the first one of the child
+				new (childEntries + child->m_Count) Entry(std::move(childEntries[child->m_Count - 1]));
+				std::move_backward(childEntries, childEntries + child->m_Count - 1, childEntries + child->m_Count);
+				childEntries[0] = std::move(siblingEntries[sibling->m_Count - 1]);
+				siblingEntries[sibling->m_Count - 1].~Entry();
+				separator = childEntries[0].m_Key;
+			}
+			else
+			{
+				new (childEntries + child->m_Count) Entry(std::move(siblingEntries[0]));
+				std::move(siblingEntries + 1, siblingEntries + sibling->m_Count, siblingEntries);
+				siblingEntries[sibling->m_Count - 1].~Entry();
+				separator = siblingEntries[0].m_Key;
+			}
+
+			child->m_Size++;
+			sibling->m_Size--;
+		}
+		else
+		{
+			Branch* childBranch = static_cast<Branch*>(child);
+			Branch* siblingBranch = static_cast<Branch*>(sibling);
+			TKey* childKeys = childBranch->GetKeys();
+			TKey* siblingKeys = siblingBranch->GetKeys();
+			pst::NodePtr<Node> movedChild;
+			if (borrowLeft)
+			{
+				// Separator moves down to the child, last key of the sibling moves up in its place
+				movedChild = std::move(siblingBranch->m_Children[sibling->m_Count]);
+				if (child->m_Count > 0)
+				{
+					new (childKeys + child->m_Count) TKey(std::move(childKeys[child->m_Count - 1]));
+					std::move_backward(childKeys, childKeys + child->m_Count - 1, childKeys + child->m_Count);
+					childKeys[0] = std::move(separator);
+				}
+				else
+				{
+					new (childKeys) TKey(std::move(separator));
+				}
+
+				std::move_backward(std::begin(childBranch->m_Children), std::begin(childBranch->m_Children) + child->m_Count + 1, std::begin(childBranch->m_Children) + child->m_Count + 2);
+				childBranch->m_Children[0] = movedChild;
+				separator = std::move(siblingKeys[sibling->m_Count - 1]);
+				siblingKeys[sibling->m_Count - 1].~TKey();
+			}
+			else
+			{
+				movedChild = std::move(siblingBranch->m_Children[0]);
+				new (childKeys + child->m_Count) TKey(std::move(separator));
+				childBranch->m_Children[child->m_Count + 1] = movedChild;
+				separator = std::move(siblingKeys[0]);
+				std::move(siblingKeys + 1, siblingKeys + sibling->m_Count, siblingKeys);
+				siblingKeys[sibling->m_Count - 1].~TKey();
+				std::move(std::begin(siblingBranch->m_Children) + 1, std::begin(siblingBranch->m_Children) + sibling->m_Count + 1, std::begin(siblingBranch->m_Children));
+			}
+
+			child->m_Size += movedChild->m_Size;
+			sibling->m_Size -= movedChild->m_Size;
+		}
+
+		child->m_Count++;
+		sibling->m_Count--;
+		return;
+	}
+
+	// Right node of the pair is appended to the left one and removed from the branch. Left node is modified, so it is cloned
+	const int leftIndex = hasLeft ? childIndex - 1 : childIndex;
+	branch->m_Children[leftIndex] = CloneNode(branch->m_Children[leftIndex].Get());
+	Node* left = branch->m_Children[leftIndex].Get();
+	const Node* right = branch->m_Children[leftIndex + 1].Get();
+	TKey* branchKeys = branch->GetKeys();
+	if (left->IsLeaf())
+	{
+		// Right node can be shared with older versions, so its items are copied, not moved
+		const Leaf* rightLeaf = static_cast<const Leaf*>(right);
+		std::uninitialized_copy(rightLeaf->GetEntries(), rightLeaf->GetEntries() + right->m_Count, static_cast<Leaf*>(left)->GetEntries() + left->m_Count);
+		left->m_Count += right->m_Count;
+	}
+	else
+	{
+		Branch* leftBranch = static_cast<Branch*>(left);
+		const Branch* rightBranch = static_cast<const Branch*>(right);
+		TKey* leftKeys = leftBranch->GetKeys();
+		new (leftKeys + left->m_Count) TKey(branchKeys[leftIndex]);
+		std::uninitialized_copy(rightBranch->GetKeys(), rightBranch->GetKeys() + right->m_Count, leftKeys + left->m_Count + 1);
+		std::copy(std::begin(rightBranch->m_Children), std::begin(rightBranch->m_Children) + right->m_Count + 1, std::begin(leftBranch->m_Children) + left->m_Count + 1);
+		left->m_Count += right->m_Count + 1;
+	}
+
+	left->m_Size += right->m_Size;
+	Retire(branch->m_Children[leftIndex + 1]);
+
+	// Separator of the pair and link to the right node are removed from the branch
+	std::move(branchKeys + leftIndex + 1, branchKeys + branch->m_Count, branchKeys + leftIndex);
+	branchKeys[branch->m_Count - 1].~TKey();
+	std::move(std::begin(branch->m_Children) + leftIndex + 2, std::begin(branch->m_Children) + branch->m_Count + 1, std::begin(branch->m_Children) + leftIndex + 1);
+	branch->m_Count--;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+int pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::SumSizes(const Branch* branch, int from, int to)
+{
+	int size = 0;
+	for (int i = from; i < to; i++)
+	{
+		size += branch->m_Children[i]->m_Size;
+	}
+
+	return size;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+const typename pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::Node* pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::GetRoot() const
+{
+	return GetRootLink(m_CurrentVersion).Get();
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::NodePtr<typename pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::Node>& pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::GetRootLink(int version)
+{
+	assert(version >= m_OldestVersion && version - m_HistoryBase < static_cast<int>(m_RootHistory.size()));
+	return m_RootHistory[version - m_HistoryBase];
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+const pst::NodePtr<typename pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::Node>& pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::GetRootLink(int version) const
+{
+	assert(version >= m_OldestVersion && version - m_HistoryBase < static_cast<int>(m_RootHistory.size()));
+	return m_RootHistory[version - m_HistoryBase];
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::StartVersion()
+{
+	assert(m_CurrentVersion >= 0);
+	m_CurrentVersion++;
+
+	// Slot can keep rolled back version
+	ClearCurrentVersion();
+
+	// New version starts with the same tree as previous one. Nodes are cloned on first change
+	GetRootLink(m_CurrentVersion) = GetRootLink(m_CurrentVersion - 1);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::ClearCurrentVersion()
+{
+	const std::size_t index = m_CurrentVersion - m_HistoryBase;
+	if (m_RootHistory.size() > index)
+	{
+		// Slot keeps rolled back version which can own large subtree
+		Retire(m_RootHistory[index]);
+	}
+	else
+	{
+		assert(m_RootHistory.size() == index);
+		m_RootHistory.push_back(nullptr);
+	}
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>::Retire(pst::NodePtr<Node>& node)
+{
+	if (node)
+	{
+		m_RetiredNodes.push_back(std::move(node));
+	}
+}
@@ -0,0 +1 @@
+#include "PersistentFatNodeMap.h"
@@ -0,0 +1,233 @@
+#pragma once
+
+#include "FixedStack.h"
+#include "KeyTraits.h"
+#include "NodePool.h"
+#include "PersistentMap.h"
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace pst
+{
+	class PersistentFatNodeMapTest;
+
+	/// Node of PersistentFatNodeMap. Key is immutable, links, color and value are versioned: node keeps values of the version
+	/// which created it and few modification slots stamped with version of change. Reader of version v sees the latest
+	/// modification with stamp not greater than v. Node is copied only when its slots are full (node-copying of Driscoll, Sarnak, Sleator and Tarjan)
+	template <typename TKey, typename TValue, typename TNodePool = NodePool, typename TKeyTraits = KeyTraits<TKey>>
+	class PersistentFatNodeMapNode : public PersistentMapKeyPrefix<typename TKeyTraits::Prefix>
+	{
+	public:
+		/// Every node has single parent in each version, so any number of slots gives O(1) amortized copies per change.
+		/// Two slots keep node small while most changes of one update (color flip and link change) still fit
+		static constexpr int ModificationSlots = 2;
+
+		enum class Field : std::uint8_t
+		{
+			Left,
+			Right,
+			Red,
+			Value
+		};
+
+		/// Change of single field. Only member which corresponds to the field is used
+		struct Modification
+		{
+			int m_Version;
+			Field m_Field;
+			bool m_Red;
+			PersistentFatNodeMapNode* m_Child;
+			TValue m_Value;
+		};
+
+		PersistentFatNodeMapNode(TKey key, int currentVersion);
+
+		/// Copies fields as they are seen by current version. Copy has no modifications
+		PersistentFatNodeMapNode(const PersistentFatNodeMapNode& other, int currentVersion);
+
+		PersistentFatNodeMapNode& operator=(const PersistentFatNodeMapNode&) = delete;
+
+		/// Destroys node and returns its memory to the pool
+		static void Destroy(PersistentFatNodeMapNode* node);
+
+		PersistentFatNodeMapNode* GetChild(bool left, int version) const;
+		bool IsRed(int version) const;
+		const TValue& GetValue(int version) const;
+
+		/// Applies change of current version in place: to own fields of node created by that version, over modification of the same field
+		/// and version or to free slot. Returns false and changes nothing if node is full and should be copied. isAppended is set if slot has been taken
+		bool TryModify(const Modification& modification, bool& isAppended);
+
+		/// Value of current version which can be changed in place. Current version should have created node or modified its value
+		TValue& GetCurrentValue(int currentVersion);
+
+		/// Drops last modification. Used by rollback, which undoes changes in reverse order
+		void PopModification([[maybe_unused]] int version);
+
+		/// Version of data which created this node
+		int GetCreateVersion() const { return m_CreateVersion; }
+
+		const TKey m_Key;
+
+		/// Nodes are owned by the map, which keeps them in a list, newest first
+		PersistentFatNodeMapNode* m_NextCreated;
+
+	private:
+		/// Latest modification of the field with version not greater than specified one
+		const Modification* FindModification(Field field, int version) const;
+
+		PersistentFatNodeMapNode* m_Left;
+		PersistentFatNodeMapNode* m_Right;
+		TValue m_Value;
+		const int m_CreateVersion;
+		bool m_Red;
+		std::uint8_t m_ModificationCount;
+		Modification m_Modifications[ModificationSlots];
+	};
+
+	/// Persistent red-black tree which keeps history with fat nodes instead of path copying. A change writes O(1) amortized
+	/// modifications and node copies instead of O(log n) new nodes, while any retained version is still searched in O(log n).
+	/// Price of that is slower reads, which check modification slots on every level, and shared nodes across versions:
+	/// old version can't be released separately, so DropVersionsBefore only limits rollback and memory is returned when map is destroyed.
+	/// Rollback undoes modifications of rolled back versions eagerly with an undo log, so later versions reuse their numbers.
+	/// Nodes have no subtree sizes (they would add modification on every level), so there are no rank queries.
+	/// Map is used by single thread, it has no snapshots for concurrent readers.
+	template <typename TKey, typename TValue, typename TNodePool = NodePool, typename TKeyTraits = KeyTraits<TKey>>
+	class PersistentFatNodeMap
+	{
+		friend class PersistentFatNodeMapTest;
+
+		/// Height of RB-tree is at most 2 * log2(n + 1), so this covers any tree with int-sized number of nodes
+		static constexpr int MaxHeight = 64;
+
+	public:
+		using LookupKey = typename TKeyTraits::LookupKey;
+
+		PersistentFatNodeMap();
+		~PersistentFatNodeMap();
+
+		PersistentFatNodeMap(const PersistentFatNodeMap&) = delete;
+		PersistentFatNodeMap& operator=(const PersistentFatNodeMap&) = delete;
+
+		/// Moves current version delta steps back and undoes its changes. Returns false and changes nothing if that version has been dropped already
+		bool Rollback(int delta);
+		int GetVersion() const;
+
+		/// Oldest version which can still be reached by Rollback or Search
+		int GetOldestVersion() const;
+
+		/// Drops all versions older than specified one (current version is never dropped) and their undo log. Nodes are not freed, see class comment
+		void DropVersionsBefore(int version);
+
+		/// Starts new version of data. All Insert and Delete calls until Commit change this version instead of creating new ones
+		void BeginBatch();
+		void Commit();
+		bool IsInBatch() const;
+
+		/// Creates entry with specified key and default value. If entry exists already - returns its value.
+		/// Returned value belongs to current version and can be changed until next change of the map. Creates new version of data unless batch is started.
+		TValue* Insert(const LookupKey& key);
+
+		/// Deletes entry with specified key. Creates new version of data if entry exists and batch is not started.
+		void Delete(const LookupKey& key);
+
+		const TValue* Search(const LookupKey& key) const;
+
+		/// Searches in specified version without changing current one. Returns nullptr if version has been dropped or is newer than current one
+		const TValue* Search(const LookupKey& key, int version) const;
+
+		/// Returns number of entries in current version
+		int GetSize() const;
+
+		/// Calls visitor(key, value) for every entry of current version in ascending order of keys
+		template <typename TVisitor>
+		void ForEach(TVisitor&& visitor) const;
+
+		/// Bytes of undo log which keeps rollback window
+		std::size_t GetUndoLogBytes() const;
+
+	private:
+		using Node = PersistentFatNodeMapNode<TKey, TValue, TNodePool, TKeyTraits>;
+		using Modification = typename Node::Modification;
+		using Field = typename Node::Field;
+		using KeyPrefix = typename TKeyTraits::Prefix;
+
+		/// Nodes from root to the node being changed. Node copy replaces the original in the path, so path always reflects current version
+		using Path = FixedStack<Node*, MaxHeight>;
+
+		struct Version
+		{
+			Node* m_Root;
+			int m_Size;
+
+			/// Undo log position where changes of this version start
+			std::size_t m_UndoLogStart;
+		};
+
+		static int CompareKeys(const LookupKey& key, const KeyPrefix& keyPrefix, const Node* node);
+		static const Node* SearchInSubtree(const Node* node, const LookupKey& key, int version);
+
+		template <typename TVisitor>
+		static void ForEachInSubtree(const Node* node, int version, TVisitor& visitor);
+
+		Node* CreateNode(const LookupKey& key);
+		Node* CopyNode(const Node* node);
+
+		/// Reads of current version
+		Node* GetChild(const Node* node, bool left) const;
+		bool IsRed(const Node* node) const;
+
+		Modification MakeChildModification(bool left, Node* child) const;
+		Modification MakeColorModification(bool red) const;
+		bool IsUnchanged(const Node* node, const Modification& modification) const;
+
+		/// Changes node at specified depth of the path. Full node is copied and the copy replaces it in its parent, which is changed the same way
+		void Modify(Path& path, std::size_t depth, Modification modification);
+
+		/// Changes child of the last node of the path
+		void ModifyChild(Path& path, bool left, const Modification& modification);
+
+		/// Replaces link to node at specified depth of the path in its parent or root of current version
+		void SetLink(Path& path, std::size_t depth, Node* node);
+
+		/// Rotates the last node of the path. Its child takes its place and the path ends with the rotated node again
+		void Rotate(Path& path, bool toLeft);
+
+		void SetRootBlack();
+
+		/// Path ends with inserted red node
+		void InsertFixup(Path& path);
+
+		/// Path ends with parent of fixNode, which is its child on specified side. fixNode can be nullptr
+		void DeleteFixup(Path& path, Node* fixNode, bool isLeft);
+
+		Version& GetVersionInfo(int version);
+		const Version& GetVersionInfo(int version) const;
+
+		/// Creates new version which shares whole tree with previous one
+		void StartVersion();
+
+		// Pool should be declared before any node owner so it is destroyed last. Kept by pointer so nodes never see it move
+		std::unique_ptr<TNodePool> m_NodePool;
+
+		/// Version m_HistoryBase + i is kept at index i. Dropped versions are compacted lazily, so history prefix before m_OldestVersion is unused
+		std::vector<Version> m_History;
+		int m_HistoryBase;
+		int m_OldestVersion;
+		int m_CurrentVersion;
+		bool m_InBatch;
+
+		/// Nodes which got modification slot taken, in order of changes. Entry i is kept at index i - m_UndoLogBase
+		std::vector<Node*> m_UndoLog;
+		std::size_t m_UndoLogBase;
+
+		/// Head of list of all nodes, newest first. Rollback frees nodes of rolled back versions from its head
+		Node* m_LastCreated;
+	};
+}
+
+#include "PersistentFatNodeMap.inl"
@@ -0,0 +1,740 @@
+#pragma once
+
+#include "PersistentFatNodeMap.h"
+
+#include <algorithm>
+#include <cassert>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::PersistentFatNodeMapNode<TKey, TValue, TNodePool, TKeyTraits>::PersistentFatNodeMapNode(TKey key, int currentVersion)
+	: PersistentMapKeyPrefix<typename TKeyTraits::Prefix>(TKeyTraits::GetPrefix(key))
+	, m_Key(std::move(key))
+	, m_NextCreated(nullptr)
+	, m_Left(nullptr)
+	, m_Right(nullptr)
+	, m_Value()
+	, m_CreateVersion(currentVersion)
+	, m_Red(true)
+	, m_ModificationCount(0)
+{
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::PersistentFatNodeMapNode<TKey, TValue, TNodePool, TKeyTraits>::PersistentFatNodeMapNode(const PersistentFatNodeMapNode& other, int currentVersion)
+	: PersistentMapKeyPrefix<typename TKeyTraits::Prefix>(other)
+	, m_Key(other.m_Key)
+	, m_NextCreated(nullptr)
+	, m_Left(other.GetChild(true, currentVersion))
+	, m_Right(other.GetChild(false, currentVersion))
+	, m_Value(other.GetValue(currentVersion))
+	, m_CreateVersion(currentVersion)
+	, m_Red(other.IsRed(currentVersion))
+	, m_ModificationCount(0)
+{
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentFatNodeMapNode<TKey, TValue, TNodePool, TKeyTraits>::Destroy(PersistentFatNodeMapNode* node)
+{
+	node->~PersistentFatNodeMapNode();
+	TNodePool::Free(node, sizeof(PersistentFatNodeMapNode));
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::PersistentFatNodeMapNode<TKey, TValue, TNodePool, TKeyTraits>* pst::PersistentFatNodeMapNode<TKey, TValue, TNodePool, TKeyTraits>::GetChild(bool left, int version) const
+{
+	const Modification* modification = FindModification(left ? Field::Left : Field::Right, version);
+	return modification ? modification->m_Child : (left ? m_Left : m_Right);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+bool pst::PersistentFatNodeMapNode<TKey, TValue, TNodePool, TKeyTraits>::IsRed(int version) const
+{
+	const Modification* modification = FindModification(Field::Red, version);
+	return modification ? modification->m_Red : m_Red;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+const TValue& pst::PersistentFatNodeMapNode<TKey, TValue, TNodePool, TKeyTraits>::GetValue(int version) const
+{
+	const Modification* modification = FindModification(Field::Value, version);
+	return modification ? modification->m_Value : m_Value;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+bool pst::PersistentFatNodeMapNode<TKey, TValue, TNodePool, TKeyTraits>::TryModify(const Modification& modification, bool& isAppended)
+{
+	isAppended = false;
+	Modification* target = nullptr;
+	if (modification.m_Version == m_CreateVersion)
+	{
+		// Nobody else has seen own fields of node created by current version
+		switch (modification.m_Field)
+		{
+		case Field::Left: m_Left = modification.m_Child; break;
+		case Field::Right: m_Right = modification.m_Child; break;
+		case Field::Red: m_Red = modification.m_Red; break;
+		case Field::Value: m_Value = modification.m_Value; break;
+		}
+
+		return true;
+	}
+
+	// Modifications of current version are the last ones
+	for (int i = m_ModificationCount - 1; i >= 0 && m_Modifications[i].m_Version == modification.m_Version; i--)
+	{
+		if (m_Modifications[i].m_Field == modification.m_Field)
+		{
+			target = &m_Modifications[i];
+			break;
+		}
+	}
+
+	if (!target)
+	{
+		if (m_ModificationCount == ModificationSlots)
+		{
+			return false;
+		}
+
+		assert(m_ModificationCount == 0 || m_Modifications[m_ModificationCount - 1].m_Version <= modification.m_Version);
+		target = &m_Modifications[m_ModificationCount++];
+		isAppended = true;
+	}
+
+	*target = modification;
+	return true;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+TValue& pst::PersistentFatNodeMapNode<TKey, TValue, TNodePool, TKeyTraits>::GetCurrentValue(int currentVersion)
+{
+	if (currentVersion == m_CreateVersion)
+	{
+		return m_Value;
+	}
+
+	Modification* modification = const_cast<Modification*>(FindModification(Field::Value, currentVersion));
+	assert(modification && modification->m_Version == currentVersion);
+	return modification->m_Value;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentFatNodeMapNode<TKey, TValue, TNodePool, TKeyTraits>::PopModification([[maybe_unused]] int version)
+{
+	assert(m_ModificationCount > 0 && m_Modifications[m_ModificationCount - 1].m_Version > version);
+	m_ModificationCount--;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+const typename pst::PersistentFatNodeMapNode<TKey, TValue, TNodePool, TKeyTraits>::Modification* pst::PersistentFatNodeMapNode<TKey, TValue, TNodePool, TKeyTraits>::FindModification(Field field, int version) const
+{
+	for (int i = m_ModificationCount - 1; i >= 0; i--)
+	{
+		if (m_Modifications[i].m_Field == field && m_Modifications[i].m_Version <= version)
+		{
+			return &m_Modifications[i];
+		}
+	}
+
+	return nullptr;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::PersistentFatNodeMap()
+	: m_NodePool(std::make_unique<TNodePool>())
+	, m_History{ Version{ nullptr, 0, 0 } }
+	, m_HistoryBase(0)
+	, m_OldestVersion(0)
+	, m_CurrentVersion(0)
+	, m_InBatch(false)
+	, m_UndoLogBase(0)
+	, m_LastCreated(nullptr)
+{
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::~PersistentFatNodeMap()
+{
+	while (m_LastCreated)
+	{
+		Node* node = m_LastCreated;
+		m_LastCreated = node->m_NextCreated;
+		Node::Destroy(node);
+	}
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+bool pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::Rollback(int delta)
+{
+	assert(!m_InBatch);
+	assert(delta > 0);
+	if (delta > m_CurrentVersion - m_OldestVersion)
+	{
+		// Version is beyond retention horizon
+		return false;
+	}
+
+	const int version = m_CurrentVersion - delta;
+
+	// Modifications are undone newest first, so every node drops its last slot
+	const std::size_t undoLogStart = GetVersionInfo(version + 1).m_UndoLogStart;
+	while (m_UndoLogBase + m_UndoLog.size() > undoLogStart)
+	{
+		m_UndoLog.back()->PopModification(version);
+		m_UndoLog.pop_back();
+	}
+
+	// Nodes of rolled back versions are reachable only from their modifications, which are gone now
+	while (m_LastCreated && m_LastCreated->GetCreateVersion() > version)
+	{
+		Node* node = m_LastCreated;
+		m_LastCreated = node->m_NextCreated;
+		Node::Destroy(node);
+	}
+
+	m_History.resize(version - m_HistoryBase + 1);
+	m_CurrentVersion = version;
+	return true;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+int pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::GetVersion() const
+{
+	return m_CurrentVersion;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+int pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::GetOldestVersion() const
+{
+	return m_OldestVersion;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::DropVersionsBefore(int version)
+{
+	version = std::min(version, m_CurrentVersion);
+	if (version <= m_OldestVersion)
+	{
+		return;
+	}
+
+	m_OldestVersion = version;
+
+	// Erasing the prefix moves every retained item, so do it only when unused prefix is the larger part. Keeps dropping amortized O(1) per version
+	const std::size_t droppedCount = m_OldestVersion - m_HistoryBase;
+	if (droppedCount * 2 >= m_History.size())
+	{
+		m_History.erase(std::begin(m_History), std::begin(m_History) + droppedCount);
+		m_HistoryBase = m_OldestVersion;
+	}
+
+	// Changes of the oldest version and older ones can't be undone anymore
+	const std::size_t droppedLogSize = GetVersionInfo(m_OldestVersion).m_UndoLogStart - m_UndoLogBase;
+	if (droppedLogSize * 2 >= m_UndoLog.size())
+	{
+		m_UndoLog.erase(std::begin(m_UndoLog), std::begin(m_UndoLog) + droppedLogSize);
+		m_UndoLogBase += droppedLogSize;
+	}
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::BeginBatch()
+{
+	assert(!m_InBatch);
+	StartVersion();
+	m_InBatch = true;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::Commit()
+{
+	assert(m_InBatch);
+	m_InBatch = false;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+bool pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::IsInBatch() const
+{
+	return m_InBatch;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+TValue* pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::Insert(const LookupKey& key)
+{
+	if (!m_InBatch)
+	{
+		StartVersion();
+	}
+
+	Path path;
+	const KeyPrefix keyPrefix = TKeyTraits::GetPrefix(key);
+	bool isLeft = false;
+	for (Node* node = GetVersionInfo(m_CurrentVersion).m_Root; node; node = GetChild(node, isLeft))
+	{
+		path.Push(node);
+		const int comparison = CompareKeys(key, keyPrefix, node);
+		if (comparison == 0)
+		{
+			// Value gets slot of current version, so caller can change it without affecting older versions
+			Modification modification{ m_CurrentVersion, Field::Value, false, nullptr, node->GetValue(m_CurrentVersion) };
+			Modify(path, path.GetSize() - 1, std::move(modification));
+			return &path.Back()->GetCurrentValue(m_CurrentVersion);
+		}
+
+		isLeft = comparison < 0;
+	}
+
+	// New node is of current version, so fixup changes it in place and never copies it
+	Node* newNode = CreateNode(key);
+	if (path.IsEmpty())
+	{
+		GetVersionInfo(m_CurrentVersion).m_Root = newNode;
+	}
+	else
+	{
+		Modify(path, path.GetSize() - 1, MakeChildModification(isLeft, newNode));
+	}
+
+	GetVersionInfo(m_CurrentVersion).m_Size++;
+	path.Push(newNode);
+	InsertFixup(path);
+	return &newNode->GetCurrentValue(m_CurrentVersion);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::Delete(const LookupKey& key)
+{
+	// Find node being deleted first without changing anything. Nothing changes if there is no such node
+	Path path;
+	const KeyPrefix keyPrefix = TKeyTraits::GetPrefix(key);
+	int comparison = 1;
+	for (Node* node = GetVersionInfo(m_CurrentVersion).m_Root; node && comparison != 0; node = GetChild(node, comparison < 0))
+	{
+		path.Push(node);
+		comparison = CompareKeys(key, keyPrefix, node);
+	}
+
+	if (comparison != 0)
+	{
+		// There is nothing to delete
+		return;
+	}
+
+	if (!m_InBatch)
+	{
+		// New version shares the tree with previous one, so found path is valid for it as well
+		StartVersion();
+	}
+
+	GetVersionInfo(m_CurrentVersion).m_Size--;
+	const std::size_t depth = path.GetSize() - 1;
+	Node* node = path[depth];
+	Node* left = GetChild(node, true);
+	Node* right = GetChild(node, false);
+	Node* fixNode = nullptr;
+	bool isFixNodeLeft = false;
+	bool isRemovedRed = false;
+	if (!left || !right)
+	{
+		// 1. Node with 0 or 1 child is replaced by the child
+		fixNode = left ? left : right;
+		isFixNodeLeft = depth > 0 && GetChild(path[depth - 1], true) == node;
+		isRemovedRed = IsRed(node);
+		SetLink(path, depth, fixNode);
+		path.Pop();
+	}
+	else
+	{
+		// 2. Node with 2 children is replaced by its successor, which takes its color. Successor's right child takes place of successor
+		path.Push(right);
+		while (Node* next = GetChild(path.Back(), true))
+		{
+			path.Push(next);
+		}
+
+		Node* successor = path.Back();
+		const std::size_t successorDepth = path.GetSize() - 1;
+		fixNode = GetChild(successor, false);
+		isRemovedRed = IsRed(successor);
+		path.Pop();
+		if (successorDepth == depth + 1)
+		{
+			// 2a. Successor is right child of deleted node and keeps its right subtree
+			const bool isNodeRed = IsRed(path[depth]);
+			SetLink(path, depth, successor);
+			path[depth] = successor;
+			Modify(path, depth, MakeChildModification(true, left));
+			Modify(path, depth, MakeColorModification(isNodeRed));
+			isFixNodeLeft = false;
+		}
+		else
+		{
+			// 2b. Successor is detached first. That can copy nodes up to deleted one, so its fields are read after that
+			Modify(path, successorDepth - 1, MakeChildModification(true, fixNode));
+			Node* current = path[depth];
+			Node* currentLeft = GetChild(current, true);
+			Node* currentRight = GetChild(current, false);
+			const bool isNodeRed = IsRed(current);
+			SetLink(path, depth, successor);
+			path[depth] = successor;
+			Modify(path, depth, MakeChildModification(true, currentLeft));
+			Modify(path, depth, MakeChildModification(false, currentRight));
+			Modify(path, depth, MakeColorModification(isNodeRed));
+			isFixNodeLeft = true;
+		}
+	}
+
+	if (!isRemovedRed)
+	{
+		DeleteFixup(path, fixNode, isFixNodeLeft);
+	}
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+const TValue* pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::Search(const LookupKey& key) const
+{
+	return Search(key, m_CurrentVersion);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+const TValue* pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::Search(const LookupKey& key, int version) const
+{
+	if (version < m_OldestVersion || version > m_CurrentVersion)
+	{
+		return nullptr;
+	}
+
+	const Node* node = SearchInSubtree(GetVersionInfo(version).m_Root, key, version);
+	return node ? &node->GetValue(version) : nullptr;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+int pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::GetSize() const
+{
+	return GetVersionInfo(m_CurrentVersion).m_Size;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+template<typename TVisitor>
+void pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::ForEach(TVisitor&& visitor) const
+{
+	ForEachInSubtree(GetVersionInfo(m_CurrentVersion).m_Root, m_CurrentVersion, visitor);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+std::size_t pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::GetUndoLogBytes() const
+{
+	return m_UndoLog.capacity() * sizeof(Node*);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+int pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::CompareKeys(const LookupKey& key, const KeyPrefix& keyPrefix, const Node* node)
+{
+	if constexpr (!std::is_same_v<KeyPrefix, pst::NoKeyPrefix>)
+	{
+		const KeyPrefix nodePrefix = node->GetKeyPrefix();
+		if (keyPrefix != nodePrefix)
+		{
+			return keyPrefix < nodePrefix ? -1 : 1;
+		}
+	}
+
+	return TKeyTraits::Compare(key, node->m_Key);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+const typename pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::Node* pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::SearchInSubtree(const Node* node, const LookupKey& key, int version)
+{
+	const KeyPrefix keyPrefix = TKeyTraits::GetPrefix(key);
+	int comparison = 0;
+	while (node && (comparison = CompareKeys(key, keyPrefix, node)) != 0)
+	{
+		node = node->GetChild(comparison < 0, version);
+	}
+
+	return node;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+template<typename TVisitor>
+void pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::ForEachInSubtree(const Node* node, int version, TVisitor& visitor)
+{
+	// Recursion depth is the tree height, which is logarithmic
+	if (!node)
+	{
+		return;
+	}
+
+	ForEachInSubtree(node->GetChild(true, version), version, visitor);
+	visitor(node->m_Key, node->GetValue(version));
+	ForEachInSubtree(node->GetChild(false, version), version, visitor);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+typename pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::Node* pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::CreateNode(const LookupKey& key)
+{
+	void* block = m_NodePool->Allocate(sizeof(Node));
+	Node* node = new (block) Node(TKeyTraits::MakeKey(key), m_CurrentVersion);
+	node->m_NextCreated = m_LastCreated;
+	m_LastCreated = node;
+	return node;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+typename pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::Node* pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::CopyNode(const Node* node)
+{
+	void* block = m_NodePool->Allocate(sizeof(Node));
+	Node* copy = new (block) Node(*node, m_CurrentVersion);
+	copy->m_NextCreated = m_LastCreated;
+	m_LastCreated = copy;
+	return copy;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+typename pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::Node* pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::GetChild(const Node* node, bool left) const
+{
+	return node->GetChild(left, m_CurrentVersion);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+bool pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::IsRed(const Node* node) const
+{
+	// Missing leaves are black
+	return node && node->IsRed(m_CurrentVersion);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+typename pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::Modification pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::MakeChildModification(bool left, Node* child) const
+{
+	return Modification{ m_CurrentVersion, left ? Field::Left : Field::Right, false, child, TValue() };
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+typename pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::Modification pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::MakeColorModification(bool red) const
+{
+	return Modification{ m_CurrentVersion, Field::Red, red, nullptr, TValue() };
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+bool pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::IsUnchanged(const Node* node, const Modification& modification) const
+{
+	switch (modification.m_Field)
+	{
+	case Field::Left: return GetChild(node, true) == modification.m_Child;
+	case Field::Right: return GetChild(node, false) == modification.m_Child;
+	case Field::Red: return IsRed(node) == modification.m_Red;
+	case Field::Value: return false;
+	}
+
+	return false;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::Modify(Path& path, std::size_t depth, Modification modification)
+{
+	assert(modification.m_Version == m_CurrentVersion);
+	while (!IsUnchanged(path[depth], modification))
+	{
+		Node* node = path[depth];
+		bool isAppended = false;
+		if (node->TryModify(modification, isAppended))
+		{
+			if (isAppended)
+			{
+				m_UndoLog.push_back(node);
+			}
+
+			return;
+		}
+
+		// Full node is copied, copy is of current version so it takes the change in its own fields. Then the copy replaces node in its parent
+		Node* copy = CopyNode(node);
+		[[maybe_unused]] const bool isModified = copy->TryModify(modification, isAppended);
+		assert(isModified && !isAppended);
+		path[depth] = copy;
+		if (depth == 0)
+		{
+			GetVersionInfo(m_CurrentVersion).m_Root = copy;
+			return;
+		}
+
+		depth--;
+		modification = MakeChildModification(GetChild(path[depth], true) == node, copy);
+	}
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::ModifyChild(Path& path, bool left, const Modification& modification)
+{
+	Node* child = GetChild(path.Back(), left);
+	assert(child);
+	path.Push(child);
+	Modify(path, path.GetSize() - 1, modification);
+	path.Pop();
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::SetLink(Path& path, std::size_t depth, Node* node)
+{
+	if (depth == 0)
+	{
+		GetVersionInfo(m_CurrentVersion).m_Root = node;
+		return;
+	}
+
+	Modify(path, depth - 1, MakeChildModification(GetChild(path[depth - 1], true) == path[depth], node));
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::Rotate(Path& path, bool toLeft)
+{
+	// Left rotation lifts right child, right rotation lifts left one
+	const std::size_t depth = path.GetSize() - 1;
+	Node* target = path[depth];
+	Node* child = GetChild(target, !toLeft);
+	Node* grandChild = GetChild(child, toLeft);
+
+	// Child is linked to the parent first, so every later copy is linked from the right place
+	SetLink(path, depth, child);
+	path[depth] = child;
+	Modify(path, depth, MakeChildModification(toLeft, target));
+	path.Push(target);
+	Modify(path, depth + 1, MakeChildModification(!toLeft, grandChild));
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::SetRootBlack()
+{
+	if (Node* root = GetVersionInfo(m_CurrentVersion).m_Root)
+	{
+		Path path;
+		path.Push(root);
+		Modify(path, 0, MakeColorModification(false));
+	}
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::InsertFixup(Path& path)
+{
+	// Red root is recolored at the end, so red parent always has a parent
+	while (path.GetSize() >= 3 && IsRed(path[path.GetSize() - 2]))
+	{
+		const std::size_t depth = path.GetSize() - 1;
+		const bool isParentLeft = GetChild(path[depth - 2], true) == path[depth - 1];
+		if (IsRed(GetChild(path[depth - 2], !isParentLeft)))
+		{
+			// Case 1. Red uncle: parent and uncle become black, grandparent becomes red and is fixed next
+			Modify(path, depth - 1, MakeColorModification(false));
+			path.Pop();
+			path.Pop();
+			ModifyChild(path, !isParentLeft, MakeColorModification(false));
+			Modify(path, depth - 2, MakeColorModification(true));
+			continue;
+		}
+
+		if (path[depth] == GetChild(path[depth - 1], !isParentLeft))
+		{
+			// Case 2. Inner child is rotated to outer position, former parent is the node being fixed now
+			path.Pop();
+			Rotate(path, isParentLeft);
+		}
+
+		// Case 3. Rotation of grandparent terminates fixup
+		Modify(path, depth - 1, MakeColorModification(false));
+		Modify(path, depth - 2, MakeColorModification(true));
+		path.Pop();
+		path.Pop();
+		Rotate(path, !isParentLeft);
+		break;
+	}
+
+	SetRootBlack();
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::DeleteFixup(Path& path, Node* fixNode, bool isLeft)
+{
+	// Both sides are handled by one code: isLeft tells on which side of its parent fixNode is
+	while (!path.IsEmpty() && !IsRed(fixNode))
+	{
+		Node* sibling = GetChild(path.Back(), !isLeft);
+		if (IsRed(sibling))
+		{
+			// Case 1. Red sibling is rotated above parent, new sibling is black
+			ModifyChild(path, !isLeft, MakeColorModification(false));
+			Modify(path, path.GetSize() - 1, MakeColorModification(true));
+			Rotate(path, isLeft);
+			sibling = GetChild(path.Back(), !isLeft);
+		}
+
+		if (!IsRed(GetChild(sibling, true)) && !IsRed(GetChild(sibling, false)))
+		{
+			// Case 2. Both sibling's children are black: sibling becomes red and parent is fixed next
+			ModifyChild(path, !isLeft, MakeColorModification(true));
+			fixNode = path.Back();
+			path.Pop();
+			isLeft = !path.IsEmpty() && GetChild(path.Back(), true) == fixNode;
+			continue;
+		}
+
+		if (!IsRed(GetChild(sibling, !isLeft)))
+		{
+			// Case 3. Inner red child of sibling is rotated to become new sibling
+			path.Push(sibling);
+			ModifyChild(path, isLeft, MakeColorModification(false));
+			Modify(path, path.GetSize() - 1, MakeColorModification(true));
+			Rotate(path, !isLeft);
+			path.Pop();
+			path.Pop();
+			sibling = GetChild(path.Back(), !isLeft);
+		}
+
+		// Case 4. Sibling takes color of parent and is rotated above it, which terminates fixup
+		const bool isParentRed = IsRed(path.Back());
+		path.Push(sibling);
+		Modify(path, path.GetSize() - 1, MakeColorModification(isParentRed));
+		ModifyChild(path, !isLeft, MakeColorModification(false));
+		path.Pop();
+		Modify(path, path.GetSize() - 1, MakeColorModification(false));
+		Rotate(path, isLeft);
+		SetRootBlack();
+		return;
+	}
+
+	if (path.IsEmpty())
+	{
+		SetRootBlack();
+	}
+	else if (fixNode)
+	{
+		ModifyChild(path, isLeft, MakeColorModification(false));
+	}
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+typename pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::Version& pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::GetVersionInfo(int version)
+{
+	assert(version >= m_OldestVersion && version - m_HistoryBase < static_cast<int>(m_History.size()));
+	return m_History[version - m_HistoryBase];
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+const typename pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::Version& pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::GetVersionInfo(int version) const
+{
+	assert(version >= m_OldestVersion && version - m_HistoryBase < static_cast<int>(m_History.size()));
+	return m_History[version - m_HistoryBase];
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>::StartVersion()
+{
+	// Rollback truncates history, so new version is always appended
+	const Version previous = GetVersionInfo(m_CurrentVersion);
+	assert(static_cast<int>(m_History.size()) == m_CurrentVersion - m_HistoryBase + 1);
+	m_History.push_back(Version{ previous.m_Root, previous.m_Size, m_UndoLogBase + m_UndoLog.size() });
+	m_CurrentVersion++;
+}
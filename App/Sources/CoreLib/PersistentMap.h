@@ -1,122 +1,691 @@
 #pragma once
 
+#include "BinaryStream.h"
+#include "EpochDomain.h"
+#include "FixedStack.h"
+#include "KeyTraits.h"
+#include "NodePool.h"
+#include "NodePtr.h"
+#include "ParallelSort.h"
+
+#include <atomic>
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <iterator>
 #include <memory>
-#include <tuple>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+/// Define as 1 to count work done by PersistentMap operations, see PersistentMapStats. When it is 0 counting is compiled out
+#ifndef PST_PERSISTENT_MAP_STATS
+	#define PST_PERSISTENT_MAP_STATS 0
+#endif
+
 namespace pst
 {
 	class PersistentMapTest;
 
-	template <typename TKey, typename TValue>
-	class PersistentMapNode
+	template <typename TKey, typename TValue, typename TKeyTraits>
+	class PersistentMapImage;
+
+	/// Key prefix cached in node. Empty base when key traits don't define prefix, so node doesn't grow
+	template <typename TPrefix>
+	class PersistentMapKeyPrefix
 	{
 	public:
-		PersistentMapNode(const TKey& key, int currentVersion);
+		explicit PersistentMapKeyPrefix(TPrefix prefix) : m_KeyPrefix(prefix) {}
 
-		PersistentMapNode(const PersistentMapNode<TKey, TValue>& other, int currentVersion);
+		TPrefix GetKeyPrefix() const { return m_KeyPrefix; }
 
-		std::shared_ptr<PersistentMapNode> Clone(int currentVersion) const;
+	private:
+		TPrefix m_KeyPrefix;
+	};
+
+	template <>
+	class PersistentMapKeyPrefix<NoKeyPrefix>
+	{
+	public:
+		explicit PersistentMapKeyPrefix(NoKeyPrefix) {}
+
+		NoKeyPrefix GetKeyPrefix() const { return NoKeyPrefix(); }
+	};
+
+	/// Node is reference counted intrusively and returns its memory to TNodePool when last NodePtr is gone.
+	/// Key and children go first, so a descent reads one cache line of the node. Small value fills the gap before 32-bit fields, color is the top bit of size
+	template <typename TKey, typename TValue, typename TNodePool = NodePool, typename TKeyTraits = KeyTraits<TKey>>
+	class PersistentMapNode : public PersistentMapKeyPrefix<typename TKeyTraits::Prefix>
+	{
+	public:
+		PersistentMapNode(TKey key, int currentVersion);
+
+		PersistentMapNode(const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>& other, int currentVersion);
+
+		PersistentMapNode& operator=(const PersistentMapNode&) = delete;
+
+		void AddRef() const { m_RefCount++; }
+
+		/// Returns true if it was the last reference
+		bool ReleaseRef() const
+		{
+			assert(m_RefCount > 0);
+			return --m_RefCount == 0;
+		}
+
+		/// Destroys node and returns its memory to the pool
+		static void Destroy(PersistentMapNode* node);
 
 		void SetIsRed([[maybe_unused]] int currentVersion, bool red)
 		{
 			// TODO: Extend version check to changing other node's data and to track duplicate clones calls
 			assert(m_CreateVersion == currentVersion);
-			m_Red = red;
+			m_SizeAndColor = red ? (m_SizeAndColor | RedBit) : (m_SizeAndColor & ~RedBit);
+		}
+
+		bool IsRed() const { return (m_SizeAndColor & RedBit) != 0; }
+
+		/// True if node is referenced by more than one NodePtr
+		bool IsShared() const { return m_RefCount > 1; }
+
+		void SetSize([[maybe_unused]] int currentVersion, int size)
+		{
+			assert(m_CreateVersion == currentVersion);
+			assert(size >= 0);
+			m_SizeAndColor = (m_SizeAndColor & RedBit) | static_cast<std::uint32_t>(size);
 		}
 
-		bool IsRed() const { return m_Red; }
+		/// Number of nodes in subtree including this node
+		int GetSize() const { return static_cast<int>(m_SizeAndColor & ~RedBit); }
+
+		/// Version of data which created this node
+		int GetCreateVersion() const { return m_CreateVersion; }
 
 		const TKey m_Key;
+		NodePtr<PersistentMapNode> m_Left;
+		NodePtr<PersistentMapNode> m_Right;
 		TValue m_Value;
-		std::shared_ptr<PersistentMapNode> m_Left;
-		std::shared_ptr<PersistentMapNode> m_Right;
 
 	private:
+		/// Sizes are non-negative ints, so their top bit is free
+		static constexpr std::uint32_t RedBit = 0x80000000u;
+
+		mutable std::uint32_t m_RefCount;
 		const int m_CreateVersion;
-		bool m_Red;
+		std::uint32_t m_SizeAndColor;
+	};
+
+	/// Counters of work done by the writer since the map has been created or since ResetStats. All of them stay 0 unless PST_PERSISTENT_MAP_STATS is 1
+	struct PersistentMapStats
+	{
+		/// Calls of Insert and Delete, including ones which find the key present or absent
+		std::uint64_t m_Inserts = 0;
+		std::uint64_t m_Deletes = 0;
+
+		/// Nodes copied from older versions, split by the code which has copied them. Node which is of current version already is changed in place and not counted.
+		/// Path copy is descent of Insert and Delete. Fixups count their clones wherever they run, other clones are made by Union, Difference and their joins
+		std::uint64_t m_PathCopyClones = 0;
+		std::uint64_t m_InsertFixupClones = 0;
+		std::uint64_t m_DeleteFixupClones = 0;
+		std::uint64_t m_OtherClones = 0;
+
+		std::uint64_t m_Rotations = 0;
+
+		/// Descents from a root: inserts, deletes, lookups of the map itself (not of its snapshots) and splits of bulk operations
+		std::uint64_t m_Walks = 0;
+		std::uint64_t m_BuildPathCalls = 0;
+
+		/// Three-way key comparisons made by the walks and by BulkLoad
+		std::uint64_t m_Comparisons = 0;
+	};
+
+	/// Memory of one retained version. Bytes are node blocks plus heap memory owned by their keys, see GetHeapSize of key traits
+	struct PersistentMapVersionMemory
+	{
+		/// Whole tree of the version, one node per key
+		std::size_t m_Nodes = 0;
+		std::size_t m_Bytes = 0;
+
+		/// Nodes created by the version. The rest of its tree is shared with the previous version
+		std::size_t m_UniqueNodes = 0;
+		std::size_t m_UniqueBytes = 0;
+	};
+
+	/// Memory of a set of versions. Node shared by several of them is counted once
+	struct PersistentMapMemory
+	{
+		std::size_t m_Nodes = 0;
+		std::size_t m_Bytes = 0;
 	};
 
-	template <typename TKey, typename TValue>
+	/// TNodePool is an allocator of node memory with Allocate(size), GetAllocatedBlocks() and static Free(block, size) methods. See NodePool.h.
+	/// Map is changed by single writer thread. Complete versions are published to snapshots which can be read by any number of threads without locks.
+	template <typename TKey, typename TValue, typename TNodePool = NodePool, typename TKeyTraits = KeyTraits<TKey>>
 	class PersistentMap
 	{
 		// TODO: Not cool but for proper testing without friend class more comprehensive API is needed
 		friend class PersistentMapTest;
+
+		/// Image writer walks nodes of retained versions the same way Save does
+		template <typename, typename, typename>
+		friend class PersistentMapImage;
+
+		/// Height of RB-tree is at most 2 * log2(n + 1), so this covers any tree with int-sized number of nodes
+		static constexpr int MaxHeight = 64;
+
+		static_assert(!std::is_same_v<TNodePool, NodePool> || alignof(PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>) <= NodePool::Granularity,
+			"Node pool blocks are not aligned enough for the node");
+
 	public:
+		/// Type accepted by lookups, e.g. std::string_view for std::string keys. See KeyTraits.h
+		using LookupKey = typename TKeyTraits::LookupKey;
+
+		/// Forward iterator over nodes of one version in ascending order of keys.
+		/// Nodes have no parent links, so iterator keeps ancestors which are not visited yet on a fixed-size stack and never allocates
+		class ConstIterator
+		{
+		public:
+			using iterator_category = std::forward_iterator_tag;
+			using value_type = PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>;
+			using difference_type = std::ptrdiff_t;
+			using pointer = const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>*;
+			using reference = const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>&;
+
+			/// Creates end iterator
+			ConstIterator() = default;
+
+			reference operator*() const { return *m_Stack.Back(); }
+			pointer operator->() const { return m_Stack.Back(); }
+
+			ConstIterator& operator++();
+			ConstIterator operator++(int);
+
+			bool operator==(const ConstIterator& other) const;
+			bool operator!=(const ConstIterator& other) const { return !(*this == other); }
+
+		private:
+			friend class PersistentMap;
+
+			/// Pushes node and its left spine, so the smallest node of the subtree is on top
+			void PushLeftSpine(const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node);
+
+			/// Current node is on top, the rest are ancestors whose left subtree is being visited. Stack of end iterator is empty
+			FixedStack<const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>*, MaxHeight> m_Stack;
+		};
+
+		/// Read-only view of published version. Valid while ReadGuard it has been taken with is alive.
+		/// Never touches reference counters, so it can be used by any thread concurrently with the writer.
+		class Snapshot
+		{
+		public:
+			const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* Search(const LookupKey& key) const;
+			const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* GetMin() const;
+			const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* GetMax() const;
+			int GetSize() const;
+			int GetRank(const LookupKey& key) const;
+			const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* GetByRank(int rank) const;
+
+			template <typename TVisitor>
+			void VisitByRank(int firstRank, int count, TVisitor&& visitor) const;
+
+			ConstIterator begin() const;
+			ConstIterator end() const;
+			ConstIterator LowerBound(const LookupKey& key) const;
+			ConstIterator UpperBound(const LookupKey& key) const;
+
+			template <typename TVisitor>
+			void ForEachInRange(const LookupKey& from, const LookupKey& to, TVisitor&& visitor) const;
+
+			int GetVersion() const { return m_Version; }
+
+			/// Number of publications before this one. Maps which are always published together have equal numbers for matching snapshots
+			std::uint64_t GetPublishCount() const { return m_PublishCount; }
+
+		private:
+			friend class PersistentMap;
+
+			Snapshot(const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* root, int version, std::uint64_t publishCount);
+
+			const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* m_Root;
+			int m_Version;
+			std::uint64_t m_PublishCount;
+		};
+
 		PersistentMap();
 
-		void Rollback(int delta);
+		/// Map which shares epoch domain with other maps lets reader protect all of them with single ReadGuard. Domain should outlive the map
+		explicit PersistentMap(EpochDomain& epochDomain);
+
+		~PersistentMap();
+
+		PersistentMap(const PersistentMap&) = delete;
+		PersistentMap& operator=(const PersistentMap&) = delete;
+
+		/// Makes current version visible to snapshots. Commit, Rollback and every change publish previous work themselves,
+		/// so explicit call is needed only to publish the last change made outside of batch, as its value is assigned after Insert returns.
+		void Publish();
+
+		/// Returns published version. Guard should be taken from GetEpochDomain()
+		Snapshot GetSnapshot(const EpochDomain::ReadGuard& guard) const;
+
+		/// Returns read-only view of retained version for the writer thread. It is valid until the version is dropped or overwritten after rollback
+		Snapshot View(int version) const;
+
+		EpochDomain& GetEpochDomain() const;
+
+		/// Moves current version delta steps back. Returns false and changes nothing if that version has been dropped already
+		bool Rollback(int delta);
 		int GetVersion() const;
 
+		/// Oldest version which can still be reached by Rollback
+		int GetOldestVersion() const;
+
+		/// Drops all versions older than specified one (current version is never dropped). Nodes which are not shared
+		/// with retained versions are reclaimed incrementally by following mutations or by Reclaim. Version numbers of retained versions don't change.
+		void DropVersionsBefore(int version);
+
+		/// Destroys up to maxNodes nodes released by dropped or overwritten versions. Returns number of freed node bytes
+		std::size_t Reclaim(std::size_t maxNodes);
+
+		/// Destroys all released nodes. Returns number of freed node bytes
+		std::size_t ReclaimAll();
+
+		/// Number of released subtrees and nodes waiting for reclamation. Unpublished roots which readers may still use are not counted
+		std::size_t GetPendingReclaimCount() const;
+
+		/// Starts new version of data. All Insert and Delete calls until Commit change this version instead of creating new ones.
+		/// Nodes which are already cloned by this version are changed in place.
+		void BeginBatch();
+		void Commit();
+		bool IsInBatch() const;
+
 		// TODO: Return wrapper over key and value, not the node itself
-		/// Creates new node with specified key. If node already created - returns pointer to it. Creates new version of data.
-		PersistentMapNode<TKey, TValue>* Insert(const TKey& key);
-		void Delete(const TKey& key);
+		/// Creates new node with specified key. If node already created - returns pointer to it. Creates new version of data unless batch is started.
+		PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* Insert(const LookupKey& key);
+
+		/// Deletes node with specified key. Creates new version of data if node exists and batch is not started.
+		void Delete(const LookupKey& key);
+
+		/// Creates new version which holds exactly entries of the range, older versions are kept. Entries are pairs of key and value in strictly ascending order of keys.
+		/// Builds perfectly balanced tree in O(n) with no fixups or intermediate versions, so n nodes are allocated instead of O(n log n) ones.
+		/// Returns false and changes nothing if keys are not strictly ascending. Should not be called inside batch
+		template <typename TForwardIterator>
+		bool BulkLoad(TForwardIterator first, TForwardIterator last);
+
+		/// Inserts or updates entries of sorted range as single change, like BulkLoad does for empty map. Entries are pairs of key and value or nodes of other map
+		/// in strictly ascending order of keys. They are built into balanced tree which is merged by join-based union in O(m log(n / m + 1)) for m entries,
+		/// and subtrees of the map which no entry falls into are shared as is. Returns false and changes nothing if keys are not strictly ascending
+		template <typename TForwardIterator>
+		bool Union(TForwardIterator first, TForwardIterator last);
+
+		/// Inserts or updates all entries of current version of other map. Nodes belong to the pool of their map, so entries are copied in O(m) and merged as by Union of range
+		void Union(const PersistentMap& other);
+
+		/// Deletes every key of current version of other map in O(m log(n / m + 1)) as single change. Nodes of other map are only read
+		void Difference(const PersistentMap& other);
 
-		const PersistentMapNode<TKey, TValue>* Search(const TKey& key) const;
-		const PersistentMapNode<TKey, TValue>* GetMin() const;
-		const PersistentMapNode<TKey, TValue>* GetMax() const;
+		/// BulkLoad of entries in any order. Entries are sorted by threadCount threads first. The last of entries with equal keys wins, as it would for Insert calls
+		bool BulkLoadUnsorted(std::vector<std::pair<TKey, TValue>> entries, unsigned threadCount = std::thread::hardware_concurrency());
+
+		const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* Search(const LookupKey& key) const;
+
+		/// Searches in specified version without changing current one. Returns nullptr if version has been dropped or is newer than current one
+		const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* Search(const LookupKey& key, int version) const;
+
+		const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* GetMin() const;
+		const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* GetMax() const;
+
+		/// Returns number of keys in current version
+		int GetSize() const;
+
+		/// Returns number of keys which are less than specified key. Key doesn't have to exist
+		int GetRank(const LookupKey& key) const;
+
+		/// Returns node with specified 0-based rank (in ascending order of keys) or nullptr if rank is out of range
+		const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* GetByRank(int rank) const;
+
+		/// Calls visitor for up to count nodes in ascending order starting from node with specified rank. Takes O(log n + count)
+		template <typename TVisitor>
+		void VisitByRank(int firstRank, int count, TVisitor&& visitor) const;
+
+		/// Iterators over current version. They are invalidated by any change
+		ConstIterator begin() const;
+		ConstIterator end() const;
+
+		/// Returns iterator to the first node whose key is not less than specified key. Takes O(log n)
+		ConstIterator LowerBound(const LookupKey& key) const;
+
+		/// Returns iterator to the first node whose key is greater than specified key. Takes O(log n)
+		ConstIterator UpperBound(const LookupKey& key) const;
+
+		/// Calls visitor for every node with key in [from, to) in ascending order. Takes O(log n + count)
+		template <typename TVisitor>
+		void ForEachInRange(const LookupKey& from, const LookupKey& to, TVisitor&& visitor) const;
+
+		/// Calls visitor(fromNode, toNode) in ascending order of keys for every key which differs between two versions:
+		/// fromNode is nullptr for added key, toNode is nullptr for removed key, both are set for key with changed value.
+		/// Subtrees shared by versions are skipped without visiting, so it takes O(changes * log n). Returns false if any version is not retained.
+		template <typename TVisitor>
+		bool Diff(int fromVersion, int toVersion, TVisitor&& visitor) const;
+
+		/// Returns memory of retained version or false if it is not retained. Complete versions never change, so the result is cached. The first query of
+		/// a version visits only nodes created by it and, for keys which own heap memory, nodes of the previous version which it has replaced
+		bool GetVersionMemory(int version, PersistentMapVersionMemory& memory) const;
+
+		/// Returns memory needed to keep versions [fromVersion; toVersion] or false if any of them is not retained. Takes O(toVersion - fromVersion)
+		/// once versions are cached. Dropping versions before X frees GetRetainedMemory(oldest, current) - GetRetainedMemory(X, current)
+		bool GetRetainedMemory(int fromVersion, int toVersion, PersistentMapMemory& memory) const;
+
+		/// Returns all nodes allocated by the map: retained versions, roots which readers may still use and released nodes waiting for reclamation.
+		/// Heap memory of keys is known for retained versions only
+		PersistentMapMemory GetLiveMemory() const;
+
+		/// Returns counters of work done so far. See PersistentMapStats
+		PersistentMapStats GetStats() const;
+		void ResetStats();
+
+		/// Writes versions [fromVersion; current] in binary form. Node shared by several versions is written once, children before parents,
+		/// so output size and time are proportional to unique nodes, not versions * size. Returns false if version is not retained or stream has failed
+		template <typename TCodec = BinaryMapCodec<TKey, TValue>>
+		bool Save(BinaryWriter& writer, int fromVersion, const TCodec& codec = TCodec()) const;
+
+		/// Restores versions written by Save into map which has no data and history yet. Version numbers and sharing of nodes between versions
+		/// are restored, so loaded map takes as much node memory as the saved one. Takes O(unique nodes).
+		/// Every node is checked to form valid RB-tree, so malformed input can't break the map. Returns false and keeps map empty if input is malformed
+		template <typename TCodec = BinaryMapCodec<TKey, TValue>>
+		bool Load(BinaryReader& reader, const TCodec& codec = TCodec());
+
+		static constexpr bool IsStatsEnabled = PST_PERSISTENT_MAP_STATS != 0;
 
 	private:
-		const PersistentMapNode<TKey, TValue>* Search(const PersistentMapNode<TKey, TValue>* node, const TKey& key) const;
-		PersistentMapNode<TKey, TValue>* Search(PersistentMapNode<TKey, TValue>* node, const TKey& key);
-		const PersistentMapNode<TKey, TValue>* GetMin(const PersistentMapNode<TKey, TValue>* node) const;
-		PersistentMapNode<TKey, TValue>* GetMin(PersistentMapNode<TKey, TValue>* node);
-		const PersistentMapNode<TKey, TValue>* GetMax(const PersistentMapNode<TKey, TValue>* node) const;
-		PersistentMapNode<TKey, TValue>* GetMax(PersistentMapNode<TKey, TValue>* node);
+		/// "PSTM" in little-endian order
+		static constexpr std::uint32_t SerializationMagic = 0x4D545350;
+		static constexpr std::uint64_t SerializationFormat = 1;
+
+		/// Loader doesn't trust node count of the input for reservation, larger inputs grow the buffer as they are read
+		static constexpr std::size_t MaxLoadReservation = 1 << 20;
+
+		/// Number of released nodes which every Insert and Delete reclaims. Mutation creates at most this many nodes, so reclamation keeps up with writes
+		static constexpr std::size_t ReclaimStepSize = MaxHeight;
+
+		/// Readers' pinned epochs are checked once this many unpublished roots are waiting, so the scan is shared by many publications
+		static constexpr std::size_t UnpublishedRootsScanSize = 16;
+
+		/// Ancestors of a node from nullptr (parent of root) to node's parent. Fixup rotations can push few more nodes
+		using Path = FixedStack<PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>*, MaxHeight + 4>;
+
+		using KeyPrefix = typename TKeyTraits::Prefix;
+
+		static int GetSize(const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node);
+
+		/// Single three-way comparison of looked up key with node's key. Cached prefixes are compared first, so key memory is touched only on prefix tie
+		static int CompareKeys(const LookupKey& key, const KeyPrefix& keyPrefix, const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node);
+
+		// Queries over subtree are static, so they are shared by the map and its snapshots
+		static const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* SearchInSubtree(const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node, const LookupKey& key);
+		PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* SearchInSubtree(PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node, const LookupKey& key);
+		static const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* GetMin(const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node);
+		PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* GetMin(PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node);
+		static const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* GetMax(const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node);
+		PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* GetMax(PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node);
+		static int GetRank(const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* root, const LookupKey& key);
+		static const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* GetByRank(const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* root, int rank);
+
+		template <typename TVisitor>
+		static void VisitByRank(const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* root, int firstRank, int count, TVisitor&& visitor);
+
+		static ConstIterator BeginOfSubtree(const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* root);
+		static ConstIterator LowerBoundInSubtree(const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* root, const LookupKey& key);
+		static ConstIterator UpperBoundInSubtree(const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* root, const LookupKey& key);
+
+		template <typename TVisitor>
+		static void ForEachInRangeOfSubtree(const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* root, const LookupKey& from, const LookupKey& to, TVisitor&& visitor);
+
+		/// In-order position inside a tree used by Diff. Item is either whole subtree which is not walked yet or single node whose left subtree is walked already
+		struct DiffItem
+		{
+			const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* m_Node;
+			bool m_IsSubtree;
+		};
+
+		/// Expanding a subtree replaces it with its left subtree, node itself and right subtree, so stack grows by at most two items per level
+		using DiffStack = FixedStack<DiffItem, 2 * MaxHeight + 1>;
+
+		/// Replaces subtree item on top of the stack with its parts in in-order
+		static void ExpandDiffItem(DiffStack& stack);
+
+		/// Subtree which is saved after its children. Children are pushed when the node is met first time
+		struct SaveItem
+		{
+			const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* m_Node;
+			bool m_IsExpanded;
+		};
+
+		/// Node read by Load with what is needed to check its parent: smallest and largest keys of the subtree and number of black nodes on every path down
+		struct LoadedNode
+		{
+			NodePtr<PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> m_Node;
+			const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* m_Min;
+			const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* m_Max;
+			int m_BlackHeight;
+		};
+
+		/// Appends nodes of subtree which are not in nodeIndices yet to nodes in post-order. Subtree which has been added already is skipped as a whole
+		static void CollectNodes(const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* root,
+			std::unordered_map<const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>*, std::size_t>& nodeIndices, std::vector<const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>*>& nodes);
+
+		/// Reads node which can refer to already loaded nodes only. Returns false if it can't be a node of RB-tree
+		template <typename TCodec>
+		bool LoadNode(BinaryReader& reader, const TCodec& codec, int currentVersion, std::vector<LoadedNode>& nodes);
+
+		/// Entries of bulk operations are pairs of key and value or nodes of other map
+		template <typename TEntry>
+		static decltype(auto) GetEntryKey(const TEntry& entry) { return (entry.first); }
+		static const TKey& GetEntryKey(const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>& node) { return node.m_Key; }
+
+		template <typename TEntry>
+		static decltype(auto) GetEntryValue(TEntry&& entry) { return (std::forward<TEntry>(entry).second); }
+		static const TValue& GetEntryValue(const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>& node) { return node.m_Value; }
+
+		/// Returns depth of the last level of balanced tree of specified size. Levels above it are full, so painting just the last level red keeps black height equal on all paths
+		static int GetBalancedRedDepth(std::int64_t size);
+
+		/// Builds balanced subtree of size entries starting at position and moves position past them. Nodes at redDepth are red, the ones above are black.
+		/// Previous is the last built node, every key should be greater than its one. Returns nullptr if keys are not ascending
+		template <typename TForwardIterator>
+		NodePtr<PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> BuildSubtree(TForwardIterator& position, int size, int depth, int redDepth,
+			const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>*& previous);
+
+		/// Subtree which is split or joined with number of black nodes on every path from its root down, root included.
+		/// Join-based algorithms pass black heights down instead of walking spines, so join of trees of black heights h1 >= h2 takes O(h1 - h2 + 1)
+		struct JoinPart
+		{
+			NodePtr<PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> m_Root;
+			int m_BlackHeight;
+		};
+
+		static int GetBlackHeight(const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* root);
+
+		/// Paints red root black through a clone, so the part can be joined
+		void MakeRootBlack(JoinPart& part);
+
+		/// Splits tree into keys less than key and keys greater than key. Returns node with the key or nullptr, it belongs to neither part.
+		/// Nodes on the search path become join keys of the parts, so they are cloned unless they are of current version already
+		NodePtr<PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> Split(JoinPart tree, const LookupKey& key, const KeyPrefix& keyPrefix, JoinPart& less, JoinPart& greater);
+
+		/// Joins trees with every key of left less than key of middle and every key of right greater than it. Middle node is reused if it is of current version.
+		/// Middle node goes red on the spine of the taller tree where the black height is equal and InsertFixup restores RB-tree properties with usual rotations.
+		/// Uses root link of current version while it works, so the link should be empty
+		JoinPart Join(JoinPart left, NodePtr<PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> middle, JoinPart right);
+
+		/// Joins trees without middle node. The largest node of left takes its place
+		JoinPart Join(JoinPart left, JoinPart right);
+
+		/// Keys of both trees, updates win for equal keys. Takes O(m log(n / m + 1)) for tree of n keys and updates of m keys
+		JoinPart UnionOfSubtrees(JoinPart tree, JoinPart updates);
+
+		/// Keys of tree which are not in removed subtree. Removed subtree is only read, so it can belong to other map
+		JoinPart DifferenceOfSubtrees(JoinPart tree, const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* removed);
 
 		/// Returns parent of minimal node right after specified node
-		PersistentMapNode<TKey, TValue>* GetMinParent(PersistentMapNode<TKey, TValue>* node);
+		PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* GetMinParent(PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node);
 
-		const PersistentMapNode<TKey, TValue>* GetRoot() const;
-		PersistentMapNode<TKey, TValue>* GetRoot();
+		const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* GetRoot() const;
+		PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* GetRoot();
+
+		/// Returns slot of m_RootHistory which keeps root of specified version
+		NodePtr<PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>>& GetRootLink(int version);
+		const NodePtr<PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>>& GetRootLink(int version) const;
+
+		/// Allocates new node of current version from the node pool
+		NodePtr<PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> CreateNode(const LookupKey& key);
+
+		/// Allocates copy of node of current version from the node pool. Node which is of current version already is returned as is.
+		NodePtr<PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> CloneNode(PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node);
+
+		/// Creates new version which shares whole tree with previous one
+		void StartVersion();
 
 		/// Resets root for current version
 		void ClearCurrentVersion();
 
-		/// Clones previous version of [root; toKey)-nodes and inserts it into current version root.
-		/// Node with m_Key == toKey is not cloned if it exists.
-		/// Returns current version of toKey's parent node.
-		PersistentMapNode<TKey, TValue>* ClonePath(const TKey& toKey);
-
-		/// Clones [from; toKey)-nodes.
-		/// Node with m_Key == toKey is not cloned if it exists.
-		/// Returns current version of from and toKey's parent node.
-		std::tuple<std::shared_ptr<PersistentMapNode<TKey, TValue>>, PersistentMapNode<TKey, TValue>*> ClonePath(const PersistentMapNode<TKey, TValue>* from, const TKey& toKey) const;
+		/// Queues subtree for reclamation instead of destroying it inline
+		void Retire(NodePtr<PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>>& node);
 
 		/// Detaches target from targetParent and makes source child of targetParent. 
 		/// TargetParent should be of current version.
 		/// Source can be either of old version or of current version. It is responsibility of caller to clone it if necessary
-		void Transplant(const PersistentMapNode<TKey, TValue>* target, PersistentMapNode<TKey, TValue>* targetParent, std::shared_ptr<PersistentMapNode<TKey, TValue>> source);
+		void Transplant(const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* target, PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* targetParent, NodePtr<PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> source);
 
 		/// Rotates subtree to left
 		/// Target and one of it's child will NOT be cloned. It is responsibility of caller to clone it if necessary
 		/// TargetParent should be of current version.
-		void LeftRotate(PersistentMapNode<TKey, TValue>* target, PersistentMapNode<TKey, TValue>* targetParent);
+		void LeftRotate(PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* target, PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* targetParent);
 
 		/// Rotates subtree to right
 		/// Target and one of it's child will NOT be cloned. It is responsibility of caller to clone it if necessary
 		/// TargetParent should be of current version.
-		void RightRotate(PersistentMapNode<TKey, TValue>* target, PersistentMapNode<TKey, TValue>* targetParent);
+		void RightRotate(PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* target, PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* targetParent);
 
-		/// Finds target node in parent and returns shared_ptr which is stored in parent
-		std::shared_ptr<PersistentMapNode<TKey, TValue>> GetSharedPtr(PersistentMapNode<TKey, TValue>* target, PersistentMapNode<TKey, TValue>* targetParent);
+		/// Finds target node in parent and returns NodePtr which is stored in parent
+		NodePtr<PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> GetNodePtr(PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* target, PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* targetParent);
 
 		/// Restores RB-tree properties after inserting node.
-		void InsertFixup(PersistentMapNode<TKey, TValue>* fixNode);
+		/// Parents are ancestors of fixNode collected during descent. They are of current version and are changed by fixup.
+		/// Returns true if root has been red and is painted black, so black height of the tree has grown.
+		bool InsertFixup(PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* fixNode, Path& parents);
 
 		/// Restores RB-tree properties after deleting node.
-		void DeleteFixup(PersistentMapNode<TKey, TValue>* fixNode, PersistentMapNode<TKey, TValue>* parentForNullNode);
+		/// FixNode can be nullptr, parents.Back() is its parent. Parents are of current version and are changed by fixup.
+		void DeleteFixup(PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* fixNode, Path& parents);
+
+		/// Returns path [root; toNode) as a vector where root is located at 0 element and toNode's parent at last element. Uses current version.
+		/// Allocates, so it is used only for inspecting tree in tests
+		std::vector<const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>*> BuildPath(const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* toNode) const;
+
+		/// Part of version memory which is computed once per version, see GetVersionMemory
+		struct VersionMemoryRecord
+		{
+			std::size_t m_UniqueNodes = 0;
+			std::size_t m_UniqueBytes = 0;
+
+			/// Heap memory of all keys of the tree. It is computed from the previous version, so it is known only after a query which needed it
+			std::size_t m_KeyHeapBytes = 0;
+			bool m_IsKeyHeapKnown = false;
+		};
+
+		/// Trivially copyable key can't own heap memory, so trees of such keys are never walked for it
+		static constexpr bool IsKeyOnHeap = !std::is_trivially_copyable_v<TKey>;
 
-		/// Returns path [root; toNode) as a vector where root is located at 0 element and toNode's parent at last element. Uses current version
-		std::vector<PersistentMapNode<TKey, TValue>*> BuildPath(PersistentMapNode<TKey, TValue>* toNode);
+		static std::size_t GetKeyHeapSize(const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node);
 
-		/// Returns path [root; toNode) as a vector where root is located at 0 element and toNode's parent at last element. Uses current version
-		std::vector<const PersistentMapNode<TKey, TValue>*> BuildPath(const PersistentMapNode<TKey, TValue>* toNode) const;
+		/// Nodes of the version can be changed only while it is built by batch
+		bool IsVersionComplete(int version) const;
 
-		std::vector<std::shared_ptr<PersistentMapNode<TKey, TValue>>> m_RootHistory;
+		/// Counts nodes created by the version. Every child of such node is either created by the version as well or shared with the previous one
+		VersionMemoryRecord GetVersionMemoryRecord(int version) const;
+
+		/// Returns heap memory of keys of the whole tree. It is the nearest known older version plus keys created minus keys replaced by every following version
+		std::size_t GetTreeKeyHeapBytes(int version) const;
+
+		/// Returns heap memory of keys of the previous version which the version doesn't have anymore
+		std::size_t GetReplacedKeyHeapBytes(int version) const;
+
+		/// Attributes clones and comparisons made while it exists to stats of the map. Scopes nest, so fixup inside Insert counts its own clones,
+		/// comparisons are added by the outermost scope. Scope without clone counter keeps the outer one. Does nothing when stats are disabled
+		class StatsScope
+		{
+		public:
+			StatsScope(const PersistentMap& map, std::uint64_t PersistentMapStats::* cloneCounter);
+			~StatsScope();
+
+			StatsScope(const StatsScope&) = delete;
+			StatsScope& operator=(const StatsScope&) = delete;
+
+		private:
+			const PersistentMap& m_Map;
+			std::uint64_t PersistentMapStats::* m_OuterCloneCounter;
+			std::uint64_t m_StartComparisons;
+		};
+
+		void CountStat(std::uint64_t PersistentMapStats::* counter) const
+		{
+			if constexpr (IsStatsEnabled)
+			{
+				(m_Stats.*counter)++;
+			}
+		}
+
+		/// Comparisons are made by static helpers shared with snapshots, so they are counted per thread and scopes take the difference
+		static inline thread_local std::uint64_t s_Comparisons = 0;
+
+		/// Root made visible to snapshots. Keeps its tree alive, so published version can be dropped from history while readers use it
+		struct PublishedRoot
+		{
+			NodePtr<PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> m_Root;
+			int m_Version;
+			std::uint64_t m_PublishCount;
+		};
+
+		/// Epoch domain is either owned by the map or shared with other maps
+		PersistentMap(std::unique_ptr<EpochDomain> ownEpochDomain, EpochDomain* epochDomain);
+
+		/// Moves unpublished roots which no reader can see anymore to reclamation. Scans readers only if force is set or enough roots are waiting
+		void ReclaimUnpublishedRoots(bool force);
+
+		// Pool should be declared before any node owner so it is destroyed last. Kept by pointer so nodes never see it move
+		std::unique_ptr<TNodePool> m_NodePool;
+		/// Root of version m_HistoryBase + i is kept at index i. Dropped versions are compacted lazily, so history prefix before m_OldestVersion is empty
+		std::vector<NodePtr<PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>>> m_RootHistory;
+		int m_HistoryBase;
+		int m_OldestVersion;
 		int m_CurrentVersion;
+		bool m_InBatch;
+
+		/// Released subtrees. Used as a stack, so it holds at most few nodes per tree level while subtree is walked
+		std::vector<NodePtr<PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>>> m_RetiredNodes;
+
+		std::unique_ptr<EpochDomain> m_OwnEpochDomain;
+		EpochDomain* m_EpochDomain;
+		std::atomic<PublishedRoot*> m_PublishedRoot;
+		std::uint64_t m_PublishCount;
+		bool m_IsCurrentPublished;
+
+		/// Replaced published roots with epoch of replacement, oldest first. Reader which pinned that epoch or earlier may still use them
+		std::deque<std::pair<std::uint64_t, PublishedRoot*>> m_UnpublishedRoots;
+
+		/// Records of complete retained versions, filled by memory queries of the writer. Slot of version is cleared when its number is reused after rollback
+		mutable std::unordered_map<int, VersionMemoryRecord> m_VersionMemory;
+
+		/// Queries of the writer are counted too, so stats are changed by const methods
+		mutable PersistentMapStats m_Stats;
+
+		/// Counter of clones of the innermost StatsScope, nullptr outside of scopes
+		mutable std::uint64_t PersistentMapStats::* m_CloneCounter;
+		mutable int m_StatsScopeDepth;
 	};
 }
 
@@ -2,339 +2,1980 @@
 
 #include "PersistentMap.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cstdlib>
 #include <iterator>
+#include <limits>
 #include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>::PersistentMapNode(TKey key, int currentVersion)
+	: PersistentMapKeyPrefix<typename TKeyTraits::Prefix>(TKeyTraits::GetPrefix(key))
+	, m_Key(std::move(key))
+	, m_Left(nullptr)
+	, m_Right(nullptr)
+	, m_Value(TValue())
+	, m_RefCount(0)
+	, m_CreateVersion(currentVersion)
+	, m_SizeAndColor(1)
+{
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>::PersistentMapNode(const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>& other, int currentVersion)
+	: PersistentMapKeyPrefix<typename TKeyTraits::Prefix>(other)
+	, m_Key(other.m_Key)
+	, m_Left(other.m_Left)
+	, m_Right(other.m_Right)
+	, m_Value(other.m_Value)
+	, m_RefCount(0)
+	, m_CreateVersion(currentVersion)
+	, m_SizeAndColor(other.m_SizeAndColor)
+{
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>::Destroy(PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node)
+{
+	node->~PersistentMapNode();
+	TNodePool::Free(node, sizeof(PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>));
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+typename pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::ConstIterator& pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::ConstIterator::operator++()
+{
+	const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node = m_Stack.Back();
+	m_Stack.Pop();
+	PushLeftSpine(node->m_Right.Get());
+	return *this;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+typename pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::ConstIterator pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::ConstIterator::operator++(int)
+{
+	ConstIterator previous = *this;
+	++*this;
+	return previous;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+bool pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::ConstIterator::operator==(const ConstIterator& other) const
+{
+	// Current node identifies position as every node is visited once
+	if (m_Stack.IsEmpty() || other.m_Stack.IsEmpty())
+	{
+		return m_Stack.IsEmpty() == other.m_Stack.IsEmpty();
+	}
+
+	return m_Stack.Back() == other.m_Stack.Back();
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::ConstIterator::PushLeftSpine(const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node)
+{
+	for (; node; node = node->m_Left.Get())
+	{
+		m_Stack.Push(node);
+	}
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Snapshot::Snapshot(const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* root, int version, std::uint64_t publishCount)
+	: m_Root(root)
+	, m_Version(version)
+	, m_PublishCount(publishCount)
+{
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Snapshot::Search(const LookupKey& key) const
+{
+	return PersistentMap::SearchInSubtree(m_Root, key);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Snapshot::GetMin() const
+{
+	return m_Root ? PersistentMap::GetMin(m_Root) : nullptr;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Snapshot::GetMax() const
+{
+	return m_Root ? PersistentMap::GetMax(m_Root) : nullptr;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+int pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Snapshot::GetSize() const
+{
+	return PersistentMap::GetSize(m_Root);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+int pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Snapshot::GetRank(const LookupKey& key) const
+{
+	return PersistentMap::GetRank(m_Root, key);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Snapshot::GetByRank(int rank) const
+{
+	return PersistentMap::GetByRank(m_Root, rank);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+template<typename TVisitor>
+void pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Snapshot::VisitByRank(int firstRank, int count, TVisitor&& visitor) const
+{
+	PersistentMap::VisitByRank(m_Root, firstRank, count, std::forward<TVisitor>(visitor));
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+typename pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::ConstIterator pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Snapshot::begin() const
+{
+	return PersistentMap::BeginOfSubtree(m_Root);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+typename pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::ConstIterator pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Snapshot::end() const
+{
+	return ConstIterator();
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+typename pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::ConstIterator pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Snapshot::LowerBound(const LookupKey& key) const
+{
+	return PersistentMap::LowerBoundInSubtree(m_Root, key);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+typename pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::ConstIterator pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Snapshot::UpperBound(const LookupKey& key) const
+{
+	return PersistentMap::UpperBoundInSubtree(m_Root, key);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+template<typename TVisitor>
+void pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Snapshot::ForEachInRange(const LookupKey& from, const LookupKey& to, TVisitor&& visitor) const
+{
+	PersistentMap::ForEachInRangeOfSubtree(m_Root, from, to, std::forward<TVisitor>(visitor));
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::PersistentMap()
+	: PersistentMap(std::make_unique<pst::EpochDomain>(), nullptr)
+{
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::PersistentMap(pst::EpochDomain& epochDomain)
+	: PersistentMap(nullptr, &epochDomain)
+{
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::PersistentMap(std::unique_ptr<pst::EpochDomain> ownEpochDomain, pst::EpochDomain* epochDomain)
+	: m_NodePool(std::make_unique<TNodePool>())
+	, m_HistoryBase(0)
+	, m_OldestVersion(0)
+	, m_CurrentVersion(0)
+	, m_InBatch(false)
+	, m_OwnEpochDomain(std::move(ownEpochDomain))
+	, m_EpochDomain(m_OwnEpochDomain ? m_OwnEpochDomain.get() : epochDomain)
+	, m_PublishedRoot(nullptr)
+	, m_PublishCount(0)
+	, m_IsCurrentPublished(false)
+	, m_CloneCounter(nullptr)
+	, m_StatsScopeDepth(0)
+{
+	ClearCurrentVersion();
+	Publish();
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::~PersistentMap()
+{
+	// No reader can use the map anymore, so every root can be released. Destroying roots directly would recurse through the whole tree
+	PublishedRoot* publishedRoot = m_PublishedRoot.load();
+	Retire(publishedRoot->m_Root);
+	delete publishedRoot;
+	for (auto& [epoch, unpublishedRoot] : m_UnpublishedRoots)
+	{
+		Retire(unpublishedRoot->m_Root);
+		delete unpublishedRoot;
+	}
+
+	m_UnpublishedRoots.clear();
+	for (auto& root : m_RootHistory)
+	{
+		Retire(root);
+	}
+
+	ReclaimAll();
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Publish()
+{
+	assert(!m_InBatch);
+	if (m_IsCurrentPublished)
+	{
+		return;
+	}
+
+	// Readers can see the record as soon as it is exchanged, so it is filled before
+	PublishedRoot* publishedRoot = new PublishedRoot{ GetRootLink(m_CurrentVersion), m_CurrentVersion, m_PublishCount++ };
+	PublishedRoot* previousRoot = m_PublishedRoot.exchange(publishedRoot);
+	if (previousRoot)
+	{
+		m_UnpublishedRoots.emplace_back(m_EpochDomain->Advance(), previousRoot);
+	}
+
+	m_IsCurrentPublished = true;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+typename pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Snapshot pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetSnapshot([[maybe_unused]] const pst::EpochDomain::ReadGuard& guard) const
+{
+	assert(&guard.GetDomain() == m_EpochDomain);
+	const PublishedRoot* publishedRoot = m_PublishedRoot.load();
+	return Snapshot(publishedRoot->m_Root.Get(), publishedRoot->m_Version, publishedRoot->m_PublishCount);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+typename pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Snapshot pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::View(int version) const
+{
+	assert(version >= m_OldestVersion && version <= m_CurrentVersion);
+	return Snapshot(GetRootLink(version).Get(), version, 0);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::EpochDomain& pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetEpochDomain() const
+{
+	return *m_EpochDomain;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+bool pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Rollback(int delta)
+{
+	assert(!m_InBatch);
+	assert(delta > 0);
+	if (delta > m_CurrentVersion - m_OldestVersion)
+	{
+		// Version is beyond retention horizon
+		return false;
+	}
+
+	m_CurrentVersion -= delta;
+	m_IsCurrentPublished = false;
+	Publish();
+	return true;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::BeginBatch()
+{
+	assert(!m_InBatch);
+
+	// Previous version stays published while batch is built, so nodes shared with it are never freed by the batch
+	Publish();
+	StartVersion();
+	m_InBatch = true;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Commit()
+{
+	assert(m_InBatch);
+	m_InBatch = false;
+	Publish();
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+bool pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::IsInBatch() const
+{
+	return m_InBatch;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+int pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetVersion() const
+{ 
+	return m_CurrentVersion; 
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+int pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetOldestVersion() const
+{
+	return m_OldestVersion;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+bool pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetVersionMemory(int version, pst::PersistentMapVersionMemory& memory) const
+{
+	if (version < m_OldestVersion || version > m_CurrentVersion)
+	{
+		return false;
+	}
+
+	const VersionMemoryRecord record = GetVersionMemoryRecord(version);
+	memory.m_Nodes = GetSize(GetRootLink(version).Get());
+	memory.m_Bytes = memory.m_Nodes * sizeof(pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>) + GetTreeKeyHeapBytes(version);
+	memory.m_UniqueNodes = record.m_UniqueNodes;
+	memory.m_UniqueBytes = record.m_UniqueBytes;
+	return true;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+bool pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetRetainedMemory(int fromVersion, int toVersion, pst::PersistentMapMemory& memory) const
+{
+	if (fromVersion < m_OldestVersion || fromVersion > toVersion || toVersion > m_CurrentVersion)
+	{
+		return false;
+	}
+
+	// Every node of a version is either created by it or shared with the previous one, so the range is the first tree plus nodes created by the others
+	memory.m_Nodes = GetSize(GetRootLink(fromVersion).Get());
+	memory.m_Bytes = memory.m_Nodes * sizeof(pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>) + GetTreeKeyHeapBytes(fromVersion);
+	for (int version = fromVersion + 1; version <= toVersion; version++)
+	{
+		const VersionMemoryRecord record = GetVersionMemoryRecord(version);
+		memory.m_Nodes += record.m_UniqueNodes;
+		memory.m_Bytes += record.m_UniqueBytes;
+	}
+
+	return true;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::PersistentMapMemory pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetLiveMemory() const
+{
+	pst::PersistentMapMemory memory;
+	[[maybe_unused]] const bool isRetained = GetRetainedMemory(m_OldestVersion, m_CurrentVersion, memory);
+	assert(isRetained);
+
+	// Other allocated nodes belong to released versions only
+	const std::size_t allocatedNodes = m_NodePool->GetAllocatedBlocks();
+	if (allocatedNodes > memory.m_Nodes)
+	{
+		memory.m_Bytes += (allocatedNodes - memory.m_Nodes) * sizeof(pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>);
+		memory.m_Nodes = allocatedNodes;
+	}
+
+	return memory;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+std::size_t pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetKeyHeapSize(const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node)
+{
+	if constexpr (IsKeyOnHeap)
+	{
+		return TKeyTraits::GetHeapSize(node->m_Key);
+	}
+	else
+	{
+		return 0;
+	}
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+bool pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::IsVersionComplete(int version) const
+{
+	return !m_InBatch || version != m_CurrentVersion;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+typename pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::VersionMemoryRecord pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetVersionMemoryRecord(int version) const
+{
+	if (const auto cached = m_VersionMemory.find(version); cached != m_VersionMemory.end())
+	{
+		return cached->second;
+	}
+
+	// Child is never newer than its parent, so nodes created by the version are a subtree at its root
+	VersionMemoryRecord record;
+	pst::FixedStack<const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>*, MaxHeight> stack;
+	if (const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* root = GetRootLink(version).Get(); root && root->GetCreateVersion() == version)
+	{
+		stack.Push(root);
+	}
+
+	while (!stack.IsEmpty())
+	{
+		const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node = stack.Back();
+		stack.Pop();
+		record.m_UniqueNodes++;
+		record.m_UniqueBytes += sizeof(pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>) + GetKeyHeapSize(node);
+		for (const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* child : { node->m_Left.Get(), node->m_Right.Get() })
+		{
+			if (child && child->GetCreateVersion() == version)
+			{
+				stack.Push(child);
+			}
+		}
+	}
+
+	if (IsVersionComplete(version))
+	{
+		m_VersionMemory[version] = record;
+	}
+
+	return record;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+std::size_t pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetTreeKeyHeapBytes(int version) const
+{
+	if constexpr (!IsKeyOnHeap)
+	{
+		return 0;
+	}
+
+	auto isKnown = [this](int knownVersion)
+	{
+		const auto cached = m_VersionMemory.find(knownVersion);
+		return cached != m_VersionMemory.end() && cached->second.m_IsKeyHeapKnown;
+	};
+
+	auto remember = [this](int knownVersion, std::size_t keyHeapBytes)
+	{
+		if (IsVersionComplete(knownVersion))
+		{
+			// Record of complete version is cached by the first query
+			GetVersionMemoryRecord(knownVersion);
+			VersionMemoryRecord& record = m_VersionMemory.at(knownVersion);
+			record.m_KeyHeapBytes = keyHeapBytes;
+			record.m_IsKeyHeapKnown = true;
+		}
+	};
+
+	int knownVersion = version;
+	while (knownVersion > m_OldestVersion && !isKnown(knownVersion))
+	{
+		knownVersion--;
+	}
+
+	std::size_t keyHeapBytes = 0;
+	if (isKnown(knownVersion))
+	{
+		keyHeapBytes = m_VersionMemory.at(knownVersion).m_KeyHeapBytes;
+	}
+	else
+	{
+		// Nothing is known since the oldest version, so its whole tree is walked once
+		pst::FixedStack<const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>*, MaxHeight> stack;
+		if (const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* root = GetRootLink(knownVersion).Get())
+		{
+			stack.Push(root);
+		}
+
+		while (!stack.IsEmpty())
+		{
+			const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node = stack.Back();
+			stack.Pop();
+			keyHeapBytes += GetKeyHeapSize(node);
+			for (const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* child : { node->m_Left.Get(), node->m_Right.Get() })
+			{
+				if (child)
+				{
+					stack.Push(child);
+				}
+			}
+		}
+
+		remember(knownVersion, keyHeapBytes);
+	}
+
+	for (int nextVersion = knownVersion + 1; nextVersion <= version; nextVersion++)
+	{
+		const VersionMemoryRecord record = GetVersionMemoryRecord(nextVersion);
+		keyHeapBytes += record.m_UniqueBytes - record.m_UniqueNodes * sizeof(pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>);
+		keyHeapBytes -= GetReplacedKeyHeapBytes(nextVersion);
+		remember(nextVersion, keyHeapBytes);
+	}
+
+	return keyHeapBytes;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+std::size_t pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetReplacedKeyHeapBytes(int version) const
+{
+	// Subtrees shared with the previous version hang from nodes created by this one, so the previous tree is walked down to them only
+	std::vector<const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>*> sharedRoots;
+	pst::FixedStack<const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>*, MaxHeight> stack;
+	if (const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* root = GetRootLink(version).Get())
+	{
+		stack.Push(root);
+	}
+
+	while (!stack.IsEmpty())
+	{
+		const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node = stack.Back();
+		stack.Pop();
+		if (node->GetCreateVersion() != version)
+		{
+			sharedRoots.push_back(node);
+			continue;
+		}
+
+		for (const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* child : { node->m_Left.Get(), node->m_Right.Get() })
+		{
+			if (child)
+			{
+				stack.Push(child);
+			}
+		}
+	}
+
+	std::sort(sharedRoots.begin(), sharedRoots.end());
+	std::size_t replacedBytes = 0;
+	if (const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* root = GetRootLink(version - 1).Get())
+	{
+		stack.Push(root);
+	}
+
+	while (!stack.IsEmpty())
+	{
+		const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node = stack.Back();
+		stack.Pop();
+		if (std::binary_search(sharedRoots.begin(), sharedRoots.end(), node))
+		{
+			continue;
+		}
+
+		replacedBytes += GetKeyHeapSize(node);
+		for (const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* child : { node->m_Left.Get(), node->m_Right.Get() })
+		{
+			if (child)
+			{
+				stack.Push(child);
+			}
+		}
+	}
+
+	return replacedBytes;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::PersistentMapStats pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetStats() const
+{
+	return m_Stats;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::ResetStats()
+{
+	m_Stats = pst::PersistentMapStats();
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::DropVersionsBefore(int version)
+{
+	version = std::min(version, m_CurrentVersion);
+	if (version <= m_OldestVersion)
+	{
+		return;
+	}
+
+	for (int droppedVersion = m_OldestVersion; droppedVersion < version; droppedVersion++)
+	{
+		Retire(GetRootLink(droppedVersion));
+		m_VersionMemory.erase(droppedVersion);
+	}
+
+	m_OldestVersion = version;
+
+	// Erasing the prefix moves every retained root, so do it only when empty prefix is the larger part. Keeps dropping amortized O(1) per version
+	const std::size_t droppedCount = m_OldestVersion - m_HistoryBase;
+	if (droppedCount * 2 >= m_RootHistory.size())
+	{
+		m_RootHistory.erase(std::begin(m_RootHistory), std::begin(m_RootHistory) + droppedCount);
+		m_HistoryBase = m_OldestVersion;
+	}
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+std::size_t pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Reclaim(std::size_t maxNodes)
+{
+	ReclaimUnpublishedRoots(maxNodes == std::numeric_limits<std::size_t>::max());
+	std::size_t freedNodes = 0;
+	while (freedNodes < maxNodes && !m_RetiredNodes.empty())
+	{
+		pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> node = std::move(m_RetiredNodes.back());
+		m_RetiredNodes.pop_back();
+		if (node->IsShared())
+		{
+			// Subtree is still used by retained version, just drop our reference
+			continue;
+		}
+
+		// Children are moved out first, so destroying the node never cascades
+		Retire(node->m_Left);
+		Retire(node->m_Right);
+		node = nullptr;
+		freedNodes++;
+	}
+
+	return freedNodes * sizeof(pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+std::size_t pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::ReclaimAll()
+{
+	return Reclaim(std::numeric_limits<std::size_t>::max());
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+std::size_t pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetPendingReclaimCount() const
+{
+	return m_RetiredNodes.size();
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Insert(const LookupKey& key)
+{
+	if (!m_InBatch)
+	{
+		Publish();
+		StartVersion();
+	}
+
+	const StatsScope statsScope(*this, &pst::PersistentMapStats::m_PathCopyClones);
+	CountStat(&pst::PersistentMapStats::m_Inserts);
+	CountStat(&pst::PersistentMapStats::m_Walks);
+	Reclaim(ReclaimStepSize);
+
+	// Single descent: clone every node on the way and remember it as an ancestor for fixup
+	Path parents;
+
+	// Parent of root is always nullptr
+	parents.Push(nullptr);
+	pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>>* link = &GetRootLink(m_CurrentVersion);
+	const KeyPrefix keyPrefix = TKeyTraits::GetPrefix(key);
+	while (*link)
+	{
+		*link = CloneNode(link->Get());
+		pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node = link->Get();
+		const int comparison = CompareKeys(key, keyPrefix, node);
+		if (comparison == 0)
+		{
+			// Target node has been found. It is cloned already so we can return it
+			return node;
+		}
+
+		parents.Push(node);
+		link = comparison < 0 ? &node->m_Left : &node->m_Right;
+	}
+
+	// Create new node
+	*link = CreateNode(key);
+	pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* newNode = link->Get();
+	newNode->SetIsRed(m_CurrentVersion, true);
+	for (std::size_t i = 1; i < parents.GetSize(); i++)
+	{
+		parents[i]->SetSize(m_CurrentVersion, parents[i]->GetSize() + 1);
+	}
+
+	// Fixup never clones nodes of current version, so new node stays valid
+	InsertFixup(newNode, parents);
+	return newNode;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Delete(const LookupKey& key)
+{
+	if (!m_InBatch)
+	{
+		Publish();
+	}
+
+	const StatsScope statsScope(*this, &pst::PersistentMapStats::m_PathCopyClones);
+	CountStat(&pst::PersistentMapStats::m_Deletes);
+	CountStat(&pst::PersistentMapStats::m_Walks);
+	Reclaim(ReclaimStepSize);
+
+	// Find node being deleted first without cloning anything. Nothing changes if there is no such node
+	Path parents;
+
+	// Parent of root is always nullptr
+	parents.Push(nullptr);
+	pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node = GetRoot();
+	const KeyPrefix keyPrefix = TKeyTraits::GetPrefix(key);
+	int comparison = 0;
+	while (node && (comparison = CompareKeys(key, keyPrefix, node)) != 0)
+	{
+		parents.Push(node);
+		node = comparison < 0 ? node->m_Left.Get() : node->m_Right.Get();
+	}
+
+	if (!node)
+	{
+		// There is nothing to delete
+		return;
+	}
+
+	if (!m_InBatch)
+	{
+		// New version shares the tree with previous one, so found path is valid for it as well
+		StartVersion();
+	}
+
+	// Clone path to parent of node being deleted (including parent itself)
+	for (std::size_t i = 1; i < parents.GetSize(); i++)
+	{
+		pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>>& link = i == 1 ? GetRootLink(m_CurrentVersion)
+			: (parents[i - 1]->m_Left.Get() == parents[i] ? parents[i - 1]->m_Left : parents[i - 1]->m_Right);
+		link = CloneNode(parents[i]);
+		parents[i] = link.Get();
+		parents[i]->SetSize(m_CurrentVersion, parents[i]->GetSize() - 1);
+	}
+
+	pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* nodeToDeleteNewParent = parents.Back();
+	pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> nodeToDelete = GetNodePtr(node, nodeToDeleteNewParent);
+	bool requiresFixup = !nodeToDelete->IsRed();
+
+	//		Start moving subtrees which effectively deletes node.
+	// 1. Case when node which will replace deletable node has 0 or 1 child
+	if (!nodeToDelete->m_Left || !nodeToDelete->m_Right)
+	{
+		const pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>>& child = nodeToDelete->m_Left ? nodeToDelete->m_Left : nodeToDelete->m_Right;
+		pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> replacementNode = child ? CloneNode(child.Get()) : nullptr;
+		Transplant(nodeToDelete.Get(), nodeToDeleteNewParent, replacementNode);
+
+		// Special case - if tree is empty now
+		if (requiresFixup && GetRoot())
+		{
+			DeleteFixup(replacementNode.Get(), parents);
+		}
+
+		return;
+	}
+
+	// 2. Case when node which will replace deletable node has 2 childs
+	pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* replacementNode;
+	pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* replacementNodeParent = GetMinParent(nodeToDelete->m_Right.Get());
+	if (replacementNodeParent)
+	{
+		replacementNode = replacementNodeParent->m_Left.Get();
+	}
+	else
+	{
+		replacementNodeParent = nodeToDelete.Get();
+		replacementNode = nodeToDelete->m_Right.Get();
+	}
+
+	requiresFixup = !replacementNode->IsRed();
+	pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> clonedReplacementNode = CloneNode(replacementNode);
+
+	// Replacement node takes place of deleted one on the path
+	parents.Push(clonedReplacementNode.Get());
+	if (replacementNodeParent == nodeToDelete.Get())
+	{
+		// 2a. Case when node which will replace deletable node is deletable node's direct child
+		Transplant(nodeToDelete.Get(), nodeToDeleteNewParent, clonedReplacementNode);
+		clonedReplacementNode->m_Left = nodeToDelete->m_Left;
+		clonedReplacementNode->SetIsRed(m_CurrentVersion, nodeToDelete->IsRed());
+		clonedReplacementNode->SetSize(m_CurrentVersion, nodeToDelete->GetSize() - 1);
+		if (requiresFixup)
+		{
+			clonedReplacementNode->m_Right = clonedReplacementNode->m_Right ? CloneNode(clonedReplacementNode->m_Right.Get()) : nullptr;
+			DeleteFixup(clonedReplacementNode->m_Right.Get(), parents);
+		}
+
+		return;
+	}
+
+	// 2b. Case when node which will replace deletable node is NOT deletable node's direct child. That means that we need to clone path to this replacementNode
+	pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> nodeToDeleteNewRightChild = CloneNode(nodeToDelete->m_Right.Get());
+	pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* replacementNodeNewParent = nodeToDeleteNewRightChild.Get();
+	while (true)
+	{
+		replacementNodeNewParent->SetSize(m_CurrentVersion, replacementNodeNewParent->GetSize() - 1);
+		parents.Push(replacementNodeNewParent);
+		if (replacementNodeNewParent->m_Left.Get() == replacementNode)
+		{
+			break;
+		}
+
+		replacementNodeNewParent->m_Left = CloneNode(replacementNodeNewParent->m_Left.Get());
+		replacementNodeNewParent = replacementNodeNewParent->m_Left.Get();
+	}
+
+	// Detach replacement node first. It is not cloned if it is of current version, so its children are about to be overwritten
+	replacementNodeNewParent->m_Left = replacementNode->m_Right;
+	Transplant(nodeToDelete.Get(), nodeToDeleteNewParent, clonedReplacementNode);
+	clonedReplacementNode->SetIsRed(m_CurrentVersion, nodeToDelete->IsRed());
+	clonedReplacementNode->SetSize(m_CurrentVersion, nodeToDelete->GetSize() - 1);
+	clonedReplacementNode->m_Left = nodeToDelete->m_Left;
+	clonedReplacementNode->m_Right = nodeToDeleteNewRightChild;
+	if (requiresFixup)
+	{
+		replacementNodeNewParent->m_Left = replacementNodeNewParent->m_Left ? CloneNode(replacementNodeNewParent->m_Left.Get()) : nullptr;
+		DeleteFixup(replacementNodeNewParent->m_Left.Get(), parents);
+	}
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+template<typename TForwardIterator>
+bool pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::BulkLoad(TForwardIterator first, TForwardIterator last)
+{
+	assert(!m_InBatch);
+	const auto count = std::distance(first, last);
+	if (count >= std::numeric_limits<int>::max())
+	{
+		// Subtree sizes are int
+		return false;
+	}
+
+	Publish();
+	StartVersion();
+	const StatsScope statsScope(*this, &pst::PersistentMapStats::m_OtherClones);
+
+	// Load creates count nodes, so it reclaims as many released nodes as count inserts would
+	Reclaim(ReclaimStepSize * (static_cast<std::size_t>(count) + 1));
+
+	const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* previous = nullptr;
+	pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> root = BuildSubtree(first, static_cast<int>(count), 0, GetBalancedRedDepth(count), previous);
+	if (count > 0 && !root)
+	{
+		// New version has not been published, so going back to previous one is enough. Its slot is cleared by the next version
+		m_CurrentVersion--;
+		m_IsCurrentPublished = true;
+		return false;
+	}
+
+	// Previous version keeps its root, so nothing is released here
+	GetRootLink(m_CurrentVersion) = std::move(root);
+	Publish();
+	return true;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+bool pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::BulkLoadUnsorted(std::vector<std::pair<TKey, TValue>> entries, unsigned threadCount)
+{
+	pst::ParallelSort(entries.begin(), entries.end(), [](const std::pair<TKey, TValue>& left, const std::pair<TKey, TValue>& right)
+		{
+			return TKeyTraits::Compare(LookupKey(left.first), right.first) < 0;
+		}, threadCount);
+
+	// Sort is stable, so the last of equal keys is the latest entry
+	auto uniqueEnd = entries.begin();
+	for (auto entry = entries.begin(); entry != entries.end(); ++entry)
+	{
+		if (uniqueEnd != entries.begin() && TKeyTraits::Compare(LookupKey(entry->first), std::prev(uniqueEnd)->first) == 0)
+		{
+			std::prev(uniqueEnd)->second = std::move(entry->second);
+		}
+		else
+		{
+			if (uniqueEnd != entry)
+			{
+				*uniqueEnd = std::move(*entry);
+			}
+
+			++uniqueEnd;
+		}
+	}
+
+	return BulkLoad(std::make_move_iterator(entries.begin()), std::make_move_iterator(uniqueEnd));
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+template<typename TForwardIterator>
+pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::BuildSubtree(TForwardIterator& position, int size, int depth, int redDepth,
+	const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>*& previous)
+{
+	if (size == 0)
+	{
+		return nullptr;
+	}
+
+	// Halves differ by at most one node, so all leaves are on the last two levels
+	const int leftSize = (size - 1) / 2;
+	pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> left = BuildSubtree(position, leftSize, depth + 1, redDepth, previous);
+	if (leftSize > 0 && !left)
+	{
+		return nullptr;
+	}
+
+	// Entry is read once, so iterator which moves entries out is fine
+	auto&& entry = *position;
+	const LookupKey& key = GetEntryKey(entry);
+	if (previous && CompareKeys(key, TKeyTraits::GetPrefix(key), previous) <= 0)
+	{
+		Retire(left);
+		return nullptr;
+	}
+
+	pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> node = CreateNode(key);
+	node->m_Value = GetEntryValue(std::forward<decltype(entry)>(entry));
+	++position;
+	previous = node.Get();
+	pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> right = BuildSubtree(position, size - 1 - leftSize, depth + 1, redDepth, previous);
+	if (size - 1 - leftSize > 0 && !right)
+	{
+		Retire(left);
+		Retire(node);
+		return nullptr;
+	}
+
+	node->m_Left = std::move(left);
+	node->m_Right = std::move(right);
+	node->SetIsRed(m_CurrentVersion, depth >= redDepth);
+	node->SetSize(m_CurrentVersion, size);
+	return node;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+int pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetBalancedRedDepth(std::int64_t size)
+{
+	int redDepth = 0;
+	while ((std::int64_t(2) << redDepth) - 1 <= size)
+	{
+		redDepth++;
+	}
+
+	return redDepth;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+template<typename TForwardIterator>
+bool pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Union(TForwardIterator first, TForwardIterator last)
+{
+	const auto count = std::distance(first, last);
+	if (count >= std::numeric_limits<int>::max())
+	{
+		// Subtree sizes are int
+		return false;
+	}
+
+	if (!m_InBatch)
+	{
+		Publish();
+		StartVersion();
+	}
+
+	const StatsScope statsScope(*this, &pst::PersistentMapStats::m_OtherClones);
+	Reclaim(ReclaimStepSize * (static_cast<std::size_t>(count) + 1));
+	const int redDepth = GetBalancedRedDepth(count);
+	const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* previous = nullptr;
+	pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> updates = BuildSubtree(first, static_cast<int>(count), 0, redDepth, previous);
+	if (count > 0 && !updates)
+	{
+		if (!m_InBatch)
+		{
+			// New version has not been published, so going back to previous one is enough. Its slot is cleared by the next version
+			m_CurrentVersion--;
+			m_IsCurrentPublished = true;
+		}
+
+		return false;
+	}
+
+	// Root link is empty while the parts are joined, see Join. Nodes above the last level of balanced tree are black, so its black height is redDepth
+	pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>>& rootLink = GetRootLink(m_CurrentVersion);
+	const int blackHeight = GetBlackHeight(rootLink.Get());
+	JoinPart result = UnionOfSubtrees(JoinPart{ std::move(rootLink), blackHeight }, JoinPart{ std::move(updates), redDepth });
+	MakeRootBlack(result);
+	GetRootLink(m_CurrentVersion) = std::move(result.m_Root);
+	if (!m_InBatch)
+	{
+		Publish();
+	}
+
+	return true;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Union(const PersistentMap& other)
+{
+	// Other map's iterator is a range of nodes in ascending order, so it can't be rejected
+	assert(&other != this);
+	[[maybe_unused]] const bool isMerged = Union(other.begin(), other.end());
+	assert(isMerged);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Difference(const PersistentMap& other)
+{
+	// Nodes of current version are changed in place, so the map can't read its own current tree while splitting it
+	assert(&other != this);
+	if (!m_InBatch)
+	{
+		Publish();
+		StartVersion();
+	}
+
+	const StatsScope statsScope(*this, &pst::PersistentMapStats::m_OtherClones);
+	Reclaim(ReclaimStepSize * (static_cast<std::size_t>(other.GetSize()) + 1));
+	pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>>& rootLink = GetRootLink(m_CurrentVersion);
+	const int blackHeight = GetBlackHeight(rootLink.Get());
+	JoinPart result = DifferenceOfSubtrees(JoinPart{ std::move(rootLink), blackHeight }, other.GetRoot());
+	MakeRootBlack(result);
+	GetRootLink(m_CurrentVersion) = std::move(result.m_Root);
+	if (!m_InBatch)
+	{
+		Publish();
+	}
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+int pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetBlackHeight(const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* root)
+{
+	int blackHeight = 0;
+	for (const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node = root; node; node = node->m_Left.Get())
+	{
+		blackHeight += node->IsRed() ? 0 : 1;
+	}
+
+	return blackHeight;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::MakeRootBlack(JoinPart& part)
+{
+	if (part.m_Root && part.m_Root->IsRed())
+	{
+		part.m_Root = CloneNode(part.m_Root.Get());
+		part.m_Root->SetIsRed(m_CurrentVersion, false);
+		part.m_BlackHeight++;
+	}
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Split(JoinPart tree, const LookupKey& key, const KeyPrefix& keyPrefix,
+	JoinPart& less, JoinPart& greater)
+{
+	if (!tree.m_Root)
+	{
+		less = JoinPart{ nullptr, 0 };
+		greater = JoinPart{ nullptr, 0 };
+		return nullptr;
+	}
+
+	pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node = tree.m_Root.Get();
+	const int childBlackHeight = tree.m_BlackHeight - (node->IsRed() ? 0 : 1);
+	JoinPart left{ node->m_Left, childBlackHeight };
+	JoinPart right{ node->m_Right, childBlackHeight };
+	const int comparison = CompareKeys(key, keyPrefix, node);
+	if (comparison == 0)
+	{
+		less = std::move(left);
+		greater = std::move(right);
+		return std::move(tree.m_Root);
+	}
+
+	// Depth of recursion is the height of the tree
+	pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> found;
+	if (comparison < 0)
+	{
+		found = Split(std::move(left), key, keyPrefix, less, greater);
+		greater = Join(std::move(greater), std::move(tree.m_Root), std::move(right));
+	}
+	else
+	{
+		found = Split(std::move(right), key, keyPrefix, less, greater);
+		less = Join(std::move(left), std::move(tree.m_Root), std::move(less));
+	}
+
+	return found;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+typename pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::JoinPart pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Join(JoinPart left,
+	pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> middle, JoinPart right)
+{
+	// Fixup stops at black root, so both parts should have one
+	MakeRootBlack(left);
+	MakeRootBlack(right);
+	middle = CloneNode(middle.Get());
+	if (left.m_BlackHeight == right.m_BlackHeight)
+	{
+		middle->m_Left = std::move(left.m_Root);
+		middle->m_Right = std::move(right.m_Root);
+		middle->SetIsRed(m_CurrentVersion, false);
+		middle->SetSize(m_CurrentVersion, GetSize(middle->m_Left.Get()) + GetSize(middle->m_Right.Get()) + 1);
+		return JoinPart{ std::move(middle), left.m_BlackHeight + 1 };
+	}
+
+	const bool isLeftTaller = left.m_BlackHeight > right.m_BlackHeight;
+	JoinPart& taller = isLeftTaller ? left : right;
+	JoinPart& shorter = isLeftTaller ? right : left;
+	pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>>& rootLink = GetRootLink(m_CurrentVersion);
+	assert(!rootLink);
+	rootLink = std::move(taller.m_Root);
+
+	// Descend the spine of the taller tree which faces the shorter one down to black subtree of the same black height. Every node on the way gets the shorter tree and middle node
+	Path parents;
+	parents.Push(nullptr);
+	pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>>* link = &rootLink;
+	int blackHeight = taller.m_BlackHeight;
+	const int addedSize = GetSize(shorter.m_Root.Get()) + 1;
+	while (blackHeight != shorter.m_BlackHeight || (*link && (*link)->IsRed()))
+	{
+		*link = CloneNode(link->Get());
+		pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node = link->Get();
+		node->SetSize(m_CurrentVersion, node->GetSize() + addedSize);
+		blackHeight -= node->IsRed() ? 0 : 1;
+		parents.Push(node);
+		link = isLeftTaller ? &node->m_Right : &node->m_Left;
+	}
+
+	// Red middle node over two subtrees of equal black height keeps black heights, so only red parent can be wrong, as after usual insert
+	pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> subtree = std::move(*link);
+	middle->m_Left = isLeftTaller ? std::move(subtree) : std::move(shorter.m_Root);
+	middle->m_Right = isLeftTaller ? std::move(shorter.m_Root) : std::move(subtree);
+	middle->SetIsRed(m_CurrentVersion, true);
+	middle->SetSize(m_CurrentVersion, GetSize(middle->m_Left.Get()) + GetSize(middle->m_Right.Get()) + 1);
+	pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* fixNode = middle.Get();
+	*link = std::move(middle);
+	const bool isHeightGrown = InsertFixup(fixNode, parents);
+	return JoinPart{ std::move(rootLink), taller.m_BlackHeight + (isHeightGrown ? 1 : 0) };
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+typename pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::JoinPart pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Join(JoinPart left, JoinPart right)
+{
+	if (!left.m_Root)
+	{
+		return right;
+	}
+
+	if (!right.m_Root)
+	{
+		return left;
+	}
+
+	const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* maxNode = GetMax(static_cast<const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>*>(left.m_Root.Get()));
+	JoinPart less;
+	JoinPart greater;
+	CountStat(&pst::PersistentMapStats::m_Walks);
+	pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> middle = Split(std::move(left), maxNode->m_Key, maxNode->GetKeyPrefix(), less, greater);
+	assert(middle && !greater.m_Root);
+	return Join(std::move(less), std::move(middle), std::move(right));
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+typename pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::JoinPart pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::UnionOfSubtrees(JoinPart tree, JoinPart updates)
+{
+	if (!updates.m_Root)
+	{
+		return tree;
+	}
+
+	if (!tree.m_Root)
+	{
+		return updates;
+	}
+
+	// Tree is split by root of updates and halves are merged with its subtrees. Node of the tree with the same key is dropped, so value of updates wins
+	const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* updateRoot = updates.m_Root.Get();
+	const int childBlackHeight = updates.m_BlackHeight - (updateRoot->IsRed() ? 0 : 1);
+	JoinPart less;
+	JoinPart greater;
+	CountStat(&pst::PersistentMapStats::m_Walks);
+	Split(std::move(tree), updateRoot->m_Key, updateRoot->GetKeyPrefix(), less, greater);
+	JoinPart left = UnionOfSubtrees(std::move(less), JoinPart{ updateRoot->m_Left, childBlackHeight });
+	JoinPart right = UnionOfSubtrees(std::move(greater), JoinPart{ updateRoot->m_Right, childBlackHeight });
+	return Join(std::move(left), std::move(updates.m_Root), std::move(right));
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+typename pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::JoinPart pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::DifferenceOfSubtrees(JoinPart tree,
+	const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* removed)
+{
+	if (!tree.m_Root || !removed)
+	{
+		return tree;
+	}
+
+	JoinPart less;
+	JoinPart greater;
+	CountStat(&pst::PersistentMapStats::m_Walks);
+	Split(std::move(tree), removed->m_Key, removed->GetKeyPrefix(), less, greater);
+	JoinPart left = DifferenceOfSubtrees(std::move(less), removed->m_Left.Get());
+	JoinPart right = DifferenceOfSubtrees(std::move(greater), removed->m_Right.Get());
+	return Join(std::move(left), std::move(right));
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Search(const LookupKey& key) const
+{
+	const StatsScope statsScope(*this, nullptr);
+	CountStat(&pst::PersistentMapStats::m_Walks);
+	return SearchInSubtree(GetRoot(), key);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Search(const LookupKey& key, int version) const
+{
+	if (version < m_OldestVersion || version > m_CurrentVersion)
+	{
+		return nullptr;
+	}
+
+	const StatsScope statsScope(*this, nullptr);
+	CountStat(&pst::PersistentMapStats::m_Walks);
+	return SearchInSubtree(GetRootLink(version).Get(), key);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetMin() const
+{
+	const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* root = GetRoot();
+	if (!root)
+	{
+		return nullptr;
+	}
+
+	return GetMin(root);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetMax() const
+{
+	const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* root = GetRoot();
+	if (!root)
+	{
+		return nullptr;
+	}
+
+	return GetMax(root);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+int pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetSize() const
+{
+	return GetSize(GetRoot());
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+int pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetRank(const LookupKey& key) const
+{
+	const StatsScope statsScope(*this, nullptr);
+	CountStat(&pst::PersistentMapStats::m_Walks);
+	return GetRank(GetRoot(), key);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+int pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetRank(const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* root, const LookupKey& key)
+{
+	int rank = 0;
+	const KeyPrefix keyPrefix = TKeyTraits::GetPrefix(key);
+	const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node = root;
+	while (node)
+	{
+		if (CompareKeys(key, keyPrefix, node) > 0)
+		{
+			rank += GetSize(node->m_Left.Get()) + 1;
+			node = node->m_Right.Get();
+		}
+		else
+		{
+			node = node->m_Left.Get();
+		}
+	}
+
+	return rank;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetByRank(int rank) const
+{
+	const StatsScope statsScope(*this, nullptr);
+	CountStat(&pst::PersistentMapStats::m_Walks);
+	return GetByRank(GetRoot(), rank);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetByRank(const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* root, int rank)
+{
+	const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node = root;
+	if (rank < 0 || rank >= GetSize(node))
+	{
+		return nullptr;
+	}
+
+	while (true)
+	{
+		const int leftSize = GetSize(node->m_Left.Get());
+		if (rank == leftSize)
+		{
+			return node;
+		}
+
+		if (rank < leftSize)
+		{
+			node = node->m_Left.Get();
+		}
+		else
+		{
+			rank -= leftSize + 1;
+			node = node->m_Right.Get();
+		}
+	}
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+template<typename TVisitor>
+void pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::VisitByRank(int firstRank, int count, TVisitor&& visitor) const
+{
+	const StatsScope statsScope(*this, nullptr);
+	CountStat(&pst::PersistentMapStats::m_Walks);
+	VisitByRank(GetRoot(), firstRank, count, std::forward<TVisitor>(visitor));
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+template<typename TVisitor>
+void pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::VisitByRank(const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* root, int firstRank, int count, TVisitor&& visitor)
+{
+	if (firstRank < 0)
+	{
+		count += firstRank;
+		firstRank = 0;
+	}
+
+	// Stack keeps ancestors which are not visited yet, so the next node is always on top
+	pst::FixedStack<const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>*, MaxHeight> stack;
+	const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node = root;
+	int rank = firstRank;
+	while (node)
+	{
+		const int leftSize = GetSize(node->m_Left.Get());
+		if (rank == leftSize)
+		{
+			stack.Push(node);
+			break;
+		}
+
+		if (rank < leftSize)
+		{
+			stack.Push(node);
+			node = node->m_Left.Get();
+		}
+		else
+		{
+			rank -= leftSize + 1;
+			node = node->m_Right.Get();
+		}
+	}
 
-template<typename TKey, typename TValue>
-pst::PersistentMapNode<TKey, TValue>::PersistentMapNode(const TKey& key, int currentVersion)
-	: m_Key(key)
-	, m_Value(TValue())
-	, m_Left(nullptr)
-	, m_Right(nullptr)
-	, m_CreateVersion(currentVersion)
-	, m_Red(false)
+	while (count > 0 && !stack.IsEmpty())
+	{
+		node = stack.Back();
+		stack.Pop();
+		visitor(*node);
+		count--;
+		for (node = node->m_Right.Get(); node; node = node->m_Left.Get())
+		{
+			stack.Push(node);
+		}
+	}
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+typename pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::ConstIterator pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::begin() const
 {
+	return BeginOfSubtree(GetRoot());
 }
 
-template<typename TKey, typename TValue>
-pst::PersistentMapNode<TKey, TValue>::PersistentMapNode(const PersistentMapNode<TKey, TValue>& other, int currentVersion)
-	: m_Key(other.m_Key)
-	, m_Value(other.m_Value)
-	, m_Left(other.m_Left)
-	, m_Right(other.m_Right)
-	, m_CreateVersion(currentVersion)
-	, m_Red(other.m_Red)
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+typename pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::ConstIterator pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::end() const
 {
+	return ConstIterator();
 }
 
-template<typename TKey, typename TValue>
-std::shared_ptr<pst::PersistentMapNode<TKey, TValue>> pst::PersistentMapNode<TKey, TValue>::Clone(int currentVersion) const
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+typename pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::ConstIterator pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::LowerBound(const LookupKey& key) const
 {
-	return std::make_shared<PersistentMapNode<TKey, TValue>>(*this, currentVersion);
+	const StatsScope statsScope(*this, nullptr);
+	CountStat(&pst::PersistentMapStats::m_Walks);
+	return LowerBoundInSubtree(GetRoot(), key);
 }
 
-template<typename TKey, typename TValue>
-pst::PersistentMap<TKey, TValue>::PersistentMap()
-	: m_CurrentVersion(0)
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+typename pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::ConstIterator pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::UpperBound(const LookupKey& key) const
 {
-	ClearCurrentVersion();
+	const StatsScope statsScope(*this, nullptr);
+	CountStat(&pst::PersistentMapStats::m_Walks);
+	return UpperBoundInSubtree(GetRoot(), key);
 }
 
-template<typename TKey, typename TValue>
-void pst::PersistentMap<TKey, TValue>::Rollback(int delta)
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+template<typename TVisitor>
+void pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::ForEachInRange(const LookupKey& from, const LookupKey& to, TVisitor&& visitor) const
 {
-	assert(delta > 0 && delta <= m_CurrentVersion);
-	m_CurrentVersion -= delta;
+	const StatsScope statsScope(*this, nullptr);
+	CountStat(&pst::PersistentMapStats::m_Walks);
+	ForEachInRangeOfSubtree(GetRoot(), from, to, std::forward<TVisitor>(visitor));
 }
 
-template<typename TKey, typename TValue>
-int pst::PersistentMap<TKey, TValue>::GetVersion() const
-{ 
-	return m_CurrentVersion; 
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+typename pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::ConstIterator pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::BeginOfSubtree(const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* root)
+{
+	ConstIterator iterator;
+	iterator.PushLeftSpine(root);
+	return iterator;
 }
 
-template<typename TKey, typename TValue>
-pst::PersistentMapNode<TKey, TValue>* pst::PersistentMap<TKey, TValue>::Insert(const TKey& key)
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+typename pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::ConstIterator pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::LowerBoundInSubtree(const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* root, const LookupKey& key)
 {
-	assert(m_CurrentVersion >= 0);
-	m_CurrentVersion++;
+	// Only nodes where descent turns left are pushed: they are exactly ancestors which are visited after the found node
+	ConstIterator iterator;
+	const KeyPrefix keyPrefix = TKeyTraits::GetPrefix(key);
+	for (const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node = root; node; )
+	{
+		if (CompareKeys(key, keyPrefix, node) > 0)
+		{
+			node = node->m_Right.Get();
+		}
+		else
+		{
+			iterator.m_Stack.Push(node);
+			node = node->m_Left.Get();
+		}
+	}
 
-	// Firstly we need to clear this version (in case of rollback - it could contain rollback'd changes)
-	ClearCurrentVersion();
+	return iterator;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+typename pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::ConstIterator pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::UpperBoundInSubtree(const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* root, const LookupKey& key)
+{
+	ConstIterator iterator;
+	const KeyPrefix keyPrefix = TKeyTraits::GetPrefix(key);
+	for (const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node = root; node; )
+	{
+		if (CompareKeys(key, keyPrefix, node) < 0)
+		{
+			iterator.m_Stack.Push(node);
+			node = node->m_Left.Get();
+		}
+		else
+		{
+			node = node->m_Right.Get();
+		}
+	}
+
+	return iterator;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+template<typename TVisitor>
+void pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::ForEachInRangeOfSubtree(const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* root, const LookupKey& from, const LookupKey& to, TVisitor&& visitor)
+{
+	const ConstIterator end;
+	const KeyPrefix toPrefix = TKeyTraits::GetPrefix(to);
+	for (ConstIterator iterator = LowerBoundInSubtree(root, from); iterator != end && CompareKeys(to, toPrefix, &*iterator) > 0; ++iterator)
+	{
+		visitor(*iterator);
+	}
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+template<typename TVisitor>
+bool pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Diff(int fromVersion, int toVersion, TVisitor&& visitor) const
+{
+	if (std::min(fromVersion, toVersion) < m_OldestVersion || std::max(fromVersion, toVersion) > m_CurrentVersion)
+	{
+		return false;
+	}
 
-	// Special case - create root
-	if (!m_RootHistory[m_CurrentVersion - 1])
+	// Both trees are walked in order at the same time. Subtrees are expanded lazily, so the walk meets shared subtree as a single item and skips it
+	DiffStack fromStack;
+	DiffStack toStack;
+	if (const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* fromRoot = GetRootLink(fromVersion).Get())
 	{
-		m_RootHistory[m_CurrentVersion] = std::make_shared<pst::PersistentMapNode<TKey, TValue>>(key, m_CurrentVersion);
-		return m_RootHistory[m_CurrentVersion].get();
+		fromStack.Push(DiffItem{ fromRoot, true });
 	}
 
-	pst::PersistentMapNode<TKey, TValue>* keyNewParent = ClonePath(key);
-	if (!keyNewParent)
+	if (const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* toRoot = GetRootLink(toVersion).Get())
 	{
-		// If we didn't found path to that key that means that we're trying to modify root node. Clone it and return.
-		m_RootHistory[m_CurrentVersion] = m_RootHistory[m_CurrentVersion - 1]->Clone(m_CurrentVersion);
-		return m_RootHistory[m_CurrentVersion].get();
+		toStack.Push(DiffItem{ toRoot, true });
 	}
 
-	if (key < keyNewParent->m_Key)
+	while (!fromStack.IsEmpty() && !toStack.IsEmpty())
 	{
-		if (keyNewParent->m_Left)
+		const DiffItem& fromItem = fromStack.Back();
+		const DiffItem& toItem = toStack.Back();
+		if (fromItem.m_IsSubtree && toItem.m_IsSubtree)
+		{
+			if (fromItem.m_Node == toItem.m_Node)
+			{
+				fromStack.Pop();
+				toStack.Pop();
+			}
+			else if (fromItem.m_Node->GetSize() >= toItem.m_Node->GetSize())
+			{
+				// Larger subtree can't be contained in the smaller one, so it is expanded first to find shared part
+				ExpandDiffItem(fromStack);
+			}
+			else
+			{
+				ExpandDiffItem(toStack);
+			}
+		}
+		else if (fromItem.m_IsSubtree)
+		{
+			ExpandDiffItem(fromStack);
+		}
+		else if (toItem.m_IsSubtree)
+		{
+			ExpandDiffItem(toStack);
+		}
+		else if (const int comparison = CompareKeys(fromItem.m_Node->m_Key, fromItem.m_Node->GetKeyPrefix(), toItem.m_Node); comparison < 0)
+		{
+			visitor(fromItem.m_Node, static_cast<const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>*>(nullptr));
+			fromStack.Pop();
+		}
+		else if (comparison > 0)
+		{
+			visitor(static_cast<const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>*>(nullptr), toItem.m_Node);
+			toStack.Pop();
+		}
+		else
 		{
-			// Target node has been found. Clone it and return
-			keyNewParent->m_Left = keyNewParent->m_Left->Clone(m_CurrentVersion);
-			return keyNewParent->m_Left.get();
+			// Path copies of unchanged nodes have equal values
+			if (fromItem.m_Node != toItem.m_Node && !(fromItem.m_Node->m_Value == toItem.m_Node->m_Value))
+			{
+				visitor(fromItem.m_Node, toItem.m_Node);
+			}
+
+			fromStack.Pop();
+			toStack.Pop();
 		}
+	}
 
-		// Create new node
-		keyNewParent->m_Left = std::make_shared<pst::PersistentMapNode<TKey, TValue>>(key, m_CurrentVersion);
-		keyNewParent->m_Left->SetIsRed(m_CurrentVersion, true);
-		InsertFixup(keyNewParent->m_Left.get());
+	// Rest of keys exists only in one of versions
+	while (!fromStack.IsEmpty())
+	{
+		if (fromStack.Back().m_IsSubtree)
+		{
+			ExpandDiffItem(fromStack);
+			continue;
+		}
 
-		// Fixup can invalidate node (by cloning it for instance)
-		return Search(GetRoot(), key);
+		visitor(fromStack.Back().m_Node, static_cast<const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>*>(nullptr));
+		fromStack.Pop();
 	}
 
-	if (keyNewParent->m_Right)
+	while (!toStack.IsEmpty())
 	{
-		// Target node has been found. Clone it and return
-		keyNewParent->m_Right = keyNewParent->m_Right->Clone(m_CurrentVersion);
-		return keyNewParent->m_Right.get();
+		if (toStack.Back().m_IsSubtree)
+		{
+			ExpandDiffItem(toStack);
+			continue;
+		}
+
+		visitor(static_cast<const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>*>(nullptr), toStack.Back().m_Node);
+		toStack.Pop();
 	}
 
-	// Create new node
-	keyNewParent->m_Right = std::make_shared<pst::PersistentMapNode<TKey, TValue>>(key, m_CurrentVersion);
-	keyNewParent->m_Right->SetIsRed(m_CurrentVersion, true);
-	InsertFixup(keyNewParent->m_Right.get());
+	return true;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::ExpandDiffItem(DiffStack& stack)
+{
+	const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node = stack.Back().m_Node;
+	assert(stack.Back().m_IsSubtree);
+	stack.Pop();
+	if (node->m_Right)
+	{
+		stack.Push(DiffItem{ node->m_Right.Get(), true });
+	}
 
-	// Fixup can invalidate node (by cloning it for instance)
-	return Search(GetRoot(), key);
+	stack.Push(DiffItem{ node, false });
+	if (node->m_Left)
+	{
+		stack.Push(DiffItem{ node->m_Left.Get(), true });
+	}
 }
 
-template<typename TKey, typename TValue>
-void pst::PersistentMap<TKey, TValue>::Delete(const TKey& key)
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+template<typename TCodec>
+bool pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Save(pst::BinaryWriter& writer, int fromVersion, const TCodec& codec) const
 {
-	if (!Search(key))
+	assert(!m_InBatch);
+	if (fromVersion < m_OldestVersion || fromVersion > m_CurrentVersion)
 	{
-		// TODO: Can be optimized
-		// There is nothing to delete
-		return;
+		return false;
 	}
 
-	assert(m_CurrentVersion >= 0);
-	m_CurrentVersion++;
+	std::unordered_map<const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>*, std::size_t> nodeIndices;
+	std::vector<const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>*> nodes;
+	for (int version = fromVersion; version <= m_CurrentVersion; version++)
+	{
+		CollectNodes(GetRootLink(version).Get(), nodeIndices, nodes);
+	}
 
-	// Firstly we need to clear this version (in case of rollback - it could contain rollback'd changes)
-	ClearCurrentVersion();
+	// Node refers to its children by distance back in the node list, 0 is no child. Children are mostly written right before parents, so distances are short
+	const auto getReference = [&nodeIndices](std::size_t fromIndex, const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node) -> std::uint64_t
+	{
+		return node ? fromIndex - nodeIndices.find(node)->second : 0;
+	};
+
+	writer.WriteUInt32(SerializationMagic);
+	writer.WriteVarUInt(SerializationFormat);
+	writer.WriteVarInt(fromVersion);
+	writer.WriteVarUInt(m_CurrentVersion - fromVersion);
+	writer.WriteVarUInt(nodes.size());
+	for (std::size_t i = 0; i < nodes.size(); i++)
+	{
+		const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node = nodes[i];
+		codec.WriteKey(writer, node->m_Key);
+		codec.WriteValue(writer, node->m_Value);
+		writer.WriteVarUInt(getReference(i, node->m_Left.Get()) << 1 | (node->IsRed() ? 1 : 0));
+		writer.WriteVarUInt(getReference(i, node->m_Right.Get()));
+
+		// Create version decides which nodes the next version may change in place, so it is kept. Written as age, which is small for recent nodes
+		writer.WriteVarUInt(m_CurrentVersion - node->GetCreateVersion());
+	}
 
-	// Find parent of node being deleted and clone all path to this parent (including parent itself)
-	pst::PersistentMapNode<TKey, TValue>* nodeToDeleteNewParent = ClonePath(key);
-	std::shared_ptr<pst::PersistentMapNode<TKey, TValue>> nodeToDelete = nullptr;
-	if (!nodeToDeleteNewParent)
+	for (int version = fromVersion; version <= m_CurrentVersion; version++)
 	{
-		nodeToDelete = m_RootHistory[m_CurrentVersion - 1];
+		writer.WriteVarUInt(getReference(nodes.size(), GetRootLink(version).Get()));
 	}
-	else if (nodeToDeleteNewParent->m_Left && nodeToDeleteNewParent->m_Left->m_Key == key)
+
+	return writer.IsGood();
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+template<typename TCodec>
+bool pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Load(pst::BinaryReader& reader, const TCodec& codec)
+{
+	assert(!m_InBatch);
+	assert(m_CurrentVersion == 0 && m_OldestVersion == 0 && !GetRoot());
+	if (reader.ReadUInt32() != SerializationMagic || reader.ReadVarUInt() != SerializationFormat)
 	{
-		nodeToDelete = nodeToDeleteNewParent->m_Left;
+		reader.Fail();
+		return false;
 	}
-	else
+
+	const std::int64_t fromVersion = reader.ReadVarInt();
+	const std::uint64_t versionCount = reader.ReadVarUInt();
+	const std::uint64_t nodeCount = reader.ReadVarUInt();
+	if (!reader.IsGood() || fromVersion < 0 || versionCount > static_cast<std::uint64_t>(std::numeric_limits<int>::max() - fromVersion))
 	{
-		nodeToDelete = nodeToDeleteNewParent->m_Right;
+		reader.Fail();
+		return false;
 	}
 
-	bool requiresFixup = !nodeToDelete->IsRed();
+	const int currentVersion = static_cast<int>(fromVersion + versionCount);
 
-	//		Start moving subtrees which effectively deletes node.
-	// 1. Case when node which will replace deletable node has 0 or 1 child
-	if (!nodeToDelete->m_Left)
+	// Nodes are owned by this buffer until the whole input is checked, so map stays empty if anything is wrong
+	std::vector<LoadedNode> nodes;
+	nodes.reserve(static_cast<std::size_t>(std::min<std::uint64_t>(nodeCount, MaxLoadReservation)));
+	for (std::uint64_t i = 0; i < nodeCount; i++)
 	{
-		std::shared_ptr<pst::PersistentMapNode<TKey, TValue>> replacementNode = nodeToDelete->m_Right ? nodeToDelete->m_Right->Clone(m_CurrentVersion) : nullptr;
-		Transplant(nodeToDelete.get(), nodeToDeleteNewParent, replacementNode);
-		if (requiresFixup)
+		if (!LoadNode(reader, codec, currentVersion, nodes))
 		{
-			// Special case - if tree is empty now
-			if (GetRoot())
-			{
-				DeleteFixup(replacementNode.get(), nodeToDeleteNewParent);
-			}
+			reader.Fail();
+			return false;
 		}
-
-		return;
 	}
 
-	if (!nodeToDelete->m_Right)
+	std::vector<pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>>> rootHistory;
+	for (int version = static_cast<int>(fromVersion); version <= currentVersion; version++)
 	{
-		std::shared_ptr<pst::PersistentMapNode<TKey, TValue>> replacementNode = nodeToDelete->m_Left ? nodeToDelete->m_Left->Clone(m_CurrentVersion) : nullptr;
-		Transplant(nodeToDelete.get(), nodeToDeleteNewParent, replacementNode);
-		if (requiresFixup)
+		const std::uint64_t rootReference = reader.ReadVarUInt();
+		if (!reader.IsGood() || rootReference > nodes.size())
 		{
-			DeleteFixup(replacementNode.get(), nodeToDeleteNewParent);
+			reader.Fail();
+			return false;
 		}
 
-		return;
-	}
+		const LoadedNode* root = rootReference ? &nodes[nodes.size() - rootReference] : nullptr;
+		if (root && (root->m_Node->GetCreateVersion() > version || root->m_Node->IsRed()))
+		{
+			reader.Fail();
+			return false;
+		}
 
-	// 2. Case when node which will replace deletable node has 2 childs
-	pst::PersistentMapNode<TKey, TValue>* replacementNode;
-	pst::PersistentMapNode<TKey, TValue>* replacementNodeParent = GetMinParent(nodeToDelete->m_Right.get());;
-	if (replacementNodeParent)
-	{
-		replacementNode = replacementNodeParent->m_Left.get();
+		rootHistory.push_back(root ? root->m_Node : nullptr);
 	}
-	else
+
+	// Nothing is retired, as the map has been empty. Version numbers of saved map are kept, so history starts with the oldest loaded version
+	m_RootHistory = std::move(rootHistory);
+	m_HistoryBase = static_cast<int>(fromVersion);
+	m_OldestVersion = m_HistoryBase;
+	m_CurrentVersion = currentVersion;
+	m_IsCurrentPublished = false;
+	m_VersionMemory.clear();
+	Publish();
+	return true;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::CollectNodes(const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* root,
+	std::unordered_map<const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>*, std::size_t>& nodeIndices, std::vector<const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>*>& nodes)
+{
+	// Every level keeps the node and its right child, so the stack holds at most two items per level
+	FixedStack<SaveItem, 2 * MaxHeight + 1> stack;
+	if (root && nodeIndices.find(root) == nodeIndices.end())
 	{
-		replacementNodeParent = nodeToDelete.get();
-		replacementNode = nodeToDelete->m_Right.get();
+		stack.Push(SaveItem{ root, false });
 	}
 
-	requiresFixup = !replacementNode->IsRed();
-	if (replacementNodeParent == nodeToDelete.get())
+	while (!stack.IsEmpty())
 	{
-		// 2a. Case when node which will replace deletable node is deletable node's direct child
-		std::shared_ptr<pst::PersistentMapNode<TKey, TValue>> clonedReplacementNode = replacementNode->Clone(m_CurrentVersion);
-		Transplant(nodeToDelete.get(), nodeToDeleteNewParent, clonedReplacementNode);
-		clonedReplacementNode->m_Left = nodeToDelete->m_Left;
-		clonedReplacementNode->SetIsRed(m_CurrentVersion, nodeToDelete->IsRed());
-		if (requiresFixup)
+		SaveItem& item = stack.Back();
+		const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node = item.m_Node;
+		if (item.m_IsExpanded)
 		{
-			clonedReplacementNode->m_Right = clonedReplacementNode->m_Right ? clonedReplacementNode->m_Right->Clone(m_CurrentVersion) : nullptr;
-			DeleteFixup(clonedReplacementNode->m_Right.get(), clonedReplacementNode.get());
+			stack.Pop();
+			nodeIndices.emplace(node, nodes.size());
+			nodes.push_back(node);
+			continue;
 		}
 
-		return;
+		item.m_IsExpanded = true;
+		for (const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* child : { node->m_Right.Get(), node->m_Left.Get() })
+		{
+			if (child && nodeIndices.find(child) == nodeIndices.end())
+			{
+				stack.Push(SaveItem{ child, false });
+			}
+		}
 	}
+}
 
-	// 2b. Case when node which will replace deletable node is NOT deletable node's direct child. That means that we need to clone path to this replacementNode
-	auto[nodeToDeleteNewRightChild, replacementNodeNewParent] = ClonePath(nodeToDelete->m_Right.get(), replacementNode->m_Key);
-	std::shared_ptr<pst::PersistentMapNode<TKey, TValue>> clonedReplacementNode = replacementNode->Clone(m_CurrentVersion);
-	Transplant(nodeToDelete.get(), nodeToDeleteNewParent, clonedReplacementNode);
-	clonedReplacementNode->SetIsRed(m_CurrentVersion, nodeToDelete->IsRed());
-	clonedReplacementNode->m_Left = nodeToDelete->m_Left;
-	clonedReplacementNode->m_Right = nodeToDeleteNewRightChild;
-	replacementNodeNewParent->m_Left = replacementNode->m_Right;
-	if (requiresFixup)
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+template<typename TCodec>
+bool pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::LoadNode(pst::BinaryReader& reader, const TCodec& codec, int currentVersion, std::vector<LoadedNode>& nodes)
+{
+	TKey key = codec.ReadKey(reader);
+	TValue value = codec.ReadValue(reader);
+	const std::uint64_t leftLink = reader.ReadVarUInt();
+	const std::uint64_t rightReference = reader.ReadVarUInt();
+	const std::uint64_t age = reader.ReadVarUInt();
+	const std::uint64_t leftReference = leftLink >> 1;
+	const bool isRed = (leftLink & 1) != 0;
+	if (!reader.IsGood() || leftReference > nodes.size() || rightReference > nodes.size() || age > static_cast<std::uint64_t>(currentVersion))
+	{
+		return false;
+	}
+
+	const int createVersion = currentVersion - static_cast<int>(age);
+	const LoadedNode* left = leftReference ? &nodes[nodes.size() - leftReference] : nullptr;
+	const LoadedNode* right = rightReference ? &nodes[nodes.size() - rightReference] : nullptr;
+	const int leftBlackHeight = left ? left->m_BlackHeight : 0;
+	const int rightBlackHeight = right ? right->m_BlackHeight : 0;
+	const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* leftNode = left ? left->m_Node.Get() : nullptr;
+	const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* rightNode = right ? right->m_Node.Get() : nullptr;
+
+	// Equal black heights and no red child of red node bound the height by MaxHeight, so every walk of loaded tree fits its stack.
+	// Child is never newer than its parent, otherwise next version could change in place node which older versions see
+	if (leftBlackHeight != rightBlackHeight || leftBlackHeight >= MaxHeight / 2
+		|| (isRed && ((leftNode && leftNode->IsRed()) || (rightNode && rightNode->IsRed())))
+		|| (leftNode && leftNode->GetCreateVersion() > createVersion) || (rightNode && rightNode->GetCreateVersion() > createVersion)
+		|| static_cast<std::int64_t>(GetSize(leftNode)) + GetSize(rightNode) >= std::numeric_limits<int>::max())
+	{
+		return false;
+	}
+
+	void* block = m_NodePool->Allocate(sizeof(pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>));
+	pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> node(new (block) pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>(std::move(key), createVersion));
+
+	// Keys should be strictly ordered, so the largest key on the left and the smallest one on the right are compared only
+	if ((left && CompareKeys(left->m_Max->m_Key, left->m_Max->GetKeyPrefix(), node.Get()) >= 0)
+		|| (right && CompareKeys(right->m_Min->m_Key, right->m_Min->GetKeyPrefix(), node.Get()) <= 0))
 	{
-		replacementNodeNewParent->m_Left = replacementNodeNewParent->m_Left ? replacementNodeNewParent->m_Left->Clone(m_CurrentVersion) : nullptr;
-		DeleteFixup(replacementNodeNewParent->m_Left.get(), replacementNodeNewParent);
+		return false;
 	}
+
+	node->m_Value = std::move(value);
+	node->m_Left = left ? left->m_Node : nullptr;
+	node->m_Right = right ? right->m_Node : nullptr;
+	node->SetIsRed(createVersion, isRed);
+	node->SetSize(createVersion, GetSize(leftNode) + GetSize(rightNode) + 1);
+	const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* minNode = left ? left->m_Min : node.Get();
+	const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* maxNode = right ? right->m_Max : node.Get();
+	nodes.push_back(LoadedNode{ std::move(node), minNode, maxNode, leftBlackHeight + (isRed ? 0 : 1) });
+	return true;
 }
 
-template<typename TKey, typename TValue>
-const pst::PersistentMapNode<TKey, TValue>* pst::PersistentMap<TKey, TValue>::Search(const TKey& key) const
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+int pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetSize(const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node)
 {
-	return Search(GetRoot(), key);
+	return node ? node->GetSize() : 0;
 }
 
-template<typename TKey, typename TValue>
-const pst::PersistentMapNode<TKey, TValue>* pst::PersistentMap<TKey, TValue>::GetMin() const
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetRoot() const
 {
-	const pst::PersistentMapNode<TKey, TValue>* root = GetRoot();
-	if (!root)
+	return GetRootLink(m_CurrentVersion).Get();
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetRoot()
+{
+	return GetRootLink(m_CurrentVersion).Get();
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>>& pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetRootLink(int version)
+{
+	assert(version >= m_OldestVersion && version - m_HistoryBase < static_cast<int>(m_RootHistory.size()));
+	return m_RootHistory[version - m_HistoryBase];
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+const pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>>& pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetRootLink(int version) const
+{
+	assert(version >= m_OldestVersion && version - m_HistoryBase < static_cast<int>(m_RootHistory.size()));
+	return m_RootHistory[version - m_HistoryBase];
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::CreateNode(const LookupKey& key)
+{
+	void* block = m_NodePool->Allocate(sizeof(pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>));
+	return pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>>(new (block) pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>(TKeyTraits::MakeKey(key), m_CurrentVersion));
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::CloneNode(pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node)
+{
+	if (node->GetCreateVersion() == m_CurrentVersion)
 	{
-		return nullptr;
+		// Node has been created by this version already, nobody else can see it
+		return pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>>(node);
 	}
 
-	return GetMin(root);
+	CountStat(m_CloneCounter ? m_CloneCounter : &pst::PersistentMapStats::m_OtherClones);
+	void* block = m_NodePool->Allocate(sizeof(pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>));
+	return pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>>(new (block) pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>(*node, m_CurrentVersion));
 }
 
-template<typename TKey, typename TValue>
-const pst::PersistentMapNode<TKey, TValue>* pst::PersistentMap<TKey, TValue>::GetMax() const
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::StatsScope::StatsScope(const PersistentMap& map, std::uint64_t pst::PersistentMapStats::* cloneCounter)
+	: m_Map(map)
+	, m_OuterCloneCounter(map.m_CloneCounter)
+	, m_StartComparisons(IsStatsEnabled ? s_Comparisons : 0)
 {
-	pst::PersistentMapNode<TKey, TValue>* root = GetRoot();
-	if (!root)
+	if constexpr (IsStatsEnabled)
 	{
-		return nullptr;
+		m_Map.m_CloneCounter = cloneCounter ? cloneCounter : m_OuterCloneCounter;
+		m_Map.m_StatsScopeDepth++;
 	}
-
-	return GetMax(root);
 }
 
-template<typename TKey, typename TValue>
-const pst::PersistentMapNode<TKey, TValue>* pst::PersistentMap<TKey, TValue>::GetRoot() const
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::StatsScope::~StatsScope()
 {
-	pst::PersistentMapNode<TKey, TValue>* root = m_RootHistory.size() > m_CurrentVersion ? m_RootHistory[m_CurrentVersion].get() : nullptr;
-	return root;
+	if constexpr (IsStatsEnabled)
+	{
+		m_Map.m_CloneCounter = m_OuterCloneCounter;
+		if (--m_Map.m_StatsScopeDepth == 0)
+		{
+			m_Map.m_Stats.m_Comparisons += s_Comparisons - m_StartComparisons;
+		}
+	}
 }
 
-template<typename TKey, typename TValue>
-pst::PersistentMapNode<TKey, TValue>* pst::PersistentMap<TKey, TValue>::GetRoot()
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::StartVersion()
 {
-	pst::PersistentMapNode<TKey, TValue>* root = m_RootHistory.size() > m_CurrentVersion ? m_RootHistory[m_CurrentVersion].get() : nullptr;
-	return root;
+	assert(m_CurrentVersion >= 0);
+	m_CurrentVersion++;
+	m_IsCurrentPublished = false;
+
+	// Firstly we need to clear this version (in case of rollback - it could contain rollback'd changes)
+	ClearCurrentVersion();
+	m_VersionMemory.erase(m_CurrentVersion);
+
+	// New version starts with the same tree as previous one. Nodes are cloned on first change
+	GetRootLink(m_CurrentVersion) = GetRootLink(m_CurrentVersion - 1);
 }
 
-template<typename TKey, typename TValue>
-void pst::PersistentMap<TKey, TValue>::ClearCurrentVersion()
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::ClearCurrentVersion()
 {
-	if (m_RootHistory.size() > m_CurrentVersion)
+	const std::size_t index = m_CurrentVersion - m_HistoryBase;
+	if (m_RootHistory.size() > index)
 	{
-		m_RootHistory[m_CurrentVersion] = nullptr;
+		// Slot keeps rolled back version which can own large subtree
+		Retire(m_RootHistory[index]);
 	}
 	else
 	{
 		// There shouldn't be any gap!
-		assert(m_RootHistory.size() == m_CurrentVersion);
+		assert(m_RootHistory.size() == index);
 		m_RootHistory.push_back(nullptr);
 	}
 }
 
-template<typename TKey, typename TValue>
-pst::PersistentMapNode<TKey, TValue>* pst::PersistentMap<TKey, TValue>::ClonePath(const TKey& toKey)
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Retire(pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>>& node)
 {
-	// Handle case when root doesn't exist or it is a target node
-	pst::PersistentMapNode<TKey, TValue>* oldRoot = m_RootHistory[m_CurrentVersion - 1].get();
-	if (!oldRoot || oldRoot->m_Key == toKey)
+	if (node)
 	{
-		return nullptr;
+		m_RetiredNodes.push_back(std::move(node));
+	}
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::ReclaimUnpublishedRoots(bool force)
+{
+	if (m_UnpublishedRoots.empty() || (!force && m_UnpublishedRoots.size() < UnpublishedRootsScanSize))
+	{
+		return;
 	}
 
-	auto[newRoot, newKeyParent] = ClonePath(oldRoot, toKey);
-	m_RootHistory[m_CurrentVersion] = newRoot;
-	return newKeyParent;
+	// Reader which pinned later epoch has taken newer root, so it can't reach nodes released by unpublished one
+	const std::uint64_t oldestPinnedEpoch = m_EpochDomain->GetOldestPinnedEpoch();
+	while (!m_UnpublishedRoots.empty() && m_UnpublishedRoots.front().first < oldestPinnedEpoch)
+	{
+		PublishedRoot* unpublishedRoot = m_UnpublishedRoots.front().second;
+		m_UnpublishedRoots.pop_front();
+		Retire(unpublishedRoot->m_Root);
+		delete unpublishedRoot;
+	}
 }
 
-template<typename TKey, typename TValue>
-void pst::PersistentMap<TKey, TValue>::InsertFixup(pst::PersistentMapNode<TKey, TValue>* fixNode)
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+bool pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::InsertFixup(pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* fixNode, Path& parents)
 {
-	// TODO: Consider caching parent and grandparent
+	const StatsScope statsScope(*this, &pst::PersistentMapStats::m_InsertFixupClones);
 
 	// All parents has been cloned already. Uncles has not.
-	std::vector<pst::PersistentMapNode<TKey, TValue>*> parents = BuildPath(fixNode);
-	auto getParent = [&parents]() { return parents[parents.size() - 1]; };
-	auto getGrandParent = [&parents]() { return parents[parents.size() - 2]; };
+	auto getParent = [&parents]() { return parents[parents.GetSize() - 1]; };
+	auto getGrandParent = [&parents]() { return parents[parents.GetSize() - 2]; };
 	while (getParent() && getParent()->IsRed())
 	{
-		if (getParent() == getGrandParent()->m_Left.get())
+		if (getParent() == getGrandParent()->m_Left.Get())
 		{
-			pst::PersistentMapNode<TKey, TValue>* uncle = getGrandParent()->m_Right.get();
+			pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* uncle = getGrandParent()->m_Right.Get();
 			if (uncle && uncle->IsRed())
 			{
 				// Case 1
 				getParent()->SetIsRed(m_CurrentVersion, false);
-				getGrandParent()->m_Right = uncle->Clone(m_CurrentVersion);
-				uncle = getGrandParent()->m_Right.get();
+				getGrandParent()->m_Right = CloneNode(uncle);
+				uncle = getGrandParent()->m_Right.Get();
 				uncle->SetIsRed(m_CurrentVersion, false);
 				getGrandParent()->SetIsRed(m_CurrentVersion, true);
 				fixNode = getGrandParent();
-				parents.pop_back();
-				parents.pop_back();
+				parents.Pop();
+				parents.Pop();
 			}
 			else
 			{
-				if (fixNode == getParent()->m_Right.get())
+				if (fixNode == getParent()->m_Right.Get())
 				{
 					// Case 2
 					fixNode = getParent();
-					parents.pop_back();
+					parents.Pop();
 
 					// Clone needed node before rotation, remember what node is being rotated and then restore parents after rotation
-					fixNode->m_Right = fixNode->m_Right->Clone(m_CurrentVersion);
-					pst::PersistentMapNode<TKey, TValue>* willBeNewParent = fixNode->m_Right.get();
+					fixNode->m_Right = CloneNode(fixNode->m_Right.Get());
+					pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* willBeNewParent = fixNode->m_Right.Get();
 					LeftRotate(fixNode, getParent());
-					parents.push_back(willBeNewParent);
+					parents.Push(willBeNewParent);
 				}
 
 				// Case 3. No else intended
@@ -342,10 +1983,10 @@ void pst::PersistentMap<TKey, TValue>::InsertFixup(pst::PersistentMapNode<TKey,
 				getGrandParent()->SetIsRed(m_CurrentVersion, true);
 
 				// Clone needed node before rotation, remember what node is being rotated and then restore parents after rotation
-				getGrandParent()->m_Left = getGrandParent()->m_Left->Clone(m_CurrentVersion);
-				pst::PersistentMapNode<TKey, TValue>* willBeNewParent = getGrandParent()->m_Left.get();
-				RightRotate(getGrandParent(), parents[parents.size() - 3]);
-				parents.push_back(willBeNewParent);
+				getGrandParent()->m_Left = CloneNode(getGrandParent()->m_Left.Get());
+				pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* willBeNewParent = getGrandParent()->m_Left.Get();
+				RightRotate(getGrandParent(), parents[parents.GetSize() - 3]);
+				parents.Push(willBeNewParent);
 
 				// Rotation should always terminate loop
 				assert(!getParent()->IsRed());
@@ -355,32 +1996,32 @@ void pst::PersistentMap<TKey, TValue>::InsertFixup(pst::PersistentMapNode<TKey,
 		{
 			// TODO: Try to find way to avoid this symmetric logic. Same for DeleteFixup!
 
-			pst::PersistentMapNode<TKey, TValue>* uncle = getGrandParent()->m_Left.get();
+			pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* uncle = getGrandParent()->m_Left.Get();
 			if (uncle && uncle->IsRed())
 			{
 				// Case 1
 				getParent()->SetIsRed(m_CurrentVersion, false);
-				getGrandParent()->m_Left = uncle->Clone(m_CurrentVersion);
-				uncle = getGrandParent()->m_Left.get();
+				getGrandParent()->m_Left = CloneNode(uncle);
+				uncle = getGrandParent()->m_Left.Get();
 				uncle->SetIsRed(m_CurrentVersion, false);
 				getGrandParent()->SetIsRed(m_CurrentVersion, true);
 				fixNode = getGrandParent();
-				parents.pop_back();
-				parents.pop_back();
+				parents.Pop();
+				parents.Pop();
 			}
 			else
 			{
-				if (fixNode == getParent()->m_Left.get())
+				if (fixNode == getParent()->m_Left.Get())
 				{
 					// Case 2
 					fixNode = getParent();
-					parents.pop_back();
+					parents.Pop();
 
 					// Clone needed node before rotation, remember what node is being rotated and then restore parents after rotation
-					fixNode->m_Left = fixNode->m_Left->Clone(m_CurrentVersion);
-					pst::PersistentMapNode<TKey, TValue>* willBeNewParent = fixNode->m_Left.get();
+					fixNode->m_Left = CloneNode(fixNode->m_Left.Get());
+					pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* willBeNewParent = fixNode->m_Left.Get();
 					RightRotate(fixNode, getParent());
-					parents.push_back(willBeNewParent);
+					parents.Push(willBeNewParent);
 				}
 
 				// Case 3. No else intended
@@ -388,10 +2029,10 @@ void pst::PersistentMap<TKey, TValue>::InsertFixup(pst::PersistentMapNode<TKey,
 				getGrandParent()->SetIsRed(m_CurrentVersion, true);
 
 				// Clone needed node before rotation, remember what node is being rotated and then restore parents after rotation
-				getGrandParent()->m_Right = getGrandParent()->m_Right->Clone(m_CurrentVersion);
-				pst::PersistentMapNode<TKey, TValue>* willBeNewParent = getGrandParent()->m_Right.get();
-				LeftRotate(getGrandParent(), parents[parents.size() - 3]);
-				parents.push_back(willBeNewParent);
+				getGrandParent()->m_Right = CloneNode(getGrandParent()->m_Right.Get());
+				pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* willBeNewParent = getGrandParent()->m_Right.Get();
+				LeftRotate(getGrandParent(), parents[parents.GetSize() - 3]);
+				parents.Push(willBeNewParent);
 
 				// Rotation should always terminate loop
 				assert(!getParent()->IsRed());
@@ -399,84 +2040,59 @@ void pst::PersistentMap<TKey, TValue>::InsertFixup(pst::PersistentMapNode<TKey,
 		}
 	}
 
+	const bool isRootRed = GetRoot()->IsRed();
 	GetRoot()->SetIsRed(m_CurrentVersion, false);
+	return isRootRed;
 }
 
-template<typename TKey, typename TValue>
-std::vector<pst::PersistentMapNode<TKey, TValue>*> pst::PersistentMap<TKey, TValue>::BuildPath(pst::PersistentMapNode<TKey, TValue>* toNode)
-{
-	// TODO: Try to avoid duplicating logic with const-method
-	assert(toNode);
-	std::vector<pst::PersistentMapNode<TKey, TValue>*> path;
-
-	// Parent of root is always nullptr
-	path.push_back(nullptr);
-	pst::PersistentMapNode<TKey, TValue>* node = GetRoot();
-	while (node && node->m_Key != toNode->m_Key)
-	{
-		path.push_back(node);
-		if (toNode->m_Key < node->m_Key)
-		{
-			node = node->m_Left.get();
-		}
-		else
-		{
-			node = node->m_Right.get();
-		}
-	}
-
-	if (!node)
-	{
-		return std::vector<pst::PersistentMapNode<TKey, TValue>*>();
-	}
-
-	return path;
-}
-
-template<typename TKey, typename TValue>
-std::vector<const pst::PersistentMapNode<TKey, TValue>*> pst::PersistentMap<TKey, TValue>::BuildPath(const pst::PersistentMapNode<TKey, TValue>* toNode) const
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+std::vector<const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>*> pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::BuildPath(const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* toNode) const
 {
 	assert(toNode);
-	std::vector<const pst::PersistentMapNode<TKey, TValue>*> path;
+	const StatsScope statsScope(*this, nullptr);
+	CountStat(&pst::PersistentMapStats::m_BuildPathCalls);
+	std::vector<const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>*> path;
 
 	// Parent of root is always nullptr
 	path.push_back(nullptr);
-	const pst::PersistentMapNode<TKey, TValue>* node = GetRoot();
-	while (node && node->m_Key != toNode->m_Key)
+	const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node = GetRoot();
+	int comparison = 0;
+	while (node && (comparison = CompareKeys(toNode->m_Key, toNode->GetKeyPrefix(), node)) != 0)
 	{
 		path.push_back(node);
-		if (toNode->m_Key < node->m_Key)
+		if (comparison < 0)
 		{
-			node = node->m_Left.get();
+			node = node->m_Left.Get();
 		}
 		else
 		{
-			node = node->m_Right.get();
+			node = node->m_Right.Get();
 		}
 	}
 
 	if (!node)
 	{
-		return std::vector<const pst::PersistentMapNode<TKey, TValue>*>();
+		return std::vector<const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>*>();
 	}
 
 	return path;
 }
 
-template<typename TKey, typename TValue>
-void pst::PersistentMap<TKey, TValue>::RightRotate(pst::PersistentMapNode<TKey, TValue>* target, pst::PersistentMapNode<TKey, TValue>* targetParent)
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::RightRotate(pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* target, pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* targetParent)
 {
 	// TODO: Unite Left and Right rotate functions?
+	CountStat(&pst::PersistentMapStats::m_Rotations);
 
-	// Important to keep shared_ptrs there. This way object won't be removed during swapping pointers
-	std::shared_ptr<pst::PersistentMapNode<TKey, TValue>> targetNode = GetSharedPtr(target, targetParent);
-	std::shared_ptr<pst::PersistentMapNode<TKey, TValue>> childNode = target->m_Left;
+	// Important to keep NodePtrs there. This way object won't be removed during swapping pointers
+	pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> targetNode = GetNodePtr(target, targetParent);
+	pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> childNode = target->m_Left;
 	targetNode->m_Left = childNode->m_Right;
 	if (!targetParent)
 	{
-		m_RootHistory[m_CurrentVersion] = childNode;
+		GetRootLink(m_CurrentVersion) = childNode;
 	}
-	else if (targetParent->m_Left.get() == target)
+	else if (targetParent->m_Left.Get() == target)
 	{
 		targetParent->m_Left = childNode;
 	}
@@ -486,20 +2102,26 @@ void pst::PersistentMap<TKey, TValue>::RightRotate(pst::PersistentMapNode<TKey,
 	}
 
 	childNode->m_Right = targetNode;
+
+	// Child takes place of target so it gets size of whole subtree
+	childNode->SetSize(m_CurrentVersion, targetNode->GetSize());
+	targetNode->SetSize(m_CurrentVersion, GetSize(targetNode->m_Left.Get()) + GetSize(targetNode->m_Right.Get()) + 1);
 }
 
-template<typename TKey, typename TValue>
-void pst::PersistentMap<TKey, TValue>::LeftRotate(pst::PersistentMapNode<TKey, TValue>* target, pst::PersistentMapNode<TKey, TValue>* targetParent)
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::LeftRotate(pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* target, pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* targetParent)
 {
-	// Important to keep shared_ptr there. This way object won't be removed during swapping pointers
-	std::shared_ptr<pst::PersistentMapNode<TKey, TValue>> targetNode = GetSharedPtr(target, targetParent);
-	std::shared_ptr<pst::PersistentMapNode<TKey, TValue>> childNode = target->m_Right;
+	CountStat(&pst::PersistentMapStats::m_Rotations);
+
+	// Important to keep NodePtr there. This way object won't be removed during swapping pointers
+	pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> targetNode = GetNodePtr(target, targetParent);
+	pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> childNode = target->m_Right;
 	targetNode->m_Right = childNode->m_Left;
 	if (!targetParent)
 	{
-		m_RootHistory[m_CurrentVersion] = childNode;
+		GetRootLink(m_CurrentVersion) = childNode;
 	}
-	else if (targetParent->m_Left.get() == target)
+	else if (targetParent->m_Left.Get() == target)
 	{
 		targetParent->m_Left = childNode;
 	}
@@ -509,17 +2131,21 @@ void pst::PersistentMap<TKey, TValue>::LeftRotate(pst::PersistentMapNode<TKey, T
 	}
 
 	childNode->m_Left = targetNode;
+
+	// Child takes place of target so it gets size of whole subtree
+	childNode->SetSize(m_CurrentVersion, targetNode->GetSize());
+	targetNode->SetSize(m_CurrentVersion, GetSize(targetNode->m_Left.Get()) + GetSize(targetNode->m_Right.Get()) + 1);
 }
 
-template<typename TKey, typename TValue>
-std::shared_ptr<pst::PersistentMapNode<TKey, TValue>> pst::PersistentMap<TKey, TValue>::GetSharedPtr(pst::PersistentMapNode<TKey, TValue>* target, pst::PersistentMapNode<TKey, TValue>* targetParent)
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetNodePtr(pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* target, pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* targetParent)
 {
 	if (!targetParent)
 	{
-		return m_RootHistory[m_CurrentVersion];
+		return GetRootLink(m_CurrentVersion);
 	}
 	
-	if (targetParent->m_Left.get() == target)
+	if (targetParent->m_Left.Get() == target)
 	{
 		return targetParent->m_Left;
 	}
@@ -527,51 +2153,46 @@ std::shared_ptr<pst::PersistentMapNode<TKey, TValue>> pst::PersistentMap<TKey, T
 	return targetParent->m_Right;
 }
 
-template<typename TKey, typename TValue>
-void pst::PersistentMap<TKey, TValue>::DeleteFixup(pst::PersistentMapNode<TKey, TValue>* fixNode, pst::PersistentMapNode<TKey, TValue>* parentForNullNode)
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::DeleteFixup(pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* fixNode, Path& parents)
 {
-	// All parents has been cloned already. Siblings has not.
-	std::vector<pst::PersistentMapNode<TKey, TValue>*> parents = fixNode ? BuildPath(fixNode) : BuildPath(parentForNullNode);
-	if (!fixNode)
-	{
-		assert(parentForNullNode);
-		parents.push_back(parentForNullNode);
-	}
+	const StatsScope statsScope(*this, &pst::PersistentMapStats::m_DeleteFixupClones);
 
-	auto getParent = [&parents]() { return parents[parents.size() - 1]; };
-	auto getGrandParent = [&parents]() { return parents[parents.size() - 2]; };
+	// All parents has been cloned already. Siblings has not.
+	auto getParent = [&parents]() { return parents[parents.GetSize() - 1]; };
+	auto getGrandParent = [&parents]() { return parents[parents.GetSize() - 2]; };
 	while (fixNode != GetRoot() && (!fixNode || !fixNode->IsRed()))
 	{
-		if (fixNode == getParent()->m_Left.get())
+		if (fixNode == getParent()->m_Left.Get())
 		{
-			pst::PersistentMapNode<TKey, TValue>* sibling = getParent()->m_Right.get();
+			pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* sibling = getParent()->m_Right.Get();
 			if (sibling && sibling->IsRed())
 			{
 				// Case 1
-				getParent()->m_Right = getParent()->m_Right->Clone(m_CurrentVersion);
-				sibling = getParent()->m_Right.get();
+				getParent()->m_Right = CloneNode(getParent()->m_Right.Get());
+				sibling = getParent()->m_Right.Get();
 				sibling->SetIsRed(m_CurrentVersion, false);
 				getParent()->SetIsRed(m_CurrentVersion, true);
 				LeftRotate(getParent(), getGrandParent());
 				
 				// Restore parents
-				pst::PersistentMapNode<TKey, TValue>* parent = parents.back();
-				parents.pop_back();
-				parents.push_back(sibling);
-				parents.push_back(parent);
+				pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* parent = parents.Back();
+				parents.Pop();
+				parents.Push(sibling);
+				parents.Push(parent);
 
 				// Find new sibling
-				sibling = getParent()->m_Right.get();
+				sibling = getParent()->m_Right.Get();
 			}
 
 			if ((!sibling->m_Left || !sibling->m_Left->IsRed()) && (!sibling->m_Right || !sibling->m_Right->IsRed()))
 			{
 				// Case 2. Both sibling's children are black
-				getParent()->m_Right = getParent()->m_Right->Clone(m_CurrentVersion);
-				sibling = getParent()->m_Right.get();
+				getParent()->m_Right = CloneNode(getParent()->m_Right.Get());
+				sibling = getParent()->m_Right.Get();
 				sibling->SetIsRed(m_CurrentVersion, true);
 				fixNode = getParent();
-				parents.pop_back();
+				parents.Pop();
 			}
 			else
 			{
@@ -579,65 +2200,65 @@ void pst::PersistentMap<TKey, TValue>::DeleteFixup(pst::PersistentMapNode<TKey,
 				{
 					// Case 3
 					// Cloning sibling in order to clone its child and rotate them then
-					getParent()->m_Right = getParent()->m_Right->Clone(m_CurrentVersion);
-					sibling = getParent()->m_Right.get();
-					sibling->m_Left = sibling->m_Left->Clone(m_CurrentVersion);
+					getParent()->m_Right = CloneNode(getParent()->m_Right.Get());
+					sibling = getParent()->m_Right.Get();
+					sibling->m_Left = CloneNode(sibling->m_Left.Get());
 					sibling->m_Left->SetIsRed(m_CurrentVersion, false);
 					sibling->SetIsRed(m_CurrentVersion, true);
 					RightRotate(sibling, getParent());
 
 					// Find new sibling
-					sibling = getParent()->m_Right.get();
+					sibling = getParent()->m_Right.Get();
 				}
 
 				// Case 4. No else intended
-				getParent()->m_Right = getParent()->m_Right->Clone(m_CurrentVersion);
-				sibling = getParent()->m_Right.get();
-				sibling->m_Right = sibling->m_Right->Clone(m_CurrentVersion);
+				getParent()->m_Right = CloneNode(getParent()->m_Right.Get());
+				sibling = getParent()->m_Right.Get();
+				sibling->m_Right = CloneNode(sibling->m_Right.Get());
 				sibling->SetIsRed(m_CurrentVersion, getParent()->IsRed());
 				getParent()->SetIsRed(m_CurrentVersion, false);
 				sibling->m_Right->SetIsRed(m_CurrentVersion, false);
 				LeftRotate(getParent(), getGrandParent());
 
 				// Restore parents
-				pst::PersistentMapNode<TKey, TValue>* parent = parents.back();
-				parents.pop_back();
-				parents.push_back(sibling);
-				parents.push_back(parent);
+				pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* parent = parents.Back();
+				parents.Pop();
+				parents.Push(sibling);
+				parents.Push(parent);
 
 				fixNode = GetRoot();
 			}
 		}
 		else
 		{
-			pst::PersistentMapNode<TKey, TValue>* sibling = getParent()->m_Left.get();
+			pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* sibling = getParent()->m_Left.Get();
 			if (sibling && sibling->IsRed())
 			{
 				// Case 1
-				getParent()->m_Left = getParent()->m_Left->Clone(m_CurrentVersion);
-				sibling = getParent()->m_Left.get();
+				getParent()->m_Left = CloneNode(getParent()->m_Left.Get());
+				sibling = getParent()->m_Left.Get();
 				sibling->SetIsRed(m_CurrentVersion, false);
 				getParent()->SetIsRed(m_CurrentVersion, true);
 				RightRotate(getParent(), getGrandParent());
 
 				// Restore parents
-				pst::PersistentMapNode<TKey, TValue>* parent = parents.back();
-				parents.pop_back();
-				parents.push_back(sibling);
-				parents.push_back(parent);
+				pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* parent = parents.Back();
+				parents.Pop();
+				parents.Push(sibling);
+				parents.Push(parent);
 
 				// Find new sibling
-				sibling = getParent()->m_Left.get();
+				sibling = getParent()->m_Left.Get();
 			}
 
 			if ((!sibling->m_Left || !sibling->m_Left->IsRed()) && (!sibling->m_Right || !sibling->m_Right->IsRed()))
 			{
 				// Case 2. Both sibling's children are black
-				getParent()->m_Left = getParent()->m_Left->Clone(m_CurrentVersion);
-				sibling = getParent()->m_Left.get();
+				getParent()->m_Left = CloneNode(getParent()->m_Left.Get());
+				sibling = getParent()->m_Left.Get();
 				sibling->SetIsRed(m_CurrentVersion, true);
 				fixNode = getParent();
-				parents.pop_back();
+				parents.Pop();
 			}
 			else
 			{
@@ -645,31 +2266,31 @@ void pst::PersistentMap<TKey, TValue>::DeleteFixup(pst::PersistentMapNode<TKey,
 				{
 					// Case 3
 					// Cloning sibling in order to clone its child and rotate them then
-					getParent()->m_Left = getParent()->m_Left->Clone(m_CurrentVersion);
-					sibling = getParent()->m_Left.get();
-					sibling->m_Right = sibling->m_Right->Clone(m_CurrentVersion);
+					getParent()->m_Left = CloneNode(getParent()->m_Left.Get());
+					sibling = getParent()->m_Left.Get();
+					sibling->m_Right = CloneNode(sibling->m_Right.Get());
 					sibling->m_Right->SetIsRed(m_CurrentVersion, false);
 					sibling->SetIsRed(m_CurrentVersion, true);
 					LeftRotate(sibling, getParent());
 
 					// Find new sibling
-					sibling = getParent()->m_Left.get();
+					sibling = getParent()->m_Left.Get();
 				}
 
 				// Case 4. No else intended
-				getParent()->m_Left = getParent()->m_Left->Clone(m_CurrentVersion);
-				sibling = getParent()->m_Left.get();
-				sibling->m_Left = sibling->m_Left->Clone(m_CurrentVersion);
+				getParent()->m_Left = CloneNode(getParent()->m_Left.Get());
+				sibling = getParent()->m_Left.Get();
+				sibling->m_Left = CloneNode(sibling->m_Left.Get());
 				sibling->SetIsRed(m_CurrentVersion, getParent()->IsRed());
 				getParent()->SetIsRed(m_CurrentVersion, false);
 				sibling->m_Left->SetIsRed(m_CurrentVersion, false);
 				RightRotate(getParent(), getGrandParent());
 
 				// Restore parents
-				pst::PersistentMapNode<TKey, TValue>* parent = parents.back();
-				parents.pop_back();
-				parents.push_back(sibling);
-				parents.push_back(parent);
+				pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* parent = parents.Back();
+				parents.Pop();
+				parents.Push(sibling);
+				parents.Push(parent);
 
 				fixNode = GetRoot();
 			}
@@ -680,137 +2301,108 @@ void pst::PersistentMap<TKey, TValue>::DeleteFixup(pst::PersistentMapNode<TKey,
 	fixNode->SetIsRed(m_CurrentVersion, false);
 }
 
-template<typename TKey, typename TValue>
-std::tuple<std::shared_ptr<pst::PersistentMapNode<TKey, TValue>>, pst::PersistentMapNode<TKey, TValue>*> pst::PersistentMap<TKey, TValue>::ClonePath(
-	const pst::PersistentMapNode<TKey, TValue>* from, const TKey& toKey) const
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+void pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::Transplant(const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* target, pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* targetParent,
+	pst::NodePtr<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>> source)
 {
-	assert(from->m_Key != toKey);
-	std::shared_ptr<pst::PersistentMapNode<TKey, TValue>> newFrom = from->Clone(m_CurrentVersion);
-	pst::PersistentMapNode<TKey, TValue>* newNode = newFrom.get();
-	while (true)
+	if (!targetParent)
 	{
-		assert(newNode->m_Key != toKey);
-		if (newNode->m_Left && newNode->m_Left->m_Key == toKey)
-		{
-			// Our left child is node we're looking for
-			return { newFrom, newNode };
-		}
-
-		if (newNode->m_Right && newNode->m_Right->m_Key == toKey)
-		{
-			// Our right child is node we're looking for
-			return { newFrom, newNode };
-		}
-
-		if (toKey < newNode->m_Key && !newNode->m_Left)
-		{
-			// Node we're looking doesn't exist. This node should be a parent for node with specified key
-			return { newFrom, newNode };
-		}
-
-		if (toKey > newNode->m_Key && !newNode->m_Right)
-		{
-			// Node we're looking doesn't exist. This node should be a parent for node with specified key
-			return { newFrom, newNode };
-		}
+		GetRootLink(m_CurrentVersion) = source;
+		return;
+	}
 
-		// Continue traversal
-		if (toKey < newNode->m_Key)
-		{
-			newNode->m_Left = newNode->m_Left->Clone(m_CurrentVersion);
-			newNode = newNode->m_Left.get();
-		}
-		else
-		{
-			newNode->m_Right = newNode->m_Right->Clone(m_CurrentVersion);
-			newNode = newNode->m_Right.get();
-		}
+	if (targetParent->m_Left.Get() == target)
+	{
+		targetParent->m_Left = source;
+		return;
 	}
 
-	// Should never reach this point
-	std::abort();
+	assert(targetParent->m_Right.Get() == target);
+	targetParent->m_Right = source;
 }
 
-template<typename TKey, typename TValue>
-void pst::PersistentMap<TKey, TValue>::Transplant(const pst::PersistentMapNode<TKey, TValue>* target, pst::PersistentMapNode<TKey, TValue>* targetParent,
-	std::shared_ptr<pst::PersistentMapNode<TKey, TValue>> source)
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+int pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::CompareKeys(const LookupKey& key, const KeyPrefix& keyPrefix, const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node)
 {
-	if (!targetParent)
+	if constexpr (IsStatsEnabled)
 	{
-		m_RootHistory[m_CurrentVersion] = source;
-		return;
+		s_Comparisons++;
 	}
 
-	if (targetParent->m_Left.get() == target)
+	if constexpr (!std::is_same_v<KeyPrefix, pst::NoKeyPrefix>)
 	{
-		targetParent->m_Left = source;
-		return;
+		const KeyPrefix nodePrefix = node->GetKeyPrefix();
+		if (keyPrefix != nodePrefix)
+		{
+			return keyPrefix < nodePrefix ? -1 : 1;
+		}
 	}
 
-	assert(targetParent->m_Right.get() == target);
-	targetParent->m_Right = source;
+	return TKeyTraits::Compare(key, node->m_Key);
 }
 
-template<typename TKey, typename TValue>
-const pst::PersistentMapNode<TKey, TValue>* pst::PersistentMap<TKey, TValue>::Search(const pst::PersistentMapNode<TKey, TValue>* node, const TKey& key) const
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::SearchInSubtree(const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node, const LookupKey& key)
 {
-	while (node && node->m_Key != key)
+	const KeyPrefix keyPrefix = TKeyTraits::GetPrefix(key);
+	int comparison = 0;
+	while (node && (comparison = CompareKeys(key, keyPrefix, node)) != 0)
 	{
-		if (key < node->m_Key)
+		if (comparison < 0)
 		{
-			node = node->m_Left.get();
+			node = node->m_Left.Get();
 		}
 		else
 		{
-			node = node->m_Right.get();
+			node = node->m_Right.Get();
 		}
 	}
 
 	return node;
 }
 
-template<typename TKey, typename TValue>
-pst::PersistentMapNode<TKey, TValue>* pst::PersistentMap<TKey, TValue>::Search(pst::PersistentMapNode<TKey, TValue>* node, const TKey& key)
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::SearchInSubtree(pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node, const LookupKey& key)
 {
-	return const_cast<pst::PersistentMapNode<TKey, TValue>*>(const_cast<const pst::PersistentMap<TKey, TValue>&>(*this).Search(node, key));
+	return const_cast<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>*>(SearchInSubtree(const_cast<const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>*>(node), key));
 }
 
-template<typename TKey, typename TValue>
-const pst::PersistentMapNode<TKey, TValue>* pst::PersistentMap<TKey, TValue>::GetMin(const pst::PersistentMapNode<TKey, TValue>* node) const
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetMin(const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node)
 {
 	while (node->m_Left)
 	{
-		node = node->m_Left.get();
+		node = node->m_Left.Get();
 	}
 
 	return node;
 }
 
-template<typename TKey, typename TValue>
-pst::PersistentMapNode<TKey, TValue>* pst::PersistentMap<TKey, TValue>::GetMin(pst::PersistentMapNode<TKey, TValue>* node)
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetMin(pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node)
 {
-	return const_cast<pst::PersistentMapNode<TKey, TValue>*>(const_cast<const pst::PersistentMap<TKey, TValue>&>(*this).GetMin(node));
+	return const_cast<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>*>(GetMin(const_cast<const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>*>(node)));
 }
 
-template<typename TKey, typename TValue>
-const pst::PersistentMapNode<TKey, TValue>* pst::PersistentMap<TKey, TValue>::GetMax(const pst::PersistentMapNode<TKey, TValue>* node) const
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetMax(const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node)
 {
 	while (node->m_Right)
 	{
-		node = node->m_Right.get();
+		node = node->m_Right.Get();
 	}
 
 	return node;
 }
 
-template<typename TKey, typename TValue>
-pst::PersistentMapNode<TKey, TValue>* pst::PersistentMap<TKey, TValue>::GetMax(pst::PersistentMapNode<TKey, TValue>* node)
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetMax(pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node)
 {
-	return const_cast<pst::PersistentMapNode<TKey, TValue>*>(const_cast<const pst::PersistentMap<TKey, TValue>&>(*this).GetMax(node));
+	return const_cast<pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>*>(GetMax(const_cast<const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>*>(node)));
 }
 
-template<typename TKey, typename TValue>
-pst::PersistentMapNode<TKey, TValue>* pst::PersistentMap<TKey, TValue>::GetMinParent(pst::PersistentMapNode<TKey, TValue>* node)
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::GetMinParent(pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node)
 {
 	if (!node->m_Left)
 	{
@@ -820,7 +2412,7 @@ pst::PersistentMapNode<TKey, TValue>* pst::PersistentMap<TKey, TValue>::GetMinPa
 
 	while (node->m_Left->m_Left)
 	{
-		node = node->m_Left.get();
+		node = node->m_Left.Get();
 	}
 
 	return node;
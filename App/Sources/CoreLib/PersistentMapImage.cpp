@@ -0,0 +1 @@
+#include "PersistentMapImage.h"
@@ -0,0 +1,185 @@
+#pragma once
+
+#include "FixedStack.h"
+#include "KeyTraits.h"
+#include "PersistentMap.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+namespace pst
+{
+	/// Read-only image of PersistentMap versions which is queried in place, e.g. right from MappedFile.
+	/// Nodes are fixed-size records which refer to children by 32-bit index, string keys refer to string section by offset,
+	/// so opening image checks only its header and first query touches just the pages on its path. Nodes shared by versions are written once.
+	/// Image is a raw memory layout: it is read on the architecture which wrote it and it is trusted, only header and section bounds are checked.
+	/// Keys should be std::string, std::string_view or trivially copyable, values should be trivially copyable.
+	/// Image never changes; writer keeps working with PersistentMap and writes new image when needed
+	template <typename TKey, typename TValue, typename TKeyTraits = KeyTraits<TKey>>
+	class PersistentMapImage
+	{
+		static constexpr bool IsStringKey = std::is_same_v<TKey, std::string> || std::is_same_v<TKey, std::string_view>;
+		static_assert(IsStringKey || std::is_trivially_copyable_v<TKey>, "Key should be a string or trivially copyable");
+		static_assert(std::is_trivially_copyable_v<TValue>, "Value should be trivially copyable");
+
+		/// Height of RB-tree is at most 2 * log2(n + 1), so this covers any tree with int-sized number of nodes
+		static constexpr int MaxHeight = 64;
+
+		struct StringReference
+		{
+			std::uint64_t m_Offset;
+			std::uint64_t m_Size;
+		};
+
+		using StoredKey = std::conditional_t<IsStringKey, StringReference, TKey>;
+
+		struct ImageNode
+		{
+			StoredKey m_Key;
+			TValue m_Value;
+
+			/// 1-based indices of children, 0 is no child
+			std::uint32_t m_Left;
+			std::uint32_t m_Right;
+
+			/// Number of nodes in subtree including this node
+			std::int32_t m_Size;
+		};
+
+	public:
+		using LookupKey = typename TKeyTraits::LookupKey;
+
+		/// String keys are viewed in string section of the image
+		using KeyView = std::conditional_t<IsStringKey, std::string_view, TKey>;
+
+		struct Entry
+		{
+			KeyView m_Key;
+			const TValue& m_Value;
+		};
+
+		/// Forward iterator over entries of one version in ascending order of keys. Entries are returned by value and refer to the image
+		class ConstIterator
+		{
+		public:
+			using iterator_category = std::input_iterator_tag;
+			using value_type = Entry;
+			using difference_type = std::ptrdiff_t;
+			using pointer = void;
+			using reference = Entry;
+
+			/// Creates end iterator
+			ConstIterator() = default;
+
+			Entry operator*() const;
+
+			ConstIterator& operator++();
+			ConstIterator operator++(int);
+
+			bool operator==(const ConstIterator& other) const;
+			bool operator!=(const ConstIterator& other) const { return !(*this == other); }
+
+		private:
+			friend class PersistentMapImage;
+
+			explicit ConstIterator(const PersistentMapImage* image);
+
+			void PushLeftSpine(const ImageNode* node);
+
+			const PersistentMapImage* m_Image = nullptr;
+
+			/// Current node is on top, the rest are ancestors whose left subtree is being visited. Stack of end iterator is empty
+			FixedStack<const ImageNode*, MaxHeight> m_Stack;
+		};
+
+		/// One version of the image. Valid while the image and its memory are alive
+		class Snapshot
+		{
+		public:
+			/// Returns value of the key or nullptr. Value lives in the image
+			const TValue* Search(const LookupKey& key) const;
+			int GetSize() const;
+
+			/// Returns number of keys which are less than specified key. Key doesn't have to exist
+			int GetRank(const LookupKey& key) const;
+
+			ConstIterator begin() const;
+			ConstIterator end() const;
+
+			/// Returns iterator to the first entry whose key is not less than specified key
+			ConstIterator LowerBound(const LookupKey& key) const;
+
+			int GetVersion() const { return m_Version; }
+
+		private:
+			friend class PersistentMapImage;
+
+			Snapshot(const PersistentMapImage* image, const ImageNode* root, int version);
+
+			const PersistentMapImage* m_Image;
+			const ImageNode* m_Root;
+			int m_Version;
+		};
+
+		/// Writes versions [fromVersion; current] of the map. Returns false if version is not retained, map has more nodes than 32-bit index can address or stream has failed
+		template <typename TNodePool>
+		static bool Write(std::ostream& stream, const PersistentMap<TKey, TValue, TNodePool, TKeyTraits>& map, int fromVersion);
+
+		/// Creates image which has no versions until Open succeeds
+		PersistentMapImage();
+
+		/// Uses image memory in place, so it should outlive the image and its snapshots. Memory should be aligned as MappedFile or heap block is.
+		/// Returns false if header doesn't describe image of this key and value types which fits the memory
+		bool Open(const void* data, std::size_t size);
+
+		bool IsOpen() const;
+		int GetVersion() const;
+		int GetOldestVersion() const;
+
+		/// Returns view of retained version
+		Snapshot GetSnapshot(int version) const;
+
+	private:
+		struct Header
+		{
+			std::uint32_t m_Magic;
+			std::uint32_t m_Format;
+
+			/// Guards against opening image of other key and value types or of other architecture
+			std::uint32_t m_NodeSize;
+			std::uint32_t m_NodeCount;
+			std::int32_t m_OldestVersion;
+			std::int32_t m_CurrentVersion;
+			std::uint64_t m_NodesOffset;
+			std::uint64_t m_RootsOffset;
+			std::uint64_t m_StringsOffset;
+			std::uint64_t m_StringsSize;
+		};
+
+		/// "PSTI" in little-endian order
+		static constexpr std::uint32_t ImageMagic = 0x49545350;
+		static constexpr std::uint32_t ImageFormat = 1;
+
+		/// Sections start at this alignment, so nodes can be read in place
+		static constexpr std::size_t SectionAlignment = alignof(std::max_align_t);
+
+		static int CompareKeys(const LookupKey& key, KeyView nodeKey);
+
+		const ImageNode* GetNode(std::uint32_t reference) const;
+		KeyView GetKey(const ImageNode* node) const;
+
+		const char* m_Data;
+		const ImageNode* m_Nodes;
+		const std::uint32_t* m_Roots;
+		const char* m_Strings;
+		int m_OldestVersion;
+		int m_CurrentVersion;
+	};
+}
+
+#include "PersistentMapImage.inl"
@@ -0,0 +1,369 @@
+#pragma once
+
+#include "PersistentMapImage.h"
+
+#include <cassert>
+#include <cstring>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+template<typename TKey, typename TValue, typename TKeyTraits>
+pst::PersistentMapImage<TKey, TValue, TKeyTraits>::ConstIterator::ConstIterator(const PersistentMapImage* image)
+	: m_Image(image)
+{
+}
+
+template<typename TKey, typename TValue, typename TKeyTraits>
+typename pst::PersistentMapImage<TKey, TValue, TKeyTraits>::Entry pst::PersistentMapImage<TKey, TValue, TKeyTraits>::ConstIterator::operator*() const
+{
+	const ImageNode* node = m_Stack.Back();
+	return Entry{ m_Image->GetKey(node), node->m_Value };
+}
+
+template<typename TKey, typename TValue, typename TKeyTraits>
+typename pst::PersistentMapImage<TKey, TValue, TKeyTraits>::ConstIterator& pst::PersistentMapImage<TKey, TValue, TKeyTraits>::ConstIterator::operator++()
+{
+	const ImageNode* node = m_Stack.Back();
+	m_Stack.Pop();
+	PushLeftSpine(m_Image->GetNode(node->m_Right));
+	return *this;
+}
+
+template<typename TKey, typename TValue, typename TKeyTraits>
+typename pst::PersistentMapImage<TKey, TValue, TKeyTraits>::ConstIterator pst::PersistentMapImage<TKey, TValue, TKeyTraits>::ConstIterator::operator++(int)
+{
+	ConstIterator result = *this;
+	++*this;
+	return result;
+}
+
+template<typename TKey, typename TValue, typename TKeyTraits>
+bool pst::PersistentMapImage<TKey, TValue, TKeyTraits>::ConstIterator::operator==(const ConstIterator& other) const
+{
+	// Position is defined by the current node, the rest of the stack follows from it
+	if (m_Stack.IsEmpty() || other.m_Stack.IsEmpty())
+	{
+		return m_Stack.IsEmpty() && other.m_Stack.IsEmpty();
+	}
+
+	return m_Stack.Back() == other.m_Stack.Back();
+}
+
+template<typename TKey, typename TValue, typename TKeyTraits>
+void pst::PersistentMapImage<TKey, TValue, TKeyTraits>::ConstIterator::PushLeftSpine(const ImageNode* node)
+{
+	while (node)
+	{
+		m_Stack.Push(node);
+		node = m_Image->GetNode(node->m_Left);
+	}
+}
+
+template<typename TKey, typename TValue, typename TKeyTraits>
+pst::PersistentMapImage<TKey, TValue, TKeyTraits>::Snapshot::Snapshot(const PersistentMapImage* image, const ImageNode* root, int version)
+	: m_Image(image)
+	, m_Root(root)
+	, m_Version(version)
+{
+}
+
+template<typename TKey, typename TValue, typename TKeyTraits>
+const TValue* pst::PersistentMapImage<TKey, TValue, TKeyTraits>::Snapshot::Search(const LookupKey& key) const
+{
+	const ImageNode* node = m_Root;
+	while (node)
+	{
+		const int comparison = CompareKeys(key, m_Image->GetKey(node));
+		if (comparison == 0)
+		{
+			return &node->m_Value;
+		}
+
+		node = m_Image->GetNode(comparison < 0 ? node->m_Left : node->m_Right);
+	}
+
+	return nullptr;
+}
+
+template<typename TKey, typename TValue, typename TKeyTraits>
+int pst::PersistentMapImage<TKey, TValue, TKeyTraits>::Snapshot::GetSize() const
+{
+	return m_Root ? m_Root->m_Size : 0;
+}
+
+template<typename TKey, typename TValue, typename TKeyTraits>
+int pst::PersistentMapImage<TKey, TValue, TKeyTraits>::Snapshot::GetRank(const LookupKey& key) const
+{
+	int rank = 0;
+	const ImageNode* node = m_Root;
+	while (node)
+	{
+		const ImageNode* left = m_Image->GetNode(node->m_Left);
+		const int comparison = CompareKeys(key, m_Image->GetKey(node));
+		if (comparison <= 0)
+		{
+			if (comparison == 0)
+			{
+				return rank + (left ? left->m_Size : 0);
+			}
+
+			node = left;
+		}
+		else
+		{
+			rank += (left ? left->m_Size : 0) + 1;
+			node = m_Image->GetNode(node->m_Right);
+		}
+	}
+
+	return rank;
+}
+
+template<typename TKey, typename TValue, typename TKeyTraits>
+typename pst::PersistentMapImage<TKey, TValue, TKeyTraits>::ConstIterator pst::PersistentMapImage<TKey, TValue, TKeyTraits>::Snapshot::begin() const
+{
+	ConstIterator iterator(m_Image);
+	iterator.PushLeftSpine(m_Root);
+	return iterator;
+}
+
+template<typename TKey, typename TValue, typename TKeyTraits>
+typename pst::PersistentMapImage<TKey, TValue, TKeyTraits>::ConstIterator pst::PersistentMapImage<TKey, TValue, TKeyTraits>::Snapshot::end() const
+{
+	return ConstIterator(m_Image);
+}
+
+template<typename TKey, typename TValue, typename TKeyTraits>
+typename pst::PersistentMapImage<TKey, TValue, TKeyTraits>::ConstIterator pst::PersistentMapImage<TKey, TValue, TKeyTraits>::Snapshot::LowerBound(const LookupKey& key) const
+{
+	// Only ancestors which are greater than the key are visited after it, so others are not kept on the stack
+	ConstIterator iterator(m_Image);
+	const ImageNode* node = m_Root;
+	while (node)
+	{
+		const int comparison = CompareKeys(key, m_Image->GetKey(node));
+		if (comparison <= 0)
+		{
+			iterator.m_Stack.Push(node);
+			if (comparison == 0)
+			{
+				break;
+			}
+
+			node = m_Image->GetNode(node->m_Left);
+		}
+		else
+		{
+			node = m_Image->GetNode(node->m_Right);
+		}
+	}
+
+	return iterator;
+}
+
+template<typename TKey, typename TValue, typename TKeyTraits>
+template<typename TNodePool>
+bool pst::PersistentMapImage<TKey, TValue, TKeyTraits>::Write(std::ostream& stream, const pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>& map, int fromVersion)
+{
+	using MapNode = pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>;
+	assert(!map.IsInBatch());
+	if (fromVersion < map.GetOldestVersion() || fromVersion > map.GetVersion())
+	{
+		return false;
+	}
+
+	// Same walk as PersistentMap::Save: children go before parents and shared subtree is written once
+	std::unordered_map<const MapNode*, std::size_t> nodeIndices;
+	std::vector<const MapNode*> nodes;
+	for (int version = fromVersion; version <= map.GetVersion(); version++)
+	{
+		pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>::CollectNodes(map.GetRootLink(version).Get(), nodeIndices, nodes);
+	}
+
+	if (nodes.size() >= std::numeric_limits<std::uint32_t>::max())
+	{
+		return false;
+	}
+
+	const auto getReference = [&nodeIndices](const MapNode* node) -> std::uint32_t
+	{
+		return node ? static_cast<std::uint32_t>(nodeIndices.find(node)->second + 1) : 0;
+	};
+
+	const auto align = [](std::uint64_t offset) { return (offset + SectionAlignment - 1) / SectionAlignment * SectionAlignment; };
+	const std::uint32_t versionCount = static_cast<std::uint32_t>(map.GetVersion() - fromVersion + 1);
+
+	// Path copies of a node have equal keys, so every string is stored once. Offsets are found by views of keys in the map, which outlives this call
+	std::string strings;
+	std::unordered_map<std::string_view, std::uint64_t> stringOffsets;
+	std::vector<ImageNode> imageNodes(nodes.size());
+	for (std::size_t i = 0; i < nodes.size(); i++)
+	{
+		ImageNode& imageNode = imageNodes[i];
+
+		// Padding is cleared, so equal maps give equal files
+		std::memset(static_cast<void*>(&imageNode), 0, sizeof(ImageNode));
+		if constexpr (IsStringKey)
+		{
+			const std::string_view key = nodes[i]->m_Key;
+			const auto [found, isAdded] = stringOffsets.emplace(key, strings.size());
+			if (isAdded)
+			{
+				strings.append(key);
+			}
+
+			imageNode.m_Key = StringReference{ found->second, key.size() };
+		}
+		else
+		{
+			imageNode.m_Key = nodes[i]->m_Key;
+		}
+
+		imageNode.m_Value = nodes[i]->m_Value;
+		imageNode.m_Left = getReference(nodes[i]->m_Left.Get());
+		imageNode.m_Right = getReference(nodes[i]->m_Right.Get());
+		imageNode.m_Size = nodes[i]->GetSize();
+	}
+
+	Header header;
+	std::memset(static_cast<void*>(&header), 0, sizeof(Header));
+	header.m_Magic = ImageMagic;
+	header.m_Format = ImageFormat;
+	header.m_NodeSize = sizeof(ImageNode);
+	header.m_NodeCount = static_cast<std::uint32_t>(nodes.size());
+	header.m_OldestVersion = fromVersion;
+	header.m_CurrentVersion = map.GetVersion();
+	header.m_NodesOffset = align(sizeof(Header));
+	header.m_RootsOffset = align(header.m_NodesOffset + nodes.size() * sizeof(ImageNode));
+	header.m_StringsOffset = align(header.m_RootsOffset + versionCount * sizeof(std::uint32_t));
+	header.m_StringsSize = strings.size();
+
+	std::vector<std::uint32_t> roots;
+	for (int version = fromVersion; version <= map.GetVersion(); version++)
+	{
+		roots.push_back(getReference(map.GetRootLink(version).Get()));
+	}
+
+	const char padding[SectionAlignment] = {};
+	const auto writeSection = [&stream, &padding](std::uint64_t& position, std::uint64_t offset, const void* data, std::size_t size)
+	{
+		stream.write(padding, static_cast<std::streamsize>(offset - position));
+		stream.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+		position = offset + size;
+	};
+
+	std::uint64_t position = 0;
+	writeSection(position, 0, &header, sizeof(Header));
+	writeSection(position, header.m_NodesOffset, imageNodes.data(), imageNodes.size() * sizeof(ImageNode));
+	writeSection(position, header.m_RootsOffset, roots.data(), roots.size() * sizeof(std::uint32_t));
+	writeSection(position, header.m_StringsOffset, strings.data(), strings.size());
+	return static_cast<bool>(stream.flush());
+}
+
+template<typename TKey, typename TValue, typename TKeyTraits>
+pst::PersistentMapImage<TKey, TValue, TKeyTraits>::PersistentMapImage()
+	: m_Data(nullptr)
+	, m_Nodes(nullptr)
+	, m_Roots(nullptr)
+	, m_Strings(nullptr)
+	, m_OldestVersion(0)
+	, m_CurrentVersion(-1)
+{
+}
+
+template<typename TKey, typename TValue, typename TKeyTraits>
+bool pst::PersistentMapImage<TKey, TValue, TKeyTraits>::Open(const void* data, std::size_t size)
+{
+	const char* bytes = static_cast<const char*>(data);
+	if (!data || size < sizeof(Header) || reinterpret_cast<std::uintptr_t>(data) % alignof(ImageNode) != 0)
+	{
+		return false;
+	}
+
+	Header header;
+	std::memcpy(&header, bytes, sizeof(Header));
+	if (header.m_Magic != ImageMagic || header.m_Format != ImageFormat || header.m_NodeSize != sizeof(ImageNode)
+		|| header.m_CurrentVersion < header.m_OldestVersion || header.m_OldestVersion < 0)
+	{
+		return false;
+	}
+
+	// Sections are checked in order of the file, and each size is bounded by the rest of the file, so none of the sums overflow
+	const std::uint64_t versionCount = static_cast<std::uint64_t>(header.m_CurrentVersion) - header.m_OldestVersion + 1;
+	if (header.m_NodesOffset % SectionAlignment != 0 || header.m_NodesOffset < sizeof(Header) || header.m_NodesOffset > size
+		|| header.m_NodeCount > (size - header.m_NodesOffset) / sizeof(ImageNode)
+		|| header.m_RootsOffset % alignof(std::uint32_t) != 0 || header.m_RootsOffset < header.m_NodesOffset + header.m_NodeCount * sizeof(ImageNode) || header.m_RootsOffset > size
+		|| versionCount > (size - header.m_RootsOffset) / sizeof(std::uint32_t)
+		|| header.m_StringsOffset < header.m_RootsOffset + versionCount * sizeof(std::uint32_t) || header.m_StringsOffset > size
+		|| header.m_StringsSize > size - header.m_StringsOffset)
+	{
+		return false;
+	}
+
+	m_Data = bytes;
+	m_Nodes = reinterpret_cast<const ImageNode*>(bytes + header.m_NodesOffset);
+	m_Roots = reinterpret_cast<const std::uint32_t*>(bytes + header.m_RootsOffset);
+	m_Strings = bytes + header.m_StringsOffset;
+	m_OldestVersion = header.m_OldestVersion;
+	m_CurrentVersion = header.m_CurrentVersion;
+	return true;
+}
+
+template<typename TKey, typename TValue, typename TKeyTraits>
+bool pst::PersistentMapImage<TKey, TValue, TKeyTraits>::IsOpen() const
+{
+	return m_Data != nullptr;
+}
+
+template<typename TKey, typename TValue, typename TKeyTraits>
+int pst::PersistentMapImage<TKey, TValue, TKeyTraits>::GetVersion() const
+{
+	return m_CurrentVersion;
+}
+
+template<typename TKey, typename TValue, typename TKeyTraits>
+int pst::PersistentMapImage<TKey, TValue, TKeyTraits>::GetOldestVersion() const
+{
+	return m_OldestVersion;
+}
+
+template<typename TKey, typename TValue, typename TKeyTraits>
+typename pst::PersistentMapImage<TKey, TValue, TKeyTraits>::Snapshot pst::PersistentMapImage<TKey, TValue, TKeyTraits>::GetSnapshot(int version) const
+{
+	assert(IsOpen() && version >= m_OldestVersion && version <= m_CurrentVersion);
+	return Snapshot(this, GetNode(m_Roots[version - m_OldestVersion]), version);
+}
+
+template<typename TKey, typename TValue, typename TKeyTraits>
+int pst::PersistentMapImage<TKey, TValue, TKeyTraits>::CompareKeys(const LookupKey& key, KeyView nodeKey)
+{
+	if constexpr (IsStringKey)
+	{
+		// Traits of string keys order them as std::string_view does, so the view is compared without building the key type
+		return std::string_view(key).compare(nodeKey);
+	}
+	else
+	{
+		return TKeyTraits::Compare(key, nodeKey);
+	}
+}
+
+template<typename TKey, typename TValue, typename TKeyTraits>
+const typename pst::PersistentMapImage<TKey, TValue, TKeyTraits>::ImageNode* pst::PersistentMapImage<TKey, TValue, TKeyTraits>::GetNode(std::uint32_t reference) const
+{
+	return reference ? m_Nodes + (reference - 1) : nullptr;
+}
+
+template<typename TKey, typename TValue, typename TKeyTraits>
+typename pst::PersistentMapImage<TKey, TValue, TKeyTraits>::KeyView pst::PersistentMapImage<TKey, TValue, TKeyTraits>::GetKey(const ImageNode* node) const
+{
+	if constexpr (IsStringKey)
+	{
+		return std::string_view(m_Strings + node->m_Key.m_Offset, static_cast<std::size_t>(node->m_Key.m_Size));
+	}
+	else
+	{
+		return node->m_Key;
+	}
+}
@@ -0,0 +1,83 @@
+#include "StringInternTable.h"
+
+#include <cassert>
+
+pst::StringInternTable::StringInternTable()
+	: m_Size(0)
+	, m_StringBytes(0)
+{
+}
+
+std::uint32_t pst::StringInternTable::Intern(std::string_view string)
+{
+	const auto found = m_Ids.find(string);
+	if (found != m_Ids.end())
+	{
+		return found->second;
+	}
+
+	assert(m_Size < InvalidId);
+	const std::uint32_t id = m_Size;
+	const auto [segmentIndex, position] = Locate(id);
+	std::unique_ptr<std::string[]>& segment = m_Segments[segmentIndex];
+	if (!segment)
+	{
+		segment = std::make_unique<std::string[]>(std::size_t(FirstSegmentSize) << segmentIndex);
+	}
+
+	std::string& stored = segment[position];
+	stored = string;
+	if (stored.data() < reinterpret_cast<const char*>(&stored) || stored.data() >= reinterpret_cast<const char*>(&stored + 1))
+	{
+		// Buffer of long string is on heap, short one is stored inline
+		m_StringBytes += stored.capacity() + 1;
+	}
+
+	// Key views the stored string, which never moves
+	m_Ids.emplace(stored, id);
+	m_Size++;
+	return id;
+}
+
+std::uint32_t pst::StringInternTable::Find(std::string_view string) const
+{
+	const auto found = m_Ids.find(string);
+	return found != m_Ids.end() ? found->second : InvalidId;
+}
+
+const std::string& pst::StringInternTable::GetString(std::uint32_t id) const
+{
+	assert(id < InvalidId);
+	const auto [segmentIndex, position] = Locate(id);
+	assert(m_Segments[segmentIndex]);
+	return m_Segments[segmentIndex][position];
+}
+
+std::uint32_t pst::StringInternTable::GetSize() const
+{
+	return m_Size;
+}
+
+std::size_t pst::StringInternTable::GetAllocatedBytes() const
+{
+	std::size_t bytes = m_StringBytes;
+	for (std::size_t segmentIndex = 0; segmentIndex < MaxSegments && m_Segments[segmentIndex]; segmentIndex++)
+	{
+		bytes += (std::size_t(FirstSegmentSize) << segmentIndex) * sizeof(std::string);
+	}
+
+	return bytes;
+}
+
+std::pair<std::size_t, std::uint32_t> pst::StringInternTable::Locate(std::uint32_t id)
+{
+	// Segments start at FirstSegmentSize * (2^k - 1), so shifted id has its highest bit at FirstSegmentBits + k
+	const std::uint64_t shiftedId = std::uint64_t(id) + FirstSegmentSize;
+	std::size_t segmentIndex = 0;
+	while (shiftedId >> (FirstSegmentBits + segmentIndex + 1))
+	{
+		segmentIndex++;
+	}
+
+	return { segmentIndex, static_cast<std::uint32_t>(shiftedId - (std::uint64_t(FirstSegmentSize) << segmentIndex)) };
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+namespace pst
+{
+	/// Append-only table which maps strings to dense ids 0, 1, 2, ... Id of a string never changes and string is never removed,
+	/// so ids and views of interned strings can be kept by any version of a persistent map and stay valid after rollback.
+	/// Strings live in segments which are never moved, segment k holds FirstSegmentSize << k strings.
+	/// Intern and Find are called by single writer thread. GetString can be called by any thread for ids it got from published data:
+	/// publication of that data orders the string before the reader, and appending new strings never touches existing ones.
+	class StringInternTable
+	{
+	public:
+		static constexpr std::uint32_t InvalidId = UINT32_MAX;
+
+		StringInternTable();
+
+		StringInternTable(const StringInternTable&) = delete;
+		StringInternTable& operator=(const StringInternTable&) = delete;
+
+		/// Returns id of the string, adding it first if it is not in the table yet
+		std::uint32_t Intern(std::string_view string);
+
+		/// Returns id of the string or InvalidId. Writer thread only
+		std::uint32_t Find(std::string_view string) const;
+
+		const std::string& GetString(std::uint32_t id) const;
+
+		/// Number of interned strings, which is also the next id
+		std::uint32_t GetSize() const;
+
+		/// Bytes of segments and string buffers, without hash index
+		std::size_t GetAllocatedBytes() const;
+
+	private:
+		static constexpr std::uint32_t FirstSegmentBits = 10;
+		static constexpr std::uint32_t FirstSegmentSize = 1u << FirstSegmentBits;
+
+		/// Enough segments for every id below InvalidId
+		static constexpr std::size_t MaxSegments = 32 - FirstSegmentBits + 1;
+
+		/// Returns segment index and position of id in it
+		static std::pair<std::size_t, std::uint32_t> Locate(std::uint32_t id);
+
+		std::array<std::unique_ptr<std::string[]>, MaxSegments> m_Segments;
+		std::unordered_map<std::string_view, std::uint32_t> m_Ids;
+		std::uint32_t m_Size;
+		std::size_t m_StringBytes;
+	};
+}
@@ -0,0 +1,399 @@
+#include "OperationLog.h"
+
+#include "PlayersStorage.h"
+
+#include <algorithm>
+#include <cassert>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+pst::OperationLog::OperationLog(DurableFile& file, std::uint64_t lastSequence, std::size_t groupCommitBytes)
+	: OperationLog(&file, &file, lastSequence, groupCommitBytes)
+{
+}
+
+pst::OperationLog::OperationLog(std::ostream& stream, std::uint64_t lastSequence, std::size_t groupCommitBytes)
+	: OperationLog(stream.rdbuf(), nullptr, lastSequence, groupCommitBytes)
+{
+}
+
+pst::OperationLog::OperationLog(std::streambuf* streamBuffer, DurableFile* file, std::uint64_t lastSequence, std::size_t groupCommitBytes)
+	: m_Stream(streamBuffer)
+	, m_File(file)
+	, m_BufferedBytes(0)
+	, m_GroupCommitBytes(groupCommitBytes)
+	, m_LastSequence(lastSequence)
+{
+	// Header goes out with the first group, so log which has never been flushed is empty
+	BinaryWriter writer(m_Buffer);
+	writer.WriteUInt32(LogMagic);
+	writer.WriteVarUInt(SerializationFormat);
+	m_BufferedBytes = static_cast<std::size_t>(m_Buffer.tellp());
+}
+
+void pst::OperationLog::AppendRegisterPlayerResult(std::string_view playerName, int playerRating)
+{
+	AppendRecord(RecordType::RegisterPlayerResult, playerName, playerRating);
+}
+
+void pst::OperationLog::AppendUnregisterPlayer(std::string_view playerName)
+{
+	AppendRecord(RecordType::UnregisterPlayer, playerName, 0);
+}
+
+void pst::OperationLog::AppendRollback(int step)
+{
+	AppendRecord(RecordType::Rollback, std::string_view(), step);
+}
+
+void pst::OperationLog::AppendBeginBatch()
+{
+	AppendRecord(RecordType::BeginBatch, std::string_view(), 0);
+}
+
+void pst::OperationLog::AppendCommit()
+{
+	AppendRecord(RecordType::Commit, std::string_view(), 0);
+}
+
+void pst::OperationLog::AppendImportPlayers(const std::vector<std::pair<std::string, int>>& playerRatings)
+{
+	// Batch framing drops import which has not been logged completely before crash
+	AppendBeginBatch();
+
+	// Empty import still has a record, so replay imports it too instead of making an empty batch
+	std::size_t index = 0;
+	for (int recordCount = 0; index < playerRatings.size() || recordCount == 0; recordCount++)
+	{
+		std::ostringstream payloadStream;
+		BinaryWriter payloadWriter(payloadStream);
+		payloadWriter.WriteVarUInt(++m_LastSequence);
+		BinaryCodec<RecordType>::Write(payloadWriter, RecordType::ImportPlayers);
+		std::size_t count = 0;
+		std::size_t size = 0;
+		while (index + count < playerRatings.size() && (count == 0 || size < ImportRecordSize))
+		{
+			size += playerRatings[index + count].first.size() + 2 * sizeof(int);
+			count++;
+		}
+
+		payloadWriter.WriteVarUInt(count);
+		for (; count > 0; count--, index++)
+		{
+			payloadWriter.WriteString(playerRatings[index].first);
+			payloadWriter.WriteVarInt(playerRatings[index].second);
+		}
+
+		AppendPayload(payloadStream.str());
+	}
+
+	AppendCommit();
+}
+
+bool pst::OperationLog::Flush()
+{
+	if (m_BufferedBytes > 0)
+	{
+		m_Stream << m_Buffer.rdbuf();
+		m_Buffer.str(std::string());
+		m_Buffer.clear();
+		m_BufferedBytes = 0;
+	}
+
+	// Stream flush hands records to the OS, and only the sync makes them durable
+	return static_cast<bool>(m_Stream.flush()) && (!m_File || m_File->Sync());
+}
+
+std::uint64_t pst::OperationLog::GetLastSequence() const
+{
+	return m_LastSequence;
+}
+
+std::size_t pst::OperationLog::GetBufferedBytes() const
+{
+	return m_BufferedBytes;
+}
+
+bool pst::OperationLog::WriteCheckpoint(DurableFile& file, const PlayersStorage& storage) const
+{
+	std::ostream stream(&file);
+	return WriteCheckpoint(stream, storage) && file.Sync();
+}
+
+bool pst::OperationLog::WriteCheckpoint(std::ostream& stream, const PlayersStorage& storage) const
+{
+	BinaryWriter writer(stream);
+	writer.WriteUInt32(CheckpointMagic);
+	writer.WriteVarUInt(SerializationFormat);
+	writer.WriteVarUInt(m_LastSequence);
+	return storage.Save(stream) && writer.IsGood();
+}
+
+bool pst::OperationLog::ReadCheckpoint(std::istream& stream, PlayersStorage& storage, std::uint64_t& sequence)
+{
+	BinaryReader reader(stream);
+	if (reader.ReadUInt32() != CheckpointMagic || reader.ReadVarUInt() != SerializationFormat)
+	{
+		return false;
+	}
+
+	sequence = reader.ReadVarUInt();
+	return reader.IsGood() && storage.Load(stream);
+}
+
+bool pst::OperationLog::Replay(std::istream& stream, PlayersStorage& storage, std::uint64_t& lastSequence)
+{
+	BinaryReader reader(stream);
+	const std::uint32_t magic = reader.ReadUInt32();
+	const std::uint64_t format = reader.ReadVarUInt();
+	if (!reader.IsGood())
+	{
+		// Header is torn, so nothing has been flushed after it
+		return true;
+	}
+
+	if (magic != LogMagic || format != SerializationFormat)
+	{
+		return false;
+	}
+
+	std::vector<Record> batch;
+	bool isInBatch = false;
+	std::uint64_t readSequence = 0;
+	Record record;
+	while (ReadRecord(reader, record))
+	{
+		// Gap in sequence numbers means that the rest of the log is not a continuation of what has been read
+		if (readSequence != 0 && record.m_Sequence != readSequence + 1)
+		{
+			break;
+		}
+
+		// Log which starts past the checkpoint has lost records in between, so it can't be applied on top of it
+		if (readSequence == 0 && record.m_Sequence > lastSequence + 1)
+		{
+			return false;
+		}
+
+		readSequence = record.m_Sequence;
+		if (record.m_Sequence <= lastSequence)
+		{
+			// Included in checkpoint. Checkpoint is never taken inside batch, so skipped records never split one
+			continue;
+		}
+
+		switch (record.m_Type)
+		{
+		case RecordType::BeginBatch:
+			if (isInBatch)
+			{
+				return false;
+			}
+
+			isInBatch = true;
+			batch.clear();
+			break;
+
+		case RecordType::Commit:
+		{
+			if (!isInBatch)
+			{
+				return false;
+			}
+
+			// Import is logged as batch of import records only
+			const bool isImport = !batch.empty() && batch.front().m_Type == RecordType::ImportPlayers;
+			if (std::any_of(batch.begin(), batch.end(), [isImport](const Record& batchRecord) { return (batchRecord.m_Type == RecordType::ImportPlayers) != isImport; }))
+			{
+				return false;
+			}
+
+			if (isImport)
+			{
+				std::vector<std::pair<std::string, int>> playerRatings;
+				for (Record& batchRecord : batch)
+				{
+					std::move(batchRecord.m_PlayerRatings.begin(), batchRecord.m_PlayerRatings.end(), std::back_inserter(playerRatings));
+				}
+
+				if (!storage.ImportPlayers(playerRatings))
+				{
+					return false;
+				}
+			}
+			else
+			{
+				storage.BeginBatch();
+				for (const Record& batchRecord : batch)
+				{
+					Apply(batchRecord, storage);
+				}
+
+				storage.Commit();
+			}
+
+			isInBatch = false;
+			lastSequence = record.m_Sequence;
+			break;
+		}
+
+		case RecordType::ImportPlayers:
+			if (!isInBatch)
+			{
+				return false;
+			}
+
+			batch.push_back(std::move(record));
+			break;
+
+		case RecordType::Rollback:
+			if (isInBatch || !storage.Rollback(record.m_Value))
+			{
+				return false;
+			}
+
+			lastSequence = record.m_Sequence;
+			break;
+
+		default:
+			if (isInBatch)
+			{
+				batch.push_back(std::move(record));
+			}
+			else
+			{
+				Apply(record, storage);
+				lastSequence = record.m_Sequence;
+			}
+
+			break;
+		}
+	}
+
+	return true;
+}
+
+std::uint32_t pst::OperationLog::GetChecksum(const std::string& payload)
+{
+	std::uint32_t hash = 2166136261u;
+	for (const char byte : payload)
+	{
+		hash = (hash ^ static_cast<unsigned char>(byte)) * 16777619u;
+	}
+
+	return hash;
+}
+
+bool pst::OperationLog::ReadRecord(BinaryReader& reader, Record& record)
+{
+	const std::uint32_t size = reader.ReadUInt32();
+	if (!reader.IsGood() || size > MaxRecordSize)
+	{
+		return false;
+	}
+
+	std::string payload(size, '\0');
+	if (!reader.ReadBytes(payload.data(), payload.size()) || reader.ReadUInt32() != GetChecksum(payload) || !reader.IsGood())
+	{
+		return false;
+	}
+
+	std::istringstream payloadStream(payload);
+	BinaryReader payloadReader(payloadStream);
+	record.m_Sequence = payloadReader.ReadVarUInt();
+	record.m_Type = BinaryCodec<RecordType>::Read(payloadReader);
+	record.m_PlayerName.clear();
+	record.m_Value = 0;
+	record.m_PlayerRatings.clear();
+	switch (record.m_Type)
+	{
+	case RecordType::RegisterPlayerResult:
+		record.m_PlayerName = payloadReader.ReadString();
+		record.m_Value = BinaryCodec<int>::Read(payloadReader);
+		break;
+
+	case RecordType::UnregisterPlayer:
+		record.m_PlayerName = payloadReader.ReadString();
+		break;
+
+	case RecordType::Rollback:
+		record.m_Value = BinaryCodec<int>::Read(payloadReader);
+		break;
+
+	case RecordType::BeginBatch:
+	case RecordType::Commit:
+		break;
+
+	case RecordType::ImportPlayers:
+	{
+		// Every player takes at least two bytes, so larger count can only be a corrupted one
+		const std::uint64_t count = payloadReader.ReadVarUInt();
+		if (count > size / 2)
+		{
+			return false;
+		}
+
+		record.m_PlayerRatings.reserve(static_cast<std::size_t>(count));
+		for (std::uint64_t i = 0; i < count; i++)
+		{
+			std::string playerName = payloadReader.ReadString();
+			const int playerRating = BinaryCodec<int>::Read(payloadReader);
+			record.m_PlayerRatings.emplace_back(std::move(playerName), playerRating);
+		}
+
+		break;
+	}
+
+	default:
+		return false;
+	}
+
+	return payloadReader.IsGood();
+}
+
+void pst::OperationLog::Apply(const Record& record, PlayersStorage& storage)
+{
+	if (record.m_Type == RecordType::RegisterPlayerResult)
+	{
+		storage.RegisterPlayerResult(record.m_PlayerName, record.m_Value);
+	}
+	else
+	{
+		assert(record.m_Type == RecordType::UnregisterPlayer);
+		storage.UnregisterPlayer(record.m_PlayerName);
+	}
+}
+
+void pst::OperationLog::AppendRecord(RecordType type, std::string_view playerName, int value)
+{
+	std::ostringstream payloadStream;
+	BinaryWriter payloadWriter(payloadStream);
+	payloadWriter.WriteVarUInt(++m_LastSequence);
+	BinaryCodec<RecordType>::Write(payloadWriter, type);
+	if (type == RecordType::RegisterPlayerResult || type == RecordType::UnregisterPlayer)
+	{
+		payloadWriter.WriteString(playerName);
+	}
+
+	if (type == RecordType::RegisterPlayerResult || type == RecordType::Rollback)
+	{
+		payloadWriter.WriteVarInt(value);
+	}
+
+	AppendPayload(payloadStream.str());
+}
+
+void pst::OperationLog::AppendPayload(const std::string& payload)
+{
+	assert(payload.size() <= MaxRecordSize);
+	BinaryWriter writer(m_Buffer);
+	writer.WriteUInt32(static_cast<std::uint32_t>(payload.size()));
+	writer.WriteBytes(payload.data(), payload.size());
+	writer.WriteUInt32(GetChecksum(payload));
+	m_BufferedBytes += payload.size() + 2 * sizeof(std::uint32_t);
+	if (m_BufferedBytes >= m_GroupCommitBytes)
+	{
+		Flush();
+	}
+}
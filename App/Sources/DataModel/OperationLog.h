@@ -0,0 +1,135 @@
+#pragma once
+
+#include "../CoreLib/BinaryStream.h"
+#include "../CoreLib/DurableFile.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace pst
+{
+	class PlayersStorage;
+
+	/// Write-ahead log of PlayersStorage changes. Storage with attached log appends a record for every change which makes or moves a step
+	/// before the change returns. Records are buffered and written to the stream by Flush, so a group of changes costs one write (group commit):
+	/// change is durable and can be acknowledged once a following Flush returns true. Records which are not flushed are lost with the log.
+	/// Records have increasing sequence numbers and checkpoint keeps the last one it includes, so recovery replays only newer records:
+	/// ReadCheckpoint, Replay of the log, then WriteCheckpoint with a new log which continues sequence numbers.
+	/// Record is framed with its size and checksum, so torn write at the end of the log is detected and ignored by Replay
+	class OperationLog
+	{
+	public:
+		static constexpr std::size_t DefaultGroupCommitBytes = 64 * 1024;
+
+		/// Appends to file, which should be just opened. lastSequence is the sequence of the last record of previous log
+		explicit OperationLog(DurableFile& file, std::uint64_t lastSequence = 0, std::size_t groupCommitBytes = DefaultGroupCommitBytes);
+
+		/// Appends to stream, which should be opened in binary mode. Flush only hands records to the stream, so they are not durable:
+		/// std::ofstream keeps them in OS cache, which is lost on OS crash or power loss. For tests and logs which are shipped elsewhere
+		explicit OperationLog(std::ostream& stream, std::uint64_t lastSequence = 0, std::size_t groupCommitBytes = DefaultGroupCommitBytes);
+
+		OperationLog(const OperationLog&) = delete;
+		OperationLog& operator=(const OperationLog&) = delete;
+
+		void AppendRegisterPlayerResult(std::string_view playerName, int playerRating);
+		void AppendUnregisterPlayer(std::string_view playerName);
+		void AppendRollback(int step);
+		void AppendBeginBatch();
+		void AppendCommit();
+
+		/// Logs players of PlayersStorage::ImportPlayers as batch of import records, so replay imports them at once instead of n registrations
+		void AppendImportPlayers(const std::vector<std::pair<std::string, int>>& playerRatings);
+
+		/// Writes buffered records and flushes the stream, then syncs log file to disk. Called by Append once buffer reaches group commit size
+		bool Flush();
+
+		/// Sequence number of the last appended record
+		std::uint64_t GetLastSequence() const;
+
+		std::size_t GetBufferedBytes() const;
+
+		/// Saves storage with sequence of the last appended record and syncs file, so previous log can be removed once it returns true.
+		/// Storage should not be in batch
+		bool WriteCheckpoint(DurableFile& file, const PlayersStorage& storage) const;
+
+		/// The same for stream, which is only flushed, so checkpoint is not durable
+		bool WriteCheckpoint(std::ostream& stream, const PlayersStorage& storage) const;
+
+		/// Loads checkpoint into empty storage and returns sequence of the last record it includes
+		static bool ReadCheckpoint(std::istream& stream, PlayersStorage& storage, std::uint64_t& sequence);
+
+		/// Applies records newer than lastSequence and sets it to the last applied one. Records of a batch are collected and applied at once
+		/// on its commit record, so batch which has not been committed before crash is dropped. Batch of import records is applied by ImportPlayers. Single changes are applied one by one,
+		/// which reproduces step numbers of the logged storage. Log should not be attached to storage while it is replayed.
+		/// Replay stops at torn or corrupted record. Returns false if a record can't be applied or the log starts after lastSequence + 1, storage should be discarded then
+		static bool Replay(std::istream& stream, PlayersStorage& storage, std::uint64_t& lastSequence);
+
+	private:
+		enum class RecordType : std::uint8_t
+		{
+			RegisterPlayerResult = 1,
+			UnregisterPlayer,
+			Rollback,
+			BeginBatch,
+			Commit,
+			ImportPlayers
+		};
+
+		struct Record
+		{
+			std::uint64_t m_Sequence;
+			RecordType m_Type;
+			std::string m_PlayerName;
+
+			/// Rating or rollback step
+			int m_Value;
+
+			/// Part of players of import record
+			std::vector<std::pair<std::string, int>> m_PlayerRatings;
+		};
+
+		/// "PSTL" and "PSTC" in little-endian order
+		static constexpr std::uint32_t LogMagic = 0x4C545350;
+		static constexpr std::uint32_t CheckpointMagic = 0x43545350;
+		static constexpr std::uint64_t SerializationFormat = 1;
+
+		/// Larger size field can only be a corrupted one
+		static constexpr std::uint32_t MaxRecordSize = 1 << 20;
+
+		/// Import is split into records of about this size, so none of them reaches MaxRecordSize
+		static constexpr std::size_t ImportRecordSize = 64 * 1024;
+
+		OperationLog(std::streambuf* streamBuffer, DurableFile* file, std::uint64_t lastSequence, std::size_t groupCommitBytes);
+
+		/// FNV-1a of record payload
+		static std::uint32_t GetChecksum(const std::string& payload);
+
+		/// Reads next record. Returns false at the end of the log or on torn or corrupted record
+		static bool ReadRecord(BinaryReader& reader, Record& record);
+
+		static void Apply(const Record& record, PlayersStorage& storage);
+
+		void AppendRecord(RecordType type, std::string_view playerName, int value);
+
+		/// Frames payload with its size and checksum and adds it to the buffer
+		void AppendPayload(const std::string& payload);
+
+		/// Over buffer of the file or of the stream
+		std::ostream m_Stream;
+
+		/// nullptr if log is written to stream
+		DurableFile* m_File;
+
+		std::stringstream m_Buffer;
+		std::size_t m_BufferedBytes;
+		std::size_t m_GroupCommitBytes;
+		std::uint64_t m_LastSequence;
+	};
+}
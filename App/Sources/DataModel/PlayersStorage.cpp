@@ -1,26 +1,555 @@
 #include "PlayersStorage.h"
 
-bool pst::PlayersStorage::RegisterPlayerResult(std::string playerName, int playerRating)
+#include "OperationLog.h"
+
+#include <algorithm>
+#include <cassert>
+#include <tuple>
+
+pst::PlayersStorage::Snapshot::Snapshot(const PlayersStorage& storage)
+	: m_Guard(storage.m_EpochDomain)
+	, m_Names(&storage.m_Names)
+	, m_PlayerIds(storage.m_PlayerIds.GetSnapshot(m_Guard))
+	, m_PlayerRatings(storage.m_PlayerRatings.GetSnapshot(m_Guard))
+	, m_RatingIndex(storage.m_RatingIndex.GetSnapshot(m_Guard))
+{
+	// Maps are published one after another, so reader can rarely catch the writer in between. Everything loaded under the guard is protected, so just load all again
+	while (m_PlayerIds.GetPublishCount() != m_PlayerRatings.GetPublishCount() || m_PlayerRatings.GetPublishCount() != m_RatingIndex.GetPublishCount())
+	{
+		m_PlayerIds = storage.m_PlayerIds.GetSnapshot(m_Guard);
+		m_PlayerRatings = storage.m_PlayerRatings.GetSnapshot(m_Guard);
+		m_RatingIndex = storage.m_RatingIndex.GetSnapshot(m_Guard);
+	}
+}
+
+int pst::PlayersStorage::Snapshot::GetPlayerRank(std::string_view playerName) const
+{
+	return PlayersStorage::GetPlayerRankById(m_PlayerRatings, m_RatingIndex, *m_Names, FindPlayerId(playerName));
+}
+
+int pst::PlayersStorage::Snapshot::GetPlayerRating(std::string_view playerName) const
+{
+	return PlayersStorage::GetPlayerRatingById(m_PlayerRatings, FindPlayerId(playerName));
+}
+
+void pst::PlayersStorage::Snapshot::VisitLeaderboard(int firstRank, int count, const std::function<void(const std::string&, int)>& visitor) const
+{
+	PlayersStorage::VisitLeaderboard(m_RatingIndex, firstRank, count, visitor);
+}
+
+void pst::PlayersStorage::Snapshot::VisitPlayersByName(std::string_view firstName, int count, const std::function<void(const std::string&, int)>& visitor) const
 {
-	m_PlayerRatings.Insert(playerName)->m_Value = playerRating;
+	PlayersStorage::VisitPlayersByName(m_PlayerIds, m_PlayerRatings, *m_Names, firstName, count, visitor);
+}
+
+std::uint32_t pst::PlayersStorage::Snapshot::FindPlayerId(std::string_view playerName) const
+{
+	// Hash index of the names is changed by the writer, so reader finds id through the map published with the snapshot
+	auto* node = m_PlayerIds.Search(playerName);
+	return node ? node->m_Value : StringInternTable::InvalidId;
+}
+
+pst::PlayersStorage::PlayersStorage()
+	: m_PlayerIds(m_EpochDomain)
+	, m_PlayerRatings(m_EpochDomain)
+	, m_RatingIndex(m_EpochDomain)
+{
+}
+
+bool pst::PlayersStorage::RegisterPlayerResult(std::string_view playerName, int playerRating)
+{
+	if (m_OperationLog)
+	{
+		m_OperationLog->AppendRegisterPlayerResult(playerName, playerRating);
+	}
+
+	const bool isSingleStep = !m_PlayerRatings.IsInBatch();
+	if (isSingleStep)
+	{
+		BeginStep();
+	}
+
+	const std::uint32_t playerId = m_Names.Intern(playerName);
+	const std::string* internedName = &m_Names.GetString(playerId);
+	if (auto* node = m_PlayerRatings.Search(playerId))
+	{
+		m_RatingIndex.Delete(RatingKey{ node->m_Value, internedName });
+	}
+	else
+	{
+		m_PlayerIds.Insert(*internedName)->m_Value = playerId;
+	}
+
+	m_PlayerRatings.Insert(playerId)->m_Value = playerRating;
+	m_RatingIndex.Insert(RatingKey{ playerRating, internedName });
+	if (isSingleStep)
+	{
+		CommitStep();
+	}
+
 	return true;
 }
 
-bool pst::PlayersStorage::UnregisterPlayer(const std::string& playerName)
+bool pst::PlayersStorage::UnregisterPlayer(std::string_view playerName)
 {
-	m_PlayerRatings.Delete(playerName);
+	const std::uint32_t playerId = m_Names.Find(playerName);
+	auto* node = playerId != StringInternTable::InvalidId ? m_PlayerRatings.Search(playerId) : nullptr;
+	if (!node)
+	{
+		// Nothing changes so no new version is created
+		return true;
+	}
+
+	if (m_OperationLog)
+	{
+		m_OperationLog->AppendUnregisterPlayer(playerName);
+	}
+
+	const bool isSingleStep = !m_PlayerRatings.IsInBatch();
+	if (isSingleStep)
+	{
+		BeginStep();
+	}
+
+	// Name stays interned, so the player gets the same id if registered again
+	m_RatingIndex.Delete(RatingKey{ node->m_Value, &m_Names.GetString(playerId) });
+	m_PlayerRatings.Delete(playerId);
+	m_PlayerIds.Delete(playerName);
+	if (isSingleStep)
+	{
+		CommitStep();
+	}
+
 	return true;
 }
 
 bool pst::PlayersStorage::Rollback(int step)
 {
-	m_PlayerRatings.Rollback(step);
+	if (!m_PlayerRatings.Rollback(step))
+	{
+		return false;
+	}
+
+	// All maps are trimmed together, so they have the same horizon. Interned names are kept, older steps may still refer to them
+	[[maybe_unused]] const bool isRolledBack = m_PlayerIds.Rollback(step) && m_RatingIndex.Rollback(step);
+	assert(isRolledBack);
+	if (m_OperationLog)
+	{
+		// Failed rollback changes nothing, so only successful one is logged
+		m_OperationLog->AppendRollback(step);
+	}
+
+	return true;
+}
+
+void pst::PlayersStorage::SetHistoryLimit(int maxSteps)
+{
+	assert(maxSteps >= 0);
+	m_HistoryLimit = maxSteps;
+	if (m_HistoryLimit > 0 && !m_PlayerRatings.IsInBatch())
+	{
+		TrimHistory(m_HistoryLimit);
+	}
+}
+
+void pst::PlayersStorage::TrimHistory(int keepSteps)
+{
+	assert(keepSteps >= 0);
+	const int oldestVersion = m_PlayerRatings.GetVersion() - keepSteps;
+	m_PlayerIds.DropVersionsBefore(oldestVersion);
+	m_PlayerRatings.DropVersionsBefore(oldestVersion);
+	m_RatingIndex.DropVersionsBefore(oldestVersion);
+}
+
+std::size_t pst::PlayersStorage::ReclaimMemory()
+{
+	return m_PlayerIds.ReclaimAll() + m_PlayerRatings.ReclaimAll() + m_RatingIndex.ReclaimAll();
+}
+
+bool pst::PlayersStorage::GetStepMemory(int step, pst::PersistentMapVersionMemory& memory) const
+{
+	// Versions of all maps are equal, so step is either retained by all of them or by none
+	pst::PersistentMapVersionMemory playerIds;
+	pst::PersistentMapVersionMemory playerRatings;
+	pst::PersistentMapVersionMemory ratingIndex;
+	if (!m_PlayerIds.GetVersionMemory(step, playerIds) || !m_PlayerRatings.GetVersionMemory(step, playerRatings) || !m_RatingIndex.GetVersionMemory(step, ratingIndex))
+	{
+		return false;
+	}
+
+	memory.m_Nodes = playerIds.m_Nodes + playerRatings.m_Nodes + ratingIndex.m_Nodes;
+	memory.m_Bytes = playerIds.m_Bytes + playerRatings.m_Bytes + ratingIndex.m_Bytes;
+	memory.m_UniqueNodes = playerIds.m_UniqueNodes + playerRatings.m_UniqueNodes + ratingIndex.m_UniqueNodes;
+	memory.m_UniqueBytes = playerIds.m_UniqueBytes + playerRatings.m_UniqueBytes + ratingIndex.m_UniqueBytes;
+	return true;
+}
+
+bool pst::PlayersStorage::GetRetainedMemory(int fromStep, int toStep, pst::PersistentMapMemory& memory) const
+{
+	pst::PersistentMapMemory playerIds;
+	pst::PersistentMapMemory playerRatings;
+	pst::PersistentMapMemory ratingIndex;
+	if (!m_PlayerIds.GetRetainedMemory(fromStep, toStep, playerIds) || !m_PlayerRatings.GetRetainedMemory(fromStep, toStep, playerRatings)
+		|| !m_RatingIndex.GetRetainedMemory(fromStep, toStep, ratingIndex))
+	{
+		return false;
+	}
+
+	memory.m_Nodes = playerIds.m_Nodes + playerRatings.m_Nodes + ratingIndex.m_Nodes;
+	memory.m_Bytes = playerIds.m_Bytes + playerRatings.m_Bytes + ratingIndex.m_Bytes;
+	return true;
+}
+
+pst::PersistentMapMemory pst::PlayersStorage::GetLiveMemory() const
+{
+	const pst::PersistentMapMemory playerIds = m_PlayerIds.GetLiveMemory();
+	const pst::PersistentMapMemory playerRatings = m_PlayerRatings.GetLiveMemory();
+	const pst::PersistentMapMemory ratingIndex = m_RatingIndex.GetLiveMemory();
+	pst::PersistentMapMemory memory;
+	memory.m_Nodes = playerIds.m_Nodes + playerRatings.m_Nodes + ratingIndex.m_Nodes;
+	memory.m_Bytes = playerIds.m_Bytes + playerRatings.m_Bytes + ratingIndex.m_Bytes + m_Names.GetAllocatedBytes();
+	return memory;
+}
+
+void pst::PlayersStorage::BeginBatch()
+{
+	if (m_OperationLog)
+	{
+		m_OperationLog->AppendBeginBatch();
+	}
+
+	BeginStep();
+}
+
+void pst::PlayersStorage::Commit()
+{
+	if (m_OperationLog)
+	{
+		m_OperationLog->AppendCommit();
+	}
+
+	CommitStep();
+}
+
+void pst::PlayersStorage::BeginStep()
+{
+	m_PlayerIds.BeginBatch();
+	m_PlayerRatings.BeginBatch();
+	m_RatingIndex.BeginBatch();
+	assert(m_PlayerIds.GetVersion() == m_PlayerRatings.GetVersion() && m_PlayerRatings.GetVersion() == m_RatingIndex.GetVersion());
+}
+
+void pst::PlayersStorage::CommitStep()
+{
+	m_PlayerIds.Commit();
+	m_PlayerRatings.Commit();
+	m_RatingIndex.Commit();
+	if (m_HistoryLimit > 0)
+	{
+		TrimHistory(m_HistoryLimit);
+	}
+}
+
+bool pst::PlayersStorage::IsStepRetained(int step) const
+{
+	return step >= m_PlayerRatings.GetOldestVersion() && step <= m_PlayerRatings.GetVersion();
+}
+
+bool pst::PlayersStorage::RegisterMatchResult(const std::vector<std::pair<std::string, int>>& playerRatings)
+{
+	BeginBatch();
+	for (const auto& [playerName, playerRating] : playerRatings)
+	{
+		RegisterPlayerResult(playerName, playerRating);
+	}
+
+	Commit();
+	return true;
+}
+
+bool pst::PlayersStorage::ImportPlayers(const std::vector<std::pair<std::string, int>>& playerRatings)
+{
+	if (m_PlayerRatings.IsInBatch() || m_PlayerRatings.GetSize() > 0)
+	{
+		return false;
+	}
+
+	if (m_OperationLog)
+	{
+		// Replay imports the same players, so it builds the same step in O(n) too
+		m_OperationLog->AppendImportPlayers(playerRatings);
+	}
+
+	// Ids of interned names are dense, so ratings are ordered by id and deduplicated by a table instead of sort
+	std::vector<int> ratingById;
+	std::vector<bool> isImported;
+	for (const auto& [playerName, playerRating] : playerRatings)
+	{
+		const std::uint32_t playerId = m_Names.Intern(playerName);
+		if (playerId >= ratingById.size())
+		{
+			ratingById.resize(playerId + 1);
+			isImported.resize(playerId + 1);
+		}
+
+		ratingById[playerId] = playerRating;
+		isImported[playerId] = true;
+	}
+
+	std::vector<std::pair<std::uint32_t, int>> ratings;
+	std::vector<std::pair<std::string_view, std::uint32_t>> playerIds;
+	std::vector<std::pair<RatingKey, bool>> ratingKeys;
+	for (std::uint32_t playerId = 0; playerId < ratingById.size(); playerId++)
+	{
+		if (isImported[playerId])
+		{
+			const std::string* internedName = &m_Names.GetString(playerId);
+			ratings.emplace_back(playerId, ratingById[playerId]);
+			playerIds.emplace_back(*internedName, playerId);
+			ratingKeys.emplace_back(RatingKey{ ratingById[playerId], internedName }, false);
+		}
+	}
+
+	// Every map makes one new version, so versions stay equal
+	[[maybe_unused]] const bool isImportedAll = m_PlayerRatings.BulkLoad(ratings.begin(), ratings.end())
+		&& m_PlayerIds.BulkLoadUnsorted(std::move(playerIds)) && m_RatingIndex.BulkLoadUnsorted(std::move(ratingKeys));
+	assert(isImportedAll);
+	assert(m_PlayerIds.GetVersion() == m_PlayerRatings.GetVersion() && m_PlayerRatings.GetVersion() == m_RatingIndex.GetVersion());
+	if (m_HistoryLimit > 0)
+	{
+		TrimHistory(m_HistoryLimit);
+	}
+
 	return true;
 }
 
-int pst::PlayersStorage::GetPlayerRating(const std::string& playerName) const
+int pst::PlayersStorage::GetPlayerRank(std::string_view playerName) const
+{
+	return GetPlayerRankById(m_PlayerRatings, m_RatingIndex, m_Names, m_Names.Find(playerName));
+}
+
+int pst::PlayersStorage::GetPlayerRating(std::string_view playerName) const
+{
+	return GetPlayerRatingById(m_PlayerRatings, m_Names.Find(playerName));
+}
+
+int pst::PlayersStorage::GetPlayerCount() const
+{
+	return m_PlayerRatings.GetSize();
+}
+
+int pst::PlayersStorage::CountPlayersBefore(int playerRating, std::string_view playerName) const
+{
+	// Lookup key views the name, so it doesn't have to be interned
+	return m_RatingIndex.GetRank(RatingLookupKey(playerRating, playerName));
+}
+
+int pst::PlayersStorage::GetPlayerRating(std::string_view playerName, int step) const
+{
+	// Ids never change, so id of current name table is valid for any step
+	const std::uint32_t playerId = m_Names.Find(playerName);
+	auto* node = playerId != StringInternTable::InvalidId ? m_PlayerRatings.Search(playerId, step) : nullptr;
+	if (node)
+	{
+		return node->m_Value;
+	}
+
+	return -1;
+}
+
+int pst::PlayersStorage::GetPlayerRank(std::string_view playerName, int step) const
+{
+	if (!IsStepRetained(step))
+	{
+		return -1;
+	}
+
+	// Views of the same step are consistent, so rank is computed as for snapshot
+	return GetPlayerRankById(m_PlayerRatings.View(step), m_RatingIndex.View(step), m_Names, m_Names.Find(playerName));
+}
+
+int pst::PlayersStorage::CountPlayersBefore(int playerRating, std::string_view playerName, int step) const
+{
+	if (!IsStepRetained(step))
+	{
+		return -1;
+	}
+
+	return m_RatingIndex.View(step).GetRank(RatingLookupKey(playerRating, playerName));
+}
+
+bool pst::PlayersStorage::VisitRatingChanges(int fromStep, int toStep, const std::function<void(const std::string&, int, int)>& visitor) const
+{
+	// Ratings are ordered by id, so changes are collected and sorted by name
+	std::vector<std::tuple<const std::string*, int, int>> changes;
+	const bool isVisited = m_PlayerRatings.Diff(fromStep, toStep, [this, &changes](const auto* fromNode, const auto* toNode)
+	{
+		const std::uint32_t playerId = fromNode ? fromNode->m_Key : toNode->m_Key;
+		changes.emplace_back(&m_Names.GetString(playerId), fromNode ? fromNode->m_Value : -1, toNode ? toNode->m_Value : -1);
+	});
+
+	std::sort(std::begin(changes), std::end(changes), [](const auto& left, const auto& right) { return *std::get<0>(left) < *std::get<0>(right); });
+	for (const auto& [playerName, oldRating, newRating] : changes)
+	{
+		visitor(*playerName, oldRating, newRating);
+	}
+
+	return isVisited;
+}
+
+int pst::PlayersStorage::GetStep() const
+{
+	return m_PlayerRatings.GetVersion();
+}
+
+void pst::PlayersStorage::VisitLeaderboard(int firstRank, int count, const std::function<void(const std::string&, int)>& visitor) const
+{
+	VisitLeaderboard(m_RatingIndex, firstRank, count, visitor);
+}
+
+void pst::PlayersStorage::VisitPlayersByName(std::string_view firstName, int count, const std::function<void(const std::string&, int)>& visitor) const
+{
+	VisitPlayersByName(m_PlayerIds, m_PlayerRatings, m_Names, firstName, count, visitor);
+}
+
+pst::PlayersStorage::Snapshot pst::PlayersStorage::GetSnapshot() const
+{
+	return Snapshot(*this);
+}
+
+bool pst::PlayersStorage::Save(std::ostream& stream) const
+{
+	assert(!m_PlayerRatings.IsInBatch());
+	BinaryWriter writer(stream);
+	writer.WriteUInt32(SerializationMagic);
+	writer.WriteVarUInt(SerializationFormat);
+	writer.WriteVarUInt(m_Names.GetSize());
+	for (std::uint32_t id = 0; id < m_Names.GetSize(); id++)
+	{
+		writer.WriteString(m_Names.GetString(id));
+	}
+
+	// All maps are trimmed together, so they have the same oldest version
+	const int oldestStep = m_PlayerRatings.GetOldestVersion();
+	return m_PlayerIds.Save(writer, oldestStep, PlayerIdsCodec{ m_Names })
+		&& m_PlayerRatings.Save(writer, oldestStep)
+		&& m_RatingIndex.Save(writer, oldestStep, RatingIndexCodec{ m_Names });
+}
+
+bool pst::PlayersStorage::Load(std::istream& stream)
+{
+	assert(m_Names.GetSize() == 0 && GetStep() == 0);
+	BinaryReader reader(stream);
+	if (reader.ReadUInt32() != SerializationMagic || reader.ReadVarUInt() != SerializationFormat)
+	{
+		return false;
+	}
+
+	const std::uint64_t nameCount = reader.ReadVarUInt();
+	for (std::uint64_t id = 0; id < nameCount && reader.IsGood(); id++)
+	{
+		// Ids are dense in order of interning, so they are restored by interning names in saved order. Repeated name means malformed input
+		if (m_Names.Intern(reader.ReadString()) != id)
+		{
+			return false;
+		}
+	}
+
+	if (!reader.IsGood()
+		|| !m_PlayerIds.Load(reader, PlayerIdsCodec{ m_Names })
+		|| !m_PlayerRatings.Load(reader)
+		|| !m_RatingIndex.Load(reader, RatingIndexCodec{ m_Names }))
+	{
+		return false;
+	}
+
+	// Maps are always changed together, so any other combination is not written by Save
+	return m_PlayerIds.GetVersion() == m_PlayerRatings.GetVersion() && m_PlayerRatings.GetVersion() == m_RatingIndex.GetVersion()
+		&& m_PlayerIds.GetOldestVersion() == m_PlayerRatings.GetOldestVersion() && m_PlayerRatings.GetOldestVersion() == m_RatingIndex.GetOldestVersion();
+}
+
+void pst::PlayersStorage::SetOperationLog(OperationLog* log)
+{
+	m_OperationLog = log;
+}
+
+void pst::PlayersStorage::PlayerIdsCodec::WriteKey(BinaryWriter& writer, std::string_view name) const
+{
+	writer.WriteVarUInt(m_Names.Find(name));
+}
+
+std::string_view pst::PlayersStorage::PlayerIdsCodec::ReadKey(BinaryReader& reader) const
+{
+	const std::string* name = ReadName(reader, m_Names);
+	return name ? std::string_view(*name) : std::string_view();
+}
+
+void pst::PlayersStorage::PlayerIdsCodec::WriteValue(BinaryWriter& writer, std::uint32_t playerId) const
+{
+	BinaryCodec<std::uint32_t>::Write(writer, playerId);
+}
+
+std::uint32_t pst::PlayersStorage::PlayerIdsCodec::ReadValue(BinaryReader& reader) const
+{
+	const std::uint32_t playerId = BinaryCodec<std::uint32_t>::Read(reader);
+	if (playerId >= m_Names.GetSize())
+	{
+		reader.Fail();
+	}
+
+	return playerId;
+}
+
+void pst::PlayersStorage::RatingIndexCodec::WriteKey(BinaryWriter& writer, const RatingKey& key) const
 {
-	auto* node = m_PlayerRatings.Search(playerName);
+	writer.WriteVarInt(key.m_Rating);
+	writer.WriteVarUInt(m_Names.Find(*key.m_Name));
+}
+
+pst::PlayersStorage::RatingKey pst::PlayersStorage::RatingIndexCodec::ReadKey(BinaryReader& reader) const
+{
+	const int rating = BinaryCodec<int>::Read(reader);
+	return RatingKey{ rating, ReadName(reader, m_Names) };
+}
+
+void pst::PlayersStorage::RatingIndexCodec::WriteValue(BinaryWriter&, bool) const
+{
+	// Value is unused, so nothing is written
+}
+
+bool pst::PlayersStorage::RatingIndexCodec::ReadValue(BinaryReader&) const
+{
+	return false;
+}
+
+const std::string* pst::PlayersStorage::ReadName(BinaryReader& reader, const StringInternTable& names)
+{
+	const std::uint64_t id = reader.ReadVarUInt();
+	if (!reader.IsGood() || id >= names.GetSize())
+	{
+		reader.Fail();
+		return nullptr;
+	}
+
+	return &names.GetString(static_cast<std::uint32_t>(id));
+}
+
+template <typename TPlayerRatings, typename TRatingIndex>
+int pst::PlayersStorage::GetPlayerRankById(const TPlayerRatings& playerRatings, const TRatingIndex& ratingIndex, const StringInternTable& names, std::uint32_t playerId)
+{
+	auto* node = playerId != StringInternTable::InvalidId ? playerRatings.Search(playerId) : nullptr;
+	if (!node)
+	{
+		return -1;
+	}
+
+	return ratingIndex.GetRank(RatingKey{ node->m_Value, &names.GetString(playerId) }) + 1;
+}
+
+template <typename TPlayerRatings>
+int pst::PlayersStorage::GetPlayerRatingById(const TPlayerRatings& playerRatings, std::uint32_t playerId)
+{
+	auto* node = playerId != StringInternTable::InvalidId ? playerRatings.Search(playerId) : nullptr;
 	if (node)
 	{
 		return node->m_Value;
@@ -28,3 +557,19 @@ int pst::PlayersStorage::GetPlayerRating(const std::string& playerName) const
 
 	return -1;
 }
+
+template <typename TRatingIndex>
+void pst::PlayersStorage::VisitLeaderboard(const TRatingIndex& ratingIndex, int firstRank, int count, const std::function<void(const std::string&, int)>& visitor)
+{
+	ratingIndex.VisitByRank(firstRank - 1, count, [&visitor](const auto& node) { visitor(*node.m_Key.m_Name, node.m_Key.m_Rating); });
+}
+
+template <typename TPlayerIds, typename TPlayerRatings>
+void pst::PlayersStorage::VisitPlayersByName(const TPlayerIds& playerIds, const TPlayerRatings& playerRatings, const StringInternTable& names, std::string_view firstName, int count, const std::function<void(const std::string&, int)>& visitor)
+{
+	const auto end = playerIds.end();
+	for (auto iterator = playerIds.LowerBound(firstName); count > 0 && iterator != end; ++iterator, count--)
+	{
+		visitor(names.GetString(iterator->m_Value), GetPlayerRatingById(playerRatings, iterator->m_Value));
+	}
+}
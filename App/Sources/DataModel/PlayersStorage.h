@@ -1,22 +1,261 @@
 #pragma once
 
 #include "../CoreLib/PersistentMap.h"
+#include "../CoreLib/StringInternTable.h"
 
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
 #include <functional>
+#include <istream>
+#include <ostream>
 #include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
 namespace pst
 {
+	class OperationLog;
+
+	/// Players are changed by single writer thread. Any number of reader threads can query them through snapshots without locks.
 	class PlayersStorage
 	{
+	private:
+		/// Key of rating index. Best player goes first. Name is interned, so key is copied by clones without allocation
+		struct RatingKey
+		{
+			int m_Rating;
+			const std::string* m_Name;
+
+			bool operator==(const RatingKey& other) const { return m_Rating == other.m_Rating && *m_Name == *other.m_Name; }
+		};
+
+		/// Lookup key of rating index. Name is a view, so rank of any name is counted without building a string.
+		/// Key made from stored one keeps its interned name, which is needed to store the key and finds the same player by pointer
+		struct RatingLookupKey
+		{
+			int m_Rating;
+			std::string_view m_Name;
+			const std::string* m_InternedName;
+
+			RatingLookupKey(int rating, std::string_view name) : m_Rating(rating), m_Name(name), m_InternedName(nullptr) {}
+			RatingLookupKey(const RatingKey& key) : m_Rating(key.m_Rating), m_Name(*key.m_Name), m_InternedName(key.m_Name) {}
+		};
+
+		/// Orders rating index by rating descending, then by name, with single three-way comparison
+		struct RatingKeyTraits
+		{
+			using LookupKey = RatingLookupKey;
+			using Prefix = NoKeyPrefix;
+
+			static RatingKey MakeKey(const RatingLookupKey& key)
+			{
+				assert(key.m_InternedName);
+				return RatingKey{ key.m_Rating, key.m_InternedName };
+			}
+
+			static int Compare(const RatingLookupKey& left, const RatingKey& right)
+			{
+				if (left.m_Rating != right.m_Rating)
+				{
+					return left.m_Rating > right.m_Rating ? -1 : 1;
+				}
+
+				// Every name is interned once, so the same player has the same pointer
+				return left.m_InternedName == right.m_Name ? 0 : left.m_Name.compare(*right.m_Name);
+			}
+
+			static Prefix GetPrefix(const RatingLookupKey&) { return Prefix(); }
+		};
+
+		/// Registered players in alphabetical order. Key views interned name, value is player id.
+		/// Names are compared by cached 8-byte prefix first, so descent rarely touches string buffers
+		using PlayerIds = PersistentMap<std::string_view, std::uint32_t, NodePool, StringPrefixKeyTraits<std::string_view>>;
+
+		/// Rating by player id
+		using PlayerRatings = PersistentMap<std::uint32_t, int>;
+
+		/// Value is unused
+		using RatingIndex = PersistentMap<RatingKey, bool, NodePool, RatingKeyTraits>;
+
+		/// Names are saved once in the names table, so map codecs write them as ids and resolve ids to interned names on load
+		struct PlayerIdsCodec
+		{
+			const StringInternTable& m_Names;
+
+			void WriteKey(BinaryWriter& writer, std::string_view name) const;
+			std::string_view ReadKey(BinaryReader& reader) const;
+			void WriteValue(BinaryWriter& writer, std::uint32_t playerId) const;
+			std::uint32_t ReadValue(BinaryReader& reader) const;
+		};
+
+		struct RatingIndexCodec
+		{
+			const StringInternTable& m_Names;
+
+			void WriteKey(BinaryWriter& writer, const RatingKey& key) const;
+			RatingKey ReadKey(BinaryReader& reader) const;
+			void WriteValue(BinaryWriter& writer, bool value) const;
+			bool ReadValue(BinaryReader& reader) const;
+		};
+
 	public:
-		bool RegisterPlayerResult(std::string playerName, int playerRating);
-		bool UnregisterPlayer(const std::string& playerName);
+		/// Consistent read-only view of the last committed step. Can be used by any thread concurrently with the writer.
+		/// Keeps memory of the step alive while it exists, so it should be short-lived
+		class Snapshot
+		{
+		public:
+			int GetPlayerRank(std::string_view playerName) const;
+			int GetPlayerRating(std::string_view playerName) const;
+			void VisitLeaderboard(int firstRank, int count, const std::function<void(const std::string&, int)>& visitor) const;
+			void VisitPlayersByName(std::string_view firstName, int count, const std::function<void(const std::string&, int)>& visitor) const;
+
+		private:
+			friend class PlayersStorage;
+
+			explicit Snapshot(const PlayersStorage& storage);
+
+			/// Returns id of player registered in this snapshot or InvalidId
+			std::uint32_t FindPlayerId(std::string_view playerName) const;
+
+			EpochDomain::ReadGuard m_Guard;
+			const StringInternTable* m_Names;
+			PlayerIds::Snapshot m_PlayerIds;
+			PlayerRatings::Snapshot m_PlayerRatings;
+			RatingIndex::Snapshot m_RatingIndex;
+		};
+
+		PlayersStorage();
+
+		bool RegisterPlayerResult(std::string_view playerName, int playerRating);
+		bool UnregisterPlayer(std::string_view playerName);
+
+		/// Returns false and changes nothing if step goes beyond retained history
 		bool Rollback(int step);
-		int GetPlayerRank(const std::string& playerName) const;
-		int GetPlayerRating(const std::string& playerName) const;
+
+		/// Keeps at most maxSteps last steps available for Rollback, older ones are dropped on every commit. 0 means unlimited history.
+		void SetHistoryLimit(int maxSteps);
+
+		/// Drops all history except last keepSteps steps. Memory of dropped steps is reclaimed incrementally by following changes
+		void TrimHistory(int keepSteps);
+
+		/// Frees all memory released by dropped or rolled back steps right away. Returns number of freed node bytes
+		std::size_t ReclaimMemory();
+
+		/// Memory of retained step summed over maps of the storage. Returns false if step is not retained. See PersistentMap::GetVersionMemory
+		bool GetStepMemory(int step, PersistentMapVersionMemory& memory) const;
+
+		/// Memory needed to keep steps [fromStep; toStep]. Returns false if any of them is not retained. See PersistentMap::GetRetainedMemory
+		bool GetRetainedMemory(int fromStep, int toStep, PersistentMapMemory& memory) const;
+
+		/// All nodes of the storage including released ones, plus names table. Names are never freed, so they are not part of any step
+		PersistentMapMemory GetLiveMemory() const;
+
+		/// All changes between BeginBatch and Commit make single step, so they are rolled back together
+		void BeginBatch();
+		void Commit();
+
+		/// Registers results of all match participants as single step
+		bool RegisterMatchResult(const std::vector<std::pair<std::string, int>>& playerRatings);
+
+		/// Registers players of an export as single step into storage which has no players. Every map is built in O(n) after parallel sort
+		/// instead of n inserts with n intermediate versions. The last rating of repeated name wins. Returns false and changes nothing if storage has players or is in batch
+		bool ImportPlayers(const std::vector<std::pair<std::string, int>>& playerRatings);
+
+		/// Returns 1-based position of player in leaderboard or -1 if player is not registered.
+		/// Players are ordered by rating descending, players with equal rating are ordered by name.
+		int GetPlayerRank(std::string_view playerName) const;
+		int GetPlayerRating(std::string_view playerName) const;
+
+		/// Returns number of registered players
+		int GetPlayerCount() const;
+
+		/// Returns number of players who go before specified rating and name in leaderboard. Player doesn't have to be registered,
+		/// so rank of a player in several storages is merged by summing these counts
+		int CountPlayersBefore(int playerRating, std::string_view playerName) const;
+
+		/// Returns rating which player had at specified step without rolling back. -1 if player was not registered or step is beyond retained history
+		int GetPlayerRating(std::string_view playerName, int step) const;
+
+		/// Returns rank which player had at specified step without rolling back. -1 if player was not registered or step is beyond retained history
+		int GetPlayerRank(std::string_view playerName, int step) const;
+
+		/// Returns number of players who went before specified rating and name at specified step. -1 if step is beyond retained history
+		int CountPlayersBefore(int playerRating, std::string_view playerName, int step) const;
+
+		/// Calls visitor(name, oldRating, newRating) for every player whose rating differs between two steps, ordered by name. Missing rating is -1.
+		/// Takes O(changes * log n) plus sorting of changes by name. Returns false if any step is beyond retained history
+		bool VisitRatingChanges(int fromStep, int toStep, const std::function<void(const std::string&, int, int)>& visitor) const;
+
+		/// Returns number of current step. Every change or batch makes new step, rollback returns to older one
+		int GetStep() const;
+
+		/// Calls visitor with name and rating for up to count players starting from specified rank. Takes O(log n + count).
+		/// "Players around me" page is VisitLeaderboard(GetPlayerRank(name) - k, 2 * k + 1, visitor).
+		void VisitLeaderboard(int firstRank, int count, const std::function<void(const std::string&, int)>& visitor) const;
+
+		/// Calls visitor with name and rating for up to count players in alphabetical order starting from the first name not less than firstName.
+		/// Takes O((count + 1) * log n) as rating of every visited player is looked up by id. Next page starts right after the last visited name.
+		void VisitPlayersByName(std::string_view firstName, int count, const std::function<void(const std::string&, int)>& visitor) const;
+
+		/// Safe to call from any thread
+		Snapshot GetSnapshot() const;
+
+		/// Writes names and every retained step in binary form. Steps share unchanged nodes, so each node and name is written once. Should not be called inside batch
+		bool Save(std::ostream& stream) const;
+
+		/// Restores steps written by Save into storage which has no players and steps yet. Step numbers are kept, history limit is not saved.
+		/// Returns false if data is malformed, storage should be discarded then
+		bool Load(std::istream& stream);
+
+		/// Every following change which makes or moves a step is appended to the log before it returns. nullptr detaches the log. Log should outlive the storage
+		void SetOperationLog(OperationLog* log);
 
 	private:
-		PersistentMap<std::string, int> m_PlayerRatings;
+		/// "PSTP" in little-endian order
+		static constexpr std::uint32_t SerializationMagic = 0x50545350;
+		static constexpr std::uint64_t SerializationFormat = 1;
+
+		/// Step bookkeeping of BeginBatch and Commit. Changes which make single step use them directly, so log sees them as single changes, not batches
+		void BeginStep();
+		void CommitStep();
+
+		bool IsStepRetained(int step) const;
+
+		/// Reads id of interned name. Returns nullptr and fails reader if there is no such name
+		static const std::string* ReadName(BinaryReader& reader, const StringInternTable& names);
+
+		// Queries are shared by the storage and its snapshots. Unknown player id is InvalidId
+		template <typename TPlayerRatings, typename TRatingIndex>
+		static int GetPlayerRankById(const TPlayerRatings& playerRatings, const TRatingIndex& ratingIndex, const StringInternTable& names, std::uint32_t playerId);
+
+		template <typename TPlayerRatings>
+		static int GetPlayerRatingById(const TPlayerRatings& playerRatings, std::uint32_t playerId);
+
+		template <typename TPlayerIds, typename TPlayerRatings>
+		static void VisitPlayersByName(const TPlayerIds& playerIds, const TPlayerRatings& playerRatings, const StringInternTable& names, std::string_view firstName, int count, const std::function<void(const std::string&, int)>& visitor);
+
+		template <typename TRatingIndex>
+		static void VisitLeaderboard(const TRatingIndex& ratingIndex, int firstRank, int count, const std::function<void(const std::string&, int)>& visitor);
+
+		/// Shared by all maps, so reader pins single epoch for all of them. Declared first as maps should be destroyed before it
+		mutable EpochDomain m_EpochDomain;
+
+		/// Every name which has ever been registered. Maps refer to players by id and interned name, so nodes don't own strings.
+		/// Table is append-only, so rollback and dropped history never invalidate ids kept by any step
+		StringInternTable m_Names;
+
+		PlayerIds m_PlayerIds;
+
+		PlayerRatings m_PlayerRatings;
+
+		/// Same players as in m_PlayerRatings, ordered for rank queries.
+		/// Every change is done as a batch on all maps, so their versions are always equal
+		RatingIndex m_RatingIndex;
+
+		int m_HistoryLimit = 0;
+
+		OperationLog* m_OperationLog = nullptr;
 	};
 }
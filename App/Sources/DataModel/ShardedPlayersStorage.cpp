@@ -0,0 +1,516 @@
+#include "ShardedPlayersStorage.h"
+
+#include <algorithm>
+#include <cassert>
+
+pst::ShardedPlayersStorage::ShardedPlayersStorage(int shardCount)
+	: m_StepShards(0)
+	, m_InBatch(false)
+	, m_OldestStep(0)
+	, m_HistoryLimit(0)
+{
+	if (shardCount <= 0)
+	{
+		shardCount = static_cast<int>(std::max(std::thread::hardware_concurrency(), 1u));
+	}
+
+	shardCount = std::min(shardCount, MaxShardCount);
+	for (int i = 0; i < shardCount; i++)
+	{
+		m_Shards.push_back(std::make_unique<Shard>());
+	}
+
+	m_ShardSteps.resize(shardCount);
+	m_RetainedShardSteps.resize(shardCount);
+
+	// Threads are started when all shards exist, so vector of shards never moves under a writer
+	for (const std::unique_ptr<Shard>& shard : m_Shards)
+	{
+		shard->m_Writer = std::thread(&ShardedPlayersStorage::RunWriter, std::ref(*shard));
+	}
+}
+
+pst::ShardedPlayersStorage::~ShardedPlayersStorage()
+{
+	for (const std::unique_ptr<Shard>& shard : m_Shards)
+	{
+		{
+			std::lock_guard<std::mutex> lock(shard->m_Mutex);
+			shard->m_IsStopping = true;
+		}
+
+		shard->m_Changed.notify_all();
+	}
+
+	// Writer applies everything queued before it stops
+	for (const std::unique_ptr<Shard>& shard : m_Shards)
+	{
+		shard->m_Writer.join();
+	}
+}
+
+bool pst::ShardedPlayersStorage::RegisterPlayerResult(std::string_view playerName, int playerRating)
+{
+	AddOperation(OperationType::RegisterPlayerResult, playerName, playerRating);
+	if (!m_InBatch)
+	{
+		CommitStep();
+	}
+
+	return true;
+}
+
+bool pst::ShardedPlayersStorage::UnregisterPlayer(std::string_view playerName)
+{
+	// Batch makes its step anyway. Single change makes step only if player is registered, which only the shard knows
+	if (m_InBatch)
+	{
+		AddOperation(OperationType::UnregisterPlayer, playerName, 0);
+		return true;
+	}
+
+	const int shardIndex = GetShardIndex(playerName);
+	FlushShard(shardIndex);
+	if (m_Shards[shardIndex]->m_Storage.GetPlayerRating(playerName) == -1)
+	{
+		return true;
+	}
+
+	AddOperation(OperationType::UnregisterPlayer, playerName, 0);
+	CommitStep();
+	return true;
+}
+
+bool pst::ShardedPlayersStorage::RegisterMatchResult(const std::vector<std::pair<std::string, int>>& playerRatings)
+{
+	BeginBatch();
+	for (const auto& [playerName, playerRating] : playerRatings)
+	{
+		RegisterPlayerResult(playerName, playerRating);
+	}
+
+	Commit();
+	return true;
+}
+
+void pst::ShardedPlayersStorage::BeginBatch()
+{
+	assert(!m_InBatch);
+	m_InBatch = true;
+}
+
+void pst::ShardedPlayersStorage::Commit()
+{
+	assert(m_InBatch);
+	m_InBatch = false;
+	CommitStep();
+}
+
+bool pst::ShardedPlayersStorage::Rollback(int step)
+{
+	assert(!m_InBatch && step > 0);
+	if (step > static_cast<int>(m_History.size()))
+	{
+		return false;
+	}
+
+	// Every shard goes back by the number of rolled back global steps which have changed it
+	std::vector<int> shardSteps(m_Shards.size());
+	for (int i = 0; i < step; i++)
+	{
+		const ShardMask shards = m_History.back();
+		m_History.pop_back();
+		for (std::size_t shardIndex = 0; shardIndex < m_Shards.size(); shardIndex++)
+		{
+			if (shards & (ShardMask(1) << shardIndex))
+			{
+				shardSteps[shardIndex]++;
+			}
+		}
+	}
+
+	for (std::size_t shardIndex = 0; shardIndex < m_Shards.size(); shardIndex++)
+	{
+		if (shardSteps[shardIndex] > 0)
+		{
+			m_ShardSteps[shardIndex] -= shardSteps[shardIndex];
+			m_RetainedShardSteps[shardIndex] -= shardSteps[shardIndex];
+			Enqueue(static_cast<int>(shardIndex), Operation{ OperationType::Rollback, std::string(), shardSteps[shardIndex] });
+		}
+	}
+
+	return true;
+}
+
+void pst::ShardedPlayersStorage::SetHistoryLimit(int maxSteps)
+{
+	assert(maxSteps >= 0);
+	m_HistoryLimit = maxSteps;
+
+	// Shards are inside step of the batch, so history is trimmed on its commit
+	if (m_HistoryLimit == 0 || m_InBatch)
+	{
+		return;
+	}
+
+	// Shards trim their own history when they are told how many of their steps are still retained
+	ShardMask trimmedShards = 0;
+	while (static_cast<int>(m_History.size()) > m_HistoryLimit)
+	{
+		const ShardMask shards = m_History.front();
+		m_History.pop_front();
+		m_OldestStep++;
+		for (std::size_t shardIndex = 0; shardIndex < m_Shards.size(); shardIndex++)
+		{
+			if (shards & (ShardMask(1) << shardIndex))
+			{
+				m_RetainedShardSteps[shardIndex]--;
+			}
+		}
+
+		trimmedShards |= shards;
+	}
+
+	for (std::size_t shardIndex = 0; shardIndex < m_Shards.size(); shardIndex++)
+	{
+		if (trimmedShards & (ShardMask(1) << shardIndex))
+		{
+			Enqueue(static_cast<int>(shardIndex), Operation{ OperationType::TrimHistory, std::string(), m_RetainedShardSteps[shardIndex] });
+		}
+	}
+}
+
+int pst::ShardedPlayersStorage::GetStep() const
+{
+	return m_OldestStep + static_cast<int>(m_History.size());
+}
+
+int pst::ShardedPlayersStorage::GetShardCount() const
+{
+	return static_cast<int>(m_Shards.size());
+}
+
+int pst::ShardedPlayersStorage::GetPlayerRating(std::string_view playerName) const
+{
+	Flush();
+	return m_Shards[GetShardIndex(playerName)]->m_Storage.GetPlayerRating(playerName);
+}
+
+int pst::ShardedPlayersStorage::GetPlayerRating(std::string_view playerName, int step) const
+{
+	if (step < m_OldestStep || step > GetStep())
+	{
+		return -1;
+	}
+
+	const int shardIndex = GetShardIndex(playerName);
+	Flush();
+	return m_Shards[shardIndex]->m_Storage.GetPlayerRating(playerName, GetShardStep(shardIndex, step));
+}
+
+int pst::ShardedPlayersStorage::GetPlayerRank(std::string_view playerName) const
+{
+	const int playerRating = GetPlayerRating(playerName);
+	if (playerRating == -1)
+	{
+		return -1;
+	}
+
+	return CountPlayersBefore(playerRating, playerName) + 1;
+}
+
+int pst::ShardedPlayersStorage::GetPlayerRank(std::string_view playerName, int step) const
+{
+	const int playerRating = GetPlayerRating(playerName, step);
+	if (playerRating == -1)
+	{
+		return -1;
+	}
+
+	// Every shard counts its players at its own step of the same global step
+	int playersBefore = 0;
+	for (std::size_t shardIndex = 0; shardIndex < m_Shards.size(); shardIndex++)
+	{
+		const int shardStep = GetShardStep(static_cast<int>(shardIndex), step);
+		playersBefore += m_Shards[shardIndex]->m_Storage.CountPlayersBefore(playerRating, playerName, shardStep);
+	}
+
+	return playersBefore + 1;
+}
+
+void pst::ShardedPlayersStorage::VisitLeaderboard(int firstRank, int count, const std::function<void(const std::string&, int)>& visitor) const
+{
+	Flush();
+	if (firstRank < 1)
+	{
+		count += firstRank - 1;
+		firstRank = 1;
+	}
+
+	int playerCount = 0;
+	for (const std::unique_ptr<Shard>& shard : m_Shards)
+	{
+		playerCount += shard->m_Storage.GetPlayerCount();
+	}
+
+	if (count <= 0 || firstRank > playerCount)
+	{
+		return;
+	}
+
+	// First visited player has firstRank - 1 players before it. Players of a shard have growing number of players before them,
+	// so the shard which owns the first player finds it by binary search of its own rank
+	std::vector<int> firstShardRanks;
+	const auto getEntry = [this](std::size_t shardIndex, int shardRank)
+	{
+		LeaderboardEntry entry{ std::string(), 0 };
+		m_Shards[shardIndex]->m_Storage.VisitLeaderboard(shardRank, 1, [&entry](const std::string& playerName, int playerRating) { entry = LeaderboardEntry{ playerName, playerRating }; });
+		return entry;
+	};
+
+	for (std::size_t shardIndex = 0; shardIndex < m_Shards.size() && firstShardRanks.empty(); shardIndex++)
+	{
+		int low = 1;
+		int high = m_Shards[shardIndex]->m_Storage.GetPlayerCount();
+		while (low <= high)
+		{
+			const int middle = low + (high - low) / 2;
+			const LeaderboardEntry entry = getEntry(shardIndex, middle);
+			const int playersBefore = CountPlayersBefore(entry.m_PlayerRating, entry.m_PlayerName);
+			if (playersBefore == firstRank - 1)
+			{
+				for (const std::unique_ptr<Shard>& shard : m_Shards)
+				{
+					firstShardRanks.push_back(shard->m_Storage.CountPlayersBefore(entry.m_PlayerRating, entry.m_PlayerName) + 1);
+				}
+
+				break;
+			}
+
+			if (playersBefore < firstRank - 1)
+			{
+				low = middle + 1;
+			}
+			else
+			{
+				high = middle - 1;
+			}
+		}
+	}
+
+	assert(firstShardRanks.size() == m_Shards.size());
+
+	// No shard gives more than count players to the page, so pages of shards are merged
+	std::vector<std::vector<LeaderboardEntry>> shardPages(m_Shards.size());
+	for (std::size_t shardIndex = 0; shardIndex < m_Shards.size(); shardIndex++)
+	{
+		m_Shards[shardIndex]->m_Storage.VisitLeaderboard(firstShardRanks[shardIndex], count, [&page = shardPages[shardIndex]](const std::string& playerName, int playerRating)
+		{
+			page.push_back(LeaderboardEntry{ playerName, playerRating });
+		});
+	}
+
+	std::vector<std::size_t> positions(m_Shards.size());
+	for (; count > 0; count--)
+	{
+		const LeaderboardEntry* best = nullptr;
+		std::size_t bestShardIndex = 0;
+		for (std::size_t shardIndex = 0; shardIndex < m_Shards.size(); shardIndex++)
+		{
+			if (positions[shardIndex] < shardPages[shardIndex].size())
+			{
+				const LeaderboardEntry& entry = shardPages[shardIndex][positions[shardIndex]];
+				if (!best || entry.IsBefore(*best))
+				{
+					best = &entry;
+					bestShardIndex = shardIndex;
+				}
+			}
+		}
+
+		if (!best)
+		{
+			break;
+		}
+
+		visitor(best->m_PlayerName, best->m_PlayerRating);
+		positions[bestShardIndex]++;
+	}
+}
+
+void pst::ShardedPlayersStorage::Flush() const
+{
+	for (std::size_t shardIndex = 0; shardIndex < m_Shards.size(); shardIndex++)
+	{
+		FlushShard(static_cast<int>(shardIndex));
+	}
+}
+
+bool pst::ShardedPlayersStorage::LeaderboardEntry::IsBefore(const LeaderboardEntry& other) const
+{
+	if (m_PlayerRating != other.m_PlayerRating)
+	{
+		return m_PlayerRating > other.m_PlayerRating;
+	}
+
+	return m_PlayerName < other.m_PlayerName;
+}
+
+void pst::ShardedPlayersStorage::RunWriter(Shard& shard)
+{
+	std::vector<Operation> operations;
+	bool isInStep = false;
+	std::unique_lock<std::mutex> lock(shard.m_Mutex);
+	while (true)
+	{
+		shard.m_Changed.wait(lock, [&shard]() { return !shard.m_Queue.empty() || shard.m_IsStopping; });
+		if (shard.m_Queue.empty())
+		{
+			return;
+		}
+
+		// Operations are applied without the lock, so the owner keeps queueing meanwhile
+		operations.swap(shard.m_Queue);
+		shard.m_IsBusy = true;
+		lock.unlock();
+		for (const Operation& operation : operations)
+		{
+			Apply(operation, shard.m_Storage, isInStep);
+		}
+
+		operations.clear();
+		lock.lock();
+		shard.m_IsBusy = false;
+		if (shard.m_Queue.empty())
+		{
+			shard.m_Changed.notify_all();
+		}
+	}
+}
+
+void pst::ShardedPlayersStorage::Apply(const Operation& operation, PlayersStorage& storage, bool& isInStep)
+{
+	switch (operation.m_Type)
+	{
+	case OperationType::RegisterPlayerResult:
+	case OperationType::UnregisterPlayer:
+		// Changes of global step make single step of the shard, so it is rolled back by one step
+		if (!isInStep)
+		{
+			storage.BeginBatch();
+			isInStep = true;
+		}
+
+		if (operation.m_Type == OperationType::RegisterPlayerResult)
+		{
+			storage.RegisterPlayerResult(operation.m_PlayerName, operation.m_Value);
+		}
+		else
+		{
+			storage.UnregisterPlayer(operation.m_PlayerName);
+		}
+
+		break;
+
+	case OperationType::CommitStep:
+		if (!isInStep)
+		{
+			storage.BeginBatch();
+		}
+
+		storage.Commit();
+		isInStep = false;
+		break;
+
+	case OperationType::Rollback:
+	{
+		assert(!isInStep);
+		[[maybe_unused]] const bool isRolledBack = storage.Rollback(operation.m_Value);
+		assert(isRolledBack);
+		break;
+	}
+
+	case OperationType::TrimHistory:
+		assert(!isInStep);
+		storage.TrimHistory(operation.m_Value);
+		break;
+	}
+}
+
+int pst::ShardedPlayersStorage::GetShardIndex(std::string_view playerName) const
+{
+	return static_cast<int>(std::hash<std::string_view>()(playerName) % m_Shards.size());
+}
+
+int pst::ShardedPlayersStorage::GetShardStep(int shardIndex, int step) const
+{
+	assert(step >= m_OldestStep && step <= GetStep());
+	int shardStep = m_ShardSteps[shardIndex];
+	for (std::size_t i = static_cast<std::size_t>(step - m_OldestStep); i < m_History.size(); i++)
+	{
+		if (m_History[i] & (ShardMask(1) << shardIndex))
+		{
+			shardStep--;
+		}
+	}
+
+	return shardStep;
+}
+
+void pst::ShardedPlayersStorage::AddOperation(OperationType type, std::string_view playerName, int value)
+{
+	const int shardIndex = GetShardIndex(playerName);
+	Enqueue(shardIndex, Operation{ type, std::string(playerName), value });
+	m_StepShards |= ShardMask(1) << shardIndex;
+}
+
+void pst::ShardedPlayersStorage::CommitStep()
+{
+	for (std::size_t shardIndex = 0; shardIndex < m_Shards.size(); shardIndex++)
+	{
+		if (!(m_StepShards & (ShardMask(1) << shardIndex)))
+		{
+			continue;
+		}
+
+		Enqueue(static_cast<int>(shardIndex), Operation{ OperationType::CommitStep, std::string(), 0 });
+		m_ShardSteps[shardIndex]++;
+		m_RetainedShardSteps[shardIndex]++;
+	}
+
+	m_History.push_back(m_StepShards);
+	m_StepShards = 0;
+	if (m_HistoryLimit > 0)
+	{
+		SetHistoryLimit(m_HistoryLimit);
+	}
+}
+
+void pst::ShardedPlayersStorage::FlushShard(int shardIndex) const
+{
+	Shard& shard = *m_Shards[shardIndex];
+	std::unique_lock<std::mutex> lock(shard.m_Mutex);
+	shard.m_Changed.wait(lock, [&shard]() { return shard.m_Queue.empty() && !shard.m_IsBusy; });
+}
+
+void pst::ShardedPlayersStorage::Enqueue(int shardIndex, Operation operation)
+{
+	Shard& shard = *m_Shards[shardIndex];
+	{
+		std::lock_guard<std::mutex> lock(shard.m_Mutex);
+		shard.m_Queue.push_back(std::move(operation));
+	}
+
+	shard.m_Changed.notify_all();
+}
+
+int pst::ShardedPlayersStorage::CountPlayersBefore(int playerRating, std::string_view playerName) const
+{
+	int playersBefore = 0;
+	for (const std::unique_ptr<Shard>& shard : m_Shards)
+	{
+		playersBefore += shard->m_Storage.CountPlayersBefore(playerRating, playerName);
+	}
+
+	return playersBefore;
+}
@@ -0,0 +1,165 @@
+#pragma once
+
+#include "PlayersStorage.h"
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace pst
+{
+	/// Players partitioned by name hash into independent PlayersStorage shards. Every shard is changed by its own writer thread, so changes of different shards run in parallel.
+	/// Storage is used by single owner thread. Changes are queued to shards and return without waiting, queries wait until queued changes are applied.
+	/// Every change or batch makes one global step which remembers shards it has changed. Rollback moves every shard back by its own steps
+	/// made by rolled back global steps, so all shards come back to the same global step
+	class ShardedPlayersStorage
+	{
+	public:
+		/// Global step keeps changed shards in a bit mask
+		static constexpr int MaxShardCount = 64;
+
+		/// 0 shards means one per hardware thread
+		explicit ShardedPlayersStorage(int shardCount = 0);
+		~ShardedPlayersStorage();
+
+		ShardedPlayersStorage(const ShardedPlayersStorage&) = delete;
+		ShardedPlayersStorage& operator=(const ShardedPlayersStorage&) = delete;
+
+		bool RegisterPlayerResult(std::string_view playerName, int playerRating);
+
+		/// As PlayersStorage, makes no step if player is not registered. Outside batch it waits for queued changes of player's shard to find that out
+		bool UnregisterPlayer(std::string_view playerName);
+
+		/// Registers results of all match participants as single global step. Shards of participants apply their parts in parallel
+		bool RegisterMatchResult(const std::vector<std::pair<std::string, int>>& playerRatings);
+
+		/// All changes between BeginBatch and Commit make single global step. Every changed shard applies them as single step of its own.
+		/// Changes are queued to shards as they are made, so queries inside batch see its changes as in PlayersStorage
+		void BeginBatch();
+		void Commit();
+
+		/// Returns false and changes nothing if step goes beyond retained history
+		bool Rollback(int step);
+
+		/// Keeps at most maxSteps last global steps available for Rollback. Every shard keeps its own steps made by them. 0 means unlimited history
+		void SetHistoryLimit(int maxSteps);
+
+		/// Returns number of current global step
+		int GetStep() const;
+		int GetShardCount() const;
+
+		/// Queries wait for queued changes, so they see every change made before them
+		int GetPlayerRating(std::string_view playerName) const;
+
+		/// Returns rating which player had at specified global step. -1 if player was not registered or step is beyond retained history
+		int GetPlayerRating(std::string_view playerName, int step) const;
+
+		/// Returns 1-based position of player in leaderboard of all shards or -1 if player is not registered. Order is the same as of PlayersStorage
+		int GetPlayerRank(std::string_view playerName) const;
+
+		/// Returns rank which player had in leaderboard of all shards at specified global step. -1 if player was not registered or step is beyond retained history
+		int GetPlayerRank(std::string_view playerName, int step) const;
+
+		/// Calls visitor with name and rating for up to count players of all shards starting from specified rank.
+		/// First player is found by binary search of rank in each shard, so it takes O(shards^2 * log^2 n + shards * count)
+		void VisitLeaderboard(int firstRank, int count, const std::function<void(const std::string&, int)>& visitor) const;
+
+		/// Waits until every queued change is applied
+		void Flush() const;
+
+	private:
+		enum class OperationType : std::uint8_t
+		{
+			RegisterPlayerResult,
+			UnregisterPlayer,
+
+			/// Ends changes of global step. Shard applies changes of global step as single step of its own
+			CommitStep,
+			Rollback,
+			TrimHistory
+		};
+
+		struct Operation
+		{
+			OperationType m_Type;
+			std::string m_PlayerName;
+			int m_Value;
+		};
+
+		struct Shard
+		{
+			PlayersStorage m_Storage;
+			std::mutex m_Mutex;
+
+			/// Wakes the writer when operations are queued and waiters of Flush when the queue is drained
+			std::condition_variable m_Changed;
+			std::vector<Operation> m_Queue;
+
+			/// Writer applies operations which have been taken from the queue
+			bool m_IsBusy = false;
+			bool m_IsStopping = false;
+			std::thread m_Writer;
+		};
+
+		/// Player of one shard which is merged into leaderboard of all shards
+		struct LeaderboardEntry
+		{
+			std::string m_PlayerName;
+			int m_PlayerRating;
+
+			/// Same order as of rating index of PlayersStorage: rating descending, then name
+			bool IsBefore(const LeaderboardEntry& other) const;
+		};
+
+		using ShardMask = std::uint64_t;
+
+		static void RunWriter(Shard& shard);
+		static void Apply(const Operation& operation, PlayersStorage& storage, bool& isInStep);
+
+		int GetShardIndex(std::string_view playerName) const;
+
+		/// Returns step of shard at retained global step: its current step less its steps made by later global steps
+		int GetShardStep(int shardIndex, int step) const;
+
+		/// Queues operation of current global step to its shard
+		void AddOperation(OperationType type, std::string_view playerName, int value);
+
+		/// Ends current global step in shards it has changed and records the step
+		void CommitStep();
+
+		/// Waits until every queued change of one shard is applied
+		void FlushShard(int shardIndex) const;
+
+		/// Queues single operation
+		void Enqueue(int shardIndex, Operation operation);
+
+		/// Returns number of players of all shards who go before specified rating and name
+		int CountPlayersBefore(int playerRating, std::string_view playerName) const;
+
+		std::vector<std::unique_ptr<Shard>> m_Shards;
+
+		/// Shards changed by global step which is being built
+		ShardMask m_StepShards;
+		bool m_InBatch;
+
+		/// Shards changed by every retained global step after the oldest one, oldest first
+		std::deque<ShardMask> m_History;
+		int m_OldestStep;
+
+		/// Step of every shard after all queued operations
+		std::vector<int> m_ShardSteps;
+
+		/// Number of steps of every shard made by global steps in m_History. Shard trims its history to these steps
+		std::vector<int> m_RetainedShardSteps;
+		int m_HistoryLimit;
+	};
+}
@@ -0,0 +1,115 @@
+#include "NodePoolTest.h"
+
+#include "../CoreLib/NodePool.h"
+#include "../CoreLib/PersistentMap.h"
+
+#include <cassert>
+#include <string>
+#include <vector>
+
+void pst::NodePoolTest::Run()
+{
+	TestBlockReuse();
+	TestSizeClasses();
+	TestFreeFindsOwner();
+	TestMapWithHeapPool();
+}
+
+void pst::NodePoolTest::TestBlockReuse()
+{
+	pst::NodePool pool;
+	void* first = pool.Allocate(48);
+	void* second = pool.Allocate(48);
+	assert(first != second);
+	assert(pool.GetAllocatedBlocks() == 2);
+
+	// Blocks of the same chunk are laid out one after another
+	assert(static_cast<char*>(second) - static_cast<char*>(first) == 48);
+
+	// Freed block should be reused by the next allocation of the same size class
+	pool.Deallocate(first, 48);
+	assert(pool.GetAllocatedBlocks() == 1);
+	const std::size_t sameClassSize = 48 - pst::NodePool::Granularity + 1;
+	void* third = pool.Allocate(sameClassSize);
+	assert(third == first);
+	pool.Deallocate(second, 48);
+	pool.Deallocate(third, sameClassSize);
+	assert(pool.GetAllocatedBlocks() == 0);
+}
+
+void pst::NodePoolTest::TestSizeClasses()
+{
+	pst::NodePool pool;
+	std::vector<void*> smallBlocks;
+	std::vector<void*> bigBlocks;
+
+	// Enough blocks to spill into several chunks
+	const int numberOfBlocks = static_cast<int>(pst::NodePool::ChunkSize / 32) * 3;
+	for (int i = 0; i < numberOfBlocks; i++)
+	{
+		smallBlocks.push_back(pool.Allocate(32));
+		bigBlocks.push_back(pool.Allocate(pst::NodePool::MaxBlockSize));
+	}
+
+	assert(pool.GetAllocatedBlocks() == smallBlocks.size() + bigBlocks.size());
+	const std::size_t reservedBytes = pool.GetReservedBytes();
+	for (void* block : smallBlocks)
+	{
+		pool.Deallocate(block, 32);
+	}
+
+	for (void* block : bigBlocks)
+	{
+		pool.Deallocate(block, pst::NodePool::MaxBlockSize);
+	}
+
+	// Oversized requests bypass chunks, but are counted and found by static Free
+	void* hugeBlock = pool.Allocate(pst::NodePool::MaxBlockSize + 1);
+	void* otherHugeBlock = pool.Allocate(4 * pst::NodePool::MaxBlockSize);
+	assert(pool.GetAllocatedBlocks() == 2);
+	pool.Deallocate(hugeBlock, pst::NodePool::MaxBlockSize + 1);
+	assert(pool.GetAllocatedBlocks() == 1);
+	pst::NodePool::Free(otherHugeBlock, 4 * pst::NodePool::MaxBlockSize);
+	assert(pool.GetAllocatedBlocks() == 0);
+	assert(pool.GetReservedBytes() == reservedBytes);
+}
+
+void pst::NodePoolTest::TestFreeFindsOwner()
+{
+	pst::NodePool firstPool;
+	pst::NodePool secondPool;
+	std::vector<void*> firstBlocks;
+	std::vector<void*> secondBlocks;
+	for (int i = 0; i < 10000; i++)
+	{
+		firstBlocks.push_back(firstPool.Allocate(64));
+		secondBlocks.push_back(secondPool.Allocate(64));
+	}
+
+	// Static Free doesn't know the pool, it has to find it through the chunk
+	for (void* block : secondBlocks)
+	{
+		pst::NodePool::Free(block, 64);
+	}
+
+	assert(firstPool.GetAllocatedBlocks() == firstBlocks.size());
+	assert(secondPool.GetAllocatedBlocks() == 0);
+	for (void* block : firstBlocks)
+	{
+		pst::NodePool::Free(block, 64);
+	}
+
+	assert(firstPool.GetAllocatedBlocks() == 0);
+}
+
+void pst::NodePoolTest::TestMapWithHeapPool()
+{
+	pst::PersistentMap<std::string, int, pst::HeapNodePool> tree;
+	tree.Insert("1")->m_Value = 100;
+	tree.Insert("2")->m_Value = 200;
+	tree.Delete("1");
+	assert(tree.Search("1") == nullptr);
+	assert(tree.Search("2")->m_Value == 200);
+	tree.Rollback(1);
+	assert(tree.Search("1")->m_Value == 100);
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+namespace pst
+{
+	class NodePoolTest
+	{
+	public:
+		static void Run();
+
+	private:
+		static void TestBlockReuse();
+		static void TestSizeClasses();
+		static void TestFreeFindsOwner();
+		static void TestMapWithHeapPool();
+	};
+}
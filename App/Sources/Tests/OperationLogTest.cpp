@@ -0,0 +1,360 @@
+#include "OperationLogTest.h"
+
+#include "../DataModel/OperationLog.h"
+#include "../DataModel/PlayersStorage.h"
+
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace
+{
+	/// Changes storage with every kind of logged operation. Some of them don't make a step, so they check that replay reproduces numbering
+	void ApplyChanges(pst::PlayersStorage& storage, int firstPlayer)
+	{
+		for (int i = firstPlayer; i < firstPlayer + 200; i++)
+		{
+			const std::string name = "player_" + std::to_string(i % 30);
+			if (i % 11 == 0)
+			{
+				storage.UnregisterPlayer(name);
+				storage.UnregisterPlayer("nobody");
+			}
+			else if (i % 17 == 0)
+			{
+				storage.RegisterMatchResult({ { name, i }, { "player_" + std::to_string(i % 7), -i } });
+			}
+			else if (i % 23 == 0)
+			{
+				storage.Rollback(3);
+				[[maybe_unused]] const bool isRolledBackPastOldest = storage.Rollback(100000);
+				assert(!isRolledBackPastOldest);
+			}
+			else
+			{
+				storage.RegisterPlayerResult(name, 1000 + i % 97);
+			}
+		}
+
+		// Empty batch still makes a step
+		storage.BeginBatch();
+		storage.Commit();
+	}
+
+	bool AreEqual(const pst::PlayersStorage& storage, const pst::PlayersStorage& otherStorage)
+	{
+		if (storage.GetStep() != otherStorage.GetStep())
+		{
+			return false;
+		}
+
+		std::string leaderboard;
+		std::string otherLeaderboard;
+		storage.VisitLeaderboard(1, 1000, [&leaderboard](const std::string& name, int rating) { leaderboard += name + ":" + std::to_string(rating) + ";"; });
+		otherStorage.VisitLeaderboard(1, 1000, [&otherLeaderboard](const std::string& name, int rating) { otherLeaderboard += name + ":" + std::to_string(rating) + ";"; });
+		return leaderboard == otherLeaderboard;
+	}
+}
+
+void pst::OperationLogTest::Run()
+{
+	TestReplay();
+	TestCheckpoint();
+	TestTornTail();
+	TestGroupCommit();
+	TestDurableFile();
+	TestImport();
+}
+
+void pst::OperationLogTest::TestReplay()
+{
+	std::stringstream logStream;
+	pst::OperationLog log(logStream);
+	pst::PlayersStorage storage;
+	storage.SetOperationLog(&log);
+	ApplyChanges(storage, 0);
+	[[maybe_unused]] const bool isFlushed = log.Flush();
+	assert(isFlushed);
+
+	pst::PlayersStorage replayedStorage;
+	std::uint64_t lastSequence = 0;
+	[[maybe_unused]] const bool isReplayed = pst::OperationLog::Replay(logStream, replayedStorage, lastSequence);
+	assert(isReplayed);
+	assert(lastSequence == log.GetLastSequence());
+	assert(AreEqual(storage, replayedStorage));
+
+	// Rolled back steps are reproduced too, so history can be compared step by step
+	for (int step = 0; step <= storage.GetStep(); step++)
+	{
+		assert(storage.GetPlayerRating("player_5", step) == replayedStorage.GetPlayerRating("player_5", step));
+	}
+}
+
+void pst::OperationLogTest::TestCheckpoint()
+{
+	std::stringstream logStream;
+	std::stringstream checkpointStream;
+	pst::PlayersStorage storage;
+	{
+		pst::OperationLog log(logStream);
+		storage.SetOperationLog(&log);
+		ApplyChanges(storage, 0);
+		[[maybe_unused]] const bool isCheckpointWritten = log.WriteCheckpoint(checkpointStream, storage);
+		assert(isCheckpointWritten);
+		ApplyChanges(storage, 1000);
+		[[maybe_unused]] const bool isFlushed = log.Flush();
+		assert(isFlushed);
+		storage.SetOperationLog(nullptr);
+	}
+
+	// Log keeps records from before the checkpoint, as if it crashed before the log was restarted. They are skipped by sequence
+	pst::PlayersStorage recoveredStorage;
+	std::uint64_t lastSequence = 0;
+	[[maybe_unused]] const bool isCheckpointRead = pst::OperationLog::ReadCheckpoint(checkpointStream, recoveredStorage, lastSequence);
+	assert(isCheckpointRead);
+	assert(lastSequence > 0);
+	[[maybe_unused]] const bool isReplayed = pst::OperationLog::Replay(logStream, recoveredStorage, lastSequence);
+	assert(isReplayed);
+	assert(AreEqual(storage, recoveredStorage));
+
+	// New log continues numbering, so the next recovery can use either log
+	std::stringstream newLogStream;
+	std::stringstream newCheckpointStream;
+	pst::OperationLog newLog(newLogStream, lastSequence);
+	[[maybe_unused]] const bool isNewCheckpointWritten = newLog.WriteCheckpoint(newCheckpointStream, recoveredStorage);
+	assert(isNewCheckpointWritten);
+	recoveredStorage.SetOperationLog(&newLog);
+	recoveredStorage.RegisterPlayerResult("latecomer", 1);
+	[[maybe_unused]] const bool isNewLogFlushed = newLog.Flush();
+	assert(isNewLogFlushed);
+	recoveredStorage.SetOperationLog(nullptr);
+
+	pst::PlayersStorage nextStorage;
+	[[maybe_unused]] const bool isNewCheckpointRead = pst::OperationLog::ReadCheckpoint(newCheckpointStream, nextStorage, lastSequence);
+	assert(isNewCheckpointRead);
+	[[maybe_unused]] const bool isNewLogReplayed = pst::OperationLog::Replay(newLogStream, nextStorage, lastSequence);
+	assert(isNewLogReplayed);
+	assert(lastSequence == newLog.GetLastSequence());
+	assert(AreEqual(recoveredStorage, nextStorage));
+
+	// Log which starts past the checkpoint misses records in between, so it is rejected rather than applied with a gap
+	std::stringstream gapCheckpointStream;
+	std::stringstream gapLogStream;
+	pst::OperationLog gapLog(gapLogStream, newLog.GetLastSequence() + 5);
+	[[maybe_unused]] const bool isGapCheckpointWritten = newLog.WriteCheckpoint(gapCheckpointStream, recoveredStorage);
+	assert(isGapCheckpointWritten);
+	recoveredStorage.SetOperationLog(&gapLog);
+	recoveredStorage.RegisterPlayerResult("latecomer", 2);
+	[[maybe_unused]] const bool isGapLogFlushed = gapLog.Flush();
+	assert(isGapLogFlushed);
+	recoveredStorage.SetOperationLog(nullptr);
+
+	pst::PlayersStorage gapStorage;
+	[[maybe_unused]] const bool isGapCheckpointRead = pst::OperationLog::ReadCheckpoint(gapCheckpointStream, gapStorage, lastSequence);
+	assert(isGapCheckpointRead);
+	[[maybe_unused]] const bool isGapReplayed = pst::OperationLog::Replay(gapLogStream, gapStorage, lastSequence);
+	assert(!isGapReplayed);
+
+	// Without a checkpoint log has to start from the first record
+	gapLogStream.clear();
+	gapLogStream.seekg(0);
+	pst::PlayersStorage emptyStorage;
+	lastSequence = 0;
+	[[maybe_unused]] const bool isReplayedWithoutCheckpoint = pst::OperationLog::Replay(gapLogStream, emptyStorage, lastSequence);
+	assert(!isReplayedWithoutCheckpoint);
+}
+
+void pst::OperationLogTest::TestTornTail()
+{
+	std::stringstream logStream;
+	pst::OperationLog log(logStream);
+	pst::PlayersStorage storage;
+	storage.SetOperationLog(&log);
+	storage.RegisterPlayerResult("Alice", 1000);
+	storage.RegisterPlayerResult("Bob", 1100);
+	[[maybe_unused]] const bool isFlushed = log.Flush();
+	assert(isFlushed);
+	const std::size_t committedSize = logStream.str().size();
+
+	// Batch which has not been committed before crash is dropped as a whole
+	storage.BeginBatch();
+	storage.RegisterPlayerResult("Carol", 1200);
+	storage.UnregisterPlayer("Alice");
+	[[maybe_unused]] const bool isBatchFlushed = log.Flush();
+	assert(isBatchFlushed);
+	const std::string data = logStream.str();
+	storage.SetOperationLog(nullptr);
+	for (std::size_t size = 0; size <= data.size(); size++)
+	{
+		std::stringstream tornStream(data.substr(0, size));
+		pst::PlayersStorage replayedStorage;
+		std::uint64_t lastSequence = 0;
+		[[maybe_unused]] const bool isTornReplayed = pst::OperationLog::Replay(tornStream, replayedStorage, lastSequence);
+		assert(isTornReplayed);
+		assert(replayedStorage.GetStep() == (size < committedSize ? static_cast<int>(lastSequence) : 2));
+		assert(replayedStorage.GetPlayerRating("Carol") == -1);
+		assert(size < committedSize || replayedStorage.GetPlayerRating("Alice") == 1000);
+	}
+
+	// Corrupted record stops replay, records after it are not applied
+	std::string corruptedData = data.substr(0, committedSize);
+	corruptedData[corruptedData.size() - 6] ^= 1;
+	std::stringstream corruptedStream(corruptedData);
+	pst::PlayersStorage replayedStorage;
+	std::uint64_t lastSequence = 0;
+	[[maybe_unused]] const bool isCorruptedReplayed = pst::OperationLog::Replay(corruptedStream, replayedStorage, lastSequence);
+	assert(isCorruptedReplayed);
+	assert(lastSequence == 1 && replayedStorage.GetPlayerRating("Bob") == -1);
+}
+
+void pst::OperationLogTest::TestGroupCommit()
+{
+	std::stringstream logStream;
+	pst::OperationLog log(logStream, 0, 1024);
+	pst::PlayersStorage storage;
+	storage.SetOperationLog(&log);
+	storage.RegisterPlayerResult("Alice", 1000);
+	storage.RegisterPlayerResult("Bob", 1100);
+	assert(logStream.str().empty());
+	assert(log.GetBufferedBytes() > 0);
+	[[maybe_unused]] const bool isFlushed = log.Flush();
+	assert(isFlushed);
+	assert(log.GetBufferedBytes() == 0);
+	const std::size_t groupSize = logStream.str().size();
+	assert(groupSize > 0);
+
+	// Buffer is written by itself once it reaches group commit size
+	while (logStream.str().size() == groupSize)
+	{
+		storage.RegisterPlayerResult("Alice", storage.GetPlayerRating("Alice") + 1);
+	}
+
+	assert(log.GetBufferedBytes() == 0);
+	assert(logStream.str().size() >= groupSize + 1024);
+	storage.SetOperationLog(nullptr);
+}
+
+void pst::OperationLogTest::TestDurableFile()
+{
+	const std::filesystem::path directory = std::filesystem::temp_directory_path();
+	const std::string logPath = (directory / "OperationLogTest.log").string();
+	const std::string checkpointPath = (directory / "OperationLogTest.checkpoint").string();
+	pst::PlayersStorage storage;
+	{
+		pst::DurableFile logFile;
+		pst::DurableFile checkpointFile;
+		[[maybe_unused]] const bool isLogFileOpened = logFile.Open(logPath);
+		[[maybe_unused]] const bool isCheckpointFileOpened = checkpointFile.Open(checkpointPath);
+		assert(isLogFileOpened && isCheckpointFileOpened);
+		pst::OperationLog log(logFile);
+		storage.SetOperationLog(&log);
+		ApplyChanges(storage, 0);
+		[[maybe_unused]] const bool isCheckpointWritten = log.WriteCheckpoint(checkpointFile, storage);
+		assert(isCheckpointWritten);
+		ApplyChanges(storage, 1000);
+		[[maybe_unused]] const bool isFlushed = log.Flush();
+		assert(isFlushed);
+		storage.SetOperationLog(nullptr);
+
+		// Flushed records are in the file before it is closed
+		std::ifstream logStream(logPath, std::ios::binary);
+		pst::PlayersStorage replayedStorage;
+		std::uint64_t lastSequence = 0;
+		[[maybe_unused]] const bool isReplayed = pst::OperationLog::Replay(logStream, replayedStorage, lastSequence);
+		assert(isReplayed);
+		assert(lastSequence == log.GetLastSequence());
+		assert(AreEqual(storage, replayedStorage));
+		[[maybe_unused]] const bool isLogFileClosed = logFile.Close();
+		[[maybe_unused]] const bool isCheckpointFileClosed = checkpointFile.Close();
+		assert(isLogFileClosed && isCheckpointFileClosed);
+		[[maybe_unused]] const bool isClosedAgain = logFile.Close();
+		assert(!isClosedAgain);
+	}
+
+	std::ifstream checkpointStream(checkpointPath, std::ios::binary);
+	std::ifstream logStream(logPath, std::ios::binary);
+	pst::PlayersStorage recoveredStorage;
+	std::uint64_t lastSequence = 0;
+	[[maybe_unused]] const bool isCheckpointRead = pst::OperationLog::ReadCheckpoint(checkpointStream, recoveredStorage, lastSequence);
+	assert(isCheckpointRead);
+	[[maybe_unused]] const bool isRecoveredReplayed = pst::OperationLog::Replay(logStream, recoveredStorage, lastSequence);
+	assert(isRecoveredReplayed);
+	assert(AreEqual(storage, recoveredStorage));
+	checkpointStream.close();
+	logStream.close();
+
+	// Opening replaces the file
+	pst::DurableFile file;
+	[[maybe_unused]] const bool isOpened = file.Open(logPath);
+	[[maybe_unused]] const bool isClosed = file.Close();
+	assert(isOpened && isClosed);
+	assert(std::filesystem::file_size(logPath) == 0);
+	std::remove(logPath.c_str());
+	std::remove(checkpointPath.c_str());
+	[[maybe_unused]] const bool isMissingFileOpened = file.Open((directory / "OperationLogTest" / "missing" / "file.log").string());
+	assert(!isMissingFileOpened);
+}
+
+void pst::OperationLogTest::TestImport()
+{
+	std::vector<std::pair<std::string, int>> playerRatings;
+	for (int i = 0; i < 20000; i++)
+	{
+		playerRatings.emplace_back("player_" + std::to_string(i * 7919 % 20000), i % 1500);
+	}
+
+	std::stringstream logStream;
+	pst::OperationLog log(logStream);
+	pst::PlayersStorage storage;
+	storage.SetOperationLog(&log);
+	[[maybe_unused]] const bool isImported = storage.ImportPlayers(playerRatings);
+	assert(isImported);
+	const std::uint64_t importSequence = log.GetLastSequence();
+	ApplyChanges(storage, 0);
+	[[maybe_unused]] const bool isFlushed = log.Flush();
+	assert(isFlushed);
+	storage.SetOperationLog(nullptr);
+
+	// Players don't fit into one record, so import is split into several records of a batch besides begin and commit
+	assert(importSequence > 3);
+
+	pst::PlayersStorage replayedStorage;
+	std::uint64_t lastSequence = 0;
+	[[maybe_unused]] const bool isReplayed = pst::OperationLog::Replay(logStream, replayedStorage, lastSequence);
+	assert(isReplayed);
+	assert(lastSequence == log.GetLastSequence());
+	assert(AreEqual(storage, replayedStorage));
+	assert(replayedStorage.GetPlayerCount() == storage.GetPlayerCount());
+	assert(replayedStorage.GetPlayerRating("player_12345", 1) == storage.GetPlayerRating("player_12345", 1));
+
+	// Import which has not been logged completely is dropped as a whole
+	const std::string data = logStream.str();
+	std::stringstream tornStream(data.substr(0, data.size() / 4));
+	pst::PlayersStorage tornStorage;
+	lastSequence = 0;
+	[[maybe_unused]] const bool isTornReplayed = pst::OperationLog::Replay(tornStream, tornStorage, lastSequence);
+	assert(isTornReplayed);
+	assert(lastSequence == 0 && tornStorage.GetStep() == 0 && tornStorage.GetPlayerCount() == 0);
+
+	// Empty import is replayed as import too
+	std::stringstream emptyLogStream;
+	pst::OperationLog emptyLog(emptyLogStream);
+	pst::PlayersStorage emptyStorage;
+	emptyStorage.SetOperationLog(&emptyLog);
+	[[maybe_unused]] const bool isEmptyImported = emptyStorage.ImportPlayers({});
+	assert(isEmptyImported);
+	[[maybe_unused]] const bool isEmptyLogFlushed = emptyLog.Flush();
+	assert(isEmptyLogFlushed);
+	emptyStorage.SetOperationLog(nullptr);
+	pst::PlayersStorage replayedEmptyStorage;
+	lastSequence = 0;
+	[[maybe_unused]] const bool isEmptyLogReplayed = pst::OperationLog::Replay(emptyLogStream, replayedEmptyStorage, lastSequence);
+	assert(isEmptyLogReplayed);
+	assert(lastSequence == 3 && replayedEmptyStorage.GetStep() == emptyStorage.GetStep());
+}
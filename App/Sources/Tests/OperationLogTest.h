@@ -0,0 +1,18 @@
+#pragma once
+
+namespace pst
+{
+	class OperationLogTest
+	{
+	public:
+		static void Run();
+
+	private:
+		static void TestReplay();
+		static void TestCheckpoint();
+		static void TestTornTail();
+		static void TestGroupCommit();
+		static void TestDurableFile();
+		static void TestImport();
+	};
+}
@@ -0,0 +1,331 @@
+#include "PersistentBTreeTest.h"
+
+#include "../CoreLib/PersistentBTree.h"
+
+#include <cassert>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+void pst::PersistentBTreeTest::Run()
+{
+	TestInsertingAndRollback();
+	TestSplitsAndMerges();
+	TestRandomDataWithVersions();
+	TestBatch();
+	TestRetention();
+	TestStringKeys();
+}
+
+void pst::PersistentBTreeTest::TestInsertingAndRollback()
+{
+	pst::PersistentBTree<std::string, int> tree;
+	assert(tree.Search("1") == nullptr);
+	tree.Insert("1")->m_Value = 100;
+	assert(tree.Search("1")->m_Value == 100);
+	tree.Insert("1")->m_Value = 200;
+	assert(tree.Search("1")->m_Value == 200);
+	tree.Rollback(1);
+	assert(tree.Search("1")->m_Value == 100);
+	tree.Rollback(1);
+	assert(tree.Search("1") == nullptr);
+	tree.Insert("2")->m_Value = 300;
+	assert(tree.Search("1") == nullptr);
+	assert(tree.Search("2")->m_Value == 300);
+	tree.Insert("1")->m_Value = 400;
+	assert(tree.Search("1")->m_Value == 400);
+	assert(tree.Search("2")->m_Value == 300);
+	tree.Rollback(2);
+	assert(tree.Search("1") == nullptr);
+	assert(tree.Search("2") == nullptr);
+	assert(tree.GetSize() == 0);
+}
+
+void pst::PersistentBTreeTest::TestSplitsAndMerges()
+{
+	using Tree = pst::PersistentBTree<int, int>;
+	Tree tree;
+
+	// Ascending, descending and interleaved keys split leaves at both ends and in the middle, and tree grows few levels
+	const int count = 20000;
+	for (int i = 0; i < count; i += 2)
+	{
+		tree.Insert(i)->m_Value = i;
+	}
+
+	for (int i = count - 1; i > 0; i -= 2)
+	{
+		tree.Insert(i)->m_Value = i;
+	}
+
+	assert(CheckIfTreeIsValid(&tree));
+	assert(tree.GetSize() == count);
+	assert(!tree.GetRoot()->IsLeaf());
+	for (int i = 0; i < count; i++)
+	{
+		assert(tree.Search(i)->m_Value == i);
+		assert(tree.GetRank(i) == i);
+	}
+
+	assert(tree.GetRank(-1) == 0);
+	assert(tree.GetRank(count) == count);
+
+	int expected = 0;
+	tree.ForEach([&expected](const Tree::Entry& entry) { assert(entry.m_Key == expected++); });
+	assert(expected == count);
+
+	// Deleting missing key changes nothing, not even version
+	const int version = tree.GetVersion();
+	tree.Delete(count);
+	assert(tree.GetVersion() == version);
+
+	// Deleting from the front, the back and every third key borrows from siblings and merges nodes until tree shrinks back to leaf
+	for (int i = 0; i < count; i += 3)
+	{
+		tree.Delete(i);
+	}
+
+	assert(CheckIfTreeIsValid(&tree));
+	for (int i = 0; i < count; i++)
+	{
+		if (i % 3 != 0)
+		{
+			tree.Delete(i);
+		}
+	}
+
+	assert(CheckIfTreeIsValid(&tree));
+	assert(tree.GetSize() == 0);
+	assert(tree.GetRoot() == nullptr);
+
+	// Every version is still there
+	[[maybe_unused]] const bool isRolledBack = tree.Rollback(tree.GetVersion() - version);
+	assert(isRolledBack);
+	assert(CheckIfTreeIsValid(&tree));
+	assert(tree.GetSize() == count);
+	assert(tree.Search(count - 1)->m_Value == count - 1);
+}
+
+void pst::PersistentBTreeTest::TestRandomDataWithVersions()
+{
+	pst::PersistentBTree<int, int> tree;
+	std::mt19937 random(4);
+	std::uniform_int_distribution<int> keys(0, 3000);
+	std::vector<std::map<int, int>> versions(1);
+	for (int step = 0; step < 20000; step++)
+	{
+		const int key = keys(random);
+		std::map<int, int> expected = versions.back();
+		if (random() % 3 == 0)
+		{
+			tree.Delete(key);
+			expected.erase(key);
+		}
+		else
+		{
+			tree.Insert(key)->m_Value = step;
+			expected[key] = step;
+		}
+
+		if (tree.GetVersion() == static_cast<int>(versions.size()))
+		{
+			versions.push_back(std::move(expected));
+		}
+
+		if (step % 5000 == 4999)
+		{
+			// Rolled back versions are overwritten by following changes
+			const int delta = 500;
+			[[maybe_unused]] const bool isRolledBack = tree.Rollback(delta);
+			assert(isRolledBack);
+			versions.resize(versions.size() - delta);
+			assert(CheckIfTreeIsValid(&tree));
+		}
+	}
+
+	assert(CheckIfTreeIsValid(&tree));
+	for (int version = 0; version <= tree.GetVersion(); version += 97)
+	{
+		const std::map<int, int>& expected = versions[version];
+		for (int key = 0; key <= 3000; key += 7)
+		{
+			const auto found = expected.find(key);
+			const auto* entry = tree.Search(key, version);
+			assert(found == expected.end() ? entry == nullptr : entry != nullptr && entry->m_Value == found->second);
+		}
+	}
+
+	assert(tree.Search(0, tree.GetVersion() + 1) == nullptr);
+	assert(tree.GetSize() == static_cast<int>(versions.back().size()));
+}
+
+void pst::PersistentBTreeTest::TestBatch()
+{
+	pst::PersistentBTree<int, int> tree;
+	tree.BeginBatch();
+	for (int i = 0; i < 1000; i++)
+	{
+		tree.Insert(i)->m_Value = i;
+	}
+
+	for (int i = 0; i < 1000; i += 2)
+	{
+		tree.Delete(i);
+	}
+
+	tree.Commit();
+	assert(!tree.IsInBatch());
+	assert(tree.GetVersion() == 1);
+	assert(tree.GetSize() == 500);
+	assert(CheckIfTreeIsValid(&tree));
+
+	// Nodes created by the batch are changed in place instead of being copied by every change, so only nodes of the final tree remain
+	tree.ReclaimAll();
+	using Node = pst::PersistentBTreeNode<int, int, pst::NodePool, pst::KeyTraits<int>>;
+	assert(tree.m_NodePool->GetAllocatedBlocks() < 2 * 500 / Node::MinCount);
+	[[maybe_unused]] const bool isRolledBack = tree.Rollback(1);
+	assert(isRolledBack);
+	assert(tree.GetSize() == 0);
+}
+
+void pst::PersistentBTreeTest::TestRetention()
+{
+	pst::PersistentBTree<int, int> tree;
+	for (int i = 0; i < 10000; i++)
+	{
+		tree.Insert(i)->m_Value = i;
+	}
+
+	for (int i = 0; i < 10000; i++)
+	{
+		tree.Insert(i)->m_Value = -i;
+	}
+
+	// Only the last version is kept, so nodes of all other versions are freed
+	const std::size_t blocksBefore = tree.m_NodePool->GetAllocatedBlocks();
+	tree.DropVersionsBefore(tree.GetVersion());
+	assert(tree.GetPendingReclaimCount() > 0);
+	const std::size_t freedBytes = tree.ReclaimAll();
+	assert(freedBytes > 0);
+	assert(tree.GetPendingReclaimCount() == 0);
+	assert(tree.m_NodePool->GetAllocatedBlocks() < blocksBefore / 100);
+	assert(tree.GetOldestVersion() == 20000);
+	[[maybe_unused]] const bool isRolledBackPastOldest = tree.Rollback(1);
+	assert(!isRolledBackPastOldest);
+	assert(tree.Search(10)->m_Value == -10);
+	assert(tree.m_RootHistory.size() == 1);
+
+	// Rollback works inside retained window
+	for (int i = 0; i < 100; i++)
+	{
+		tree.Delete(i);
+		tree.DropVersionsBefore(tree.GetVersion() - 10);
+	}
+
+	assert(tree.GetVersion() == 20100);
+	assert(tree.GetOldestVersion() == 20090);
+	assert(tree.m_RootHistory.size() <= 21);
+	[[maybe_unused]] const bool isRolledBack = tree.Rollback(10);
+	assert(isRolledBack);
+	assert(tree.Search(89) == nullptr);
+	assert(tree.Search(90)->m_Value == -90);
+	[[maybe_unused]] const bool isRolledBackPastWindow = tree.Rollback(1);
+	assert(!isRolledBackPastWindow);
+	assert(CheckIfTreeIsValid(&tree));
+	assert(tree.GetSize() == 9910);
+}
+
+void pst::PersistentBTreeTest::TestStringKeys()
+{
+	// Long keys share prefix, so cached prefix of the traits can't decide and strings are compared
+	pst::PersistentBTree<std::string, int, pst::NodePool, pst::StringPrefixKeyTraits<>> tree;
+	std::map<std::string, int> expected;
+	std::mt19937 random(8);
+	for (int i = 0; i < 5000; i++)
+	{
+		const std::string key = (random() % 2 ? "player_" : "player_with_long_name_") + std::to_string(random() % 4000);
+		tree.Insert(key)->m_Value = i;
+		expected[key] = i;
+	}
+
+	assert(CheckIfTreeIsValid(&tree));
+	int rank = 0;
+	for (const auto& [key, value] : expected)
+	{
+		assert(tree.Search(key)->m_Value == value);
+		assert(tree.GetRank(key) == rank++);
+	}
+
+	for (const auto& [key, value] : expected)
+	{
+		tree.Delete(key);
+	}
+
+	assert(tree.GetSize() == 0);
+	tree.DropVersionsBefore(tree.GetVersion());
+	tree.ReclaimAll();
+	assert(tree.m_NodePool->GetAllocatedBlocks() == 0);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+bool pst::PersistentBTreeTest::CheckIfTreeIsValid(const pst::PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>* tree)
+{
+	const auto* root = tree->GetRoot();
+	return !root || CheckSubtree<TKey, TValue, TNodePool, TKeyTraits>(root, true, nullptr, nullptr) >= 0;
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+int pst::PersistentBTreeTest::CheckSubtree(const pst::PersistentBTreeNode<TKey, TValue, TNodePool, TKeyTraits>* node, bool isRoot, const TKey* lower, const TKey* upper)
+{
+	using Node = pst::PersistentBTreeNode<TKey, TValue, TNodePool, TKeyTraits>;
+	const int minCount = isRoot ? 1 : Node::MinCount;
+	if (node->m_Count < minCount || node->m_Count > Node::Capacity)
+	{
+		return -1;
+	}
+
+	// Every key of the node is inside bounds given by the parent and keys are strictly ascending
+	const auto isInBounds = [lower, upper](const TKey& key)
+	{
+		return (!lower || !(key < *lower)) && (!upper || key < *upper);
+	};
+
+	if (node->IsLeaf())
+	{
+		const auto* entries = static_cast<const pst::PersistentBTreeLeaf<TKey, TValue, TNodePool, TKeyTraits>*>(node)->GetEntries();
+		for (int i = 0; i < node->m_Count; i++)
+		{
+			if (!isInBounds(entries[i].m_Key) || (i > 0 && !(entries[i - 1].m_Key < entries[i].m_Key)))
+			{
+				return -1;
+			}
+		}
+
+		return node->m_Size == node->m_Count ? 0 : -1;
+	}
+
+	const auto* branch = static_cast<const pst::PersistentBTreeBranch<TKey, TValue, TNodePool, TKeyTraits>*>(node);
+	const TKey* keys = branch->GetKeys();
+	int depth = -1;
+	int size = 0;
+	for (int i = 0; i <= node->m_Count; i++)
+	{
+		if (i < node->m_Count && (!isInBounds(keys[i]) || (i > 0 && !(keys[i - 1] < keys[i]))))
+		{
+			return -1;
+		}
+
+		const auto* child = branch->m_Children[i].Get();
+		const int childDepth = CheckSubtree<TKey, TValue, TNodePool, TKeyTraits>(child, false, i > 0 ? &keys[i - 1] : lower, i < node->m_Count ? &keys[i] : upper);
+		if (childDepth < 0 || (depth >= 0 && childDepth != depth))
+		{
+			return -1;
+		}
+
+		depth = childDepth;
+		size += child->m_Size;
+	}
+
+	return size == node->m_Size ? depth + 1 : -1;
+}
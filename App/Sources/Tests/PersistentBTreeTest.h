@@ -0,0 +1,32 @@
+#pragma once
+
+namespace pst
+{
+	template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+	class PersistentBTree;
+
+	template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+	class PersistentBTreeNode;
+
+	class PersistentBTreeTest
+	{
+	public:
+		static void Run();
+
+	private:
+		static void TestInsertingAndRollback();
+		static void TestSplitsAndMerges();
+		static void TestRandomDataWithVersions();
+		static void TestBatch();
+		static void TestRetention();
+		static void TestStringKeys();
+
+		// Helper methods to inspect tree
+		template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+		static bool CheckIfTreeIsValid(const PersistentBTree<TKey, TValue, TNodePool, TKeyTraits>* tree);
+
+		/// Checks node counts and sizes, order of keys within [lower; upper) bounds and returns depth of leaves or -1 if subtree is broken
+		template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+		static int CheckSubtree(const PersistentBTreeNode<TKey, TValue, TNodePool, TKeyTraits>* node, bool isRoot, const TKey* lower, const TKey* upper);
+	};
+}
@@ -0,0 +1,269 @@
+#include "PersistentFatNodeMapTest.h"
+
+#include "../CoreLib/PersistentFatNodeMap.h"
+
+#include <cassert>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+void pst::PersistentFatNodeMapTest::Run()
+{
+	TestInsertingAndRollback();
+	TestRandomDataWithVersions();
+	TestRollbackFreesNodes();
+	TestSpacePerUpdate();
+	TestStringKeys();
+}
+
+void pst::PersistentFatNodeMapTest::TestInsertingAndRollback()
+{
+	pst::PersistentFatNodeMap<std::string, int> map;
+	assert(map.Search("1") == nullptr);
+	*map.Insert("1") = 100;
+	assert(*map.Search("1") == 100);
+	*map.Insert("1") = 200;
+	assert(*map.Search("1") == 200);
+	assert(*map.Search("1", 1) == 100);
+	map.Rollback(1);
+	assert(*map.Search("1") == 100);
+	map.Rollback(1);
+	assert(map.Search("1") == nullptr);
+	*map.Insert("2") = 300;
+	assert(map.Search("1") == nullptr);
+	assert(*map.Search("2") == 300);
+	*map.Insert("1") = 400;
+	assert(*map.Search("1") == 400);
+	assert(*map.Search("2") == 300);
+	map.Rollback(2);
+	assert(map.Search("1") == nullptr);
+	assert(map.Search("2") == nullptr);
+	assert(map.GetSize() == 0);
+}
+
+void pst::PersistentFatNodeMapTest::TestRandomDataWithVersions()
+{
+	pst::PersistentFatNodeMap<int, int> map;
+	std::mt19937 random(15);
+	std::uniform_int_distribution<int> keys(0, 2000);
+	std::vector<std::map<int, int>> versions(1);
+	for (int step = 0; step < 30000; step++)
+	{
+		const int key = keys(random);
+		std::map<int, int> expected = versions.back();
+		if (random() % 3 == 0)
+		{
+			map.Delete(key);
+			expected.erase(key);
+		}
+		else
+		{
+			*map.Insert(key) = step;
+			expected[key] = step;
+		}
+
+		if (map.GetVersion() == static_cast<int>(versions.size()))
+		{
+			versions.push_back(std::move(expected));
+		}
+
+		if (step % 3000 == 2999)
+		{
+			// Rolled back versions are overwritten by following changes
+			const int delta = 1 + static_cast<int>(random() % 500);
+			[[maybe_unused]] const bool isRolledBack = map.Rollback(delta);
+			assert(isRolledBack);
+			versions.resize(versions.size() - delta);
+			assert(CheckIfTreeIsRB(&map));
+		}
+
+		if (step % 1000 == 0)
+		{
+			assert(CheckIfTreeIsRB(&map));
+		}
+	}
+
+	// Every version reads the same data as it had when it was current
+	assert(CheckIfTreeIsRB(&map));
+	for (int version = 0; version <= map.GetVersion(); version += 53)
+	{
+		const std::map<int, int>& expected = versions[version];
+		for (int key = 0; key <= 2000; key += 3)
+		{
+			const auto found = expected.find(key);
+			const int* value = map.Search(key, version);
+			assert(found == expected.end() ? value == nullptr : value != nullptr && *value == found->second);
+		}
+	}
+
+	int count = 0;
+	auto expectedItem = versions.back().begin();
+	map.ForEach([&](int key, int value)
+	{
+		assert(key == expectedItem->first && value == expectedItem->second);
+		expectedItem++;
+		count++;
+	});
+
+	assert(count == map.GetSize() && count == static_cast<int>(versions.back().size()));
+
+	// Dropped versions are not reachable, retained ones still are
+	map.DropVersionsBefore(map.GetVersion() - 100);
+	assert(map.Search(0, map.GetVersion() - 101) == nullptr);
+	[[maybe_unused]] const bool isRolledBackPastWindow = map.Rollback(101);
+	assert(!isRolledBackPastWindow);
+	[[maybe_unused]] const bool isRolledBackInWindow = map.Rollback(100);
+	assert(isRolledBackInWindow);
+	assert(CheckIfTreeIsRB(&map));
+	assert(map.GetSize() == static_cast<int>(versions[map.GetVersion()].size()));
+}
+
+void pst::PersistentFatNodeMapTest::TestRollbackFreesNodes()
+{
+	pst::PersistentFatNodeMap<int, int> map;
+	for (int i = 0; i < 1000; i++)
+	{
+		*map.Insert(i) = i;
+	}
+
+	const std::size_t blocks = map.m_NodePool->GetAllocatedBlocks();
+	const std::size_t undoLogSize = map.m_UndoLog.size();
+	for (int i = 0; i < 1000; i++)
+	{
+		*map.Insert(i) = -i;
+		map.Delete(i / 2);
+	}
+
+	assert(map.m_NodePool->GetAllocatedBlocks() > blocks);
+	[[maybe_unused]] const bool isRolledBack = map.Rollback(map.GetVersion() - 1000);
+	assert(isRolledBack);
+	assert(map.m_NodePool->GetAllocatedBlocks() == blocks);
+	assert(map.m_UndoLog.size() == undoLogSize);
+	for (int i = 0; i < 1000; i++)
+	{
+		assert(*map.Search(i) == i);
+	}
+
+	// Batch changes single version in place
+	map.BeginBatch();
+	for (int i = 0; i < 1000; i++)
+	{
+		*map.Insert(i) += 1;
+		*map.Insert(i) += 1;
+	}
+
+	map.Commit();
+	assert(map.GetVersion() == 1001);
+	assert(*map.Search(10) == 12);
+	assert(*map.Search(10, 1000) == 10);
+}
+
+void pst::PersistentFatNodeMapTest::TestSpacePerUpdate()
+{
+	pst::PersistentFatNodeMap<int, int> map;
+	const int count = 1 << 14;
+	for (int i = 0; i < count; i++)
+	{
+		*map.Insert(i) = i;
+	}
+
+	// Path copying would create about log2(count) nodes per update. Node copying creates a constant number on average
+	std::mt19937 random(16);
+	const std::size_t blocks = map.m_NodePool->GetAllocatedBlocks();
+	const int updates = 100000;
+	for (int i = 0; i < updates; i++)
+	{
+		const int key = static_cast<int>(random() % count);
+		if (i % 2 == 0)
+		{
+			*map.Insert(key) = -i;
+		}
+		else
+		{
+			map.Delete(key);
+			*map.Insert(key) = i;
+		}
+	}
+
+	assert(map.m_NodePool->GetAllocatedBlocks() - blocks < 3 * static_cast<std::size_t>(updates));
+	assert(CheckIfTreeIsRB(&map));
+	assert(map.GetSize() == count);
+}
+
+void pst::PersistentFatNodeMapTest::TestStringKeys()
+{
+	// Long keys share prefix, so cached prefix of the traits can't decide and strings are compared
+	pst::PersistentFatNodeMap<std::string, int, pst::NodePool, pst::StringPrefixKeyTraits<>> map;
+	std::map<std::string, int> expected;
+	std::mt19937 random(17);
+	for (int i = 0; i < 5000; i++)
+	{
+		const std::string key = (random() % 2 ? "player_" : "player_with_long_name_") + std::to_string(random() % 3000);
+		if (i % 4 == 3)
+		{
+			map.Delete(key);
+			expected.erase(key);
+		}
+		else
+		{
+			*map.Insert(key) = i;
+			expected[key] = i;
+		}
+	}
+
+	assert(CheckIfTreeIsRB(&map));
+	assert(map.GetSize() == static_cast<int>(expected.size()));
+	for (const auto& [key, value] : expected)
+	{
+		assert(*map.Search(key) == value);
+	}
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+bool pst::PersistentFatNodeMapTest::CheckIfTreeIsRB(const pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>* map)
+{
+	const auto* root = map->GetVersionInfo(map->GetVersion()).m_Root;
+	if (root && root->IsRed(map->GetVersion()))
+	{
+		return false;
+	}
+
+	int count = 0;
+	return CheckSubtree<TKey, TValue, TNodePool, TKeyTraits>(map, root, nullptr, nullptr, count) >= 0 && count == map->GetSize();
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+int pst::PersistentFatNodeMapTest::CheckSubtree(const pst::PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>* map, const pst::PersistentFatNodeMapNode<TKey, TValue, TNodePool, TKeyTraits>* node,
+	const TKey* lower, const TKey* upper, int& count)
+{
+	if (!node)
+	{
+		return 0;
+	}
+
+	if ((lower && !(*lower < node->m_Key)) || (upper && !(node->m_Key < *upper)))
+	{
+		return -1;
+	}
+
+	// Red node has no red children
+	const int version = map->GetVersion();
+	const auto* left = node->GetChild(true, version);
+	const auto* right = node->GetChild(false, version);
+	const bool isRed = node->IsRed(version);
+	if (isRed && ((left && left->IsRed(version)) || (right && right->IsRed(version))))
+	{
+		return -1;
+	}
+
+	count++;
+	const int leftHeight = CheckSubtree<TKey, TValue, TNodePool, TKeyTraits>(map, left, lower, &node->m_Key, count);
+	const int rightHeight = CheckSubtree<TKey, TValue, TNodePool, TKeyTraits>(map, right, &node->m_Key, upper, count);
+	if (leftHeight < 0 || leftHeight != rightHeight)
+	{
+		return -1;
+	}
+
+	return leftHeight + (isRed ? 0 : 1);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+namespace pst
+{
+	template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+	class PersistentFatNodeMap;
+
+	template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+	class PersistentFatNodeMapNode;
+
+	class PersistentFatNodeMapTest
+	{
+	public:
+		static void Run();
+
+	private:
+		static void TestInsertingAndRollback();
+		static void TestRandomDataWithVersions();
+		static void TestRollbackFreesNodes();
+		static void TestSpacePerUpdate();
+		static void TestStringKeys();
+
+		// Helper methods to inspect map
+		template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+		static bool CheckIfTreeIsRB(const PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>* map);
+
+		/// Checks order of keys within (lower; upper) bounds and colors of current version. Returns black height or -1 if subtree is broken
+		template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+		static int CheckSubtree(const PersistentFatNodeMap<TKey, TValue, TNodePool, TKeyTraits>* map, const PersistentFatNodeMapNode<TKey, TValue, TNodePool, TKeyTraits>* node,
+			const TKey* lower, const TKey* upper, int& count);
+	};
+}
@@ -0,0 +1,213 @@
+#include "PersistentMapImageTest.h"
+
+#include "../CoreLib/MappedFile.h"
+#include "../CoreLib/PersistentMap.h"
+#include "../CoreLib/PersistentMapImage.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace
+{
+	using StringMap = pst::PersistentMap<std::string, int, pst::NodePool, pst::StringPrefixKeyTraits<>>;
+	using StringMapImage = pst::PersistentMapImage<std::string, int, pst::StringPrefixKeyTraits<>>;
+
+	/// Image is read in place, so it is copied to memory aligned as heap block
+	std::vector<std::uint64_t> ToAlignedBuffer(const std::string& data)
+	{
+		std::vector<std::uint64_t> buffer(data.size() / sizeof(std::uint64_t) + 1);
+		std::memcpy(buffer.data(), data.data(), data.size());
+		return buffer;
+	}
+
+	void FillMap(StringMap& map)
+	{
+		auto generator = std::default_random_engine{};
+		std::uniform_int_distribution<int> keyDistribution(0, 999);
+		map.BeginBatch();
+		for (int i = 0; i < 1000; i++)
+		{
+			map.Insert("player_" + std::to_string(i))->m_Value = i;
+		}
+
+		map.Commit();
+		for (int version = 0; version < 300; version++)
+		{
+			const int key = keyDistribution(generator);
+			if (key % 3 == 0)
+			{
+				map.Delete("player_" + std::to_string(key));
+			}
+			else
+			{
+				map.Insert("player_" + std::to_string(key))->m_Value = -version;
+			}
+		}
+	}
+
+	template <typename TMapSnapshot, typename TImageSnapshot>
+	bool AreEqual(const TMapSnapshot& mapSnapshot, const TImageSnapshot& imageSnapshot)
+	{
+		return mapSnapshot.GetSize() == imageSnapshot.GetSize()
+			&& std::equal(mapSnapshot.begin(), mapSnapshot.end(), imageSnapshot.begin(), imageSnapshot.end(), [](const auto& node, const auto& entry)
+			{
+				return node.m_Key == entry.m_Key && node.m_Value == entry.m_Value;
+			});
+	}
+}
+
+void pst::PersistentMapImageTest::Run()
+{
+	TestVersions();
+	TestIntegerKeys();
+	TestMappedFile();
+	TestMalformedImage();
+}
+
+void pst::PersistentMapImageTest::TestVersions()
+{
+	StringMap map;
+	FillMap(map);
+	map.DropVersionsBefore(50);
+	std::stringstream stream;
+	[[maybe_unused]] const bool isWrittenPastOldest = StringMapImage::Write(stream, map, 49);
+	assert(!isWrittenPastOldest);
+	[[maybe_unused]] const bool isWritten = StringMapImage::Write(stream, map, map.GetOldestVersion());
+	assert(isWritten);
+	const std::string data = stream.str();
+	const std::vector<std::uint64_t> buffer = ToAlignedBuffer(data);
+
+	StringMapImage image;
+	assert(!image.IsOpen());
+	[[maybe_unused]] const bool isOpened = image.Open(buffer.data(), data.size());
+	assert(isOpened);
+	assert(image.GetVersion() == map.GetVersion() && image.GetOldestVersion() == map.GetOldestVersion());
+	for (int version = image.GetOldestVersion(); version <= image.GetVersion(); version++)
+	{
+		const auto mapSnapshot = map.View(version);
+		const auto imageSnapshot = image.GetSnapshot(version);
+		assert(imageSnapshot.GetVersion() == version);
+		assert(AreEqual(mapSnapshot, imageSnapshot));
+		for (const std::string key : { "player_0", "player_500", "player_999", "player_5000", "a", "z" })
+		{
+			const auto* node = mapSnapshot.Search(key);
+			const int* value = imageSnapshot.Search(key);
+			assert(node ? value && *value == node->m_Value : !value);
+			assert(imageSnapshot.GetRank(key) == mapSnapshot.GetRank(key));
+			const auto lower = imageSnapshot.LowerBound(key);
+			const auto mapLower = mapSnapshot.LowerBound(key);
+			assert(mapLower == mapSnapshot.end() ? lower == imageSnapshot.end() : (*lower).m_Key == mapLower->m_Key);
+		}
+	}
+
+	// Versions share unchanged nodes, so image of all versions is a few times larger than image of one
+	std::stringstream lastVersionStream;
+	[[maybe_unused]] const bool isLastVersionWritten = StringMapImage::Write(lastVersionStream, map, map.GetVersion());
+	assert(isLastVersionWritten);
+	assert(data.size() < lastVersionStream.str().size() * 4);
+}
+
+void pst::PersistentMapImageTest::TestIntegerKeys()
+{
+	pst::PersistentMap<int, std::uint32_t> map;
+	for (int i = 0; i < 500; i++)
+	{
+		map.Insert(i * 7 % 500)->m_Value = i;
+	}
+
+	for (int i = 0; i < 500; i += 3)
+	{
+		map.Delete(i);
+	}
+
+	std::stringstream stream;
+	[[maybe_unused]] const bool isWritten = pst::PersistentMapImage<int, std::uint32_t>::Write(stream, map, 0);
+	assert(isWritten);
+	const std::string data = stream.str();
+	const std::vector<std::uint64_t> buffer = ToAlignedBuffer(data);
+	pst::PersistentMapImage<int, std::uint32_t> image;
+	[[maybe_unused]] const bool isOpened = image.Open(buffer.data(), data.size());
+	assert(isOpened);
+	assert(image.GetSnapshot(0).GetSize() == 0);
+	for (int version : { 1, 250, 500, image.GetVersion() })
+	{
+		assert(AreEqual(map.View(version), image.GetSnapshot(version)));
+	}
+
+	// Iterator is a plain forward walk, so it can be used by algorithms
+	const auto snapshot = image.GetSnapshot(image.GetVersion());
+	assert(std::distance(snapshot.LowerBound(100), snapshot.end()) == snapshot.GetSize() - snapshot.GetRank(100));
+}
+
+void pst::PersistentMapImageTest::TestMappedFile()
+{
+	StringMap map;
+	FillMap(map);
+	const std::string path = (std::filesystem::temp_directory_path() / "PersistentMapImageTest.image").string();
+	{
+		std::ofstream file(path, std::ios::binary | std::ios::trunc);
+		[[maybe_unused]] const bool isWritten = StringMapImage::Write(file, map, 0);
+		assert(isWritten);
+	}
+
+	{
+		pst::MappedFile mappedFile;
+		[[maybe_unused]] const bool isFileOpened = mappedFile.Open(path);
+		assert(isFileOpened);
+		StringMapImage image;
+		[[maybe_unused]] const bool isOpened = image.Open(mappedFile.GetData(), mappedFile.GetSize());
+		assert(isOpened);
+		for (int version : { 0, 1, 150, map.GetVersion() })
+		{
+			assert(AreEqual(map.View(version), image.GetSnapshot(version)));
+		}
+
+		mappedFile.Close();
+		assert(!mappedFile.GetData() && mappedFile.GetSize() == 0);
+	}
+
+	std::remove(path.c_str());
+	pst::MappedFile missingFile;
+	[[maybe_unused]] const bool isMissingFileOpened = missingFile.Open(path);
+	assert(!isMissingFileOpened);
+}
+
+void pst::PersistentMapImageTest::TestMalformedImage()
+{
+	StringMap map;
+	FillMap(map);
+	std::stringstream stream;
+	[[maybe_unused]] const bool isWritten = StringMapImage::Write(stream, map, 0);
+	assert(isWritten);
+	const std::string data = stream.str();
+	const std::vector<std::uint64_t> buffer = ToAlignedBuffer(data);
+
+	// Every section is checked against size of the memory, so truncated image is never opened
+	for (std::size_t size = 0; size < data.size(); size += 61)
+	{
+		StringMapImage image;
+		[[maybe_unused]] const bool isTruncatedOpened = image.Open(buffer.data(), size);
+		assert(!isTruncatedOpened);
+		assert(!image.IsOpen());
+	}
+
+	// Node size differs for other key and value types
+	pst::PersistentMapImage<int, int> intImage;
+	[[maybe_unused]] const bool isIntImageOpened = intImage.Open(buffer.data(), data.size());
+	assert(!isIntImageOpened);
+
+	std::vector<std::uint64_t> corruptedBuffer = buffer;
+	reinterpret_cast<char*>(corruptedBuffer.data())[0] ^= 1;
+	StringMapImage image;
+	[[maybe_unused]] const bool isCorruptedOpened = image.Open(corruptedBuffer.data(), data.size());
+	assert(!isCorruptedOpened);
+}
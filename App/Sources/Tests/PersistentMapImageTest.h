@@ -0,0 +1,16 @@
+#pragma once
+
+namespace pst
+{
+	class PersistentMapImageTest
+	{
+	public:
+		static void Run();
+
+	private:
+		static void TestVersions();
+		static void TestIntegerKeys();
+		static void TestMappedFile();
+		static void TestMalformedImage();
+	};
+}
@@ -4,11 +4,19 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
 #include <cmath>
+#include <map>
 #include <numeric>
 #include <random>
+#include <set>
+#include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
 
 void pst::PersistentMapTest::Run()
 {
@@ -16,6 +24,21 @@ void pst::PersistentMapTest::Run()
 	TestSortness();
 	TestDeleting();
 	TestRBTreeWithRandomData();
+	TestOrderStatistics();
+	TestBatch();
+	TestRetention();
+	TestDeferredReclamation();
+	TestConcurrentSnapshots();
+	TestSearchAtVersion();
+	TestDiff();
+	TestIterators();
+	TestKeyTraits();
+	TestSerialization();
+	TestBulkLoad();
+	TestSetOperations();
+	TestStats();
+	TestMemoryAccounting();
+	TestNodeLayout();
 }
 
 void pst::PersistentMapTest::TestInsertingAndRollback()
@@ -138,9 +161,11 @@ void pst::PersistentMapTest::TestRBTreeWithRandomData()
 
 		assert(CheckIfTreeIsSorted(&tree));
 		assert(CheckIfTreeIsRB(&tree));
+		assert(CheckIfSizesAreValid(tree.GetRoot()));
 		tree.Rollback(1000);
 		assert(CheckIfTreeIsSorted(&tree));
 		assert(CheckIfTreeIsRB(&tree));
+		assert(CheckIfSizesAreValid(tree.GetRoot()));
 		tree.Rollback(3000);
 		assert(CheckIfTreeIsSorted(&tree));
 		assert(CheckIfTreeIsRB(&tree));
@@ -156,28 +181,1059 @@ void pst::PersistentMapTest::TestRBTreeWithRandomData()
 	}
 }
 
-template<typename TKey, typename TValue>
-bool pst::PersistentMapTest::CheckIfTreeIsSorted(const pst::PersistentMap<TKey, TValue>* map)
+void pst::PersistentMapTest::TestOrderStatistics()
+{
+	auto generator = std::default_random_engine{};
+	pst::PersistentMap<int, int> tree;
+	assert(tree.GetSize() == 0);
+	assert(tree.GetRank(10) == 0);
+	assert(tree.GetByRank(0) == nullptr);
+
+	// Only even keys so that ranks of missing keys are checked as well
+	std::vector<int> keys(2000);
+	for (int i = 0; i < static_cast<int>(keys.size()); i++)
+	{
+		keys[i] = i * 2;
+	}
+
+	std::shuffle(std::begin(keys), std::end(keys), generator);
+	for (int key : keys)
+	{
+		tree.Insert(key);
+	}
+
+	// Updating existing key doesn't change sizes
+	tree.Insert(keys[0])->m_Value = 1;
+	const int fullVersion = tree.GetVersion();
+	assert(CheckIfSizesAreValid(tree.GetRoot()));
+	assert(tree.GetSize() == static_cast<int>(keys.size()));
+	for (int i = 0; i < static_cast<int>(keys.size()); i++)
+	{
+		assert(tree.GetRank(i * 2) == i);
+		assert(tree.GetRank(i * 2 + 1) == i + 1);
+		assert(tree.GetByRank(i)->m_Key == i * 2);
+	}
+
+	std::vector<int> visitedKeys;
+	tree.VisitByRank(1995, 10, [&visitedKeys](const auto& node) { visitedKeys.push_back(node.m_Key); });
+	assert(visitedKeys.size() == 5);
+	assert(visitedKeys.front() == 3990 && visitedKeys.back() == 3998);
+	visitedKeys.clear();
+	tree.VisitByRank(0, 3000, [&visitedKeys](const auto& node) { visitedKeys.push_back(node.m_Key); });
+	assert(visitedKeys.size() == keys.size());
+	assert(std::is_sorted(std::begin(visitedKeys), std::end(visitedKeys)));
+
+	// Delete half of keys and check that ranks are consistent with remaining ones
+	std::shuffle(std::begin(keys), std::end(keys), generator);
+	std::vector<int> remainingKeys(std::begin(keys) + keys.size() / 2, std::end(keys));
+	keys.resize(keys.size() / 2);
+	for (int key : keys)
+	{
+		tree.Delete(key);
+	}
+
+	std::sort(std::begin(remainingKeys), std::end(remainingKeys));
+	assert(CheckIfSizesAreValid(tree.GetRoot()));
+	assert(tree.GetSize() == static_cast<int>(remainingKeys.size()));
+	for (int i = 0; i < static_cast<int>(remainingKeys.size()); i++)
+	{
+		assert(tree.GetRank(remainingKeys[i]) == i);
+		assert(tree.GetByRank(i)->m_Key == remainingKeys[i]);
+	}
+
+	// Older versions keep their own statistics
+	tree.Rollback(tree.GetVersion() - fullVersion);
+	assert(CheckIfSizesAreValid(tree.GetRoot()));
+	assert(tree.GetSize() == 2000);
+	assert(tree.GetByRank(1999)->m_Key == 3998);
+}
+
+void pst::PersistentMapTest::TestBatch()
+{
+	pst::PersistentMap<int, int> tree;
+	tree.Insert(1)->m_Value = 1;
+	tree.BeginBatch();
+	assert(tree.IsInBatch());
+	assert(tree.GetVersion() == 2);
+	tree.Insert(2)->m_Value = 2;
+	tree.Insert(3)->m_Value = 3;
+	tree.Insert(1)->m_Value = 11;
+	tree.Delete(2);
+	assert(tree.GetVersion() == 2);
+	assert(tree.Search(1)->m_Value == 11);
+	assert(tree.Search(2) == nullptr);
+	assert(tree.Search(3)->m_Value == 3);
+	tree.Commit();
+	assert(!tree.IsInBatch());
+	tree.Insert(4);
+	assert(tree.GetVersion() == 3);
+	tree.Rollback(1);
+	tree.Rollback(1);
+	assert(tree.Search(1)->m_Value == 1);
+	assert(tree.Search(3) == nullptr);
+
+	// Nodes cloned by batch are reused, so number of live nodes doesn't depend on number of changes to the same keys
+	tree.BeginBatch();
+	tree.ReclaimAll();
+	const std::size_t blocksBefore = tree.m_NodePool->GetAllocatedBlocks();
+	for (int i = 0; i < 100; i++)
+	{
+		tree.Insert(1)->m_Value = i;
+	}
+
+	tree.Commit();
+	assert(tree.m_NodePool->GetAllocatedBlocks() == blocksBefore + 1);
+
+	// Random batches should keep tree valid and equal to non-persistent reference
+	auto generator = std::default_random_engine{};
+	std::uniform_int_distribution<int> keyDistribution(0, 999);
+	std::vector<std::vector<int>> referenceHistory;
+	std::vector<int> reference(1000, -1);
+	reference[1] = 99;
+	for (int batch = 0; batch < 200; batch++)
+	{
+		tree.BeginBatch();
+		for (int i = 0; i < 20; i++)
+		{
+			const int key = keyDistribution(generator);
+			if (key % 3 == 0)
+			{
+				tree.Delete(key);
+				reference[key] = -1;
+			}
+			else
+			{
+				tree.Insert(key)->m_Value = batch;
+				reference[key] = batch;
+			}
+		}
+
+		tree.Commit();
+		referenceHistory.push_back(reference);
+		assert(CheckIfTreeIsSorted(&tree));
+		assert(CheckIfTreeIsRB(&tree));
+		assert(CheckIfSizesAreValid(tree.GetRoot()));
+	}
+
+	for (int step = 0; step < 100; step++)
+	{
+		tree.Rollback(1);
+		referenceHistory.pop_back();
+	}
+
+	for (int key = 0; key < 1000; key++)
+	{
+		const auto* node = tree.Search(key);
+		assert(node ? node->m_Value == referenceHistory.back()[key] : referenceHistory.back()[key] == -1);
+	}
+}
+
+void pst::PersistentMapTest::TestRetention()
+{
+	pst::PersistentMap<int, int> tree;
+	for (int i = 0; i < 1000; i++)
+	{
+		tree.Insert(i)->m_Value = i;
+	}
+
+	for (int i = 0; i < 1000; i++)
+	{
+		tree.Insert(i)->m_Value = -i;
+	}
+
+	// Only last version is kept, so old values are freed and each key has single node.
+	// Last version is published first, otherwise published previous version would keep its nodes
+	tree.Publish();
+	tree.DropVersionsBefore(tree.GetVersion());
+	assert(tree.GetPendingReclaimCount() > 0);
+	const std::size_t blocksBefore = tree.m_NodePool->GetAllocatedBlocks();
+	const std::size_t freedBytes = tree.ReclaimAll();
+	assert(freedBytes == (blocksBefore - 1000) * sizeof(pst::PersistentMapNode<int, int, pst::NodePool>));
+	assert(tree.m_NodePool->GetAllocatedBlocks() == 1000);
+	assert(tree.GetPendingReclaimCount() == 0);
+	assert(tree.GetOldestVersion() == 2000);
+	assert(tree.GetVersion() == 2000);
+	assert(tree.Search(10)->m_Value == -10);
+	[[maybe_unused]] const bool isRolledBackPastOldest = tree.Rollback(1);
+	assert(!isRolledBackPastOldest);
+	assert(tree.Search(10)->m_Value == -10);
+	tree.DropVersionsBefore(tree.GetVersion());
+	assert(tree.GetPendingReclaimCount() == 0);
+
+	// Version numbers stay stable and rollback works inside retained window
+	for (int i = 0; i < 100; i++)
+	{
+		tree.Delete(i);
+		tree.DropVersionsBefore(tree.GetVersion() - 10);
+	}
+
+	assert(tree.GetVersion() == 2100);
+	assert(tree.GetOldestVersion() == 2090);
+	assert(tree.m_RootHistory.size() <= 21);
+	[[maybe_unused]] const bool isRolledBack = tree.Rollback(10);
+	assert(isRolledBack);
+	assert(tree.Search(89) == nullptr);
+	assert(tree.Search(90)->m_Value == -90);
+	[[maybe_unused]] const bool isRolledBackPastWindow = tree.Rollback(1);
+	assert(!isRolledBackPastWindow);
+	tree.Insert(5000);
+	assert(tree.GetVersion() == 2091);
+	assert(CheckIfTreeIsRB(&tree));
+	assert(CheckIfSizesAreValid(tree.GetRoot()));
+
+	// Dropped versions can't be reached even with a rolled back tail in history
+	tree.DropVersionsBefore(3000);
+	assert(tree.GetOldestVersion() == 2091);
+	assert(tree.Search(5000) != nullptr);
+	assert(tree.GetSize() == 911);
+}
+
+void pst::PersistentMapTest::TestDeferredReclamation()
+{
+	pst::PersistentMap<int, int> tree;
+	tree.BeginBatch();
+	for (int i = 0; i < 10000; i++)
+	{
+		tree.Insert(i);
+	}
+
+	tree.Commit();
+	const std::size_t fullTreeBlocks = tree.m_NodePool->GetAllocatedBlocks();
+	assert(fullTreeBlocks == 10000);
+
+	// Overwriting rolled back version doesn't free its subtree inline, every mutation does bounded amount of work instead
+	tree.Rollback(1);
+	tree.BeginBatch();
+
+	// Unpublished root of rolled back version is released without waiting for more publications
+	tree.ReclaimUnpublishedRoots(true);
+	tree.Insert(-1);
+	assert(tree.GetPendingReclaimCount() > 0);
+	const std::size_t reclaimStepSize = pst::PersistentMap<int, int>::ReclaimStepSize;
+	std::size_t blocks = tree.m_NodePool->GetAllocatedBlocks();
+	assert(blocks + reclaimStepSize >= fullTreeBlocks);
+	for (int i = 0; i < 1000 && tree.GetPendingReclaimCount() > 0; i++)
+	{
+		tree.Insert(-1);
+		const std::size_t newBlocks = tree.m_NodePool->GetAllocatedBlocks();
+		assert(newBlocks + reclaimStepSize >= blocks);
+		blocks = newBlocks;
+	}
+
+	tree.Commit();
+	assert(tree.GetPendingReclaimCount() == 0);
+	assert(tree.m_NodePool->GetAllocatedBlocks() == 1);
+	assert(tree.Search(-1) != nullptr && tree.GetSize() == 1);
+}
+
+void pst::PersistentMapTest::TestConcurrentSnapshots()
+{
+	// Every committed version has all keys with value equal to its batch number, so reader can check that snapshot is never torn
+	static constexpr int keysCount = 64;
+	pst::PersistentMap<int, int> tree;
+	std::atomic<bool> isWriterDone(false);
+	auto reader = [&tree, &isWriterDone]()
+	{
+		while (!isWriterDone.load())
+		{
+			pst::EpochDomain::ReadGuard guard(tree.GetEpochDomain());
+			const auto snapshot = tree.GetSnapshot(guard);
+			if (snapshot.GetSize() == 0)
+			{
+				continue;
+			}
+
+			assert(snapshot.GetSize() == keysCount);
+			const int value = snapshot.GetMin()->m_Value;
+			int visitedKeys = 0;
+			snapshot.VisitByRank(0, keysCount, [value, &visitedKeys](const auto& node)
+			{
+				assert(node.m_Key == visitedKeys && node.m_Value == value);
+				visitedKeys++;
+			});
+
+			assert(visitedKeys == keysCount);
+			assert(snapshot.Search(keysCount / 2)->m_Value == value);
+			assert(snapshot.GetRank(keysCount) == keysCount);
+		}
+	};
+
+	std::vector<std::thread> readers;
+	for (int i = 0; i < 4; i++)
+	{
+		readers.emplace_back(reader);
+	}
+
+	auto generator = std::default_random_engine{};
+	std::uniform_int_distribution<int> stepDistribution(0, 9);
+	for (int batch = 0; batch < 3000; batch++)
+	{
+		tree.BeginBatch();
+		for (int key = 0; key < keysCount; key++)
+		{
+			tree.Insert(key)->m_Value = batch;
+		}
+
+		tree.Commit();
+		if (stepDistribution(generator) == 0 && tree.GetVersion() - tree.GetOldestVersion() > 1)
+		{
+			tree.Rollback(1);
+		}
+
+		tree.DropVersionsBefore(tree.GetVersion() - 5);
+	}
+
+	isWriterDone.store(true);
+	for (std::thread& thread : readers)
+	{
+		thread.join();
+	}
+
+	// Nothing is pinned anymore, so everything except published and retained versions can be freed
+	tree.ReclaimAll();
+	assert(tree.GetPendingReclaimCount() == 0);
+	assert(tree.m_UnpublishedRoots.empty());
+}
+
+void pst::PersistentMapTest::TestSearchAtVersion()
+{
+	pst::PersistentMap<int, int> tree;
+	for (int i = 0; i < 1000; i++)
+	{
+		tree.Insert(i % 10)->m_Value = i;
+	}
+
+	tree.Delete(5);
+	assert(tree.GetVersion() == 1001);
+	assert(tree.Search(5, 1001) == nullptr);
+	assert(tree.Search(5, 1000)->m_Value == 995);
+	assert(tree.Search(5, 6)->m_Value == 5);
+	assert(tree.Search(7, 6) == nullptr);
+	assert(tree.Search(0, 0) == nullptr);
+	assert(tree.Search(0, 1002) == nullptr);
+	assert(tree.GetVersion() == 1001);
+
+	// Rolled back and dropped versions are not visible
+	tree.Rollback(500);
+	assert(tree.Search(5, 600) == nullptr);
+	assert(tree.Search(5, 501)->m_Value == 495);
+	tree.DropVersionsBefore(400);
+	assert(tree.Search(5, 399) == nullptr);
+	assert(tree.Search(5, 400)->m_Value == 395);
+}
+
+void pst::PersistentMapTest::TestDiff()
+{
+	pst::PersistentMap<int, int> tree;
+	auto generator = std::default_random_engine{};
+	std::uniform_int_distribution<int> keyDistribution(0, 499);
+	std::vector<std::vector<int>> referenceHistory(1, std::vector<int>(500, -1));
+	for (int version = 1; version <= 300; version++)
+	{
+		std::vector<int> reference = referenceHistory.back();
+		tree.BeginBatch();
+		for (int i = 0; i < 5; i++)
+		{
+			const int key = keyDistribution(generator);
+			if (key % 4 == 0)
+			{
+				tree.Delete(key);
+				reference[key] = -1;
+			}
+			else
+			{
+				// Some updates keep the same value, they should not be reported
+				const int value = key % 4 == 1 ? key : version;
+				tree.Insert(key)->m_Value = value;
+				reference[key] = value;
+			}
+		}
+
+		tree.Commit();
+		referenceHistory.push_back(reference);
+	}
+
+	for (auto [fromVersion, toVersion] : { std::pair(0, 300), std::pair(300, 0), std::pair(299, 300), std::pair(150, 160), std::pair(42, 42), std::pair(0, 0) })
+	{
+		std::vector<int> changedKeys;
+		const bool isDiffed = tree.Diff(fromVersion, toVersion, [&](const auto* fromNode, const auto* toNode)
+		{
+			const int key = fromNode ? fromNode->m_Key : toNode->m_Key;
+			assert(!changedKeys.empty() ? changedKeys.back() < key : true);
+			assert((fromNode ? fromNode->m_Value : -1) == referenceHistory[fromVersion][key]);
+			assert((toNode ? toNode->m_Value : -1) == referenceHistory[toVersion][key]);
+			changedKeys.push_back(key);
+		});
+
+		assert(isDiffed);
+		std::vector<int> expectedKeys;
+		for (int key = 0; key < 500; key++)
+		{
+			if (referenceHistory[fromVersion][key] != referenceHistory[toVersion][key])
+			{
+				expectedKeys.push_back(key);
+			}
+		}
+
+		assert(changedKeys == expectedKeys);
+	}
+
+	tree.DropVersionsBefore(10);
+	assert(!tree.Diff(5, 300, [](const auto*, const auto*) {}));
+	assert(!tree.Diff(10, 301, [](const auto*, const auto*) {}));
+}
+
+void pst::PersistentMapTest::TestIterators()
+{
+	pst::PersistentMap<int, int> tree;
+	assert(tree.begin() == tree.end());
+	assert(tree.LowerBound(0) == tree.end());
+
+	// Even keys only, so bounds of odd keys fall between nodes
+	std::vector<int> keys(1000);
+	std::iota(std::begin(keys), std::end(keys), 0);
+	std::transform(std::begin(keys), std::end(keys), std::begin(keys), [](int key) { return key * 2; });
+	std::vector<int> shuffledKeys = keys;
+	std::shuffle(std::begin(shuffledKeys), std::end(shuffledKeys), std::default_random_engine{});
+	for (int key : shuffledKeys)
+	{
+		tree.Insert(key)->m_Value = key + 1;
+	}
+
+	std::vector<int> iteratedKeys;
+	for (const auto& node : tree)
+	{
+		assert(node.m_Value == node.m_Key + 1);
+		iteratedKeys.push_back(node.m_Key);
+	}
+
+	assert(iteratedKeys == keys);
+	assert(std::distance(tree.begin(), tree.end()) == 1000);
+	for (int key = -1; key <= 2000; key++)
+	{
+		const auto expectedLower = std::lower_bound(std::begin(keys), std::end(keys), key);
+		const auto expectedUpper = std::upper_bound(std::begin(keys), std::end(keys), key);
+		const auto lower = tree.LowerBound(key);
+		const auto upper = tree.UpperBound(key);
+		assert(expectedLower == std::end(keys) ? lower == tree.end() : lower->m_Key == *expectedLower);
+		assert(expectedUpper == std::end(keys) ? upper == tree.end() : upper->m_Key == *expectedUpper);
+		assert(std::distance(lower, tree.end()) == std::distance(expectedLower, std::end(keys)));
+	}
+
+	std::vector<int> rangeKeys;
+	tree.ForEachInRange(101, 120, [&rangeKeys](const auto& node) { rangeKeys.push_back(node.m_Key); });
+	assert((rangeKeys == std::vector<int>{ 102, 104, 106, 108, 110, 112, 114, 116, 118 }));
+	rangeKeys.clear();
+	tree.ForEachInRange(120, 120, [&rangeKeys](const auto& node) { rangeKeys.push_back(node.m_Key); });
+	assert(rangeKeys.empty());
+
+	// Older version is walked through the view while current one is changed
+	const int fullVersion = tree.GetVersion();
+	for (int key = 0; key < 2000; key += 4)
+	{
+		tree.Delete(key);
+	}
+
+	const auto fullView = tree.View(fullVersion);
+	assert(std::distance(fullView.begin(), fullView.end()) == 1000);
+	assert(std::distance(tree.begin(), tree.end()) == 500);
+	assert(fullView.LowerBound(3)->m_Key == 4);
+	assert(tree.LowerBound(3)->m_Key == 6);
+	auto iterator = tree.begin();
+	assert((iterator++)->m_Key == 2);
+	assert(iterator->m_Key == 6);
+}
+
+void pst::PersistentMapTest::TestKeyTraits()
+{
+	// Keys share long prefixes, differ in length and contain bytes above 0x7f, so both prefix and full comparison decide ordering
+	const std::vector<std::string> words = { "", "a", "ab", "abcdefgh", "abcdefgh0", "abcdefgh1", "abcdefghi", "abcdefg", std::string("ab\0", 3), "\xff", "b", "zzzzzzzzzzzz", "player_0001", "player_0002", "player_10" };
+	pst::PersistentMap<std::string, int, pst::NodePool, pst::StringPrefixKeyTraits<>> tree;
+	std::set<std::string> expectedKeys;
+	for (int i = 0; i < 2000; i++)
+	{
+		const std::string key = words[i % words.size()] + std::to_string(i * 7919 % 2000);
+		tree.Insert(key)->m_Value = i;
+		expectedKeys.insert(key);
+	}
+
+	for (const std::string& word : words)
+	{
+		tree.Insert(word)->m_Value = -1;
+		expectedKeys.insert(word);
+	}
+
+	assert(CheckIfTreeIsSorted(&tree));
+	assert(CheckIfTreeIsRB(&tree));
+	assert(std::equal(std::begin(expectedKeys), std::end(expectedKeys), tree.begin(), tree.end(), [](const std::string& key, const auto& node) { return key == node.m_Key; }));
+
+	int rank = 0;
+	for (const std::string& key : expectedKeys)
+	{
+		// Lookup by view of a longer buffer, so traits can't rely on terminating zero
+		const std::string buffer = key + "#";
+		const std::string_view view(buffer.data(), key.size());
+		assert(tree.Search(view) && tree.Search(view)->m_Key == key);
+		assert(tree.GetRank(view) == rank++);
+	}
+
+	assert(!tree.Search(std::string_view("abcdefgh", 5)));
+	for (const std::string_view probe : { "abcdefgh2", "abcdefgh", "player_0", "\xfe", "zzzzzzzzzzzzz" })
+	{
+		const auto expectedLower = expectedKeys.lower_bound(std::string(probe));
+		const auto lower = tree.LowerBound(probe);
+		assert(expectedLower == std::end(expectedKeys) ? lower == tree.end() : lower->m_Key == *expectedLower);
+	}
+
+	for (const std::string& word : words)
+	{
+		tree.Delete(std::string_view(word));
+	}
+
+	for (const std::string& key : expectedKeys)
+	{
+		const bool isDeleted = std::find(std::begin(words), std::end(words), key) != std::end(words);
+		assert(!tree.Search(std::string_view(key)) == isDeleted);
+	}
+
+	assert(CheckIfTreeIsSorted(&tree));
+	assert(CheckIfTreeIsRB(&tree));
+	assert(tree.GetSize() == static_cast<int>(expectedKeys.size() - words.size()));
+}
+
+void pst::PersistentMapTest::TestSerialization()
+{
+	pst::PersistentMap<std::string, int, pst::NodePool, pst::StringPrefixKeyTraits<>> tree;
+	auto generator = std::default_random_engine{};
+	std::uniform_int_distribution<int> keyDistribution(0, 999);
+	for (int version = 1; version <= 500; version++)
+	{
+		const int key = keyDistribution(generator);
+		if (key % 5 == 0)
+		{
+			tree.Delete("player_" + std::to_string(key));
+		}
+		else
+		{
+			tree.Insert("player_" + std::to_string(key))->m_Value = version;
+		}
+	}
+
+	tree.DropVersionsBefore(100);
+	tree.ReclaimAll();
+
+	std::stringstream stream;
+	pst::BinaryWriter writer(stream);
+	[[maybe_unused]] const bool isSavedPastOldest = tree.Save(writer, 99);
+	assert(!isSavedPastOldest);
+	[[maybe_unused]] const bool isSaved = tree.Save(writer, tree.GetOldestVersion());
+	assert(isSaved);
+	const std::string data = stream.str();
+
+	// Sharing is restored, so every retained version takes the same node memory as in the saved map
+	pst::PersistentMap<std::string, int, pst::NodePool, pst::StringPrefixKeyTraits<>> loadedTree;
+	pst::BinaryReader reader(stream);
+	[[maybe_unused]] const bool isLoaded = loadedTree.Load(reader);
+	assert(isLoaded);
+	assert(loadedTree.GetVersion() == tree.GetVersion());
+	assert(loadedTree.GetOldestVersion() == tree.GetOldestVersion());
+	assert(loadedTree.m_NodePool->GetAllocatedBlocks() == tree.m_NodePool->GetAllocatedBlocks());
+	for (int version = tree.GetOldestVersion(); version <= tree.GetVersion(); version++)
+	{
+		const auto view = tree.View(version);
+		const auto loadedView = loadedTree.View(version);
+		assert(std::equal(view.begin(), view.end(), loadedView.begin(), loadedView.end(), [](const auto& node, const auto& loadedNode)
+		{
+			return node.m_Key == loadedNode.m_Key && node.m_Value == loadedNode.m_Value;
+		}));
+	}
+
+	assert(CheckIfTreeIsRB(&loadedTree));
+	assert(CheckIfSizesAreValid(loadedTree.GetRoot()));
+
+	// Loaded map continues history: rollback reaches saved versions and new versions share their nodes
+	const int baseVersion = tree.GetVersion() - 100;
+	[[maybe_unused]] const bool isRolledBack = loadedTree.Rollback(100);
+	assert(isRolledBack);
+	loadedTree.Insert("player_1")->m_Value = -1;
+	assert(loadedTree.Search("player_1")->m_Value == -1);
+	assert(loadedTree.GetSize() == tree.View(baseVersion).GetSize() + (tree.View(baseVersion).Search("player_1") ? 0 : 1));
+	[[maybe_unused]] const bool isRolledBackPastOldest = loadedTree.Rollback(loadedTree.GetVersion() - loadedTree.GetOldestVersion() + 1);
+	assert(!isRolledBackPastOldest);
+	[[maybe_unused]] const bool isRolledBackToOldest = loadedTree.Rollback(loadedTree.GetVersion() - loadedTree.GetOldestVersion());
+	assert(isRolledBackToOldest);
+	assert(loadedTree.GetSize() == tree.View(tree.GetOldestVersion()).GetSize());
+
+	// Save of a later version writes only nodes it can reach
+	std::stringstream lastVersionStream;
+	pst::BinaryWriter lastVersionWriter(lastVersionStream);
+	[[maybe_unused]] const bool isLastVersionSaved = tree.Save(lastVersionWriter, tree.GetVersion());
+	assert(isLastVersionSaved);
+	assert(lastVersionStream.str().size() * 3 < data.size());
+
+	// Truncated or corrupted input is rejected before it reaches the map, or forms valid tree
+	for (std::size_t size = 0; size < data.size(); size += 7)
+	{
+		std::stringstream truncatedStream(data.substr(0, size));
+		pst::BinaryReader truncatedReader(truncatedStream);
+		pst::PersistentMap<std::string, int, pst::NodePool, pst::StringPrefixKeyTraits<>> truncatedTree;
+		[[maybe_unused]] const bool isTruncatedLoaded = truncatedTree.Load(truncatedReader);
+		assert(!isTruncatedLoaded);
+		assert(truncatedTree.GetVersion() == 0 && truncatedTree.GetSize() == 0);
+		assert(truncatedTree.m_NodePool->GetAllocatedBlocks() == 0);
+	}
+
+	std::uniform_int_distribution<std::size_t> positionDistribution(0, data.size() - 1);
+	for (int i = 0; i < 200; i++)
+	{
+		std::string corruptedData = data;
+		corruptedData[positionDistribution(generator)] ^= static_cast<char>(1 << (i % 8));
+		std::stringstream corruptedStream(corruptedData);
+		pst::BinaryReader corruptedReader(corruptedStream);
+		pst::PersistentMap<std::string, int, pst::NodePool, pst::StringPrefixKeyTraits<>> corruptedTree;
+		if (corruptedTree.Load(corruptedReader))
+		{
+			assert(CheckIfTreeIsSorted(&corruptedTree));
+			assert(CheckIfTreeIsRB(&corruptedTree));
+			assert(CheckIfSizesAreValid(corruptedTree.GetRoot()));
+		}
+		else
+		{
+			assert(corruptedTree.m_NodePool->GetAllocatedBlocks() == 0);
+		}
+	}
+}
+
+void pst::PersistentMapTest::TestBulkLoad()
+{
+	// Every size up to few full levels, so each shape of the incomplete last level is built
+	for (int size = 0; size <= 130; size++)
+	{
+		std::vector<std::pair<int, int>> entries;
+		for (int i = 0; i < size; i++)
+		{
+			entries.emplace_back(i * 2, -i);
+		}
+
+		pst::PersistentMap<int, int> tree;
+		tree.Insert(1)->m_Value = 1;
+		[[maybe_unused]] const bool isLoaded = tree.BulkLoad(entries.begin(), entries.end());
+		assert(isLoaded);
+		assert(tree.GetVersion() == 2);
+		assert(tree.GetSize() == size);
+		assert(CheckIfTreeIsSorted(&tree));
+		assert(CheckIfTreeIsRB(&tree));
+		assert(CheckIfSizesAreValid(tree.GetRoot()));
+		assert(std::equal(std::begin(entries), std::end(entries), tree.begin(), tree.end(), [](const auto& entry, const auto& node) { return entry.first == node.m_Key && entry.second == node.m_Value; }));
+
+		// Loaded version is an ordinary one: older version is kept and the tree can be changed further
+		assert(tree.Search(1, 1) && !tree.Search(1));
+		tree.Insert(1)->m_Value = 1;
+		assert(CheckIfTreeIsRB(&tree));
+		tree.Delete(1);
+		[[maybe_unused]] const bool isRolledBack = tree.Rollback(3);
+		assert(isRolledBack && tree.GetSize() == 1 && tree.Search(1));
+	}
+
+	// Keys which are not strictly ascending change nothing, wherever the wrong key is
+	const std::vector<std::pair<std::string, int>> duplicates = { { "a", 1 }, { "b", 2 }, { "c", 3 }, { "c", 4 }, { "d", 5 } };
+	const std::vector<std::pair<std::string, int>> descending = { { "a", 1 }, { "c", 2 }, { "b", 3 } };
+	pst::PersistentMap<std::string, int, pst::NodePool, pst::StringPrefixKeyTraits<>> tree;
+	tree.Insert("x")->m_Value = 1;
+	[[maybe_unused]] const bool isDuplicatesLoaded = tree.BulkLoad(duplicates.begin(), duplicates.end());
+	assert(!isDuplicatesLoaded);
+	[[maybe_unused]] const bool isDescendingLoaded = tree.BulkLoad(descending.begin(), descending.end());
+	assert(!isDescendingLoaded);
+	assert(tree.GetVersion() == 1 && tree.GetSize() == 1 && tree.Search("x")->m_Value == 1);
+	tree.ReclaimAll();
+	assert(tree.GetPendingReclaimCount() == 0);
+	tree.Insert("y")->m_Value = 2;
+	assert(tree.GetVersion() == 2 && tree.GetSize() == 2);
+	[[maybe_unused]] const bool isRolledBack = tree.Rollback(1);
+	assert(isRolledBack && tree.GetSize() == 1);
+
+	// Unsorted input is large enough to be sorted by several threads. The last entry of equal keys wins
+	auto generator = std::default_random_engine{};
+	std::uniform_int_distribution<int> keyDistribution(0, 99999);
+	std::vector<std::pair<std::string, int>> unsorted;
+	std::map<std::string, int> expected;
+	for (int i = 0; i < 200000; i++)
+	{
+		const std::string key = "player_" + std::to_string(keyDistribution(generator));
+		unsorted.emplace_back(key, i);
+		expected[key] = i;
+	}
+
+	[[maybe_unused]] const bool isUnsortedLoaded = tree.BulkLoadUnsorted(unsorted, 4);
+	assert(isUnsortedLoaded);
+	assert(tree.GetSize() == static_cast<int>(expected.size()));
+	assert(CheckIfTreeIsRB(&tree));
+	assert(CheckIfSizesAreValid(tree.GetRoot()));
+	assert(std::equal(std::begin(expected), std::end(expected), tree.begin(), tree.end(), [](const auto& entry, const auto& node) { return entry.first == node.m_Key && entry.second == node.m_Value; }));
+	[[maybe_unused]] const bool isUnsortedRolledBack = tree.Rollback(1);
+	assert(isUnsortedRolledBack && tree.GetSize() == 1);
+}
+
+void pst::PersistentMapTest::TestSetOperations()
+{
+	// Sizes of both sides differ from equal to far apart, so joins meet every difference of black heights
+	auto generator = std::default_random_engine{};
+	for (int treeSize : { 0, 1, 2, 7, 100, 3000 })
+	{
+		for (int updatesSize : { 0, 1, 3, 50, 1000, 5000 })
+		{
+			std::uniform_int_distribution<int> keyDistribution(0, 2 * (treeSize + updatesSize));
+			pst::PersistentMap<int, int> tree;
+			std::map<int, int> expected;
+			for (int i = 0; i < treeSize; i++)
+			{
+				const int key = keyDistribution(generator);
+				tree.Insert(key)->m_Value = i;
+				expected[key] = i;
+			}
+
+			const std::map<int, int> expectedBefore = expected;
+			const int versionBefore = tree.GetVersion();
+			std::map<int, int> updates;
+			for (int i = 0; i < updatesSize; i++)
+			{
+				updates[keyDistribution(generator)] = -i;
+			}
+
+			for (const auto& [key, value] : updates)
+			{
+				expected[key] = value;
+			}
+
+			[[maybe_unused]] const bool isUnited = tree.Union(updates.begin(), updates.end());
+			assert(isUnited);
+			assert(tree.GetVersion() == versionBefore + 1);
+			assert(CheckIfTreeIsSorted(&tree));
+			assert(CheckIfTreeIsRB(&tree));
+			assert(CheckIfSizesAreValid(tree.GetRoot()));
+			assert(std::equal(std::begin(expected), std::end(expected), tree.begin(), tree.end(), [](const auto& entry, const auto& node) { return entry.first == node.m_Key && entry.second == node.m_Value; }));
+
+			// Difference with other map reads its nodes only, so the other map can go first
+			{
+				pst::PersistentMap<int, int> removed;
+				for (int i = 0; i < updatesSize; i++)
+				{
+					const int key = keyDistribution(generator);
+					removed.Insert(key)->m_Value = 0;
+					expected.erase(key);
+				}
+
+				tree.Difference(removed);
+			}
+
+			assert(tree.GetVersion() == versionBefore + 2);
+			assert(CheckIfTreeIsSorted(&tree));
+			assert(CheckIfTreeIsRB(&tree));
+			assert(CheckIfSizesAreValid(tree.GetRoot()));
+			assert(std::equal(std::begin(expected), std::end(expected), tree.begin(), tree.end(), [](const auto& entry, const auto& node) { return entry.first == node.m_Key && entry.second == node.m_Value; }));
+
+			// Older version shares untouched subtrees and is not changed by them
+			assert(std::equal(std::begin(expectedBefore), std::end(expectedBefore), tree.View(versionBefore).begin(), tree.View(versionBefore).end(), [](const auto& entry, const auto& node) { return entry.first == node.m_Key && entry.second == node.m_Value; }));
+			[[maybe_unused]] const bool isRolledBack = tree.Rollback(2);
+			assert(isRolledBack && tree.GetSize() == static_cast<int>(expectedBefore.size()));
+			assert(CheckIfTreeIsRB(&tree));
+		}
+	}
+
+	// Union with other map copies its nodes, so it outlives the other map. Keys which are not ascending change nothing
+	pst::PersistentMap<std::string, int, pst::NodePool, pst::StringPrefixKeyTraits<>> tree;
+	tree.Insert("b")->m_Value = 1;
+	tree.Insert("d")->m_Value = 2;
+	{
+		pst::PersistentMap<std::string, int, pst::NodePool, pst::StringPrefixKeyTraits<>> other;
+		other.Insert("a")->m_Value = 3;
+		other.Insert("d")->m_Value = 4;
+		other.Insert("e")->m_Value = 5;
+		tree.Union(other);
+		assert(other.GetSize() == 3 && other.Search("d")->m_Value == 4);
+	}
+
+	const std::vector<std::pair<std::string, int>> descending = { { "c", 6 }, { "a", 7 } };
+	[[maybe_unused]] const bool isDescendingUnited = tree.Union(descending.begin(), descending.end());
+	assert(!isDescendingUnited);
+	assert(tree.GetVersion() == 3 && tree.GetSize() == 4);
+	assert(tree.Search("a")->m_Value == 3 && tree.Search("b")->m_Value == 1 && tree.Search("d")->m_Value == 4 && tree.Search("e")->m_Value == 5);
+	assert(CheckIfTreeIsRB(&tree));
+
+	// Set operations inside batch change the batch version in place with inserts and deletes around them
+	const std::vector<std::pair<std::string, int>> updates = { { "c", 6 }, { "f", 7 } };
+	tree.BeginBatch();
+	tree.Insert("g")->m_Value = 8;
+	[[maybe_unused]] const bool isUnited = tree.Union(updates.begin(), updates.end());
+	assert(isUnited);
+	[[maybe_unused]] const bool isDescendingUnitedAfterUpdates = tree.Union(descending.begin(), descending.end());
+	assert(!isDescendingUnitedAfterUpdates);
+	tree.Delete("a");
+	{
+		pst::PersistentMap<std::string, int, pst::NodePool, pst::StringPrefixKeyTraits<>> removed;
+		removed.Insert("b");
+		removed.Insert("x");
+		tree.Difference(removed);
+	}
+
+	tree.Commit();
+	assert(tree.GetVersion() == 4 && tree.GetSize() == 5);
+	assert(CheckIfTreeIsRB(&tree));
+	assert(CheckIfSizesAreValid(tree.GetRoot()));
+	const std::vector<std::string> expectedKeys = { "c", "d", "e", "f", "g" };
+	assert(std::equal(std::begin(expectedKeys), std::end(expectedKeys), tree.begin(), tree.end(), [](const std::string& key, const auto& node) { return key == node.m_Key; }));
+	[[maybe_unused]] const bool isRolledBack = tree.Rollback(1);
+	assert(isRolledBack && tree.GetSize() == 4 && tree.Search("a"));
+}
+
+void pst::PersistentMapTest::TestStats()
+{
+	pst::PersistentMap<int, int> tree;
+	tree.Insert(1);
+	tree.Insert(2);
+	tree.Insert(3);
+	assert(tree.Search(2));
+	const pst::PersistentMapStats stats = tree.GetStats();
+	if constexpr (!pst::PersistentMap<int, int>::IsStatsEnabled)
+	{
+		// Counting is compiled out, so nothing changes
+		assert(stats.m_Inserts == 0 && stats.m_Walks == 0 && stats.m_PathCopyClones == 0 && stats.m_Rotations == 0 && stats.m_Comparisons == 0);
+		return;
+	}
+
+	// Every insert starts a version, so the whole path is copied. The third one makes red parent of red node on the right spine, which takes one rotation.
+	// Parent is of current version already, so the rotation copies nothing
+	assert(stats.m_Inserts == 3 && stats.m_Deletes == 0);
+	assert(stats.m_PathCopyClones == 3 && stats.m_InsertFixupClones == 0 && stats.m_DeleteFixupClones == 0 && stats.m_OtherClones == 0);
+	assert(stats.m_Rotations == 1);
+	assert(stats.m_Walks == 4 && stats.m_BuildPathCalls == 0);
+	assert(stats.m_Comparisons == 0 + 1 + 2 + 1);
+
+	// Nodes changed by the batch once are not copied again
+	tree.ResetStats();
+	tree.BeginBatch();
+	tree.Insert(2);
+	tree.Insert(2);
+	tree.Commit();
+	assert(tree.GetStats().m_PathCopyClones == 1 && tree.GetStats().m_Inserts == 2 && tree.GetStats().m_Comparisons == 2);
+
+	// Missing key is not deleted, but its walk is counted
+	tree.ResetStats();
+	tree.Delete(4);
+	assert(tree.GetStats().m_Deletes == 1 && tree.GetStats().m_Walks == 1 && tree.GetStats().m_PathCopyClones == 0);
+	assert(tree.BuildPath(tree.Search(3)).size() == 2 && tree.GetStats().m_BuildPathCalls == 1);
+
+	// Random changes need fixups of both kinds, bulk operations copy nodes outside of scopes of single changes
+	tree.ResetStats();
+	auto generator = std::default_random_engine{};
+	std::uniform_int_distribution<int> keyDistribution(0, 1000);
+	for (int i = 0; i < 2000; i++)
+	{
+		tree.Insert(keyDistribution(generator));
+		tree.Delete(keyDistribution(generator));
+	}
+
+	assert(tree.GetStats().m_InsertFixupClones > 0 && tree.GetStats().m_DeleteFixupClones > 0 && tree.GetStats().m_OtherClones == 0);
+	assert(tree.GetStats().m_Walks == 4000 && tree.GetStats().m_Comparisons > 4000);
+	const std::vector<std::pair<int, int>> updates = { { 1001, 0 }, { 1002, 0 } };
+	[[maybe_unused]] const bool isUnited = tree.Union(updates.begin(), updates.end());
+	assert(isUnited);
+	assert(tree.GetStats().m_OtherClones > 0);
+}
+
+void pst::PersistentMapTest::TestMemoryAccounting()
+{
+	// Keys of 20 characters own heap buffers, keys of 4 characters live inside the string
+	using Map = pst::PersistentMap<std::string, int>;
+	using Node = pst::PersistentMapNode<std::string, int, pst::NodePool, pst::KeyTraits<std::string>>;
+	auto getBytes = [](const Node* node) { return sizeof(Node) + pst::KeyTraits<std::string>::GetHeapSize(node->m_Key); };
+	auto getNodes = [](const Map& map, int version)
+	{
+		std::set<const Node*> nodes;
+		for (const Node& node : map.View(version))
+		{
+			nodes.insert(&node);
+		}
+
+		return nodes;
+	};
+
+	// Expected memory is computed from sets of nodes of every retained version
+	auto checkMemory = [&](const Map& map)
+	{
+		std::set<const Node*> retainedNodes;
+		std::size_t retainedBytes = 0;
+		for (int version = map.GetVersion(); version >= map.GetOldestVersion(); version--)
+		{
+			const std::set<const Node*> nodes = getNodes(map, version);
+			pst::PersistentMapVersionMemory expected;
+			for (const Node* node : nodes)
+			{
+				expected.m_Nodes++;
+				expected.m_Bytes += getBytes(node);
+				const bool isShared = version > map.GetOldestVersion() ? map.Search(node->m_Key, version - 1) == node : node->GetCreateVersion() < version;
+				if (!isShared)
+				{
+					expected.m_UniqueNodes++;
+					expected.m_UniqueBytes += getBytes(node);
+				}
+
+				if (retainedNodes.insert(node).second)
+				{
+					retainedBytes += getBytes(node);
+				}
+			}
+
+			pst::PersistentMapVersionMemory memory;
+			[[maybe_unused]] const bool isVersionRetained = map.GetVersionMemory(version, memory);
+			assert(isVersionRetained);
+			assert(memory.m_Nodes == expected.m_Nodes && memory.m_Bytes == expected.m_Bytes);
+			assert(memory.m_UniqueNodes == expected.m_UniqueNodes && memory.m_UniqueBytes == expected.m_UniqueBytes);
+			pst::PersistentMapMemory retained;
+			[[maybe_unused]] const bool isRangeRetained = map.GetRetainedMemory(version, map.GetVersion(), retained);
+			assert(isRangeRetained);
+			assert(retained.m_Nodes == retainedNodes.size() && retained.m_Bytes == retainedBytes);
+		}
+	};
+
+	auto generator = std::default_random_engine{};
+	std::uniform_int_distribution<int> keyDistribution(0, 300);
+	auto makeKey = [](int key) { return key % 2 ? std::to_string(1000 + key) : "key_" + std::to_string(1000000000000000 + key); };
+	Map tree;
+	checkMemory(tree);
+	for (int step = 0; step < 300; step++)
+	{
+		switch (step % 10)
+		{
+		case 0:
+		{
+			// Batch is queried while it is built, so its incomplete version is not cached
+			tree.BeginBatch();
+			tree.Insert(makeKey(keyDistribution(generator)));
+			checkMemory(tree);
+			tree.Delete(makeKey(keyDistribution(generator)));
+			tree.Insert(makeKey(keyDistribution(generator)));
+			tree.Commit();
+			break;
+		}
+		case 1:
+		{
+			std::map<std::string, int> updates;
+			for (int i = 0; i < 10; i++)
+			{
+				updates[makeKey(keyDistribution(generator))] = i;
+			}
+
+			[[maybe_unused]] const bool isUnited = tree.Union(updates.begin(), updates.end());
+			assert(isUnited);
+			break;
+		}
+		case 2:
+		{
+			Map removed;
+			for (int i = 0; i < 5; i++)
+			{
+				removed.Insert(makeKey(keyDistribution(generator)));
+			}
+
+			tree.Difference(removed);
+			break;
+		}
+		case 3:
+			// Numbers of rolled back versions are reused by the following changes
+			if (tree.GetVersion() > tree.GetOldestVersion())
+			{
+				tree.Rollback(std::min(2, tree.GetVersion() - tree.GetOldestVersion()));
+			}
+
+			break;
+		case 4:
+			tree.DropVersionsBefore(tree.GetVersion() - 15);
+			break;
+		default:
+			tree.Insert(makeKey(keyDistribution(generator)))->m_Value = step;
+			tree.Delete(makeKey(keyDistribution(generator)));
+			break;
+		}
+
+		checkMemory(tree);
+	}
+
+	// Without readers and released nodes every allocated node belongs to a retained version
+	tree.ReclaimAll();
+	pst::PersistentMapMemory retained;
+	[[maybe_unused]] const bool isRetained = tree.GetRetainedMemory(tree.GetOldestVersion(), tree.GetVersion(), retained);
+	assert(isRetained);
+	assert(tree.GetLiveMemory().m_Nodes == retained.m_Nodes && tree.GetLiveMemory().m_Bytes == retained.m_Bytes);
+	tree.DropVersionsBefore(tree.GetVersion());
+	assert(tree.GetLiveMemory().m_Nodes > static_cast<std::size_t>(tree.GetSize()));
+	tree.ReclaimAll();
+	assert(tree.GetLiveMemory().m_Nodes == static_cast<std::size_t>(tree.GetSize()));
+	[[maybe_unused]] const bool isDroppedVersionRetained = tree.GetRetainedMemory(tree.GetVersion() - 1, tree.GetVersion(), retained);
+	assert(!isDroppedVersionRetained);
+
+	// Keys which can't own heap memory take node blocks only
+	pst::PersistentMap<int, int> numbers;
+	for (int i = 0; i < 100; i++)
+	{
+		numbers.Insert(i);
+	}
+
+	[[maybe_unused]] const bool isNumbersRetained = numbers.GetRetainedMemory(0, 100, retained);
+	assert(isNumbersRetained && retained.m_Nodes > 100);
+	assert(retained.m_Bytes == retained.m_Nodes * sizeof(pst::PersistentMapNode<int, int, pst::NodePool, pst::KeyTraits<int>>));
+}
+
+void pst::PersistentMapTest::TestNodeLayout()
+{
+	// Color shares the word with size, so neither of them changes the other
+	using Node = pst::PersistentMapNode<std::uint32_t, int>;
+	Node node(1, 0);
+	node.SetIsRed(0, true);
+	node.SetSize(0, std::numeric_limits<int>::max());
+	assert(node.IsRed() && node.GetSize() == std::numeric_limits<int>::max());
+	node.SetIsRed(0, false);
+	assert(!node.IsRed() && node.GetSize() == std::numeric_limits<int>::max());
+	node.SetSize(0, 0);
+	node.SetIsRed(0, true);
+	assert(node.IsRed() && node.GetSize() == 0);
+
+	// Small key and value fill the gaps around children, so node of two 4-byte fields is 40 bytes and node pool doesn't round it up
+	if constexpr (sizeof(void*) == 8)
+	{
+		static_assert(sizeof(Node) == 40);
+		static_assert(sizeof(pst::PersistentMapNode<std::string_view, std::uint32_t, pst::NodePool, pst::StringPrefixKeyTraits<std::string_view>>) == 56);
+		pst::NodePool pool;
+		void* first = pool.Allocate(sizeof(Node));
+		void* second = pool.Allocate(sizeof(Node));
+		assert(static_cast<char*>(second) - static_cast<char*>(first) == sizeof(Node));
+		pool.Deallocate(first, sizeof(Node));
+		pool.Deallocate(second, sizeof(Node));
+	}
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+bool pst::PersistentMapTest::CheckIfTreeIsSorted(const pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>* map)
 {
 	return CheckIfTreeIsSorted(map, map->GetRoot());
 }
 
-template<typename TKey, typename TValue>
-bool pst::PersistentMapTest::CheckIfTreeIsRB(const pst::PersistentMap<TKey, TValue>* map)
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+bool pst::PersistentMapTest::CheckIfTreeIsRB(const pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>* map)
 {
-	const pst::PersistentMapNode<TKey, TValue>* root = map->GetRoot();
+	const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* root = map->GetRoot();
 	if (!root)
 	{
 		return true;
 	}
 
-	const pst::PersistentMapNode<TKey, TValue>* minNode = map->GetMin();
+	const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* minNode = map->GetMin();
 	int blackNodes = CountBlackNodes(map, minNode);
 	return !root->IsRed() && CheckIfTreeIsRB(map, root, blackNodes);
 }
 
-template<typename TKey, typename TValue>
-bool pst::PersistentMapTest::CheckIfTreeIsSorted(const pst::PersistentMap<TKey, TValue>* map, const pst::PersistentMapNode<TKey, TValue>* node)
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+bool pst::PersistentMapTest::CheckIfTreeIsSorted(const pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>* map, const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node)
 {
 	if (!node)
 	{
@@ -194,11 +1250,11 @@ bool pst::PersistentMapTest::CheckIfTreeIsSorted(const pst::PersistentMap<TKey,
 		return false;
 	}
 
-	return CheckIfTreeIsSorted(map, node->m_Left.get()) && CheckIfTreeIsSorted(map, node->m_Right.get());
+	return CheckIfTreeIsSorted(map, node->m_Left.Get()) && CheckIfTreeIsSorted(map, node->m_Right.Get());
 }
 
-template<typename TKey, typename TValue>
-bool pst::PersistentMapTest::CheckIfTreeIsRB(const pst::PersistentMap<TKey, TValue>* map, const pst::PersistentMapNode<TKey, TValue>* node, int expectedBlackNodes)
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+bool pst::PersistentMapTest::CheckIfTreeIsRB(const pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>* map, const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node, int expectedBlackNodes)
 {
 	if (!node)
 	{
@@ -224,14 +1280,32 @@ bool pst::PersistentMapTest::CheckIfTreeIsRB(const pst::PersistentMap<TKey, TVal
 		}
 	}
 
-	return CheckIfTreeIsRB(map, node->m_Left.get(), expectedBlackNodes) && CheckIfTreeIsRB(map, node->m_Right.get(), expectedBlackNodes);
+	return CheckIfTreeIsRB(map, node->m_Left.Get(), expectedBlackNodes) && CheckIfTreeIsRB(map, node->m_Right.Get(), expectedBlackNodes);
+}
+
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+bool pst::PersistentMapTest::CheckIfSizesAreValid(const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node)
+{
+	if (!node)
+	{
+		return true;
+	}
+
+	const int leftSize = node->m_Left ? node->m_Left->GetSize() : 0;
+	const int rightSize = node->m_Right ? node->m_Right->GetSize() : 0;
+	if (node->GetSize() != leftSize + rightSize + 1)
+	{
+		return false;
+	}
+
+	return CheckIfSizesAreValid(node->m_Left.Get()) && CheckIfSizesAreValid(node->m_Right.Get());
 }
 
-template<typename TKey, typename TValue>
-int pst::PersistentMapTest::CountBlackNodes(const pst::PersistentMap<TKey, TValue>* map, const pst::PersistentMapNode<TKey, TValue>* toNode)
+template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+int pst::PersistentMapTest::CountBlackNodes(const pst::PersistentMap<TKey, TValue, TNodePool, TKeyTraits>* map, const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* toNode)
 {
 	int blackNodes = 0;
-	std::vector<const pst::PersistentMapNode<TKey, TValue>*> path = map->BuildPath(toNode);
+	std::vector<const pst::PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>*> path = map->BuildPath(toNode);
 	for (auto* node : path)
 	{
 		if (node && !node->IsRed())
@@ -2,10 +2,10 @@
 
 namespace pst
 {
-	template<typename TKey, typename TValue>
+	template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
 	class PersistentMap;
 
-	template<typename TKey, typename TValue>
+	template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
 	class PersistentMapNode;
 
 	class PersistentMapTest
@@ -19,21 +19,39 @@ namespace pst
 		static void TestSortness();
 		static void TestDeleting();
 		static void TestRBTreeWithRandomData();
+		static void TestOrderStatistics();
+		static void TestBatch();
+		static void TestRetention();
+		static void TestDeferredReclamation();
+		static void TestConcurrentSnapshots();
+		static void TestSearchAtVersion();
+		static void TestDiff();
+		static void TestIterators();
+		static void TestKeyTraits();
+		static void TestSerialization();
+		static void TestBulkLoad();
+		static void TestSetOperations();
+		static void TestStats();
+		static void TestMemoryAccounting();
+		static void TestNodeLayout();
 
 		// Helper methods to inspect map
-		template<typename TKey, typename TValue>
-		static bool CheckIfTreeIsSorted(const PersistentMap<TKey, TValue>* map);
+		template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+		static bool CheckIfTreeIsSorted(const PersistentMap<TKey, TValue, TNodePool, TKeyTraits>* map);
 
-		template<typename TKey, typename TValue>
-		static bool CheckIfTreeIsRB(const PersistentMap<TKey, TValue>* map);
+		template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+		static bool CheckIfTreeIsRB(const PersistentMap<TKey, TValue, TNodePool, TKeyTraits>* map);
 
-		template<typename TKey, typename TValue>
-		static bool CheckIfTreeIsSorted(const PersistentMap<TKey, TValue>* map, const PersistentMapNode<TKey, TValue>* node);
+		template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+		static bool CheckIfTreeIsSorted(const PersistentMap<TKey, TValue, TNodePool, TKeyTraits>* map, const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node);
 
-		template<typename TKey, typename TValue>
-		static bool CheckIfTreeIsRB(const PersistentMap<TKey, TValue>* map, const PersistentMapNode<TKey, TValue>* node, int expectedBlackNodes);
+		template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+		static bool CheckIfTreeIsRB(const PersistentMap<TKey, TValue, TNodePool, TKeyTraits>* map, const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node, int expectedBlackNodes);
 
-		template<typename TKey, typename TValue>
-		static int CountBlackNodes(const PersistentMap<TKey, TValue>* map, const PersistentMapNode<TKey, TValue>* toNode);
+		template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+		static bool CheckIfSizesAreValid(const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* node);
+
+		template<typename TKey, typename TValue, typename TNodePool, typename TKeyTraits>
+		static int CountBlackNodes(const PersistentMap<TKey, TValue, TNodePool, TKeyTraits>* map, const PersistentMapNode<TKey, TValue, TNodePool, TKeyTraits>* toNode);
 	};
 }
@@ -2,13 +2,28 @@
 
 #include "../DataModel/PlayersStorage.h"
 
+#include <atomic>
 #include <cassert>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
 
 void pst::PlayerStorageTest::Run()
 {
 	TestRegistration();
 	TestRollback();
+	TestRank();
+	TestMatchResult();
+	TestHistoryLimit();
+	TestConcurrentSnapshots();
+	TestRatingAtStep();
+	TestRollbackOfNewNames();
+	TestSaveAndLoad();
+	TestImport();
+	TestMemory();
 }
 
 void pst::PlayerStorageTest::TestRegistration()
@@ -59,3 +74,382 @@ void pst::PlayerStorageTest::TestRollback()
 	assert(storage.GetPlayerRating(nickname1) == -1);
 	assert(storage.GetPlayerRating(nickname2) == -1);
 }
+
+void pst::PlayerStorageTest::TestRank()
+{
+	pst::PlayersStorage storage;
+	const std::string nickname1 = "xXx_Destroyer_xXx";
+	const std::string nickname2 = "CatLover2000";
+	const std::string nickname3 = "Anonymous";
+	assert(storage.GetPlayerRank(nickname1) == -1);
+	storage.RegisterPlayerResult(nickname1, 1500);
+	storage.RegisterPlayerResult(nickname2, 1700);
+	storage.RegisterPlayerResult(nickname3, 1500);
+	assert(storage.GetPlayerRank(nickname2) == 1);
+	assert(storage.GetPlayerRank(nickname3) == 2);
+	assert(storage.GetPlayerRank(nickname1) == 3);
+
+	// Players with equal rating are ordered by name
+	std::vector<std::pair<std::string, int>> leaderboard;
+	auto collect = [&leaderboard](const std::string& name, int rating) { leaderboard.emplace_back(name, rating); };
+	storage.VisitLeaderboard(1, 10, collect);
+	assert(leaderboard.size() == 3);
+	assert(leaderboard[0].first == nickname2 && leaderboard[0].second == 1700);
+	assert(leaderboard[1].first == nickname3 && leaderboard[1].second == 1500);
+	assert(leaderboard[2].first == nickname1 && leaderboard[2].second == 1500);
+
+	storage.RegisterPlayerResult(nickname1, 2000);
+	assert(storage.GetPlayerRank(nickname1) == 1);
+	assert(storage.GetPlayerRank(nickname2) == 2);
+	storage.UnregisterPlayer(nickname2);
+	assert(storage.GetPlayerRank(nickname2) == -1);
+	assert(storage.GetPlayerRank(nickname3) == 2);
+	leaderboard.clear();
+	storage.VisitLeaderboard(2, 10, collect);
+	assert(leaderboard.size() == 1 && leaderboard[0].first == nickname3);
+
+	// Index follows ratings on rollback
+	storage.Rollback(1);
+	assert(storage.GetPlayerRank(nickname2) == 2);
+	storage.Rollback(1);
+	assert(storage.GetPlayerRank(nickname2) == 1);
+	assert(storage.GetPlayerRank(nickname1) == 3);
+	storage.RegisterPlayerResult(nickname3, 1000);
+	assert(storage.GetPlayerRank(nickname3) == 3);
+	assert(storage.GetPlayerRank(nickname1) == 2);
+	storage.Rollback(4);
+	assert(storage.GetPlayerRank(nickname1) == -1);
+	assert(storage.GetPlayerRank(nickname3) == -1);
+	leaderboard.clear();
+	storage.VisitLeaderboard(1, 10, collect);
+	assert(leaderboard.empty());
+}
+
+void pst::PlayerStorageTest::TestMatchResult()
+{
+	pst::PlayersStorage storage;
+	storage.RegisterPlayerResult("Leeroy", 900);
+	storage.RegisterMatchResult({ { "Leeroy", 1000 }, { "Jenkins", 1100 }, { "Chicken", 800 } });
+	assert(storage.GetPlayerRating("Leeroy") == 1000);
+	assert(storage.GetPlayerRank("Jenkins") == 1);
+	assert(storage.GetPlayerRank("Chicken") == 3);
+
+	storage.BeginBatch();
+	storage.RegisterPlayerResult("Chicken", 1200);
+	storage.UnregisterPlayer("Jenkins");
+	storage.Commit();
+	assert(storage.GetPlayerRank("Chicken") == 1);
+	assert(storage.GetPlayerRank("Jenkins") == -1);
+
+	// Whole match is rolled back as one step
+	storage.Rollback(1);
+	assert(storage.GetPlayerRank("Jenkins") == 1);
+	assert(storage.GetPlayerRating("Chicken") == 800);
+	storage.Rollback(1);
+	assert(storage.GetPlayerRating("Leeroy") == 900);
+	assert(storage.GetPlayerRating("Jenkins") == -1);
+	assert(storage.GetPlayerRank("Leeroy") == 1);
+
+	// Alphabetical pages
+	storage.RegisterMatchResult({ { "Jenkins", 1100 }, { "Chicken", 800 } });
+	std::vector<std::string> names;
+	auto collectName = [&names](const std::string& name, int) { names.push_back(name); };
+	storage.VisitPlayersByName("", 2, collectName);
+	assert((names == std::vector<std::string>{ "Chicken", "Jenkins" }));
+	storage.VisitPlayersByName(names.back() + '\0', 2, collectName);
+	assert((names == std::vector<std::string>{ "Chicken", "Jenkins", "Leeroy" }));
+	storage.GetSnapshot().VisitPlayersByName("K", 10, collectName);
+	assert(names.size() == 4 && names.back() == "Leeroy");
+}
+
+void pst::PlayerStorageTest::TestHistoryLimit()
+{
+	pst::PlayersStorage storage;
+	storage.SetHistoryLimit(3);
+	for (int rating = 1; rating <= 10; rating++)
+	{
+		storage.RegisterPlayerResult("Grinder", rating);
+	}
+
+	[[maybe_unused]] const bool isRolledBackPastLimit = storage.Rollback(4);
+	assert(!isRolledBackPastLimit);
+	assert(storage.GetPlayerRating("Grinder") == 10);
+	[[maybe_unused]] const bool isRolledBack = storage.Rollback(3);
+	assert(isRolledBack);
+	assert(storage.GetPlayerRating("Grinder") == 7);
+	assert(storage.GetPlayerRank("Grinder") == 1);
+	[[maybe_unused]] const bool isRolledBackPastOldest = storage.Rollback(1);
+	assert(!isRolledBackPastOldest);
+
+	storage.SetHistoryLimit(0);
+	storage.RegisterPlayerResult("Grinder", 11);
+	storage.RegisterPlayerResult("Newbie", 1);
+	storage.TrimHistory(0);
+	[[maybe_unused]] const std::size_t reclaimedBytes = storage.ReclaimMemory();
+	assert(reclaimedBytes > 0);
+	[[maybe_unused]] const std::size_t reclaimedAgainBytes = storage.ReclaimMemory();
+	assert(reclaimedAgainBytes == 0);
+	[[maybe_unused]] const bool isRolledBackAfterTrim = storage.Rollback(1);
+	assert(!isRolledBackAfterTrim);
+	assert(storage.GetPlayerRank("Newbie") == 2);
+}
+
+void pst::PlayerStorageTest::TestConcurrentSnapshots()
+{
+	// Two players always swap places, so in any consistent snapshot their ranks are 1 and 2 and match their ratings
+	pst::PlayersStorage storage;
+	storage.SetHistoryLimit(10);
+	std::atomic<bool> isWriterDone(false);
+	auto reader = [&storage, &isWriterDone]()
+	{
+		while (!isWriterDone.load())
+		{
+			const pst::PlayersStorage::Snapshot snapshot = storage.GetSnapshot();
+			const int rating1 = snapshot.GetPlayerRating("Ping");
+			const int rating2 = snapshot.GetPlayerRating("Pong");
+			if (rating1 == -1)
+			{
+				assert(rating2 == -1);
+				continue;
+			}
+
+			assert(rating1 != rating2);
+			assert(snapshot.GetPlayerRank("Ping") == (rating1 > rating2 ? 1 : 2));
+			assert(snapshot.GetPlayerRank("Pong") == (rating2 > rating1 ? 1 : 2));
+			int visitedPlayers = 0;
+			snapshot.VisitLeaderboard(1, 10, [&visitedPlayers, &snapshot](const std::string& name, int rating)
+			{
+				assert(snapshot.GetPlayerRating(name) == rating);
+				visitedPlayers++;
+			});
+
+			assert(visitedPlayers == 2);
+		}
+	};
+
+	std::vector<std::thread> readers;
+	for (int i = 0; i < 4; i++)
+	{
+		readers.emplace_back(reader);
+	}
+
+	for (int match = 0; match < 3000; match++)
+	{
+		const int winnerRating = 1000 + match;
+		storage.RegisterMatchResult({ { "Ping", match % 2 ? winnerRating : 0 }, { "Pong", match % 2 ? 0 : winnerRating } });
+		if (match % 7 == 0)
+		{
+			storage.Rollback(1);
+		}
+	}
+
+	isWriterDone.store(true);
+	for (std::thread& thread : readers)
+	{
+		thread.join();
+	}
+}
+
+void pst::PlayerStorageTest::TestRatingAtStep()
+{
+	pst::PlayersStorage storage;
+	storage.RegisterPlayerResult("Tortoise", 1000);
+	const int firstStep = storage.GetStep();
+	storage.RegisterMatchResult({ { "Tortoise", 1010 }, { "Hare", 990 } });
+	storage.UnregisterPlayer("Tortoise");
+	assert(storage.GetPlayerRating("Tortoise") == -1);
+	assert(storage.GetPlayerRating("Tortoise", firstStep) == 1000);
+	assert(storage.GetPlayerRating("Tortoise", firstStep + 1) == 1010);
+	assert(storage.GetPlayerRating("Hare", firstStep) == -1);
+	assert(storage.GetPlayerRating("Hare", storage.GetStep()) == 990);
+	assert(storage.GetPlayerRating("Hare", storage.GetStep() + 1) == -1);
+	assert(storage.GetStep() == firstStep + 2);
+	assert(storage.GetPlayerRank("Tortoise", firstStep + 1) == 1);
+	assert(storage.GetPlayerRank("Hare", firstStep + 1) == 2);
+	assert(storage.GetPlayerRank("Hare", firstStep) == -1);
+	assert(storage.GetPlayerRank("Hare", storage.GetStep()) == storage.GetPlayerRank("Hare"));
+	assert(storage.GetPlayerRank("Hare", storage.GetStep() + 1) == -1);
+	assert(storage.CountPlayersBefore(1000, "Unknown", firstStep + 1) == 1);
+	assert(storage.CountPlayersBefore(1000, "Unknown", storage.GetStep()) == 0);
+	assert(storage.CountPlayersBefore(1000, "Unknown", storage.GetStep() + 1) == -1);
+
+	std::vector<std::tuple<std::string, int, int>> changes;
+	[[maybe_unused]] const bool isVisited = storage.VisitRatingChanges(firstStep, storage.GetStep(), [&changes](const std::string& name, int oldRating, int newRating)
+	{
+		changes.emplace_back(name, oldRating, newRating);
+	});
+
+	assert(isVisited);
+	assert(changes.size() == 2);
+	assert(changes[0] == std::make_tuple(std::string("Hare"), -1, 990));
+	assert(changes[1] == std::make_tuple(std::string("Tortoise"), 1000, -1));
+	assert(!storage.VisitRatingChanges(firstStep, storage.GetStep() + 1, [](const std::string&, int, int) {}));
+}
+
+void pst::PlayerStorageTest::TestRollbackOfNewNames()
+{
+	// Names stay interned after rollback, so players registered again later are found by the same id
+	pst::PlayersStorage storage;
+	storage.RegisterPlayerResult("Mallory", 1500);
+	const int step = storage.GetStep();
+	storage.RegisterMatchResult({ { "Alice", 1600 }, { "Bob", 1400 } });
+	assert(storage.GetPlayerRank("Alice") == 1);
+	storage.Rollback(1);
+	assert(storage.GetStep() == step);
+	assert(storage.GetPlayerRating("Alice") == -1);
+	assert(storage.GetPlayerRank("Bob") == -1);
+	assert(storage.GetSnapshot().GetPlayerRating("Alice") == -1);
+
+	std::vector<std::string> names;
+	const auto collectNames = [&names](const std::string& name, int) { names.push_back(name); };
+	storage.VisitPlayersByName("", 10, collectNames);
+	assert((names == std::vector<std::string>{ "Mallory" }));
+
+	storage.RegisterPlayerResult("Bob", 1700);
+	storage.RegisterPlayerResult("Alice", 1200);
+	const auto snapshot = storage.GetSnapshot();
+	assert(snapshot.GetPlayerRank("Bob") == 1);
+	assert(snapshot.GetPlayerRank("Alice") == 3);
+	assert(snapshot.GetPlayerRating("Mallory") == 1500);
+	names.clear();
+	snapshot.VisitPlayersByName("B", 10, collectNames);
+	assert((names == std::vector<std::string>{ "Bob", "Mallory" }));
+	names.clear();
+	snapshot.VisitLeaderboard(1, 10, collectNames);
+	assert((names == std::vector<std::string>{ "Bob", "Mallory", "Alice" }));
+}
+
+void pst::PlayerStorageTest::TestSaveAndLoad()
+{
+	pst::PlayersStorage storage;
+	for (int i = 0; i < 300; i++)
+	{
+		storage.RegisterPlayerResult("player_" + std::to_string(i % 50), 1000 + i * 37 % 200);
+		if (i % 40 == 39)
+		{
+			storage.UnregisterPlayer("player_" + std::to_string(i % 7));
+		}
+	}
+
+	storage.TrimHistory(100);
+	std::stringstream stream;
+	[[maybe_unused]] const bool isSaved = storage.Save(stream);
+	assert(isSaved);
+
+	pst::PlayersStorage loadedStorage;
+	[[maybe_unused]] const bool isLoaded = loadedStorage.Load(stream);
+	assert(isLoaded);
+	assert(loadedStorage.GetStep() == storage.GetStep());
+	for (int step = storage.GetStep() - 100; step <= storage.GetStep(); step += 9)
+	{
+		for (int i = 0; i < 50; i++)
+		{
+			const std::string name = "player_" + std::to_string(i);
+			assert(loadedStorage.GetPlayerRating(name, step) == storage.GetPlayerRating(name, step));
+		}
+	}
+
+	std::vector<std::pair<std::string, int>> leaderboard;
+	std::vector<std::pair<std::string, int>> loadedLeaderboard;
+	storage.VisitLeaderboard(1, 100, [&leaderboard](const std::string& name, int rating) { leaderboard.emplace_back(name, rating); });
+	loadedStorage.VisitLeaderboard(1, 100, [&loadedLeaderboard](const std::string& name, int rating) { loadedLeaderboard.emplace_back(name, rating); });
+	assert(leaderboard == loadedLeaderboard);
+
+	// History is restored up to the trimmed horizon
+	[[maybe_unused]] const bool isRolledBackPastHorizon = loadedStorage.Rollback(101);
+	assert(!isRolledBackPastHorizon);
+	[[maybe_unused]] const bool isLoadedRolledBack = loadedStorage.Rollback(100);
+	assert(isLoadedRolledBack);
+	[[maybe_unused]] const bool isRolledBack = storage.Rollback(100);
+	assert(isRolledBack);
+	assert(loadedStorage.GetPlayerRank("player_3") == storage.GetPlayerRank("player_3"));
+	loadedStorage.RegisterPlayerResult("newcomer", 5000);
+	assert(loadedStorage.GetPlayerRank("newcomer") == 1);
+	assert(loadedStorage.GetSnapshot().GetPlayerRating("player_10") == storage.GetPlayerRating("player_10"));
+
+	std::stringstream truncatedStream(stream.str().substr(0, stream.str().size() / 2));
+	pst::PlayersStorage truncatedStorage;
+	[[maybe_unused]] const bool isTruncatedLoaded = truncatedStorage.Load(truncatedStream);
+	assert(!isTruncatedLoaded);
+}
+
+void pst::PlayerStorageTest::TestImport()
+{
+	// Some names are interned by an unregistered player before import, so ids of imported players are not dense from zero
+	std::vector<std::pair<std::string, int>> playerRatings;
+	for (int i = 0; i < 3000; i++)
+	{
+		playerRatings.emplace_back("player_" + std::to_string(i * 7919 % 1000), i % 500);
+	}
+
+	pst::PlayersStorage imported;
+	imported.RegisterPlayerResult("player_500", 10);
+	imported.UnregisterPlayer("player_500");
+	pst::PlayersStorage registered;
+	registered.RegisterPlayerResult("player_500", 10);
+	registered.UnregisterPlayer("player_500");
+	registered.RegisterMatchResult(playerRatings);
+	[[maybe_unused]] const bool isImported = imported.ImportPlayers(playerRatings);
+	assert(isImported);
+	assert(imported.GetStep() == registered.GetStep());
+	for (int i = 0; i < 1000; i++)
+	{
+		const std::string name = "player_" + std::to_string(i);
+		assert(imported.GetPlayerRating(name) == registered.GetPlayerRating(name));
+		assert(imported.GetPlayerRank(name) == registered.GetPlayerRank(name));
+		assert(imported.GetSnapshot().GetPlayerRank(name) == registered.GetPlayerRank(name));
+	}
+
+	std::vector<std::tuple<std::string, int>> importedPage;
+	std::vector<std::tuple<std::string, int>> registeredPage;
+	imported.VisitLeaderboard(1, 1000, [&importedPage](const std::string& name, int rating) { importedPage.emplace_back(name, rating); });
+	registered.VisitLeaderboard(1, 1000, [&registeredPage](const std::string& name, int rating) { registeredPage.emplace_back(name, rating); });
+	assert(importedPage == registeredPage && importedPage.size() == 1000);
+
+	// Import is single step which is changed and rolled back as usual. Storage with players can't import
+	[[maybe_unused]] const bool isImportedIntoPlayers = imported.ImportPlayers({ { "Leeroy", 1000 } });
+	assert(!isImportedIntoPlayers);
+	imported.RegisterPlayerResult("Leeroy", 1000);
+	assert(imported.GetPlayerRank("Leeroy") == 1);
+	[[maybe_unused]] const bool isLeeroyRolledBack = imported.Rollback(1);
+	assert(isLeeroyRolledBack && imported.GetPlayerRating("Leeroy") == -1);
+	[[maybe_unused]] const bool isImportRolledBack = imported.Rollback(1);
+	assert(isImportRolledBack && imported.GetPlayerRating("player_0") == -1);
+	[[maybe_unused]] const bool isEmptyImported = imported.ImportPlayers({});
+	assert(isEmptyImported && imported.GetPlayerRating("player_0") == -1);
+}
+
+void pst::PlayerStorageTest::TestMemory()
+{
+	pst::PlayersStorage storage;
+	for (int i = 0; i < 100; i++)
+	{
+		storage.RegisterPlayerResult("player_" + std::to_string(i), i);
+	}
+
+	// Every player has a node in each of three maps. Change of one rating copies a few paths and shares the rest with the previous step
+	storage.RegisterPlayerResult("player_50", 1000);
+	const int step = storage.GetStep();
+	pst::PersistentMapVersionMemory previous;
+	pst::PersistentMapVersionMemory current;
+	[[maybe_unused]] const bool isPreviousRetained = storage.GetStepMemory(step - 1, previous);
+	[[maybe_unused]] const bool isCurrentRetained = storage.GetStepMemory(step, current);
+	assert(isPreviousRetained && isCurrentRetained);
+	assert(previous.m_Nodes == 300 && current.m_Nodes == 300);
+	assert(current.m_UniqueNodes > 0 && current.m_UniqueNodes < 30 && current.m_Bytes > current.m_UniqueBytes);
+	pst::PersistentMapMemory retained;
+	[[maybe_unused]] const bool isRangeRetained = storage.GetRetainedMemory(step - 1, step, retained);
+	assert(isRangeRetained);
+	assert(retained.m_Nodes == previous.m_Nodes + current.m_UniqueNodes && retained.m_Bytes == previous.m_Bytes + current.m_UniqueBytes);
+	[[maybe_unused]] const bool isNextRetained = storage.GetStepMemory(step + 1, current);
+	[[maybe_unused]] const bool isNextRangeRetained = storage.GetRetainedMemory(step, step + 1, retained);
+	assert(!isNextRetained && !isNextRangeRetained);
+
+	// Dropped steps are freed by reclamation, names stay
+	[[maybe_unused]] const bool isHistoryRetained = storage.GetRetainedMemory(0, step, retained);
+	assert(isHistoryRetained && storage.GetLiveMemory().m_Bytes > retained.m_Bytes);
+	storage.TrimHistory(0);
+	storage.ReclaimMemory();
+	[[maybe_unused]] const bool isTrimmedRetained = storage.GetStepMemory(step - 1, previous);
+	assert(storage.GetLiveMemory().m_Nodes == 300 && !isTrimmedRetained);
+}
@@ -10,5 +10,14 @@ namespace pst
 	private:
 		static void TestRegistration();
 		static void TestRollback();
+		static void TestRank();
+		static void TestMatchResult();
+		static void TestHistoryLimit();
+		static void TestConcurrentSnapshots();
+		static void TestRatingAtStep();
+		static void TestRollbackOfNewNames();
+		static void TestSaveAndLoad();
+		static void TestImport();
+		static void TestMemory();
 	};
 }
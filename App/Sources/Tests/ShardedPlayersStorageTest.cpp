@@ -0,0 +1,211 @@
+#include "ShardedPlayersStorageTest.h"
+
+#include "../DataModel/PlayersStorage.h"
+#include "../DataModel/ShardedPlayersStorage.h"
+
+#include <cassert>
+#include <random>
+#include <string>
+
+namespace
+{
+	std::string GetLeaderboard(const pst::PlayersStorage& storage, int firstRank, int count)
+	{
+		std::string leaderboard;
+		storage.VisitLeaderboard(firstRank, count, [&leaderboard](const std::string& name, int rating) { leaderboard += name + ":" + std::to_string(rating) + ";"; });
+		return leaderboard;
+	}
+
+	std::string GetLeaderboard(const pst::ShardedPlayersStorage& storage, int firstRank, int count)
+	{
+		std::string leaderboard;
+		storage.VisitLeaderboard(firstRank, count, [&leaderboard](const std::string& name, int rating) { leaderboard += name + ":" + std::to_string(rating) + ";"; });
+		return leaderboard;
+	}
+}
+
+void pst::ShardedPlayersStorageTest::Run()
+{
+	TestAgainstPlayersStorage();
+	TestLeaderboard();
+	TestHistoryLimit();
+	TestBatch();
+}
+
+void pst::ShardedPlayersStorageTest::TestAgainstPlayersStorage()
+{
+	// Sharded storage should behave as single storage, including steps which are not made for unknown players
+	pst::PlayersStorage storage;
+	pst::ShardedPlayersStorage shardedStorage(4);
+	assert(shardedStorage.GetShardCount() == 4);
+	std::mt19937 random(7);
+	for (int i = 0; i < 2000; i++)
+	{
+		const std::string name = "player_" + std::to_string(random() % 100);
+		const int rating = static_cast<int>(random() % 50);
+		switch (random() % 8)
+		{
+		case 0:
+			storage.UnregisterPlayer(name);
+			shardedStorage.UnregisterPlayer(name);
+			break;
+
+		case 1:
+		{
+			const std::vector<std::pair<std::string, int>> playerRatings{ { name, rating }, { "player_" + std::to_string(random() % 100), rating + 1 }, { "newcomer_" + std::to_string(i), rating } };
+			storage.RegisterMatchResult(playerRatings);
+			shardedStorage.RegisterMatchResult(playerRatings);
+			break;
+		}
+
+		case 2:
+		{
+			const int step = static_cast<int>(random() % 4) + 1;
+			[[maybe_unused]] const bool isRolledBack = storage.Rollback(step);
+			[[maybe_unused]] const bool isShardedRolledBack = shardedStorage.Rollback(step);
+			assert(isRolledBack == isShardedRolledBack);
+			break;
+		}
+
+		default:
+			storage.RegisterPlayerResult(name, rating);
+			shardedStorage.RegisterPlayerResult(name, rating);
+			break;
+		}
+
+		assert(storage.GetStep() == shardedStorage.GetStep());
+		if (i % 50 == 0)
+		{
+			assert(GetLeaderboard(storage, 1, 1000) == GetLeaderboard(shardedStorage, 1, 1000));
+			assert(storage.GetPlayerRating(name) == shardedStorage.GetPlayerRating(name));
+			assert(storage.GetPlayerRank(name) == shardedStorage.GetPlayerRank(name));
+			for (int step = 0; step <= storage.GetStep(); step += 7)
+			{
+				assert(storage.GetPlayerRating(name, step) == shardedStorage.GetPlayerRating(name, step));
+				assert(storage.GetPlayerRank(name, step) == shardedStorage.GetPlayerRank(name, step));
+			}
+		}
+	}
+
+	// Unregistration in batch is part of its step either way
+	storage.BeginBatch();
+	storage.UnregisterPlayer("nobody");
+	storage.Commit();
+	shardedStorage.BeginBatch();
+	shardedStorage.UnregisterPlayer("nobody");
+	shardedStorage.Commit();
+	assert(storage.GetStep() == shardedStorage.GetStep());
+
+	// Rollback after unregistration of unknown player undoes the change before it
+	shardedStorage.RegisterPlayerResult("latecomer", 1);
+	shardedStorage.UnregisterPlayer("nobody");
+	[[maybe_unused]] const bool isLatecomerRolledBack = shardedStorage.Rollback(1);
+	assert(isLatecomerRolledBack);
+	assert(shardedStorage.GetPlayerRating("latecomer") == -1);
+
+	[[maybe_unused]] const bool isRolledBackPastStart = shardedStorage.Rollback(shardedStorage.GetStep() + 1);
+	assert(!isRolledBackPastStart);
+	[[maybe_unused]] const bool isRolledBackToStart = shardedStorage.Rollback(shardedStorage.GetStep());
+	assert(isRolledBackToStart);
+	assert(shardedStorage.GetStep() == 0);
+	assert(GetLeaderboard(shardedStorage, 1, 1000).empty());
+}
+
+void pst::ShardedPlayersStorageTest::TestLeaderboard()
+{
+	pst::PlayersStorage storage;
+	pst::ShardedPlayersStorage shardedStorage(5);
+	for (int i = 0; i < 300; i++)
+	{
+		// Many equal ratings, so players are often ordered by name across shards
+		const std::string name = "player_" + std::to_string(i);
+		storage.RegisterPlayerResult(name, i % 13);
+		shardedStorage.RegisterPlayerResult(name, i % 13);
+	}
+
+	for (int firstRank = -5; firstRank <= 305; firstRank += 3)
+	{
+		for (int count : { 0, 1, 7, 40 })
+		{
+			assert(GetLeaderboard(storage, firstRank, count) == GetLeaderboard(shardedStorage, firstRank, count));
+		}
+	}
+
+	assert(shardedStorage.GetPlayerRank("nobody") == -1);
+	assert(shardedStorage.GetPlayerRank("player_12") == storage.GetPlayerRank("player_12"));
+	assert(shardedStorage.GetPlayerRating("player_12") == 12);
+}
+
+void pst::ShardedPlayersStorageTest::TestHistoryLimit()
+{
+	pst::ShardedPlayersStorage shardedStorage(3);
+	shardedStorage.SetHistoryLimit(5);
+	for (int i = 0; i < 20; i++)
+	{
+		shardedStorage.RegisterPlayerResult("player_" + std::to_string(i % 4), i);
+	}
+
+	assert(shardedStorage.GetStep() == 20);
+	assert(shardedStorage.GetPlayerRating("player_1", 14) == -1);
+	assert(shardedStorage.GetPlayerRating("player_1", 15) == 13);
+	assert(shardedStorage.GetPlayerRating("player_3", 16) == 15);
+	assert(shardedStorage.GetPlayerRank("player_1", 14) == -1);
+	assert(shardedStorage.GetPlayerRank("player_1", 15) == 2);
+	[[maybe_unused]] const bool isRolledBackPastLimit = shardedStorage.Rollback(6);
+	assert(!isRolledBackPastLimit);
+	[[maybe_unused]] const bool isRolledBack = shardedStorage.Rollback(5);
+	assert(isRolledBack);
+	assert(shardedStorage.GetStep() == 15);
+	assert(shardedStorage.GetPlayerRating("player_0") == 12);
+	assert(shardedStorage.GetPlayerRating("player_3") == 11);
+	[[maybe_unused]] const bool isRolledBackPastOldest = shardedStorage.Rollback(1);
+	assert(!isRolledBackPastOldest);
+
+	// Unlimited history keeps steps from now on
+	shardedStorage.SetHistoryLimit(0);
+	shardedStorage.RegisterPlayerResult("player_0", 100);
+	shardedStorage.RegisterPlayerResult("player_0", 101);
+	[[maybe_unused]] const bool isRolledBackUnlimited = shardedStorage.Rollback(2);
+	assert(isRolledBackUnlimited);
+	assert(shardedStorage.GetPlayerRating("player_0") == 12);
+}
+
+void pst::ShardedPlayersStorageTest::TestBatch()
+{
+	// Queries inside batch see its changes, as in PlayersStorage
+	pst::PlayersStorage storage;
+	pst::ShardedPlayersStorage shardedStorage(4);
+	storage.RegisterPlayerResult("Alice", 20);
+	shardedStorage.RegisterPlayerResult("Alice", 20);
+	storage.BeginBatch();
+	shardedStorage.BeginBatch();
+	for (int i = 0; i < 10; i++)
+	{
+		const std::string name = "player_" + std::to_string(i);
+		storage.RegisterPlayerResult(name, 10 + i * 2);
+		shardedStorage.RegisterPlayerResult(name, 10 + i * 2);
+	}
+
+	storage.UnregisterPlayer("player_8");
+	shardedStorage.UnregisterPlayer("player_8");
+	assert(shardedStorage.GetPlayerRating("player_9") == 28);
+	assert(shardedStorage.GetPlayerRating("player_8") == -1);
+	assert(shardedStorage.GetPlayerRank("Alice") == 4);
+	assert(storage.GetPlayerRank("Alice") == shardedStorage.GetPlayerRank("Alice"));
+	assert(GetLeaderboard(storage, 1, 100) == GetLeaderboard(shardedStorage, 1, 100));
+
+	// History limit set inside batch is applied on its commit
+	shardedStorage.SetHistoryLimit(1);
+	storage.Commit();
+	shardedStorage.Commit();
+	assert(storage.GetStep() == 2 && shardedStorage.GetStep() == 2);
+	assert(GetLeaderboard(storage, 1, 100) == GetLeaderboard(shardedStorage, 1, 100));
+
+	// Batch is still single step of every shard
+	[[maybe_unused]] const bool isRolledBack = shardedStorage.Rollback(1);
+	assert(isRolledBack);
+	assert(shardedStorage.GetPlayerRating("player_9") == -1);
+	assert(shardedStorage.GetPlayerRank("Alice") == 1);
+	[[maybe_unused]] const bool isRolledBackPastLimit = shardedStorage.Rollback(1);
+	assert(!isRolledBackPastLimit);
+}
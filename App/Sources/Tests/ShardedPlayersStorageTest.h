@@ -0,0 +1,16 @@
+#pragma once
+
+namespace pst
+{
+	class ShardedPlayersStorageTest
+	{
+	public:
+		static void Run();
+
+	private:
+		static void TestAgainstPlayersStorage();
+		static void TestLeaderboard();
+		static void TestHistoryLimit();
+		static void TestBatch();
+	};
+}
@@ -0,0 +1,73 @@
+#include "StringInternTableTest.h"
+
+#include "../CoreLib/StringInternTable.h"
+
+#include <cassert>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+void pst::StringInternTableTest::Run()
+{
+	TestDenseIds();
+	TestStableStrings();
+}
+
+void pst::StringInternTableTest::TestDenseIds()
+{
+	pst::StringInternTable table;
+	assert(table.GetSize() == 0);
+	assert(table.Find("Cheesecake") == pst::StringInternTable::InvalidId);
+	[[maybe_unused]] const std::uint32_t cheesecakeId = table.Intern("Cheesecake");
+	assert(cheesecakeId == 0);
+	[[maybe_unused]] const std::uint32_t emptyId = table.Intern("");
+	assert(emptyId == 1);
+	[[maybe_unused]] const std::uint32_t repeatedId = table.Intern("Cheesecake");
+	assert(repeatedId == 0);
+	assert(table.Find("") == 1);
+	assert(table.GetSize() == 2);
+
+	// Enough strings to fill few segments
+	for (int i = 0; i < 10000; i++)
+	{
+		[[maybe_unused]] const std::uint32_t id = table.Intern("player_" + std::to_string(i));
+		assert(id == static_cast<std::uint32_t>(i + 2));
+	}
+
+	assert(table.GetSize() == 10002);
+	for (int i = 0; i < 10000; i++)
+	{
+		const std::string name = "player_" + std::to_string(i);
+		assert(table.Find(name) == static_cast<std::uint32_t>(i + 2));
+		assert(table.GetString(i + 2) == name);
+	}
+
+	assert(table.GetString(0) == "Cheesecake");
+	assert(table.GetString(1).empty());
+}
+
+void pst::StringInternTableTest::TestStableStrings()
+{
+	pst::StringInternTable table;
+	const std::string longName(100, 'x');
+	const std::string* shortString = &table.GetString(table.Intern("short"));
+	const std::string* longString = &table.GetString(table.Intern(longName));
+	const char* longBuffer = longString->data();
+	const std::size_t bytes = table.GetAllocatedBytes();
+	assert(bytes >= longName.size());
+
+	// Appending never moves strings which are interned already, so their addresses can be kept as keys
+	std::vector<std::uint32_t> ids;
+	for (int i = 0; i < 5000; i++)
+	{
+		ids.push_back(table.Intern(std::to_string(i) + longName));
+	}
+
+	assert(&table.GetString(0) == shortString && *shortString == "short");
+	assert(&table.GetString(1) == longString && longString->data() == longBuffer);
+	assert(table.GetAllocatedBytes() > bytes + 5000 * longName.size());
+	for (int i = 0; i < 5000; i++)
+	{
+		assert(table.GetString(ids[i]) == std::to_string(i) + longName);
+	}
+}
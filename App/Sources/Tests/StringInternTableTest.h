@@ -0,0 +1,14 @@
+#pragma once
+
+namespace pst
+{
+	class StringInternTableTest
+	{
+	public:
+		static void Run();
+
+	private:
+		static void TestDenseIds();
+		static void TestStableStrings();
+	};
+}